@@ -9,6 +9,8 @@
 #include <future>
 #include <assert.h>
 #include <mutex>
+#include <memory>
+#include <atomic>
 #include <string.h>
 
 #include "dogbot/protocol.h"
@@ -228,11 +230,18 @@ namespace DogBotN {
 
     //! Set the handler for a particular type of packet.
     //! Returns the id of the handler or -1 if failed.
+    //! This may be called from within a handler.
     ComsCallbackHandleC SetHandler(ComsPacketTypeT packetType,const std::function<void (uint8_t *data,int len)> &handler);
 
     //! Remove given handler
+    //! Once this returns the handler will not be called again, unless it is called
+    //! from within a handler, in which case the packet currently being processed
+    //! may still be passed to it. Don't hold a lock the handler may take while calling this.
     void DeleteHandler(const ComsCallbackHandleC &handle);
 
+    //! Device id a packet is to or from, -1 if it doesn't have one.
+    static int PacketDeviceId(const uint8_t *data,int len);
+
     //! Convert a report value to an angle in radians
     static float PositionReport2Angle(int16_t val)
     { return val * M_PI * 4.0/ 65535.0; }
@@ -247,10 +256,41 @@ namespace DogBotN {
 
     std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
 
-    std::mutex m_accessPacketHandler;
+    //! Set of handlers in use. This is never modified once published, changes
+    //! are made to a copy which then replaces it.
+    struct HandlerTableC
+    {
+      std::vector<std::vector<std::function<void (uint8_t *data,int len)> > > m_packetHandler;
+      std::vector<std::function<void (uint8_t *data,int len)> > m_genericHandler;
+    };
+
+    //! Get a copy of the current handler table to modify, m_accessPacketHandler must be locked.
+    std::unique_ptr<HandlerTableC> CopyHandlers() const;
+
+    //! Called with the new handler table whenever handlers are added or removed,
+    //! m_accessPacketHandler is locked.
+    virtual void HandlersChanged(const HandlerTableC &table)
+    {}
+
+    //! Publish a new handler table, m_accessPacketHandler must be locked.
+    //! The table it replaces is kept until WaitForReaders() frees it.
+    void PublishHandlers(std::unique_ptr<HandlerTableC> table);
+
+    //! Wait for packets being processed with replaced handler tables to finish, then free the tables.
+    //! m_accessPacketHandler must not be locked, as a handler may be changing handlers itself.
+    //! Returns at once if called from one of this object's handlers.
+    void WaitForReaders();
+
+    std::mutex m_accessPacketHandler; //! Serialises changes to the handlers, packet processing doesn't take it.
+    std::mutex m_accessGracePeriod;   //! Serialises WaitForReaders()
+
+    std::atomic<const HandlerTableC *> m_handlers { new HandlerTableC() };
+    std::vector<const HandlerTableC *> m_retiredHandlers; //! Replaced tables packets may still be using, protected by m_accessPacketHandler.
 
-    std::vector<std::vector<std::function<void (uint8_t *data,int len)> > > m_packetHandler;
-    std::vector<std::function<void (uint8_t *data,int len)> > m_genericHandler;
+    // Packets being processed count themselves against the current epoch, so
+    // WaitForReaders() can move the epoch on and wait for the old count to drop to zero.
+    std::atomic<unsigned> m_readEpoch { 0 };
+    std::atomic<int> m_readers[2] { {0}, {0} };
   };
 
 
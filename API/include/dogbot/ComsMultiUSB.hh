@@ -0,0 +1,63 @@
+#ifndef DOGBOG_COMSMULTIUSB_HEADER
+#define DOGBOG_COMSMULTIUSB_HEADER 1
+
+#include "dogbot/ComsUSB.hh"
+
+namespace DogBotN {
+
+  //! Communication over all the USB bridges plugged in, each with its own CAN bus.
+  //! Packets for a device go to the bridge it was last heard from, anything
+  //! else, or for a device not heard from yet, goes to every bridge. Packets
+  //! received from all the bridges are passed to handlers one at a time.
+  //! Bridges are found when the connection is opened, so one plugged in
+  //! later isn't used until it is opened again.
+
+  class ComsMultiUSBC
+   : public ComsC
+  {
+  public:
+    //! Construct with transfer settings used for every bridge.
+    ComsMultiUSBC(const ComsUSBTransferConfigC &config = ComsUSBTransferConfigC());
+
+    //! Destructor
+    // Disconnects and closes file descriptors
+    virtual ~ComsMultiUSBC();
+
+    //! Open all the bridges found. 'portAddr' is of the form 'usb*' or 'usb*:in,out,isoPackets,dispatchCPU'
+    virtual bool Open(const std::string &portAddr) override;
+
+    //! Close connection
+    virtual void Close() override;
+
+    //! Is connection ready ? True if any of the bridges are.
+    virtual bool IsReady() const override;
+
+    //! Send packet
+    virtual void SendPacket(const uint8_t *data,int len) override;
+
+    //! Test if a name is one for this class.
+    static bool IsMultiUSBName(const std::string &name);
+
+    //! Number of bridges opened.
+    size_t Bridges() const
+    { return m_bridges.size(); }
+
+    //! Access a bridge.
+    std::shared_ptr<ComsUSBC> Bridge(size_t n) const
+    { return m_bridges.at(n); }
+
+    //! Bridge a device was last heard from, -1 if it hasn't been.
+    int BridgeForDevice(int deviceId) const;
+
+  protected:
+    //! Handle a packet received on bridge 'bridge'.
+    void ProcessBridgePacket(int bridge,uint8_t *data,int len);
+
+    ComsUSBTransferConfigC m_config;
+    std::vector<std::shared_ptr<ComsUSBC> > m_bridges; //! Only changed by Open() and Close().
+    std::vector<int> m_genericHandlerIds;
+    std::atomic<int8_t> m_route[256]; //! Bridge each device was last heard from, -1 if unknown.
+    std::mutex m_accessRx;
+  };
+}
+#endif
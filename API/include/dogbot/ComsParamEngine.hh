@@ -0,0 +1,124 @@
+#ifndef DOGBOT_COMSPARAMENGINE_HEADER
+#define DOGBOT_COMSPARAMENGINE_HEADER 1
+
+#include "dogbot/Coms.hh"
+#include <map>
+#include <deque>
+#include <chrono>
+#include <condition_variable>
+
+namespace DogBotN {
+
+  //! Result of an asynchronous parameter read.
+
+  struct ComsParamResultC
+  {
+    bool m_ok = false;  //! Set if a reply was received.
+    int m_len = 0;      //! Number of bytes in m_data
+    BufferTypeT m_data;
+  };
+
+  //! Issue parameter sets and reads to many devices at once.
+  //! Each request returns a future which is completed when the device replies,
+  //! or when it has failed to after a number of attempts. Only one request for
+  //! each parameter on a device is in flight at a time, and the number of
+  //! requests outstanding for each device is limited, anything more is queued
+  //! and sent in order as replies arrive.
+  //! Requests must be for a single device, broadcasts are not supported.
+
+  class ComsParamEngineC
+  {
+  public:
+    //! Construct from coms object
+    ComsParamEngineC(const std::shared_ptr<ComsC> &coms);
+
+    //! Destructor, any outstanding requests fail.
+    ~ComsParamEngineC();
+
+    //! Set a parameter, the future is true once the device has confirmed the value.
+    template<typename ParamT>
+    std::future<bool> SetParam(int deviceId,ComsParameterIndexT param,ParamT value)
+    {
+      static_assert(sizeof(value) <= 7,"Parameter too large.");
+      BufferTypeT buff;
+      memcpy(buff.uint8,&value,sizeof(value));
+      return SetParam(deviceId,param,buff,sizeof(value));
+    }
+
+    //! Set a parameter from the first 'len' bytes of 'buff'.
+    std::future<bool> SetParam(int deviceId,ComsParameterIndexT param,const BufferTypeT &buff,int len);
+
+    //! Read a parameter.
+    std::future<ComsParamResultC> ReadParam(int deviceId,ComsParameterIndexT param);
+
+    //! Set the maximum number of requests in flight to each device. Default is 4.
+    void SetMaxInFlight(int requests);
+
+    //! Set the time to wait for a reply and the number of times a request is sent.
+    //! Defaults are 250ms and 4 attempts.
+    void SetRetry(int timeoutMs,int attempts);
+
+    //! Number of requests queued or in flight.
+    size_t Outstanding();
+
+  protected:
+    typedef std::chrono::steady_clock ClockT;
+
+    struct RequestC
+    {
+      int m_deviceId = 0;
+      ComsParameterIndexT m_param = CPI_DeviceType;
+      bool m_isSet = false;
+      BufferTypeT m_data;
+      int m_len = 0;
+      int m_attempts = 0;
+      ClockT::time_point m_deadline;
+      std::promise<bool> m_setDone;
+      std::promise<ComsParamResultC> m_readDone;
+    };
+
+    typedef std::pair<int,int> KeyT; // Device id and parameter index
+
+    //! Queue a request and wake the sender.
+    void Queue(const std::shared_ptr<RequestC> &req);
+
+    //! Complete a request, m_access must not be locked.
+    static void Complete(RequestC &req,bool ok,const uint8_t *data,int len);
+
+    //! Remove a request from the in flight set, m_access must be locked.
+    void Retire(const KeyT &key);
+
+    //! Handle a parameter report
+    void HandleReport(uint8_t *data,int len);
+
+    //! Handle an error report
+    void HandleError(uint8_t *data,int len);
+
+    //! Send a request to the device
+    void Send(const RequestC &req);
+
+    //! Thread starting queued requests and dealing with time outs.
+    void RunSender();
+
+    std::shared_ptr<ComsC> m_coms;
+    std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
+
+    std::mutex m_access;
+    std::condition_variable m_wake;
+    bool m_terminate = false;
+
+    int m_maxInFlight = 4;
+    int m_timeoutMs = 250;
+    int m_attempts = 4;
+
+    std::deque<std::shared_ptr<RequestC> > m_queue;
+    std::map<KeyT,std::shared_ptr<RequestC> > m_inFlight;
+    std::map<int,int> m_inFlightCount; // Indexed by device id
+
+    ComsCallbackHandleC m_reportHandle;
+    ComsCallbackHandleC m_errorHandle;
+    std::thread m_sender;
+  };
+
+}
+#endif
@@ -0,0 +1,168 @@
+#ifndef DOGBOG_COMSRECORD_HEADER
+#define DOGBOG_COMSRECORD_HEADER 1
+
+#include "dogbot/Coms.hh"
+#include <cstdio>
+
+namespace DogBotN {
+
+  //! Start of a packet log file.
+  //!
+  //! The header is followed by the packets, each a ComsLogRecordC then the
+  //! packet bytes, and, once the recording is closed, by an index of
+  //! ComsLogIndexC entries giving the position of every g_comsLogIndexEvery'th
+  //! packet. All values are little endian, as written by the host.
+
+  struct ComsLogHeaderC
+  {
+    uint32_t m_magic;
+    uint32_t m_version;
+    int64_t m_startTime;     //! When recording started, nanoseconds since the unix epoch.
+    uint64_t m_packets;      //! Number of packets, 0 if the recording wasn't closed.
+    uint64_t m_indexOffset;  //! Where in the file the index starts, 0 if there isn't one.
+    uint64_t m_indexEntries; //! Number of index entries.
+    uint64_t m_duration;     //! Time of the last packet, nanoseconds after the start.
+    uint8_t m_reserved[16];
+  };
+
+  //! Header for each packet in a log file, followed by 'm_len' bytes of packet.
+  //! Records aren't aligned, read fields with memcpy.
+
+#pragma pack(push,1)
+  struct ComsLogRecordC
+  {
+    uint64_t m_time;  //! Nanoseconds after the start of the recording.
+    uint8_t m_len;
+  };
+#pragma pack(pop)
+
+  //! Entry in the index at the end of a log file.
+
+  struct ComsLogIndexC
+  {
+    uint64_t m_time;   //! Time of the packet.
+    uint64_t m_offset; //! Position of its record in the file.
+  };
+
+  //! Number of packets between index entries.
+  const int g_comsLogIndexEvery = 1024;
+
+  //! Record every packet received on a connection to a log file.
+  //! Packets are written as they arrive from the generic handler, through
+  //! a large buffer, so recording adds little to the cost of handling them.
+
+  class ComsRecorderC
+  {
+  public:
+    //! Record packets received by 'coms'.
+    ComsRecorderC(const std::shared_ptr<ComsC> &coms);
+
+    //! Finish recording.
+    ~ComsRecorderC();
+
+    //! Start recording to 'filename', replacing anything already there.
+    bool Open(const std::string &filename);
+
+    //! Stop recording and write the index.
+    void Close();
+
+    //! Are packets being recorded ?
+    bool IsOpen() const
+    { return m_file != nullptr; }
+
+    //! Number of packets recorded so far.
+    uint64_t Packets() const
+    { return m_packets; }
+
+  protected:
+    //! Write a packet to the log.
+    void Record(const uint8_t *data,int len);
+
+    typedef std::chrono::steady_clock ClockT;
+
+    std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
+    std::shared_ptr<ComsC> m_coms;
+    int m_genericHandlerId = -1;
+
+    std::mutex m_access;
+    FILE *m_file = nullptr;
+    std::vector<char> m_buffer;
+    ClockT::time_point m_start;
+    int64_t m_startTime = 0;         //! m_start in nanoseconds since the unix epoch.
+    uint64_t m_offset = 0;           //! Where the next record will be written.
+    uint64_t m_lastTime = 0;
+    std::atomic<uint64_t> m_packets { 0 };
+    std::vector<ComsLogIndexC> m_index;
+  };
+
+  //! A packet read from a log.
+
+  struct ComsLogPacketC
+  {
+    uint64_t m_time;       //! Nanoseconds after the start of the recording.
+    const uint8_t *m_data; //! Points into the mapped file.
+    int m_len;
+  };
+
+  //! Read access to a packet log, the file is mapped rather than read.
+
+  class ComsLogReaderC
+  {
+  public:
+    //! Default constructor.
+    ComsLogReaderC();
+
+    //! Unmap file.
+    ~ComsLogReaderC();
+
+    //! Map a log. If the recording wasn't closed properly the packets
+    //! written before it stopped are found and indexed.
+    bool Open(const std::string &filename);
+
+    //! Unmap file.
+    void Close();
+
+    //! Is a log open ?
+    bool IsOpen() const
+    { return m_data != nullptr; }
+
+    //! Number of packets in the log.
+    uint64_t Packets() const
+    { return m_packets; }
+
+    //! Time of the last packet, in nanoseconds after the start.
+    uint64_t Duration() const
+    { return m_duration; }
+
+    //! When the recording started, in nanoseconds since the unix epoch.
+    int64_t StartTime() const
+    { return m_startTime; }
+
+    //! Position of the first packet.
+    uint64_t Begin() const
+    { return sizeof(ComsLogHeaderC); }
+
+    //! Position of the first packet at or after 'time' nanoseconds into the recording.
+    uint64_t Seek(uint64_t time) const;
+
+    //! Read the packet at 'offset' and move 'offset' on to the next one.
+    //! Returns false at the end of the log.
+    bool Next(uint64_t &offset,ComsLogPacketC &packet) const;
+
+  protected:
+    //! Scan the packets to count them and build the index.
+    void Scan();
+
+    std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+    uint64_t m_end = 0;      //! End of the packets.
+    uint64_t m_packets = 0;
+    uint64_t m_duration = 0;
+    int64_t m_startTime = 0;
+    std::vector<ComsLogIndexC> m_index;
+  };
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef DOGBOG_COMSREPLAY_HEADER
+#define DOGBOG_COMSREPLAY_HEADER 1
+
+#include "dogbot/ComsRecord.hh"
+#include <condition_variable>
+
+namespace DogBotN {
+
+  //! Play a packet log made by ComsRecorderC back as if the packets were
+  //! being received from a device.
+  //!
+  //! Packets are passed to ProcessPacket at the rate they were recorded,
+  //! scaled by a speed factor, or with a speed of 0 as fast as possible,
+  //! which makes a repeatable load for anything built on ComsC. Packets
+  //! sent to the connection are dropped, there is nothing to answer them.
+  //!
+  //! Playing starts 100ms after the first handler is installed, so
+  //! something like DogBotAPIC which sets up its handlers on its own
+  //! thread after opening the connection doesn't miss the start.
+
+  class ComsReplayC
+   : public ComsC
+  {
+  public:
+    //! default
+    ComsReplayC();
+
+    //! Destructor
+    virtual ~ComsReplayC();
+
+    //! Open a log and start playing it, 'replay:filename[@speed]'.
+    //! Speed defaults to 1, real time, 0 plays it as fast as possible.
+    virtual bool Open(const std::string &portAddr) override;
+
+    //! Stop playing.
+    virtual void Close() override;
+
+    //! Is connection ready ?
+    virtual bool IsReady() const override;
+
+    //! Packets sent to a replay go nowhere.
+    virtual void SendPacket(const uint8_t *data,int len) override;
+
+    //! Set playback speed, 1 is real time, 0 is as fast as possible. Takes effect on the next pass.
+    void SetSpeed(double speed)
+    { m_speed = speed; }
+
+    //! Number of times to play the log, 0 repeats until closed. Call before Open().
+    void SetRepeat(int count)
+    { m_repeat = count; }
+
+    //! Wait until playback has finished, or 'timeout' has passed.
+    //! Returns true if it finished.
+    bool Wait(std::chrono::milliseconds timeout);
+
+    //! Number of packets played.
+    uint64_t Played() const
+    { return m_played; }
+
+    //! Access the log being played.
+    const ComsLogReaderC &Log() const
+    { return m_reader; }
+
+    //! Test if an address is a replay, 'replay:filename'.
+    static bool IsReplayAddress(const std::string &addr)
+    { return addr.compare(0,7,"replay:") == 0; }
+
+  protected:
+    //! Note when handlers have been installed.
+    virtual void HandlersChanged(const HandlerTableC &table) override;
+
+    //! Play the log.
+    void RunReplay();
+
+    ComsLogReaderC m_reader;
+    std::thread m_threadReplay;
+    std::atomic<double> m_speed { 1.0 };
+    int m_repeat = 1;
+    std::atomic<uint64_t> m_played { 0 };
+    std::atomic<bool> m_hasHandlers { false };
+
+    std::mutex m_access;
+    std::condition_variable m_finishedCond;
+    bool m_finished = true;
+  };
+
+}
+
+#endif
@@ -2,6 +2,8 @@
 #define DOGBOG_SERIALCOMS_HEADER 1
 
 #include "dogbot/Coms.hh"
+#include "dogbot/SerialFrame.hh"
+#include <condition_variable>
 
 namespace DogBotN {
 
@@ -35,19 +37,48 @@ namespace DogBotN {
     //! Accept a byte
     void AcceptByte(uint8_t sendByte);
 
+    //! Accept a block of bytes, packets found are processed in place.
+    void AcceptBlock(uint8_t *data,size_t len);
+
+    //! Set the framing to ask the device for when the port is opened.
+    //! SF_COBSCRC16 is used by default, if the device doesn't support it SF_STXChecksum is kept.
+    void SetFraming(SerialFramingT framing)
+    { m_preferredFraming = framing; }
+
+    //! Framing in use.
+    SerialFramingT Framing() const
+    { return (SerialFramingT) m_txFraming.load(); }
+
+    //! Number of corrupted frames received.
+    uint32_t RxErrors() const
+    { return m_decoder.Errors() + m_decoderCOBS.Errors(); }
 
   protected:
-    int m_state = 0;
-    int m_checkSum = 0;
-    int m_packetLen = 0;
-    uint8_t m_data[64];
-    int m_at = 0;
-    const uint8_t m_charSTX = 0x02;
-    const uint8_t m_charETX = 0x03;
+    static const int m_maxPacketLen = 64;
+
+    //! Ask the device for m_preferredFraming, returns false if there was no reply.
+    bool NegotiateFraming();
+
+    //! Handle a frame that has been received.
+    void HandleFrame(uint8_t *data,int len);
+
+    //! Encode and write a packet, m_accessTx must be locked.
+    void WriteFrame(const uint8_t *data,int len);
+
+    SerialFrameDecoderC<m_maxPacketLen> m_decoder;
+    SerialFrameCOBSDecoderC<m_maxPacketLen> m_decoderCOBS;
+    uint8_t m_txFrame[m_maxPacketLen + g_serialFrameOverhead]; //! Protected by m_accessTx
+
+    SerialFramingT m_preferredFraming = SF_COBSCRC16;
+    std::atomic<int> m_rxFraming { SF_STXChecksum }; //! Only changed by the receive thread.
+    std::atomic<int> m_txFraming { SF_STXChecksum };
+    std::mutex m_accessFraming;
+    std::condition_variable m_framingReply;
+    bool m_gotFramingReply = false;
 
     int m_fd = -1;
 
-    // Packet structure.
+    // Packet structure with SF_STXChecksum framing, see SerialFrame.hh
     // x    STX
     // x    Len - Of data excluding STX,ETX and Checksum.
     // 0    Address
@@ -0,0 +1,193 @@
+#ifndef DOGBOG_COMSSHM_HEADER
+#define DOGBOG_COMSSHM_HEADER 1
+
+#include "dogbot/Coms.hh"
+#include <atomic>
+
+namespace DogBotN {
+
+  //! Largest packet passed through shared memory.
+  const int g_comsShmMaxPacket = 64;
+
+  //! One packet in a shared memory ring. A small packet shares the first
+  //! cache line with the sequence number, so reading it touches only that line.
+
+  struct alignas(64) ComsShmSlotC
+  {
+    std::atomic<uint64_t> m_seq;  //! Position in the ring plus one once written, 0 while being written.
+    uint8_t m_len;
+    uint8_t m_data[g_comsShmMaxPacket];
+  };
+
+  //! Start of the shared memory segment, followed by the publish slots then the command slots.
+
+  struct ComsShmHeaderC
+  {
+    uint32_t m_magic;
+    uint32_t m_version;
+    uint32_t m_pubSlots;                     //! Size of the publish ring, a power of two.
+    uint32_t m_cmdSlots;                     //! Size of the command ring, a power of two.
+    std::atomic<uint32_t> m_generation;      //! Changed each time a server starts.
+    std::atomic<uint32_t> m_running;         //! Set while a server is using the segment.
+
+    // Packets from the server to every client.
+    alignas(64) std::atomic<uint64_t> m_pubHead; //! Next position the server will write.
+    std::atomic<uint32_t> m_pubNotify;       //! Bumped after each packet, clients wait on it.
+    std::atomic<uint32_t> m_pubWaiters;      //! Clients waiting for a packet.
+
+    // Packets from any client to the server.
+    alignas(64) std::atomic<uint64_t> m_cmdHead; //! Next position a client will claim.
+    std::atomic<uint32_t> m_cmdNotify;       //! Bumped after each packet, the server waits on it.
+    std::atomic<uint32_t> m_cmdWaiters;      //! Non zero while the server is waiting.
+
+    alignas(64) uint64_t m_cmdTail;          //! Next position the server will read, only used by it.
+  };
+
+  //! A mapped shared memory segment holding a ring of packets published by
+  //! one server to any number of clients, and a ring of packets sent by the
+  //! clients to the server.
+  //!
+  //! The publish ring never waits for clients. Each client keeps its own
+  //! position and reads a slot as a seqlock, so one that falls more than a
+  //! ring behind loses packets rather than holding up the server. The command
+  //! ring works as MPSCRingC does, with a sequence number in each slot.
+  //! Waiting is done on futexes in the segment, so an idle client costs
+  //! nothing and the server only makes a system call when someone is waiting.
+
+  class ComsShmRegionC
+  {
+  public:
+    //! Default constructor.
+    ComsShmRegionC();
+
+    //! Unmap the segment.
+    ~ComsShmRegionC();
+
+    //! Create or take over the segment 'name' as the server.
+    //! Ring sizes are rounded up to powers of two.
+    bool Create(const std::string &name,size_t pubSlots = 4096,size_t cmdSlots = 256);
+
+    //! Map an existing segment 'name' as a client.
+    bool Attach(const std::string &name);
+
+    //! Unmap the segment, if it was created the server is marked as stopped.
+    void Detach();
+
+    //! Is a segment mapped ?
+    bool IsAttached() const
+    { return m_header != nullptr; }
+
+    //! Access header.
+    ComsShmHeaderC &Header()
+    { return *m_header; }
+
+    //! Write a packet to the publish ring. Server only, from one thread at a time.
+    bool Publish(const uint8_t *data,int len);
+
+    //! Read the packet at 'cursor' into 'data', which must hold g_comsShmMaxPacket bytes.
+    //! Returns its length, 0 if there is nothing new yet. Packets overwritten
+    //! before they could be read are added to 'lost' and skipped.
+    int ReadPublished(uint64_t &cursor,uint8_t *data,uint64_t &lost);
+
+    //! Wait up to 'timeoutMs' for a packet after 'cursor' to be published.
+    void WaitPublished(uint64_t cursor,int timeoutMs);
+
+    //! Poll for up to 'us' microseconds before going to sleep in a wait.
+    //! Packets arriving close together are then picked up without either
+    //! side making a system call.
+    void SetSpin(int us)
+    { m_spin = std::chrono::microseconds(us); }
+
+    //! Queue a packet for the server, returns false if the ring is full.
+    //! Any client thread may call this.
+    bool PushCommand(const uint8_t *data,int len);
+
+    //! Take the next packet sent to the server. Returns its length or 0 if there isn't one.
+    //! Server only.
+    int PopCommand(uint8_t *data);
+
+    //! Wait up to 'timeoutMs' for a packet to be sent to the server. Server only.
+    void WaitCommand(int timeoutMs);
+
+    //! Name used for shm_open from an address, 'shm://name' or 'shm:name'.
+    //! Returns an empty string if the address isn't a shared memory one.
+    static std::string ShmName(const std::string &addr);
+
+    //! Test if an address is for shared memory.
+    static bool IsShmAddress(const std::string &addr)
+    { return !ShmName(addr).empty(); }
+
+  protected:
+    //! Map 'size' bytes of an open segment.
+    bool Map(int fd,size_t size);
+
+    ComsShmSlotC *PubSlot(uint64_t pos)
+    { return m_pubSlots + (pos & (m_header->m_pubSlots - 1)); }
+
+    ComsShmSlotC *CmdSlot(uint64_t pos)
+    { return m_cmdSlots + (pos & (m_header->m_cmdSlots - 1)); }
+
+    std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
+    ComsShmHeaderC *m_header = nullptr;
+    ComsShmSlotC *m_pubSlots = nullptr;
+    ComsShmSlotC *m_cmdSlots = nullptr;
+    size_t m_size = 0;
+    bool m_isServer = false;
+    std::chrono::microseconds m_spin { 50 };
+    uint64_t m_knownHead = 0;  //! Publish head when a client last looked.
+  };
+
+  //! Communication with a dogBotServer on the same host through shared memory.
+  //! Received packets are read straight from the server's ring, sent ones are
+  //! queued for it, neither goes through a socket.
+  //! When the server restarts the segment is mapped again, as the new server
+  //! may have resized or replaced it.
+
+  class ComsShmC
+   : public ComsC
+  {
+  public:
+    //! default
+    ComsShmC();
+
+    //! Destructor
+    virtual ~ComsShmC();
+
+    //! Open a port, 'shm://name' where name is the segment the server was given.
+    virtual bool Open(const std::string &portAddr) override;
+
+    //! Close connection
+    virtual void Close() override;
+
+    //! Is connection ready ? Not while the server is stopped.
+    virtual bool IsReady() const override;
+
+    //! Send packet
+    virtual void SendPacket(const uint8_t *data,int len) override;
+
+    //! Poll for up to 'us' microseconds before sleeping while waiting for packets, call before Open().
+    void SetSpin(int us)
+    { m_spin = us; }
+
+    //! Number of published packets missed because this client fell behind.
+    uint64_t Lost() const
+    { return m_lost; }
+
+  protected:
+    //! Read published packets and dispatch them.
+    void RunRecieve();
+
+    //! Map the segment again once the server has started.
+    //! Returns null if the connection is closed first.
+    std::shared_ptr<ComsShmRegionC> Reattach();
+
+    std::shared_ptr<ComsShmRegionC> m_region; //! Replaced when the server restarts, use std::atomic_load.
+    std::string m_name;
+    int m_spin = 50;
+    std::thread m_threadRecieve;
+    std::atomic<uint64_t> m_lost { 0 };
+  };
+
+}
+
+#endif
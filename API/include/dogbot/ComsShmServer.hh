@@ -0,0 +1,56 @@
+#ifndef DOGBOG_COMSSHMSERVER_HEADER
+#define DOGBOG_COMSSHMSERVER_HEADER 1
+
+#include "dogbot/ComsShm.hh"
+
+namespace DogBotN {
+
+  //! Serve clients on the same host through shared memory.
+  //! Every packet received from 'coms' is published to the segment, and
+  //! packets clients queue in it are sent on to 'coms'.
+
+  class ComsShmServerC
+  {
+  public:
+    ComsShmServerC(const std::shared_ptr<ComsC> &coms,std::shared_ptr<spdlog::logger> &log);
+
+    //! Make sure everything is disconnected.
+    ~ComsShmServerC();
+
+    //! Run server
+    //! 'addr' is 'shm://name', the segment is created as /dev/shm/name.
+    //! Returns false if it couldn't be set up.
+    bool Run(const std::string &addr,size_t pubSlots = 4096,size_t cmdSlots = 256);
+
+    //! Stop the server, Run() returns shortly afterwards.
+    void Stop()
+    { m_terminate = true; }
+
+    //! Has the segment been set up for clients ?
+    bool IsReady() const
+    { return m_ready; }
+
+    //! Poll for up to 'us' microseconds before sleeping while waiting for packets, call before Run().
+    void SetSpin(int us)
+    { m_region.SetSpin(us); }
+
+    //! Number of packets published.
+    uint64_t Published() const
+    { return m_published; }
+
+  protected:
+    std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
+
+    std::shared_ptr<ComsC> m_coms;
+    ComsShmRegionC m_region;
+
+    std::mutex m_accessPublish; //! Keep to a single producer if packets arrive on more than one thread.
+    std::atomic<uint64_t> m_published { 0 };
+    std::atomic<bool> m_terminate { false };
+    std::atomic<bool> m_ready { false };
+    int m_genericHandlerId = -1;
+  };
+
+}
+
+#endif
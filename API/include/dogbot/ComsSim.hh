@@ -0,0 +1,179 @@
+#ifndef DOGBOG_COMSSIM_HEADER
+#define DOGBOG_COMSSIM_HEADER 1
+
+#include "dogbot/Coms.hh"
+#include "dogbot/flashlz.h"
+#include <condition_variable>
+
+namespace DogBotN {
+
+  //! Simulated set of motor controllers.
+  //!
+  //! Each device answers the same packets the firmware does: it announces
+  //! itself and takes the id it is given, reads and sets parameters, follows
+  //! the control state changes in main.c, and once running sends servo
+  //! reports along with the background state reports. Servo commands drive
+  //! a simple model of the motor and gearbox, a velocity loop behind the
+  //! position loop, limited by the current limit, moving an inertia with
+  //! viscous damping. Changing to CS_BootLoader starts an emulation of the
+  //! boot-loader in flashops.cpp, with a flash image for each device, so
+  //! firmware updates can be run against it.
+  //!
+  //! Devices start with no id, as fresh boards do, so need something
+  //! managing device ids, such as DogBotAPIC in DMM_DeviceManager mode.
+  //!
+  //! Servo report timestamps count 10ms ticks, as the firmware's do, so at
+  //! report rates above 100Hz a client's velocity estimates will be off.
+
+  class ComsSimC
+   : public ComsC
+  {
+  public:
+    //! default
+    ComsSimC();
+
+    //! Destructor
+    virtual ~ComsSimC();
+
+    //! Start simulating, 'sim[:devices[,rate]]' where rate is servo reports
+    //! a second. Defaults to 12 devices at 100Hz.
+    virtual bool Open(const std::string &portAddr) override;
+
+    //! Stop simulating.
+    virtual void Close() override;
+
+    //! Is connection ready ?
+    virtual bool IsReady() const override;
+
+    //! Send a packet to the simulated devices.
+    virtual void SendPacket(const uint8_t *data,int len) override;
+
+    //! Number of devices being simulated.
+    int Devices() const
+    { return (int) m_devices.size(); }
+
+    //! Number of packets the devices have sent.
+    uint64_t PacketsSent() const
+    { return m_sent; }
+
+    //! Test if an address is for the simulator, 'sim' or 'sim:...'
+    static bool IsSimAddress(const std::string &addr)
+    { return addr == "sim" || addr.compare(0,4,"sim:") == 0; }
+
+  protected:
+    typedef std::chrono::steady_clock ClockT;
+
+    //! State of one simulated device.
+    struct DeviceC
+    {
+      uint32_t m_uid[2] = { 0,0 };
+      int m_deviceId = 0;
+      BufferTypeT m_param[256];              //!< Stored parameter values, indexed by ComsParameterIndexT.
+
+      enum ControlStateT m_controlState = CS_StartUp;
+      enum PWMControlDynamicT m_controlMode = CM_Brake;
+      enum FaultCodeT m_faultCode = FC_Ok;
+      enum MotionHomedStateT m_homedState = MHS_Measuring;
+      enum PositionReferenceT m_positionRef = PR_Relative;
+      ClockT::time_point m_stateChanged;     //!< When the control state last changed.
+      int m_backgroundCount = 0;
+      ClockT::time_point m_nextBackground;
+
+      // Motion, in joint radians.
+      uint8_t m_demandMode = 0;              //!< Mode from the last servo packet.
+      float m_demandPosition = 0;
+      float m_demandVelocity = 0;
+      float m_demandCurrent = 0;
+      float m_currentLimit = 0;              //!< Limit from the last servo packet.
+      float m_position = 0;
+      float m_velocity = 0;
+      float m_current = 0;
+      float m_currentAverage = 0;
+      float m_velocityISum = 0;
+      float m_homeOffset = 0;                //!< Position of the calibrated zero.
+      float m_driveTemp = 30;
+      float m_motorTemp = 30;
+
+      // Boot-loader, see flashops.cpp
+      std::vector<uint8_t> m_flash;          //!< Flash image, made when the boot-loader is first entered.
+      enum BootLoaderStateT m_blState = BLS_Disabled;
+      uint8_t m_blLastSeq = 0;
+      uint8_t m_blTxSeq = 0;
+      uint32_t m_blAddress = 0;
+      uint16_t m_blLen = 0;
+      uint32_t m_blAt = 0;
+      uint32_t m_blLastAck = 0;
+      uint32_t m_blPageAddress = 0;
+      bool m_blPageWritten = false;
+      bool m_blResyncSent = false;
+      bool m_blCompressed = false;
+      struct FlashLZDecoderC m_blDecoder;
+      uint8_t m_blPage[256];                 //!< Page being staged for writing.
+    };
+
+    //! Run the simulation.
+    void RunSim();
+
+    //! Act on a packet sent by the host.
+    void HandlePacket(const uint8_t *data,int len);
+
+    //! Act on a packet addressed to 'dev'.
+    void HandleDevicePacket(DeviceC &dev,const uint8_t *data,int len);
+
+    //! Act on a boot-loader packet addressed to 'dev'.
+    void HandleBootLoaderPacket(DeviceC &dev,const uint8_t *data,int len);
+
+    //! Advance the model of 'dev' by 'dt' seconds.
+    void Step(DeviceC &dev,float dt);
+
+    //! Send the servo and background reports due from 'dev'.
+    void Report(DeviceC &dev,ClockT::time_point now);
+
+    //! Follow ChangeControlState() in the firmware.
+    bool ChangeControlState(DeviceC &dev,enum ControlStateT newState);
+
+    //! Read a parameter, returns its length or -1 if there is no such parameter.
+    int ReadParam(DeviceC &dev,int index,BufferTypeT &data);
+
+    //! Set a parameter.
+    bool SetParam(DeviceC &dev,int index,const BufferTypeT &data,int len);
+
+    //! Send the value of a parameter.
+    void SendParam(DeviceC &dev,int index);
+
+    //! Send an error report from 'dev'.
+    void SendError(DeviceC &dev,enum ComsErrorTypeT code,int causeType,int data);
+
+    //! Send a boot-loader result from 'dev'.
+    void SendFlashResult(DeviceC &dev,uint8_t seq,enum BootLoaderStateT state,enum FlashOperationStatusT result);
+
+    //! Send a packet from a device to the host.
+    void Send(const void *data,int len);
+
+    //! Check a boot-loader sequence number, as BootLoaderCheckSequence().
+    bool BootLoaderCheckSequence(DeviceC &dev,uint8_t seqNum,int packetType);
+
+    //! Store a byte written through the boot-loader.
+    bool BootLoaderPutByte(DeviceC &dev,uint8_t value);
+
+    //! Program the page being staged into the flash image.
+    bool BootLoaderWritePage(DeviceC &dev);
+
+    //! Read back a byte written through the boot-loader.
+    uint8_t BootLoaderGetByte(DeviceC &dev,uint16_t distance);
+
+    std::vector<DeviceC> m_devices;
+    float m_rate = 100;                      //!< Servo reports a second.
+    ClockT::time_point m_start;
+    std::thread m_threadSim;
+    std::atomic<uint64_t> m_sent { 0 };
+
+    std::mutex m_access;
+    std::condition_variable m_wake;
+    std::vector<std::vector<uint8_t> > m_incoming;
+    bool m_running = false;
+  };
+
+}
+
+#endif
@@ -2,8 +2,9 @@
 #define DOGBOG_COMSUSB_HEADER 1
 
 #include "dogbot/Coms.hh"
+#include "dogbot/RingBuffer.hh"
 #include <libusb.h>
-#include <deque>
+#include <condition_variable>
 
 namespace DogBotN {
 
@@ -24,6 +25,54 @@ namespace DogBotN {
   };
 
 
+  //! Settings for the USB transfer pipeline, these take effect when the device is opened.
+  //! More transfers in flight make it less likely a late completion on a busy host
+  //! misses a frame. More iso packets per transfer reduce the number of completions
+  //! to handle, but each packet takes a 1ms frame so incoming data is delayed until
+  //! the whole transfer is complete.
+
+  class ComsUSBTransferConfigC
+  {
+  public:
+    //! Default settings
+    ComsUSBTransferConfigC()
+    {}
+
+    //! Construct from a device name, see Parse().
+    ComsUSBTransferConfigC(const std::string &name);
+
+    //! Set from a device name of the form 'usb' or 'usb:in,out,isoPackets,dispatchCPU' where
+    //! any trailing values may be omitted. 'usb@location' or 'usb@location:...' only opens
+    //! the bridge plugged in at that location, see ComsUSBC::DeviceLocation().
+    //! Returns false if it isn't a usb device name.
+    bool Parse(const std::string &name);
+
+    int m_inTransfers = 8;            //! IN transfers kept queued.
+    int m_outTransfers = 8;           //! OUT transfers in the pool.
+    int m_isoPacketsPerTransfer = 1;  //! Iso packets in each transfer.
+    size_t m_txQueueSize = 64;        //! Packets the transmit queue holds, a power of two.
+    size_t m_rxQueueSize = 256;       //! Received iso packets waiting for dispatch, a power of two.
+    int m_dispatchCPU = -1;           //! CPU to call packet handlers from, -1 for any.
+    std::string m_location;           //! Bus and port path of the bridge to open, empty for any.
+  };
+
+  //! Counters for the USB transfer pipeline.
+
+  class ComsUSBStatsC
+  {
+  public:
+    uint64_t m_inTransfers = 0;     //! IN transfers completed.
+    uint64_t m_inPackets = 0;       //! Iso packets received with data in them.
+    uint64_t m_inPacketErrors = 0;  //! Iso packets that failed, their frame is lost.
+    uint64_t m_inUnderruns = 0;     //! Times no IN transfer was queued, frames may have been missed.
+    uint64_t m_outTransfers = 0;    //! OUT transfers completed.
+    uint64_t m_outErrors = 0;       //! OUT transfers that failed to submit or complete.
+    uint64_t m_txDropped = 0;       //! Packets dropped because the transmit queue was full.
+    size_t m_txQueueMax = 0;        //! Longest the transmit queue has been.
+    uint64_t m_rxOverflows = 0;     //! Iso packets dropped because the receive queue was full.
+    size_t m_rxQueueMax = 0;        //! Longest the receive queue has been.
+  };
+
   //! Information about a transfer
 
   class USBTransferDataC
@@ -36,19 +85,26 @@ namespace DogBotN {
     //! Free m_transfer structure.
     ~USBTransferDataC();
 
-    //! Setup an ISO buffer
-    void SetupIso(ComsUSBC *coms,struct libusb_device_handle *handle,USBTransferDirectionT direction);
+    //! Size of each iso packet.
+    static const int IsoPacketSize = 64;
+
+    //! Setup an ISO buffer with space for 'isoPackets' packets.
+    void SetupIso(ComsUSBC *coms,struct libusb_device_handle *handle,USBTransferDirectionT direction,int isoPackets = 1);
 
     //! Setup an Ctrl buffer
     void SetupIntr(ComsUSBC *coms,struct libusb_device_handle *handle,USBTransferDirectionT direction);
 
     //! Get size of buffer.
     unsigned BufferSize() const
-    { return sizeof(m_buffer); }
+    { return m_buffer.size(); }
+
+    //! Number of iso packets the buffer has space for.
+    int IsoPackets() const
+    { return m_buffer.size() / IsoPacketSize; }
 
     //! Access buffer.
     unsigned char *Buffer()
-    { return m_buffer; }
+    { return m_buffer.data(); }
 
     USBTransferDirectionT Direction() const
     { return m_direction; }
@@ -65,7 +121,7 @@ namespace DogBotN {
     ComsUSBC *m_comsUSB = 0;
     USBTransferDirectionT m_direction = UTD_IN;
     struct libusb_transfer* m_transfer = 0;
-    unsigned char m_buffer[64];
+    std::vector<unsigned char> m_buffer;
   };
 
   //! Low level serial communication over usb with the driver board
@@ -79,6 +135,9 @@ namespace DogBotN {
     //! default
     ComsUSBC();
 
+    //! Construct with transfer settings
+    ComsUSBC(const ComsUSBTransferConfigC &config);
+
     //! Destructor
     // Disconnects and closes file descriptors
     virtual ~ComsUSBC();
@@ -107,21 +166,55 @@ namespace DogBotN {
     //! Process outgoing data complete
     void ProcessOutTransferIso(USBTransferDataC *data);
 
+    //! Access transfer settings
+    const ComsUSBTransferConfigC &TransferConfig() const
+    { return m_config; }
+
+    //! Get a copy of the transfer counters.
+    ComsUSBStatsC Stats();
+
+    //! Location of a device, the bus number followed by the ports on the way to it, for example '1-2.3'.
+    //! This stays the same as long as the device is plugged into the same socket.
+    static std::string DeviceLocation(libusb_device *device);
+
+    //! List the locations of all the bridges currently plugged in.
+    static std::vector<std::string> ListBridges();
+
   protected:
     //! Close usb handle
     void CloseUSB();
 
-    // 'data' is a free buffer or null.
-    void SendTxQueue(USBTransferDataC *data);
+    //! Pack queued packets into a transfer and submit it, only called from the USB thread.
+    //! 'data' is a free buffer or null. Returns true if a transfer was submitted.
+    bool SendTxQueue(USBTransferDataC *data);
+
+    //! Test if there are packets queued and a free transfer to send them with.
+    bool TxPending();
+
+    //! Make the USB thread return from handling events.
+    void WakeUSBThread();
+
+    //! Thread passing received packets to handlers.
+    void RunDispatch();
+
+    //! Split an iso packet into its packets and process them.
+    void DispatchFrame(const DataPacketT &frame);
+
+    //! Stop the dispatch thread.
+    void StopDispatch();
 
     void Init();
 
     //! Open connection to device
     void Open(struct libusb_device_handle *handle);
 
-    //! Remove transfer from active list.
+    //! Remove transfer from active list, m_accessTx must not be locked.
     void TransferComplete(USBTransferDataC *data);
 
+    ComsUSBTransferConfigC m_config;
+    ComsUSBStatsC m_stats; //! Protected by m_accessTx
+    int m_inQueued = 0;    //! IN transfers submitted, only used from the USB thread.
+
     std::vector<USBTransferDataC *> m_outDataFree;
     std::vector<USBTransferDataC *> m_activeTransfers;
 
@@ -139,7 +232,16 @@ namespace DogBotN {
 
     std::thread m_threadUSB;
 
-    std::deque<DataPacketT> m_txQueue;
+    std::unique_ptr<MPSCRingC<DataPacketT> > m_txQueue; //! Packets waiting to be sent, emptied by the USB thread.
+    std::atomic<bool> m_txWake { false };   //! Set when the USB thread is waiting for events.
+    std::atomic<uint64_t> m_txDropped { 0 };
+
+    std::unique_ptr<SPSCRingC<DataPacketT> > m_rxQueue; //! Iso packets received, filled by the USB thread.
+    std::thread m_threadDispatch;
+    std::mutex m_accessRxWake;
+    std::condition_variable m_rxWake;
+    std::atomic<bool> m_rxSleeping { false }; //! Set when the dispatch thread is waiting for data.
+    std::atomic<bool> m_rxTerminate { false };
 
     std::mutex m_accessTx;
     std::timed_mutex m_mutexExitOk;
@@ -0,0 +1,126 @@
+#ifndef DOGBOG_COMSZMQBATCH_HEADER
+#define DOGBOG_COMSZMQBATCH_HEADER 1
+
+#include "dogbot/Coms.hh"
+#include <zmq.hpp>
+#include <condition_variable>
+
+namespace DogBotN {
+
+  //! Counters for a ComsZMQBatcherC.
+
+  class ComsZMQBatchStatsC
+  {
+  public:
+    uint64_t m_messages = 0;      //! ZMQ messages sent.
+    uint64_t m_packets = 0;       //! Packets sent in them.
+    double m_totalDelayUs = 0;    //! Total time packets waited to be sent.
+    double m_maxDelayUs = 0;      //! Longest time a packet waited to be sent.
+  };
+
+  //! Packs packets into fewer, larger ZMQ messages.
+  //! Packets are held until 'flushUs' after the first one in a batch arrived,
+  //! or until the batch would exceed 'maxBytes', then sent as one message.
+  //! A batch starts with ZMQBatchMarker, followed by each packet preceded
+  //! by its length in a byte. With a flush window of zero every packet is
+  //! sent straight away in a message of its own, as it always was.
+  //! Either way packets are sent in the order they were added.
+  //!
+  //! With 'topics' set each message starts with a two byte topic, the packet
+  //! type and the device id, so subscribers can filter on it. A batch then
+  //! only holds packets of one type, and is sent as soon as a packet of
+  //! another type is added, so consecutive packets of the same type share a
+  //! message. A batch holding more than one device has ZMQTopicAnyDevice in
+  //! its topic, as do packets without a device id.
+
+  class ComsZMQBatcherC
+  {
+  public:
+    //! First byte of a batched message, never a packet type.
+    static const uint8_t ZMQBatchMarker = 0xFF;
+
+    //! Device id in the topic of messages which aren't for a single device.
+    static const uint8_t ZMQTopicAnyDevice = 0xFF;
+
+    //! Size of the topic at the start of each message.
+    static const int ZMQTopicSize = 2;
+
+    //! 'send' is called with each message to go out, one at a time.
+    ComsZMQBatcherC(const std::function<void (zmq::message_t &msg)> &send,int flushUs = 0,size_t maxBytes = 4096,bool topics = false);
+
+    //! Send anything waiting and stop.
+    ~ComsZMQBatcherC();
+
+    //! Queue a packet to send.
+    void Add(const uint8_t *data,int len);
+
+    //! Send anything waiting now.
+    void Flush();
+
+    //! Get a copy of the counters.
+    ComsZMQBatchStatsC Stats();
+
+    //! Call 'handler(uint8_t *data,int len)' for each packet in a message, batched or not.
+    //! 'topics' says if the message starts with a topic to skip.
+    //! Returns false if a batch is corrupt.
+    template<typename HandlerT>
+    static bool Unpack(zmq::message_t &msg,const HandlerT &handler,bool topics = false)
+    {
+      uint8_t *data = (uint8_t *) msg.data();
+      size_t len = msg.size();
+      if(topics) {
+        if(len < (size_t) ZMQTopicSize)
+          return false;
+        data += ZMQTopicSize;
+        len -= ZMQTopicSize;
+      }
+      if(len == 0)
+        return true;
+      if(data[0] != ZMQBatchMarker) {
+        handler(data,(int) len);
+        return true;
+      }
+      size_t at = 1;
+      while(at < len) {
+        size_t packetLen = data[at++];
+        if(packetLen == 0 || at + packetLen > len)
+          return false;
+        handler(data + at,(int) packetLen);
+        at += packetLen;
+      }
+      return true;
+    }
+
+  protected:
+    typedef std::chrono::steady_clock ClockT;
+
+    //! Packets waiting to go out in one message.
+    struct BatchC
+    {
+      std::vector<uint8_t> m_data;
+      std::vector<ClockT::time_point> m_arrived; //! When each packet in the batch was added.
+    };
+
+    //! Send the waiting batch, m_access must be locked.
+    void SendBatch();
+
+    //! Thread sending batches when their flush window ends.
+    void RunFlush();
+
+    std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
+    std::function<void (zmq::message_t &msg)> m_send;
+    std::chrono::microseconds m_flushWindow;
+    size_t m_maxBytes;
+    bool m_topics;
+
+    std::mutex m_access;
+    std::condition_variable m_wake;
+    BatchC m_batch;                 //! Packets waiting to be sent, empty if there are none.
+    ComsZMQBatchStatsC m_stats;
+    bool m_terminate = false;
+    std::thread m_threadFlush;
+  };
+
+}
+
+#endif
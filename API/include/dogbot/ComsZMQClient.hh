@@ -2,7 +2,9 @@
 #define DOGBOG_ZMQCLIENTCOMS_HEADER 1
 
 #include "dogbot/Coms.hh"
+#include "dogbot/ComsZMQBatch.hh"
 #include <zmq.hpp>
+#include <set>
 
 namespace DogBotN {
 
@@ -23,6 +25,7 @@ namespace DogBotN {
     virtual ~ComsZMQClientC();
 
     //! Open a port.
+    //! 'portAddr' is 'local' for a server on this machine, or a tcp://, ipc:// or inproc:// address, see ZMQEndpoints().
     virtual bool Open(const std::string &portAddr) override;
 
     //! Close connection
@@ -34,12 +37,54 @@ namespace DogBotN {
     //! Send packet
     virtual void SendPacket(const uint8_t *data,int len) override;
 
+    //! Pack packets sent within 'flushUs' of each other, up to 'maxBytes',
+    //! into a single message. Zero sends each packet on its own. Call before Open().
+    void SetBatching(int flushUs,size_t maxBytes = 4096)
+    {
+      m_batchFlushUs = flushUs;
+      m_batchMaxBytes = maxBytes;
+    }
+
+    //! Get counters for messages sent.
+    ComsZMQBatchStatsC BatchStats();
+
+    //! Receive packets of type 'packetType' from device 'deviceId', or from every device if it's negative.
+    //! This is in addition to any made for registered handlers. Packets from several devices
+    //! batched together by the server are received by anyone subscribed to one of them.
+    void Subscribe(ComsPacketTypeT packetType,int deviceId = -1);
+
+    //! Remove a subscription made with Subscribe().
+    void Unsubscribe(ComsPacketTypeT packetType,int deviceId = -1);
+
+    //! Subscribe to each packet type when a handler is first registered for it, on by default.
+    //! A generic handler subscribes to everything unless Subscribe() has been used.
+    //! Replies to requests, such as ReportParam and Error, are always received.
+    void SetAutoSubscribe(bool enable);
 
   protected:
 
-    bool RunRecieve();
+    bool RunRecieve(const std::string &stateEndpoint);
+
+    //! Called when handlers are added or removed.
+    virtual void HandlersChanged(const HandlerTableC &table) override;
+
+    //! Topics the receiver should be subscribed to, m_accessSubscriptions must be locked.
+    std::set<std::string> WantedTopics() const;
+
+    //! Bring the subscriptions on 'sub' up to date, called from the receive thread.
+    void UpdateSubscriptions(zmq::socket_t &sub,std::set<std::string> &subscribed);
 
     std::shared_ptr<zmq::socket_t> m_client;
+    std::shared_ptr<ComsZMQBatcherC> m_batcher; //! Protected by m_accessTx
+    int m_batchFlushUs = 0;
+    size_t m_batchMaxBytes = 4096;
+
+    std::mutex m_accessSubscriptions;
+    std::set<std::string> m_explicitTopics;
+    std::vector<bool> m_handlerTypes = std::vector<bool>(256,false); //! Types handlers have been registered for.
+    bool m_genericHandler = false;
+    bool m_autoSubscribe = true;
+    std::atomic<bool> m_subscriptionsChanged { true };
 
     std::thread m_threadRecieve;
 
@@ -2,6 +2,7 @@
 #define DOGBOG_COMSZMQSERVER_HEADER 1
 
 #include "dogbot/Coms.hh"
+#include "dogbot/ComsZMQBatch.hh"
 #include <zmq.hpp>
 
 namespace DogBotN {
@@ -20,18 +21,45 @@ namespace DogBotN {
     void SetVerbose(bool verbose)
     { m_verbose = verbose; }
 
+    //! Pack packets published within 'flushUs' of each other, up to 'maxBytes',
+    //! into a single message. Zero sends each packet on its own. Call before Run().
+    void SetBatching(int flushUs,size_t maxBytes = 4096)
+    {
+      m_batchFlushUs = flushUs;
+      m_batchMaxBytes = maxBytes;
+    }
+
+    //! Get counters for published messages.
+    ComsZMQBatchStatsC BatchStats();
+
     //! Run server
+    //! 'addr' is a comma separated list of addresses to serve clients on,
+    //! such as 'tcp://*', 'ipc:///tmp/dogbot' or 'inproc://dogbot', see ZMQEndpoints().
     void Run(const std::string &addr);
 
+    //! Stop the server, Run() returns shortly afterwards.
+    void Stop()
+    { m_terminate = true; }
+
   protected:
+    //! Log the rate messages are published at and the delay batching adds.
+    void LogBatchStats();
+
     std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
 
     std::shared_ptr<ComsC> m_coms;
 
 
     bool m_verbose = false;
-    bool m_terminate = false;
+    std::atomic<bool> m_terminate { false };
     int m_genericHandlerId = -1;
+
+    int m_batchFlushUs = 0;
+    size_t m_batchMaxBytes = 4096;
+    std::mutex m_accessBatcher;
+    std::shared_ptr<ComsZMQBatcherC> m_batcher;
+    ComsZMQBatchStatsC m_lastStats;
+    std::chrono::steady_clock::time_point m_lastStatsTime;
   };
 
 }
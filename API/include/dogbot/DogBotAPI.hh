@@ -53,7 +53,7 @@ namespace DogBotN {
     DogBotAPIC();
 
     //! Construct with a string
-    //! \param connectionName Typically 'usb' to connect directly via usb or 'local' to connect via a server.
+    //! \param connectionName Typically 'usb' to connect directly via usb, 'usb*' to use every usb bridge plugged in, or 'local' to connect via a server, which can also be given as a tcp://, ipc:// or inproc:// address, 'shm://name' for one serving shared memory, 'replay:filename' to play back a packet log, or 'sim:devices' to simulate a set of controllers.
     //! \param log Where to output log messages
     //! \param devMaster If this instance of the class should manage device ids, management is enabled if connecting directly via usb, and not otherwise
     DogBotAPIC(
@@ -2,6 +2,8 @@
 #define DOGBOT_FIRMWARE_UPDATE_HEADER 1
 
 #include "dogbot/Coms.hh"
+#include <map>
+#include <condition_variable>
 
 namespace DogBotN {
 
@@ -16,6 +18,11 @@ namespace DogBotN {
     //! Start update
     bool DoUpdate(int deviceId,const std::string &filename);
 
+    //! Update a set of devices at once.
+    //! Commands and data are broadcast, each device acknowledges them independently
+    //! and any data a device misses is resent to just that device.
+    bool DoUpdate(const std::vector<int> &devices,const std::string &filename);
+
     //! Switch into dry run mode.
     void SetDryRun()
     { m_dryRun = true; }
@@ -25,28 +32,62 @@ namespace DogBotN {
       m_exitBootloaderOnComplete = enable;
     }
 
-  protected:
+    //! Erase and write every sector in the image, even if the device already has it. Enabled by default.
+    //! When disabled sectors the devices already have are skipped, if the boot-loaders can compute a CRC-32.
+    void SetFullUpdate(bool enable)
+    { m_fullUpdate = enable; }
 
-    //! Connect
-    void Init();
+    //! Compress data sent to boot-loaders that support it. Enabled by default.
+    void SetCompression(bool enable)
+    { m_compress = enable; }
 
     //! Load an intel hex file
     bool LoadHexFile(const std::string &filename);
 
+    //! Access image loaded from the hex file, indexed by start address.
+    const std::map<uint32_t,std::vector<uint8_t> > &Image() const
+    { return m_dataMap; }
+
+    //! Compress a block of data into the format described in flashlz.h
+    static std::vector<uint8_t> Compress(const uint8_t *data,size_t len);
+
+    //! Set the number of data packets allowed in flight before waiting for an acknowledge.
+    //! This must be less than 128 so sequence numbers can't be confused, and at least
+    //! BOOTLOADER_ACK_LIMIT (16) as boot-loaders only acknowledge that often when no
+    //! 256 byte page has been written. Sizes outside this range are clamped.
+    void SetWindowSize(int packets);
+
+  protected:
+
+    //! Connect
+    void Init();
+
     //! Write data to flash
-    bool WriteFlash(uint8_t targetDevice,uint32_t address,uint8_t *data,uint32_t size);
+    bool WriteFlash(uint32_t address,uint8_t *data,uint32_t size);
+
+    //! Check the flash contents of every device against the loaded image.
+    bool VerifyFlash();
+
+    //! Checksum of what the loaded image puts in an area of flash, taking
+    //! anything outside the image as erased. Either the byte sum or, if 'crc'
+    //! is set, the CRC-32 computed by the boot-loader.
+    uint32_t ImageCheckSum(uint32_t address,uint32_t len,bool crc) const;
+
+    //! Ask every device for the checksum of an area of flash and compare it with the image.
+    //! Returns true if they all match, 'quiet' suppresses logging of mismatches.
+    bool CheckFlash(uint32_t address,uint16_t len,bool quiet = false);
 
     //! Send a boot-loader reset
     void SendBootLoaderReset(uint8_t deviceId,bool enable);
 
     //! Send a boot-loader begin write
-    void SendBootLoaderBeginWrite(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len);
+    void SendBootLoaderBeginWrite(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len,bool compressed = false);
 
     //! Send a boot-loader erase sector
     void SendBootLoaderErase(uint8_t deviceId,uint8_t seqNum,uint32_t address);
 
     //! Send a boot-loader checksum request
-    void SendBootLoaderCheckSum(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len);
+    void SendBootLoaderCheckSum(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len,bool crc);
 
     //! Send a boot-loader begin read
     void SendBootLoaderBeginRead(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len);
@@ -54,8 +95,32 @@ namespace DogBotN {
     //! Send a boot-loader begin read
     void SendBootLoaderData(uint8_t deviceId,uint8_t seqNum,uint8_t *data,uint8_t len);
 
-    //! Wait for result.
-    bool WaitForResult(uint8_t seqNo,const std::string &op);
+    //! Wait for a result with the given sequence number from all devices.
+    bool WaitForResult(uint8_t seqNo,const std::string &op,int timeoutMs = 2000);
+
+    //! Progress of the update for a single device.
+    struct DeviceStateC
+    {
+      bool m_gotResult = false;
+      struct PacketFlashResultC m_result;
+      bool m_lostSequence = false;
+      uint8_t m_lostSequenceExpected = 0; //! Sequence number the boot-loader is waiting for
+      bool m_gotCheckSum = false;
+      struct PacketFlashChecksumResultC m_checkSum;
+      bool m_error = false;
+
+      int m_acked = 0;   //! Data packets acknowledged in the current write
+      int m_next = 0;    //! Next data packet to send to this device
+      int m_resendFrom = -1; //! Packet we last went back to after a lost sequence report
+      int m_retries = 0;
+    };
+
+    //! Clear results from all devices, ready for a new command.
+    void ClearResults();
+
+    //! Find state for a device, returns null if it isn't part of the update.
+    //! Must be called with m_mutexResult locked.
+    DeviceStateC *FindDevice(int deviceId);
 
     //! Set the handler for a particular type of packet.
     //! Returns the id of the handler or -1 if failed.
@@ -70,12 +135,22 @@ namespace DogBotN {
 
     bool m_flagError = false;
     bool m_exitBootloaderOnComplete = true;
-    bool m_gotResult = false;
     std::mutex m_mutexResult;
     std::condition_variable m_condVar;
-    struct PacketFlashResultC m_pktResult;
+    std::map<int,DeviceStateC> m_devices; //! Devices being updated.
+    uint8_t m_sendAddress = 0;  //! Device id commands are sent to, 0 if broadcast
     uint8_t m_seqNo = -1;
     bool m_dryRun = false;
+    bool m_fullUpdate = true;
+    bool m_compress = true;
+    bool m_useCompression = false; //! Set if all devices accept compressed data.
+    bool m_useCRC = false;      //! Set if all devices can compute a CRC-32 of their flash.
+
+    int m_windowSize = 48;      //! Data packets in flight.
+    int m_dataTimeout = 250;    //! Time to wait for an acknowledge before resending, in milliseconds.
+    int m_maxRetries = 8;       //! Resends without progress before giving up.
+    size_t m_retransmitCount = 0;
+    size_t m_bytesSent = 0;     //! Data bytes sent, after compression.
   };
 
 }
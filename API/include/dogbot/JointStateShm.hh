@@ -0,0 +1,166 @@
+#ifndef DOGBOG_JOINTSTATESHM_HEADER
+#define DOGBOG_JOINTSTATESHM_HEADER 1
+
+#include "dogbot/DogBotAPI.hh"
+#include <atomic>
+#include <map>
+
+namespace DogBotN {
+
+  //! Number of records in a joint state table, one for each possible device id.
+  const int g_jointStateRecords = 256;
+
+  //! Last known state of one servo.
+
+  struct JointStateC
+  {
+    int64_t m_timestamp;      //! When the position was reported, nanoseconds on the steady clock (CLOCK_MONOTONIC).
+    float m_position;         //! Radians
+    float m_velocity;         //! Radians per second
+    float m_torque;           //! Newton meters
+    float m_temperature;      //! Degrees C
+    float m_supplyVoltage;    //! Volts
+    uint32_t m_updates;       //! Number of times the record has been written.
+    uint8_t m_valid;          //! Non zero once the servo has been seen.
+    uint8_t m_deviceId;
+    uint8_t m_faultCode;      //! FaultCodeT
+    uint8_t m_controlState;   //! ControlStateT
+    uint8_t m_homedState;     //! MotionHomedStateT
+    uint8_t m_controlDynamic; //! PWMControlDynamicT
+    uint8_t m_enabled;
+  };
+
+  //! A JointStateC guarded by a sequence number, in a cache line of its own.
+  //! The sequence number is odd while the record is being written.
+
+  struct alignas(64) JointStateRecordC
+  {
+    std::atomic<uint32_t> m_seq;
+    JointStateC m_state;
+  };
+
+  //! Start of a joint state segment, followed by g_jointStateRecords records indexed by device id.
+
+  struct alignas(64) JointStateShmHeaderC
+  {
+    uint32_t m_magic;
+    uint32_t m_version;
+    uint32_t m_records;
+    std::atomic<uint32_t> m_generation; //! Changed each time a writer starts.
+    std::atomic<uint32_t> m_running;    //! Set while a writer is using the segment.
+    std::atomic<uint64_t> m_updates;    //! Bumped after every record written.
+  };
+
+  //! Table of the latest state of every servo in shared memory.
+  //! One process writes it, any number may read it without locking or
+  //! system calls. Each record is read as a seqlock, so a reader always
+  //! gets a consistent copy of one servo, and the writer never waits.
+
+  class JointStateTableC
+  {
+  public:
+    //! Default constructor.
+    JointStateTableC();
+
+    //! Unmap the segment.
+    ~JointStateTableC();
+
+    //! Create or take over the segment 'addr', 'shm://name', as the writer.
+    bool Create(const std::string &addr);
+
+    //! Map an existing segment 'addr', 'shm://name', for reading.
+    bool Attach(const std::string &addr);
+
+    //! Unmap the segment, if it was created the writer is marked as stopped.
+    void Detach();
+
+    //! Is a segment mapped ?
+    bool IsAttached() const
+    { return m_header != nullptr; }
+
+    //! Is the writer running ?
+    bool IsRunning() const
+    { return m_header != nullptr && m_header->m_running.load() != 0; }
+
+    //! Number of records written since the writer started, a cheap way to see if anything changed.
+    uint64_t Updates() const
+    { return m_header == nullptr ? 0 : m_header->m_updates.load(std::memory_order_acquire); }
+
+    //! Write the record for a device. Writer only, from one thread at a time.
+    bool Write(int deviceId,const JointStateC &state);
+
+    //! Mark the record for a device as no longer valid. Writer only.
+    void Clear(int deviceId);
+
+    //! Read the record for a device.
+    //! Returns false if there's no valid record for it.
+    bool Read(int deviceId,JointStateC &state) const;
+
+    //! Read every valid record. Each record is consistent in itself, but
+    //! records may come from different reports.
+    //! Returns the number of records read.
+    size_t Snapshot(std::vector<JointStateC> &states) const;
+
+    //! Convert a time point to the timestamp used in records.
+    static int64_t Timestamp(JointC::TimePointT timePoint)
+    { return std::chrono::duration_cast<std::chrono::nanoseconds>(timePoint.time_since_epoch()).count(); }
+
+  protected:
+    //! Map 'size' bytes of an open segment.
+    bool Map(int fd,size_t size);
+
+    std::shared_ptr<spdlog::logger> m_log = spdlog::get("console");
+    JointStateShmHeaderC *m_header = nullptr;
+    JointStateRecordC *m_records = nullptr;
+    size_t m_size = 0;
+    bool m_isWriter = false;
+  };
+
+  //! Keep a joint state table up to date with the servos known to a DogBotAPIC.
+  //! Records are written from the API's position and status callbacks, so
+  //! this works the same in dogBotServer or in any process using the API directly.
+
+  class JointStatePublisherC
+  {
+  public:
+    //! Publish the servos known to 'api', once Open() has been called.
+    JointStatePublisherC(DogBotAPIC &api,std::shared_ptr<spdlog::logger> &log);
+
+    //! Remove callbacks and mark the table as stopped.
+    ~JointStatePublisherC();
+
+    //! Create the segment and start publishing.
+    bool Open(const std::string &addr);
+
+    //! Stop publishing.
+    void Close();
+
+    //! Access the table.
+    JointStateTableC &Table()
+    { return m_table; }
+
+  protected:
+    //! Add a servo, or update its record after a status change.
+    void UpdateServo(ServoC *servo);
+
+    //! Write the record for a servo, m_access must be locked.
+    void WriteServo(ServoC *servo,JointC::TimePointT theTime,double position,double velocity,double torque);
+
+    //! Callbacks registered with a servo and the id its record was last written under.
+    struct ServoEntryC
+    {
+      CallbackHandleC m_positionCallback { nullptr,-1 };
+      int m_deviceId = -1;
+    };
+
+    DogBotAPIC &m_api;
+    std::shared_ptr<spdlog::logger> m_log;
+    std::mutex m_access;
+    JointStateTableC m_table;
+    std::map<ServoC *,ServoEntryC> m_servos;
+    CallbackHandleC m_statusCallback { nullptr,-1 };
+  };
+
+}
+
+#endif
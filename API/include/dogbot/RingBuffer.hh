@@ -0,0 +1,171 @@
+#ifndef DOGBOT_RINGBUFFER_HEADER
+#define DOGBOT_RINGBUFFER_HEADER 1
+
+#include <atomic>
+#include <memory>
+#include <cassert>
+#include <cstddef>
+
+namespace DogBotN {
+
+  //! Bounded queue for any number of producer threads and a single consumer.
+  //! Neither side takes a lock, a producer finding the queue full is told so
+  //! rather than waiting. Each slot carries a sequence number saying whether
+  //! it is free for the next producer or ready for the consumer.
+
+  template<typename DataT>
+  class MPSCRingC
+  {
+  public:
+    //! Create a ring holding 'size' entries, which must be a power of two.
+    MPSCRingC(size_t size)
+     : m_cells(new CellC[size]),
+       m_mask(size - 1)
+    {
+      assert(size >= 2 && (size & (size - 1)) == 0);
+      for(size_t i = 0;i < size;i++)
+        m_cells[i].m_sequence.store(i,std::memory_order_relaxed);
+    }
+
+    //! Add an entry, returns false if the ring is full.
+    //! May be called from any thread.
+    bool Push(const DataT &data)
+    {
+      size_t pos = m_head.load(std::memory_order_relaxed);
+      for(;;) {
+        CellC &cell = m_cells[pos & m_mask];
+        size_t seq = cell.m_sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) seq - (ptrdiff_t) pos;
+        if(diff == 0) {
+          if(m_head.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed)) {
+            cell.m_data = data;
+            cell.m_sequence.store(pos + 1,std::memory_order_release);
+            return true;
+          }
+        } else if(diff < 0) {
+          return false; // Full
+        } else {
+          pos = m_head.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    //! Look at the next entry without removing it, returns null if the ring is empty.
+    //! Only call from the consumer thread.
+    DataT *Front()
+    {
+      CellC &cell = m_cells[m_tail & m_mask];
+      if(cell.m_sequence.load(std::memory_order_acquire) != m_tail + 1)
+        return nullptr;
+      return &cell.m_data;
+    }
+
+    //! Remove the entry returned by Front().
+    //! Only call from the consumer thread.
+    void PopFront()
+    {
+      CellC &cell = m_cells[m_tail & m_mask];
+      cell.m_sequence.store(m_tail + m_mask + 1,std::memory_order_release);
+      m_tail++;
+    }
+
+    //! Test if the ring is empty, only reliable from the consumer thread.
+    bool IsEmpty() const
+    { return m_cells[m_tail & m_mask].m_sequence.load(std::memory_order_acquire) != m_tail + 1; }
+
+    //! Number of entries queued, approximate if producers are busy.
+    //! Only call from the consumer thread.
+    size_t Size() const
+    { return m_head.load(std::memory_order_relaxed) - m_tail; }
+
+    //! Number of entries the ring holds.
+    size_t Capacity() const
+    { return m_mask + 1; }
+
+  protected:
+    struct CellC
+    {
+      std::atomic<size_t> m_sequence;
+      DataT m_data;
+    };
+
+    std::unique_ptr<CellC[]> m_cells;
+    size_t m_mask;
+    char m_pad0[64];
+    std::atomic<size_t> m_head { 0 }; //! Next slot for a producer
+    char m_pad1[64];
+    size_t m_tail = 0;                //! Next slot for the consumer
+  };
+
+  //! Bounded queue for a single producer thread and a single consumer thread.
+  //! Entries are filled and read in place, so nothing is copied through the queue.
+
+  template<typename DataT>
+  class SPSCRingC
+  {
+  public:
+    //! Create a ring holding 'size' entries, which must be a power of two.
+    SPSCRingC(size_t size)
+     : m_data(new DataT[size]),
+       m_mask(size - 1)
+    {
+      assert(size >= 2 && (size & (size - 1)) == 0);
+    }
+
+    //! Get the next free entry to fill in, returns null if the ring is full.
+    //! Only call from the producer thread.
+    DataT *Back()
+    {
+      size_t head = m_head.load(std::memory_order_relaxed);
+      if(head - m_tail.load(std::memory_order_acquire) > m_mask)
+        return nullptr;
+      return &m_data[head & m_mask];
+    }
+
+    //! Make the entry returned by Back() available to the consumer.
+    //! Only call from the producer thread.
+    void PushBack()
+    { m_head.store(m_head.load(std::memory_order_relaxed) + 1,std::memory_order_release); }
+
+    //! Look at the next entry without removing it, returns null if the ring is empty.
+    //! Only call from the consumer thread.
+    DataT *Front()
+    {
+      size_t tail = m_tail.load(std::memory_order_relaxed);
+      if(tail == m_head.load(std::memory_order_acquire))
+        return nullptr;
+      return &m_data[tail & m_mask];
+    }
+
+    //! Remove the entry returned by Front(), freeing it for the producer.
+    //! Only call from the consumer thread.
+    void PopFront()
+    { m_tail.store(m_tail.load(std::memory_order_relaxed) + 1,std::memory_order_release); }
+
+    //! Test if the ring is empty.
+    bool IsEmpty() const
+    { return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_acquire); }
+
+    //! Number of entries queued.
+    size_t Size() const
+    {
+      // Read the tail first so it can't pass the head we compare it with.
+      size_t tail = m_tail.load(std::memory_order_acquire);
+      return m_head.load(std::memory_order_acquire) - tail;
+    }
+
+    //! Number of entries the ring holds.
+    size_t Capacity() const
+    { return m_mask + 1; }
+
+  protected:
+    std::unique_ptr<DataT[]> m_data;
+    size_t m_mask;
+    char m_pad0[64];
+    std::atomic<size_t> m_head { 0 }; //! Next entry for the producer
+    char m_pad1[64];
+    std::atomic<size_t> m_tail { 0 }; //! Next entry for the consumer
+  };
+
+}
+#endif
@@ -0,0 +1,373 @@
+#ifndef DOGBOT_SERIALFRAME_HEADER
+#define DOGBOT_SERIALFRAME_HEADER 1
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+// Framing used on the serial link, shared by the API and the firmware.
+// A link starts with SF_STXChecksum framing:
+//
+//  STX
+//  Len       - Of data excluding STX, ETX and checksum.
+//  Data      - 'Len' bytes.
+//  Checksum  - 16 bit sum of 0x55, Len and Data, low byte first.
+//  ETX
+//
+// The host may then ask for SF_COBSCRC16 framing by sending a
+// CPT_SerialFraming packet. The device replies with the framing it will use
+// from then on in the old framing, and the host switches once it has the reply.
+//
+//  Data and CRC-16 (CCITT, initial value 0xFFFF, low byte first) COBS encoded
+//  so they contain no zeros, then a zero to end the frame.
+//
+// A COBS frame is always 4 bytes longer than its data, and as a zero can only
+// be the end of a frame, the frame after any corrupted bytes is read correctly.
+
+static const uint8_t g_serialFrameSTX = 0x02;
+static const uint8_t g_serialFrameETX = 0x03;
+
+//! Bytes a frame adds around the data.
+static const int g_serialFrameOverhead = 5;
+
+//! Write a frame holding 'len' bytes of 'data' into 'frame', which must have
+//! space for len + g_serialFrameOverhead bytes. Returns the size of the frame.
+
+static inline int SerialFrameEncode(uint8_t *frame,const uint8_t *data,int len)
+{
+  uint8_t *at = frame;
+  *(at++) = g_serialFrameSTX;
+  *(at++) = len;
+  int crc = len + 0x55;
+  for(int i = 0;i < len;i++) {
+    uint8_t value = data[i];
+    *(at++) = value;
+    crc += value;
+  }
+  *(at++) = crc;
+  *(at++) = crc >> 8;
+  *(at++) = g_serialFrameETX;
+  return at - frame;
+}
+
+//! Bytes SF_COBSCRC16 framing adds around the data, for data under 252 bytes.
+static const int g_serialFrameCOBSOverhead = 4;
+
+static const uint16_t g_serialFrameCRCTable[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+  0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+  0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+  0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+  0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+  0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+  0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+  0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+  0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+  0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+  0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+  0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+  0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+  0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+  0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+  0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+  0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+  0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+  0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+  0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+  0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+  0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+//! Compute the CRC-16 of 'len' bytes of 'data'.
+
+static inline uint16_t SerialFrameCRC16(const uint8_t *data,int len)
+{
+  uint16_t crc = 0xFFFF;
+  for(int i = 0;i < len;i++)
+    crc = (crc << 8) ^ g_serialFrameCRCTable[((crc >> 8) ^ data[i]) & 0xff];
+  return crc;
+}
+
+//! Write a COBS frame holding 'len' bytes of 'data' into 'frame', which must have
+//! space for len + g_serialFrameCOBSOverhead bytes. Returns the size of the frame.
+
+static inline int SerialFrameEncodeCOBS(uint8_t *frame,const uint8_t *data,int len)
+{
+  uint16_t crc = SerialFrameCRC16(data,len);
+  uint8_t *code = frame;  // Where the count of bytes up to the next zero goes
+  uint8_t *at = frame + 1;
+  uint8_t count = 1;
+  for(int i = 0;i < len + 2;i++) {
+    uint8_t value = (i < len) ? data[i] : (uint8_t) ((i == len) ? crc : (crc >> 8));
+    if(value != 0) {
+      *(at++) = value;
+      if(++count != 0xFF)
+        continue;
+    }
+    *code = count;
+    code = at++;
+    count = 1;
+  }
+  *code = count;
+  *(at++) = 0;
+  return at - frame;
+}
+
+//! Decode frames from a stream a block at a time.
+//! The block is searched for STX with memchr, and a frame that lies
+//! entirely in the block is checked and handed on where it is, without
+//! copying. Only a frame split between blocks is copied to an internal
+//! buffer while the rest of it arrives. Bytes are accepted and rejected
+//! as the original one byte at a time state machine did, other than a
+//! frame with no data being read correctly.
+//! 'MaxLen' is the largest data length accepted.
+
+template<int MaxLen>
+class SerialFrameDecoderC
+{
+public:
+  //! Forget any partly received frame.
+  void Reset()
+  {
+    m_inFrame = false;
+    m_have = 0;
+  }
+
+  //! Decode a block of 'len' bytes, calling 'handler(uint8_t *data,int len)'
+  //! for each complete frame. 'data' may be pointed into by the handler's
+  //! argument, so must stay valid until it returns.
+  //! Returns the number of bytes used, which is all of them unless Pause() is called.
+  template<typename HandlerT>
+  size_t Decode(uint8_t *data,size_t len,const HandlerT &handler)
+  {
+    m_pause = false;
+    size_t at = 0;
+    while(at < len) {
+      if(!m_inFrame) {
+        const uint8_t *stx = (const uint8_t *) memchr(data + at,g_serialFrameSTX,len - at);
+        if(stx == 0)
+          return len;
+        at = (stx - data) + 1;
+        m_inFrame = true;
+        m_have = 0;
+        continue;
+      }
+
+      // Finish a frame started in an earlier block.
+      if(m_have > 0) {
+        size_t frameLen = m_frame[0] + 4;
+        size_t n = frameLen - m_have;
+        if(n > len - at)
+          n = len - at;
+        memcpy(m_frame + m_have,data + at,n);
+        m_have += n;
+        at += n;
+        if(m_have < frameLen)
+          return len;
+        m_have = 0;
+        m_inFrame = false;
+        int failed = Check(m_frame);
+        if(failed < 0) {
+          handler(m_frame + 1,(int) m_frame[0]);
+          if(m_pause)
+            return at;
+          continue;
+        }
+        // Bytes after the one that failed are looked at again for the start of a frame.
+        uint8_t rest[4];
+        size_t restLen = frameLen - failed;
+        memcpy(rest,m_frame + failed,restLen);
+        Decode(rest,restLen,handler);
+        continue;
+      }
+
+      int packetLen = data[at];
+      if(packetLen > MaxLen) {
+        m_errors++;
+        m_inFrame = false;
+        at++;
+        continue;
+      }
+      size_t frameLen = packetLen + 4;
+      if(len - at < frameLen) {
+        // Frame continues in the next block.
+        memcpy(m_frame,data + at,len - at);
+        m_have = len - at;
+        return len;
+      }
+      m_inFrame = false;
+      int failed = Check(data + at);
+      if(failed < 0) {
+        handler(data + at + 1,packetLen);
+        at += frameLen;
+        if(m_pause)
+          return at;
+        continue;
+      }
+      at += failed;
+    }
+    return len;
+  }
+
+  //! Called from a handler to stop decoding after the current frame,
+  //! for example because the framing is about to change.
+  void Pause()
+  { m_pause = true; }
+
+  //! Number of frames with a bad length, checksum or terminator.
+  uint32_t Errors() const
+  { return m_errors; }
+
+protected:
+  //! Check a frame starting at its length byte, the whole of which must be present.
+  //! Returns -1 if it is good, otherwise the offset to carry on searching from.
+  int Check(const uint8_t *frame)
+  {
+    int packetLen = frame[0];
+    int crc = 0x55 + packetLen;
+    for(int i = 1;i <= packetLen;i++)
+      crc += frame[i];
+    int failed = -1;
+    if(frame[packetLen+1] != (uint8_t) crc)
+      failed = packetLen+1;
+    else if(frame[packetLen+2] != (uint8_t) (crc >> 8))
+      failed = packetLen+2;
+    else if(frame[packetLen+3] != g_serialFrameETX)
+      failed = packetLen+3;
+    if(failed < 0)
+      return -1;
+    m_errors++;
+    // A bad byte which is an STX starts the next frame.
+    if(frame[failed] == g_serialFrameSTX) {
+      m_inFrame = true;
+      m_have = 0;
+      failed++;
+    }
+    return failed;
+  }
+
+  bool m_pause = false;
+  bool m_inFrame = false;   //! Set once an STX has been seen.
+  size_t m_have = 0;        //! Bytes of a split frame after the STX held in m_frame.
+  uint32_t m_errors = 0;
+  uint8_t m_frame[MaxLen + 4];
+};
+
+//! Decode SF_COBSCRC16 frames from a stream a block at a time.
+//! The block is searched for the zero ending each frame with memchr, and a
+//! frame that lies entirely in the block is decoded where it is. A frame
+//! split between blocks is copied to an internal buffer.
+//! 'MaxLen' is the largest data length accepted.
+
+template<int MaxLen>
+class SerialFrameCOBSDecoderC
+{
+public:
+  //! Forget any partly received frame.
+  void Reset()
+  {
+    m_have = 0;
+    m_discard = false;
+  }
+
+  //! Decode a block of 'len' bytes, calling 'handler(uint8_t *data,int len)'
+  //! for each complete frame. Frames are decoded in place so the contents
+  //! of 'data' are changed.
+  //! Returns the number of bytes used, which is all of them unless Pause() is called.
+  template<typename HandlerT>
+  size_t Decode(uint8_t *data,size_t len,const HandlerT &handler)
+  {
+    m_pause = false;
+    size_t at = 0;
+    while(at < len) {
+      uint8_t *end = (uint8_t *) memchr(data + at,0,len - at);
+      if(end == 0) {
+        // Frame continues in the next block.
+        size_t n = len - at;
+        if(m_discard || m_have + n > sizeof(m_frame)) {
+          m_discard = true;
+          m_have = 0;
+        } else {
+          memcpy(m_frame + m_have,data + at,n);
+          m_have += n;
+        }
+        return len;
+      }
+      size_t n = end - (data + at);
+      uint8_t *frame = data + at;
+      at += n + 1;
+      if(m_discard) {
+        // The end of a frame that was too long.
+        m_discard = false;
+        m_errors++;
+        continue;
+      }
+      if(m_have > 0) {
+        if(m_have + n > sizeof(m_frame)) {
+          m_have = 0;
+          m_errors++;
+          continue;
+        }
+        memcpy(m_frame + m_have,frame,n);
+        frame = m_frame;
+        n += m_have;
+        m_have = 0;
+      }
+      if(n == 0)
+        continue; // Nothing between two zeros, used to mark the start of a frame.
+      int dataLen = Unstuff(frame,n) - 2;
+      if(dataLen < 0 || dataLen > MaxLen || SerialFrameCRC16(frame,dataLen) != (frame[dataLen] | (frame[dataLen+1] << 8))) {
+        m_errors++;
+        continue;
+      }
+      handler(frame,dataLen);
+      if(m_pause)
+        return at;
+    }
+    return len;
+  }
+
+  //! Called from a handler to stop decoding after the current frame.
+  void Pause()
+  { m_pause = true; }
+
+  //! Number of frames which were corrupted.
+  uint32_t Errors() const
+  { return m_errors; }
+
+protected:
+  //! Decode COBS data in place, returns the decoded length or -1 if it isn't valid.
+  static int Unstuff(uint8_t *frame,size_t len)
+  {
+    size_t from = 0;
+    size_t to = 0;
+    while(from < len) {
+      uint8_t code = frame[from++];
+      if(code == 0 || from + code - 1 > len)
+        return -1;
+      for(int i = 1;i < code;i++)
+        frame[to++] = frame[from++];
+      if(code != 0xFF && from < len)
+        frame[to++] = 0;
+    }
+    return to;
+  }
+
+  bool m_pause = false;
+  bool m_discard = false;   //! Set while skipping the rest of a frame that is too long.
+  size_t m_have = 0;        //! Bytes of a split frame held in m_frame.
+  uint32_t m_errors = 0;
+  uint8_t m_frame[MaxLen + g_serialFrameCOBSOverhead];
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "dogbot/Joint.hh"
 #include <chrono>
+#include <atomic>
 #include "dogbot/Coms.hh"
 
 namespace DogBotN {
@@ -218,6 +219,21 @@ namespace DogBotN {
     //! Returns true if state changed.
     bool UpdateTick(TimePointT timeNow);
 
+    //! State returned by GetState() and GetStateAt().
+    struct ServoStateC
+    {
+      unsigned m_tick;
+      float m_position;
+      float m_velocity;
+      float m_torque;
+    };
+
+    //! Publish the current state for GetState() and GetStateAt().
+    //! m_mutexState must be locked, so there is only ever one writer.
+    void PublishState();
+
+    //! Get a consistent copy of the published state, without locking.
+    void ReadState(ServoStateC &state) const;
 
     mutable std::mutex m_mutexAdmin;
 
@@ -252,6 +268,12 @@ namespace DogBotN {
     std::chrono::duration<double> m_comsTimeout; // Default is 200ms
     unsigned m_tick = 0;
 
+    // Published as a seqlock with two copies, so a control loop reading the
+    // state never waits for the thread handling servo reports. Readers use
+    // m_state[m_stateSeq & 1] while the writer updates the other copy.
+    std::atomic<uint32_t> m_stateSeq { 0 };
+    ServoStateC m_state[2] { { 0,0,0,0 }, { 0,0,0,0 } };
+
     float m_defaultPositionTorque = 4.0;
     float m_supplyVoltage = 0;
     enum PositionReferenceT m_positionRef = PR_Relative;
@@ -2,11 +2,33 @@
 #define DOGBOG_ZMQCONTEXT_HEADER 1
 
 #include <zmq.hpp>
+#include <string>
+#include <vector>
 
 namespace DogBotN {
 
   extern zmq::context_t g_zmqContext;
 
+  //! Default port clients send commands to, state is published on the next one.
+  const int g_zmqDefaultPort = 7200;
+
+  //! Test if 'addr' names a ZMQ server, 'local' or a tcp://, ipc:// or inproc:// address.
+  bool IsZMQAddress(const std::string &addr);
+
+  //! Work out the endpoints used to send commands to a server and receive
+  //! its state from an address.
+  //!   'local' or '' is the server on this machine over tcp, as it always was.
+  //!   '*' or '*.*.*.*' is every interface, for a server to bind to.
+  //!   'tcp://host[:port]' uses port for commands and port+1 for state.
+  //!   'ipc://path' uses the sockets 'path-commands' and 'path-state', for processes on the same host.
+  //!   'inproc://name' uses 'name-commands' and 'name-state', for clients in the same process as the server.
+  //! 'bind' selects the server end, which listens on every interface by default.
+  //! Returns false if the address isn't understood.
+  bool ZMQEndpoints(const std::string &addr,bool bind,std::string &commands,std::string &state);
+
+  //! Split a comma separated list of addresses.
+  std::vector<std::string> ZMQSplitAddresses(const std::string &addrs);
+
 }
 
 #endif
@@ -0,0 +1,129 @@
+#ifndef DOGBOT_FLASHLZ_HEADER
+#define DOGBOT_FLASHLZ_HEADER 1
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  // Compressed data stream used by CPT_FlashWriteCompressed.
+  //
+  // The stream is a sequence of tokens:
+  //   0x00-0x7F  Literal run, followed by (token + 1) bytes to copy to the output.
+  //   0x80-0xFF  Match of ((token & 0x7F) + FLASHLZ_MIN_MATCH) bytes copied from
+  //              earlier in the output, followed by the 16 bit little endian
+  //              distance back to them.
+  //
+  // Matches only refer to data already written in the current block, so the
+  // boot-loader reads them back from flash and needs no history buffer.
+
+#define FLASHLZ_MIN_MATCH   4
+#define FLASHLZ_MAX_MATCH   (0x7F + FLASHLZ_MIN_MATCH)
+#define FLASHLZ_MAX_LITERAL 0x80
+#define FLASHLZ_MAX_DISTANCE 0xFFFF
+
+  enum FlashLZStatusT {
+    FLZ_Ok = 0,
+    FLZ_Corrupt = 1,
+    FLZ_WriteFailed = 2
+  };
+
+  enum FlashLZStateT {
+    FLZ_Token = 0,
+    FLZ_Literal = 1,
+    FLZ_Distance0 = 2,
+    FLZ_Distance1 = 3
+  };
+
+  struct FlashLZDecoderC {
+    uint8_t m_state;
+    uint8_t m_count;     // Bytes left in the current literal or match
+    uint16_t m_distance;
+    uint32_t m_written;  // Bytes output so far
+    uint32_t m_len;      // Total bytes expected
+  };
+
+  // Write a byte to the output, returns 0 if it failed.
+  typedef int (*FlashLZPutT)(void *ctx,uint8_t value);
+
+  // Read a byte that was written 'distance' bytes ago.
+  typedef uint8_t (*FlashLZGetT)(void *ctx,uint16_t distance);
+
+  static inline void FlashLZ_Init(struct FlashLZDecoderC *dec,uint32_t len)
+  {
+    dec->m_state = FLZ_Token;
+    dec->m_count = 0;
+    dec->m_distance = 0;
+    dec->m_written = 0;
+    dec->m_len = len;
+  }
+
+  static inline int FlashLZ_Done(const struct FlashLZDecoderC *dec)
+  {
+    return dec->m_written >= dec->m_len;
+  }
+
+  // Decode the next piece of the stream, it may be split anywhere.
+
+  static inline enum FlashLZStatusT FlashLZ_Decode(
+      struct FlashLZDecoderC *dec,
+      const uint8_t *data,
+      int len,
+      FlashLZPutT put,
+      FlashLZGetT get,
+      void *ctx
+      )
+  {
+    for(int i = 0;i < len;i++) {
+      uint8_t value = data[i];
+      // Anything after the end of the block is an error.
+      if(dec->m_written >= dec->m_len)
+        return FLZ_Corrupt;
+      switch(dec->m_state)
+      {
+        case FLZ_Token:
+          if(value < 0x80) {
+            dec->m_count = value + 1;
+            dec->m_state = FLZ_Literal;
+          } else {
+            dec->m_count = (value & 0x7F) + FLASHLZ_MIN_MATCH;
+            dec->m_state = FLZ_Distance0;
+          }
+          break;
+        case FLZ_Literal:
+          if(!put(ctx,value))
+            return FLZ_WriteFailed;
+          dec->m_written++;
+          if(--dec->m_count == 0)
+            dec->m_state = FLZ_Token;
+          break;
+        case FLZ_Distance0:
+          dec->m_distance = value;
+          dec->m_state = FLZ_Distance1;
+          break;
+        case FLZ_Distance1:
+          dec->m_distance |= (uint16_t) value << 8;
+          if(dec->m_distance == 0 ||
+             dec->m_distance > dec->m_written ||
+             dec->m_written + dec->m_count > dec->m_len)
+            return FLZ_Corrupt;
+          for(;dec->m_count > 0;dec->m_count--) {
+            if(!put(ctx,get(ctx,dec->m_distance)))
+              return FLZ_WriteFailed;
+            dec->m_written++;
+          }
+          dec->m_state = FLZ_Token;
+          break;
+        default:
+          return FLZ_Corrupt;
+      }
+    }
+    return FLZ_Ok;
+  }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -40,7 +40,10 @@ extern "C" {
     CPT_FlashChecksum    = 24, // Generate a checksum
     CPT_FlashData        = 25, // Data packet
     CPT_FlashWrite       = 26, // Write buffer
-    CPT_FlashRead        = 27  // Read buffer and send it back
+    CPT_FlashRead        = 27, // Read buffer and send it back
+    CPT_FlashWriteCompressed = 28, // Write buffer from a compressed data stream, see flashlz.h
+    CPT_SerialFraming    = 29, // Select the framing used on a serial link, see SerialFrame.hh
+    CPT_FlashCRC32       = 30  // Generate a CRC-32 of an area of flash, replied to with CPT_FlashChecksumResult
   };
 
 
@@ -58,7 +61,8 @@ extern "C" {
     CET_BootLoaderProtected = 10,
     CET_BootLoaderBusy  = 11,
     CET_BootLoaderWriteFailed = 12,
-    CET_BootLoaderUnalignedAddress = 13
+    CET_BootLoaderUnalignedAddress = 13,
+    CET_BootLoaderCorruptData = 14
   };
 
   enum FaultCodeT {
@@ -86,6 +90,12 @@ extern "C" {
   };
 
 
+  enum SerialFramingT
+  {
+    SF_STXChecksum = 0, // STX, length, data, 16 bit sum, ETX
+    SF_COBSCRC16 = 1    // COBS encoded data and CRC-16, followed by a zero
+  };
+
   enum DeviceTypeT
   {
     DT_Unknown = 0,
@@ -261,6 +271,11 @@ extern "C" {
     uint8_t m_enable;
   };
 
+  struct PacketSerialFramingC {
+    uint8_t m_packetType; // CPT_SerialFraming
+    uint8_t m_framing;    // SerialFramingT
+  };
+
   struct PacketPingPongC {
     uint8_t m_packetType;
     uint8_t m_deviceId;
@@ -342,13 +357,19 @@ extern "C" {
 
 
 
+  // Boot-loaders acknowledge data packets at least this often, so a host
+  // must allow at least this many packets in flight or it will stall.
+#define BOOTLOADER_ACK_LIMIT 16
+
   enum FlashOperationStatusT
   {
     FOS_Ok = 0,
     FOS_WriteComplete = 1,
     FOS_DataAck = 2,
     FOS_SequenceLost = 3,
-    FOS_ProgrammingError = 4
+    FOS_ProgrammingError = 4,
+    FOS_ReadyCompressed = 5,  // Reply to an enabling reset from a boot-loader that accepts compressed writes and CPT_FlashCRC32
+    FOS_AlreadyErased = 6     // Erase skipped as the sector was already blank
   };
 
   enum BootLoaderStateT {
@@ -0,0 +1,80 @@
+#ifndef DOGBOT_BENCHLATENCY_HEADER
+#define DOGBOT_BENCHLATENCY_HEADER 1
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <algorithm>
+#include <cmath>
+
+namespace DogBotN {
+
+  //! Latency samples collected by a benchmark, in whatever unit it records
+  //! them, and summarised the same way by every benchmark.
+
+  class BenchLatencyC
+  {
+  public:
+    //! Create, with room for 'samples' before reallocating.
+    BenchLatencyC(size_t samples = 0)
+    { m_samples.reserve(samples); }
+
+    //! Add a sample.
+    void Add(double sample)
+    {
+      m_samples.push_back(sample);
+      m_sorted = false;
+    }
+
+    //! Add all the samples from 'other'.
+    void Add(const BenchLatencyC &other)
+    {
+      m_samples.insert(m_samples.end(),other.m_samples.begin(),other.m_samples.end());
+      m_sorted = false;
+    }
+
+    //! Number of samples.
+    size_t Size() const
+    { return m_samples.size(); }
+
+    //! Mean of the samples, 0 if there are none.
+    double Mean() const
+    {
+      double total = 0;
+      for(auto a : m_samples)
+        total += a;
+      return m_samples.empty() ? 0 : total / m_samples.size();
+    }
+
+    //! Nearest rank percentile, 'p' from 0 to 1. 0 gives the smallest sample,
+    //! 1 the largest and 0 if there are no samples.
+    double Percentile(double p) const
+    {
+      if(m_samples.empty())
+        return 0;
+      if(!m_sorted) {
+        std::sort(m_samples.begin(),m_samples.end());
+        m_sorted = true;
+      }
+      size_t rank = (size_t) ceil(p * m_samples.size());
+      return m_samples[std::min(m_samples.size(),std::max(rank,(size_t) 1)) - 1];
+    }
+
+    //! Titles for the columns written by Print(), with 'unit' after each.
+    static std::string Titles(const std::string &unit)
+    { return "Mean " + unit + "  Median " + unit + "  99% " + unit + "  99.9% " + unit + "  Max " + unit; }
+
+    //! Write the mean, median, 99%, 99.9% and largest sample, separated by two spaces.
+    void Print(std::ostream &strm) const
+    {
+      strm << Mean() << "  " << Percentile(0.5) << "  " << Percentile(0.99)
+           << "  " << Percentile(0.999) << "  " << Percentile(1.0);
+    }
+
+  protected:
+    mutable std::vector<double> m_samples;
+    mutable bool m_sorted = true;
+  };
+
+}
+#endif
@@ -3,6 +3,7 @@
 
 #include <thread>
 #include <vector>
+#include <algorithm>
 #include <functional>
 #include <assert.h>
 #include <mutex>
@@ -34,6 +35,9 @@ namespace DogBotN
   ComsC::~ComsC()
   {
     Close();
+    for(auto a : m_retiredHandlers)
+      delete a;
+    delete m_handlers.load();
   }
 
   //! Close connection
@@ -59,19 +63,66 @@ namespace DogBotN
     return false;
   }
 
+  //! ComsC objects the current thread is processing a packet for, innermost last.
+  static thread_local std::vector<const ComsC *> t_processing;
+
+  //! Get a copy of the current handler table to modify, m_accessPacketHandler must be locked.
+  std::unique_ptr<ComsC::HandlerTableC> ComsC::CopyHandlers() const
+  {
+    return std::unique_ptr<HandlerTableC>(new HandlerTableC(*m_handlers.load()));
+  }
+
+  //! Publish a new handler table, m_accessPacketHandler must be locked.
+  void ComsC::PublishHandlers(std::unique_ptr<HandlerTableC> table)
+  {
+    const HandlerTableC *newTable = table.release();
+    m_retiredHandlers.push_back(m_handlers.exchange(newTable));
+    HandlersChanged(*newTable);
+  }
+
+  //! Wait for packets being processed with replaced handler tables to finish, then free the tables.
+  void ComsC::WaitForReaders()
+  {
+    // We'd wait for ourselves if called from one of our own handlers, so don't.
+    // The tables are freed by a later call instead.
+    if(std::find(t_processing.begin(),t_processing.end(),this) != t_processing.end())
+      return ;
+    std::lock_guard<std::mutex> lock(m_accessGracePeriod);
+    std::vector<const HandlerTableC *> retired;
+    {
+      std::lock_guard<std::mutex> lockHandlers(m_accessPacketHandler);
+      retired.swap(m_retiredHandlers);
+    }
+    // New packets count themselves against the other reader count, and only
+    // see the current table. Once those which started before the switch are
+    // done nothing can be using the retired tables.
+    unsigned epoch = m_readEpoch.load();
+    m_readEpoch.store(epoch + 1);
+    while(m_readers[epoch & 1].load() != 0)
+      std::this_thread::yield();
+    for(auto a : retired)
+      delete a;
+  }
+
   //! Set handler for all packets, this is called as well as any specific handlers that have been installed.
   //! Only one can be set at any time.
   int ComsC::SetGenericHandler(const std::function<void (uint8_t *data,int len)> &handler)
   {
     std::lock_guard<std::mutex> lock(m_accessPacketHandler);
-    for(int i = 0;i < m_genericHandler.size();i++) {
-      if(!m_genericHandler[i]) {
-        m_genericHandler[i] = handler;
-        return i;
+    std::unique_ptr<HandlerTableC> table = CopyHandlers();
+    int ret = -1;
+    for(int i = 0;i < table->m_genericHandler.size();i++) {
+      if(!table->m_genericHandler[i]) {
+        table->m_genericHandler[i] = handler;
+        ret = i;
+        break;
       }
     }
-    int ret = m_genericHandler.size();
-    m_genericHandler.push_back(handler);
+    if(ret < 0) {
+      ret = table->m_genericHandler.size();
+      table->m_genericHandler.push_back(handler);
+    }
+    PublishHandlers(std::move(table));
     return ret;
   }
 
@@ -81,11 +132,16 @@ namespace DogBotN
   {
     if(id < 0)
       return ;
-    std::lock_guard<std::mutex> lock(m_accessPacketHandler);
-    assert(id < m_genericHandler.size());
-    if(id >= m_genericHandler.size())
-      return ;
-    m_genericHandler[id] = std::function<void (uint8_t *data,int len)>();
+    {
+      std::lock_guard<std::mutex> lock(m_accessPacketHandler);
+      std::unique_ptr<HandlerTableC> table = CopyHandlers();
+      assert(id < table->m_genericHandler.size());
+      if(id >= table->m_genericHandler.size())
+        return ;
+      table->m_genericHandler[id] = std::function<void (uint8_t *data,int len)>();
+      PublishHandlers(std::move(table));
+    }
+    WaitForReaders();
   }
 
 
@@ -95,18 +151,24 @@ namespace DogBotN
     std::lock_guard<std::mutex> lock(m_accessPacketHandler);
     assert((int) packetId < 256);
 
-    while(m_packetHandler.size() <= (int) packetId) {
-      m_packetHandler.push_back(std::vector<std::function<void (uint8_t *data,int )> >());
+    std::unique_ptr<HandlerTableC> table = CopyHandlers();
+    while(table->m_packetHandler.size() <= (int) packetId) {
+      table->m_packetHandler.push_back(std::vector<std::function<void (uint8_t *data,int )> >());
     }
-    std::vector<std::function<void (uint8_t *data,int )> > &list = m_packetHandler[(int) packetId];
+    std::vector<std::function<void (uint8_t *data,int )> > &list = table->m_packetHandler[(int) packetId];
+    int id = -1;
     for(int i = 0;i < list.size();i++) {
       if(!list[i]) { // Found free slot.
         list[i] = handler;
-        return ComsCallbackHandleC(packetId,i);
+        id = i;
+        break;
       }
     }
-    int id = list.size();
-    list.push_back(handler);
+    if(id < 0) {
+      id = list.size();
+      list.push_back(handler);
+    }
+    PublishHandlers(std::move(table));
     return ComsCallbackHandleC(packetId,id);
   }
 
@@ -116,13 +178,46 @@ namespace DogBotN
     ComsPacketTypeT packetType = handle.PacketType();
     int id = handle.Id();
     assert(id >= 0);
-    assert((unsigned) packetType < m_packetHandler.size());
-    assert(id < m_packetHandler[(int) packetType].size());
-    m_packetHandler[(int) packetType][id] = std::function<void (uint8_t *data,int )>();
+    if(id < 0)
+      return ;
+    {
+      std::lock_guard<std::mutex> lock(m_accessPacketHandler);
+      std::unique_ptr<HandlerTableC> table = CopyHandlers();
+      assert((unsigned) packetType < table->m_packetHandler.size());
+      assert(id < table->m_packetHandler[(int) packetType].size());
+      table->m_packetHandler[(int) packetType][id] = std::function<void (uint8_t *data,int )>();
+      PublishHandlers(std::move(table));
+    }
+    WaitForReaders();
   }
 
 
 
+  //! Device id a packet is to or from.
+  int ComsC::PacketDeviceId(const uint8_t *data,int len)
+  {
+    if(len < 2)
+      return -1;
+    switch((enum ComsPacketTypeT) data[0])
+    {
+      case CPT_NoOp:
+      case CPT_EmergencyStop:
+      case CPT_SyncTime:
+      case CPT_QueryDevices:
+      case CPT_Sync:
+      case CPT_PWMState:
+      case CPT_BridgeMode:
+      case CPT_SerialFraming:
+        return -1;
+      case CPT_SetDeviceId:
+        // The target is picked by its unique id, the id here is the new one.
+        return -1;
+      default:
+        break;
+    }
+    return data[1];
+  }
+
   //! Process received packet.
   void ComsC::ProcessPacket(uint8_t *packetData,int packetLen)
   {
@@ -134,12 +229,29 @@ namespace DogBotN
     m_log->debug("Got packet [%d] %s ",packetLen,dataStr.c_str());
 #endif
 
-    // Do some handling
-    {
-      std::lock_guard<std::mutex> lock(m_accessPacketHandler);
-      for(auto &func : m_genericHandler) {
-        if(func) func(packetData,packetLen);
+    // Count ourselves as a reader, so the table we use isn't freed under us.
+    // If the epoch moves on while doing so, count against the new one instead.
+    unsigned epoch;
+    for(;;) {
+      epoch = m_readEpoch.load();
+      m_readers[epoch & 1]++;
+      if(m_readEpoch.load() == epoch)
+        break;
+      m_readers[epoch & 1]--;
+    }
+    t_processing.push_back(this);
+    struct ReaderGuardC {
+      std::atomic<int> *m_readers;
+      ~ReaderGuardC() {
+        t_processing.pop_back();
+        (*m_readers)--;
       }
+    } readerGuard { &m_readers[epoch & 1] };
+    const HandlerTableC *handlers = m_handlers.load();
+
+    // Do some handling
+    for(auto &func : handlers->m_genericHandler) {
+      if(func) func(packetData,packetLen);
     }
 
     // data[0] //
@@ -159,19 +271,16 @@ namespace DogBotN
         m_log->debug("Got sync. ");
         break;
       default: {
-        {
-          std::lock_guard<std::mutex> lock(m_accessPacketHandler);
-          if(packetId < m_packetHandler.size()) {
-            bool hasHandler = false;
-            for(auto a : m_packetHandler[packetId]) {
-              if(a) {
-                hasHandler =  true;
-                a(packetData,packetLen);
-              }
+        if(packetId < handlers->m_packetHandler.size()) {
+          bool hasHandler = false;
+          for(auto &a : handlers->m_packetHandler[packetId]) {
+            if(a) {
+              hasHandler =  true;
+              a(packetData,packetLen);
             }
-            if(hasHandler)
-              return ;
           }
+          if(hasHandler)
+            return ;
         }
         // Fall back to the default handlers.
         switch(packetId) {
@@ -200,7 +309,7 @@ namespace DogBotN
                          (int) pkt->m_errorData);
           } break;
           default:
-            m_log->debug("Don't know how to handle packet {} (Of {}) ",packetId,(int) m_packetHandler.size());
+            m_log->debug("Don't know how to handle packet {} (Of {}) ",packetId,(int) handlers->m_packetHandler.size());
         }
       } break;
     }
@@ -0,0 +1,110 @@
+
+#include "dogbot/ComsMultiUSB.hh"
+
+namespace DogBotN
+{
+
+  //! Construct with transfer settings used for every bridge.
+  ComsMultiUSBC::ComsMultiUSBC(const ComsUSBTransferConfigC &config)
+   : m_config(config)
+  {
+    for(auto &a : m_route)
+      a.store(-1,std::memory_order_relaxed);
+  }
+
+  // Disconnects and closes file descriptors
+  ComsMultiUSBC::~ComsMultiUSBC()
+  {
+    Close();
+  }
+
+  //! Test if a name is one for this class.
+  bool ComsMultiUSBC::IsMultiUSBName(const std::string &name)
+  {
+    return name.compare(0,4,"usb*") == 0 && (name.size() == 4 || name[4] == ':');
+  }
+
+  //! Open all the bridges found.
+  bool ComsMultiUSBC::Open(const std::string &portAddr)
+  {
+    if(IsMultiUSBName(portAddr))
+      m_config.Parse(std::string("usb") + portAddr.substr(4));
+    Close();
+    m_terminate = false;
+
+    std::vector<std::string> locations = ComsUSBC::ListBridges();
+    if(locations.empty()) {
+      m_log->error("No USB bridges found. ");
+      return false;
+    }
+    for(size_t i = 0;i < locations.size() && i < 127;i++) {
+      m_log->info("Opening USB bridge {} at {} ",i,locations[i]);
+      ComsUSBTransferConfigC config = m_config;
+      config.m_location = locations[i];
+      auto bridge = std::make_shared<ComsUSBC>(config);
+      bridge->SetLogger(m_log);
+      int id = (int) i;
+      m_genericHandlerIds.push_back(bridge->SetGenericHandler([this,id](uint8_t *data,int len) { ProcessBridgePacket(id,data,len); }));
+      m_bridges.push_back(bridge);
+    }
+    return true;
+  }
+
+  //! Close connection
+  void ComsMultiUSBC::Close()
+  {
+    m_terminate = true;
+    for(size_t i = 0;i < m_bridges.size();i++) {
+      m_bridges[i]->RemoveGenericHandler(m_genericHandlerIds[i]);
+      m_bridges[i]->Close();
+    }
+    m_bridges.clear();
+    m_genericHandlerIds.clear();
+    for(auto &a : m_route)
+      a.store(-1,std::memory_order_relaxed);
+  }
+
+  //! Is connection ready ?
+  bool ComsMultiUSBC::IsReady() const
+  {
+    for(auto &a : m_bridges)
+      if(a->IsReady())
+        return true;
+    return false;
+  }
+
+  //! Bridge a device was last heard from.
+  int ComsMultiUSBC::BridgeForDevice(int deviceId) const
+  {
+    if(deviceId < 0 || deviceId > 255)
+      return -1;
+    return m_route[deviceId].load(std::memory_order_relaxed);
+  }
+
+  //! Handle a packet received on bridge 'bridge'.
+  void ComsMultiUSBC::ProcessBridgePacket(int bridge,uint8_t *data,int len)
+  {
+    int deviceId = PacketDeviceId(data,len);
+    if(deviceId > 0 && m_route[deviceId].load(std::memory_order_relaxed) != bridge) {
+      m_log->debug("Device {} is on bridge {} ",deviceId,bridge);
+      m_route[deviceId].store(bridge,std::memory_order_relaxed);
+    }
+    // Each bridge has its own dispatch thread, handlers expect one at a time.
+    std::lock_guard<std::mutex> lock(m_accessRx);
+    ProcessPacket(data,len);
+  }
+
+  //! Send packet
+  void ComsMultiUSBC::SendPacket(const uint8_t *data,int len)
+  {
+    int deviceId = PacketDeviceId(data,len);
+    int bridge = (deviceId > 0) ? m_route[deviceId].load(std::memory_order_relaxed) : -1;
+    if(bridge >= 0 && bridge < (int) m_bridges.size()) {
+      m_bridges[bridge]->SendPacket(data,len);
+      return ;
+    }
+    for(auto &a : m_bridges)
+      a->SendPacket(data,len);
+  }
+
+}
@@ -0,0 +1,266 @@
+
+#include "dogbot/ComsParamEngine.hh"
+
+namespace DogBotN
+{
+
+  //! Construct from coms object
+  ComsParamEngineC::ComsParamEngineC(const std::shared_ptr<ComsC> &coms)
+    : m_coms(coms)
+  {
+    m_reportHandle = m_coms->SetHandler(CPT_ReportParam,[this](uint8_t *data,int len) { HandleReport(data,len); });
+    m_errorHandle = m_coms->SetHandler(CPT_Error,[this](uint8_t *data,int len) { HandleError(data,len); });
+    m_sender = std::thread([this]{ RunSender(); });
+  }
+
+  //! Destructor, any outstanding requests fail.
+  ComsParamEngineC::~ComsParamEngineC()
+  {
+    m_coms->DeleteHandler(m_reportHandle);
+    m_coms->DeleteHandler(m_errorHandle);
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_terminate = true;
+    }
+    m_wake.notify_all();
+    m_sender.join();
+  }
+
+  //! Set a parameter from the first 'len' bytes of 'buff'.
+  std::future<bool> ComsParamEngineC::SetParam(int deviceId,ComsParameterIndexT param,const BufferTypeT &buff,int len)
+  {
+    auto req = std::make_shared<RequestC>();
+    std::future<bool> ret = req->m_setDone.get_future();
+    if(len < 0 || len > 7) {
+      m_log->error("Parameter {} too large.",(int) param);
+      req->m_setDone.set_value(false);
+      return ret;
+    }
+    req->m_deviceId = deviceId;
+    req->m_param = param;
+    req->m_isSet = true;
+    req->m_data = buff;
+    req->m_len = len;
+    Queue(req);
+    return ret;
+  }
+
+  //! Read a parameter.
+  std::future<ComsParamResultC> ComsParamEngineC::ReadParam(int deviceId,ComsParameterIndexT param)
+  {
+    auto req = std::make_shared<RequestC>();
+    std::future<ComsParamResultC> ret = req->m_readDone.get_future();
+    req->m_deviceId = deviceId;
+    req->m_param = param;
+    Queue(req);
+    return ret;
+  }
+
+  //! Set the maximum number of requests in flight to each device.
+  void ComsParamEngineC::SetMaxInFlight(int requests)
+  {
+    assert(requests > 0);
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_maxInFlight = requests;
+    }
+    m_wake.notify_all();
+  }
+
+  //! Set the time to wait for a reply and the number of times a request is sent.
+  void ComsParamEngineC::SetRetry(int timeoutMs,int attempts)
+  {
+    std::lock_guard<std::mutex> lock(m_access);
+    m_timeoutMs = timeoutMs;
+    m_attempts = attempts;
+  }
+
+  //! Number of requests queued or in flight.
+  size_t ComsParamEngineC::Outstanding()
+  {
+    std::lock_guard<std::mutex> lock(m_access);
+    return m_queue.size() + m_inFlight.size();
+  }
+
+  //! Queue a request and wake the sender.
+  void ComsParamEngineC::Queue(const std::shared_ptr<RequestC> &req)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_queue.push_back(req);
+    }
+    m_wake.notify_all();
+  }
+
+  //! Complete a request, m_access must not be locked.
+  void ComsParamEngineC::Complete(RequestC &req,bool ok,const uint8_t *data,int len)
+  {
+    if(req.m_isSet) {
+      req.m_setDone.set_value(ok);
+      return ;
+    }
+    ComsParamResultC result;
+    result.m_ok = ok;
+    if(ok) {
+      result.m_len = len;
+      memcpy(result.m_data.uint8,data,len);
+    }
+    req.m_readDone.set_value(result);
+  }
+
+  //! Remove a request from the in flight set, m_access must be locked.
+  void ComsParamEngineC::Retire(const KeyT &key)
+  {
+    m_inFlight.erase(key);
+    m_inFlightCount[key.first]--;
+  }
+
+  //! Handle a parameter report
+  void ComsParamEngineC::HandleReport(uint8_t *data,int len)
+  {
+    if(len < (int) sizeof(PacketParamHeaderC)) {
+      m_log->error("Short ReportParam packet received. {} Bytes ",len);
+      return ;
+    }
+    const PacketParam8ByteC *pkt = reinterpret_cast<const PacketParam8ByteC *>(data);
+    int dataLen = std::min(len - (int) sizeof(PacketParamHeaderC),(int) sizeof(BufferTypeT));
+    bool ok = true;
+    std::shared_ptr<RequestC> req;
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      KeyT key(pkt->m_header.m_deviceId,pkt->m_header.m_index);
+      auto it = m_inFlight.find(key);
+      if(it == m_inFlight.end())
+        return ;
+      if(it->second->m_isSet) {
+        if(dataLen != it->second->m_len) {
+          m_log->error("Unexpected reply size {}, when {} bytes were sent for parameter {} ",dataLen,it->second->m_len,(int) key.second);
+          ok = false;
+        } else if(memcmp(it->second->m_data.uint8,pkt->m_data.uint8,dataLen) != 0) {
+          // Leave it to be sent again.
+          m_log->warn("Unexpected value returned for parameter {} on device {}. ",key.second,key.first);
+          return ;
+        }
+      }
+      req = it->second;
+      Retire(key);
+    }
+    m_wake.notify_all();
+    Complete(*req,ok,pkt->m_data.uint8,dataLen);
+  }
+
+  //! Handle an error report
+  void ComsParamEngineC::HandleError(uint8_t *data,int len)
+  {
+    if(len != sizeof(PacketErrorC))
+      return ;
+    const PacketErrorC *pkt = reinterpret_cast<const PacketErrorC *>(data);
+    if(pkt->m_errorCode != CET_ParameterOutOfRange || pkt->m_causeType != CPT_SetParam)
+      return ;
+    std::shared_ptr<RequestC> req;
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      KeyT key(pkt->m_deviceId,pkt->m_errorData);
+      auto it = m_inFlight.find(key);
+      if(it == m_inFlight.end() || !it->second->m_isSet)
+        return ;
+      req = it->second;
+      Retire(key);
+    }
+    m_log->error("Device {} rejected value for parameter {} ",(int) pkt->m_deviceId,(int) pkt->m_errorData);
+    m_wake.notify_all();
+    Complete(*req,false,nullptr,0);
+  }
+
+  //! Send a request to the device
+  void ComsParamEngineC::Send(const RequestC &req)
+  {
+    if(!req.m_isSet) {
+      m_coms->SendQueryParam(req.m_deviceId,req.m_param);
+      return ;
+    }
+    PacketParam8ByteC msg;
+    msg.m_header.m_packetType = CPT_SetParam;
+    msg.m_header.m_deviceId = req.m_deviceId;
+    msg.m_header.m_index = (uint16_t) req.m_param;
+    memcpy(msg.m_data.uint8,req.m_data.uint8,req.m_len);
+    m_coms->SendPacket((uint8_t*) &msg,sizeof(msg.m_header)+req.m_len);
+  }
+
+  //! Thread starting queued requests and dealing with time outs.
+  void ComsParamEngineC::RunSender()
+  {
+    std::vector<std::shared_ptr<RequestC> > toSend;
+    std::vector<std::shared_ptr<RequestC> > failed;
+    std::unique_lock<std::mutex> lock(m_access);
+    while(!m_terminate) {
+      ClockT::time_point now = ClockT::now();
+      ClockT::time_point wakeAt = now + std::chrono::seconds(1);
+      std::chrono::milliseconds timeout(m_timeoutMs);
+
+      // Resend or give up on requests that haven't been answered.
+      for(auto it = m_inFlight.begin();it != m_inFlight.end();) {
+        RequestC &req = *it->second;
+        if(req.m_deadline <= now) {
+          if(req.m_attempts >= m_attempts) {
+            failed.push_back(it->second);
+            m_inFlightCount[req.m_deviceId]--;
+            it = m_inFlight.erase(it);
+            continue;
+          }
+          req.m_attempts++;
+          req.m_deadline = now + timeout;
+          toSend.push_back(it->second);
+        }
+        wakeAt = std::min(wakeAt,req.m_deadline);
+        ++it;
+      }
+
+      // Start anything that isn't held up behind another request.
+      for(auto it = m_queue.begin();it != m_queue.end();) {
+        RequestC &req = **it;
+        KeyT key(req.m_deviceId,req.m_param);
+        if(m_inFlight.find(key) != m_inFlight.end() || m_inFlightCount[req.m_deviceId] >= m_maxInFlight) {
+          ++it;
+          continue;
+        }
+        m_inFlight[key] = *it;
+        m_inFlightCount[req.m_deviceId]++;
+        req.m_attempts = 1;
+        req.m_deadline = now + timeout;
+        wakeAt = std::min(wakeAt,req.m_deadline);
+        toSend.push_back(*it);
+        it = m_queue.erase(it);
+      }
+
+      if(toSend.empty() && failed.empty()) {
+        m_wake.wait_until(lock,wakeAt);
+        continue;
+      }
+
+      lock.unlock();
+      for(auto &req : toSend)
+        Send(*req);
+      for(auto &req : failed) {
+        m_log->warn("No reply from device {} for parameter {} ",req->m_deviceId,(int) req->m_param);
+        Complete(*req,false,nullptr,0);
+      }
+      toSend.clear();
+      failed.clear();
+      lock.lock();
+    }
+
+    // Fail anything left.
+    for(auto &req : m_queue)
+      failed.push_back(req);
+    for(auto &a : m_inFlight)
+      failed.push_back(a.second);
+    m_queue.clear();
+    m_inFlight.clear();
+    m_inFlightCount.clear();
+    lock.unlock();
+    for(auto &req : failed)
+      Complete(*req,false,nullptr,0);
+  }
+
+}
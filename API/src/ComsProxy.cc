@@ -1,8 +1,13 @@
 
 #include "dogbot/ComsProxy.hh"
 #include "dogbot/ComsZMQClient.hh"
+#include "dogbot/ZMQContext.hh"
 #include "dogbot/ComsSerial.hh"
 #include "dogbot/ComsUSB.hh"
+#include "dogbot/ComsMultiUSB.hh"
+#include "dogbot/ComsShm.hh"
+#include "dogbot/ComsReplay.hh"
+#include "dogbot/ComsSim.hh"
 #include <iostream>
 
 namespace DogBotN
@@ -19,30 +24,36 @@ namespace DogBotN
   // Disconnects and closes file descriptors
   ComsProxyC::~ComsProxyC()
   {
-    if(m_coms) {
-      std::lock_guard<std::mutex> lock(m_accessTx);
-      m_coms->RemoveGenericHandler(m_genericHandlerId);
-      m_genericHandlerId = -1;
-    }
+    SetComs(std::shared_ptr<ComsC>());
   }
 
   //! Set
   void ComsProxyC::SetComs(const std::shared_ptr<ComsC> &coms)
   {
     assert(coms.get() != this); // On the off chance something tried to make a loop.
-    std::lock_guard<std::mutex> lock(m_accessTx);
-
-    if(m_coms && m_genericHandlerId >= 0) {
-      m_coms->RemoveGenericHandler(m_genericHandlerId);
+    std::shared_ptr<ComsC> oldComs;
+    int oldHandlerId = -1;
+    {
+      std::lock_guard<std::mutex> lock(m_accessTx);
+      oldComs = m_coms;
+      oldHandlerId = m_genericHandlerId;
       m_genericHandlerId = -1;
+      m_coms = coms;
     }
-    m_coms = coms;
-    if(m_coms) {
-      m_genericHandlerId = m_coms->SetGenericHandler([this](uint8_t *data,int len) mutable
+
+    // Removing the handler waits for packets in progress, and their handlers
+    // may send packets, so don't hold m_accessTx.
+    if(oldComs && oldHandlerId >= 0)
+      oldComs->RemoveGenericHandler(oldHandlerId);
+
+    if(coms) {
+      int handlerId = coms->SetGenericHandler([this](uint8_t *data,int len) mutable
                                 {
                                   ProcessPacket(data,len);
                                 }
       );
+      std::lock_guard<std::mutex> lock(m_accessTx);
+      m_genericHandlerId = handlerId;
     }
   }
 
@@ -66,10 +77,19 @@ namespace DogBotN
   bool ComsProxyC::Open(const std::string &portAddr)
   {
     std::shared_ptr<ComsC> coms;
-    if(std::string("usb") == portAddr) {
-      coms = std::make_shared<ComsUSBC>();
-    } else if(std::string("local") == portAddr) {
+    ComsUSBTransferConfigC usbConfig;
+    if(usbConfig.Parse(portAddr)) {
+      coms = std::make_shared<ComsUSBC>(usbConfig);
+    } else if(ComsMultiUSBC::IsMultiUSBName(portAddr)) {
+      coms = std::make_shared<ComsMultiUSBC>();
+    } else if(IsZMQAddress(portAddr)) {
       coms = std::make_shared<ComsZMQClientC>();
+    } else if(ComsShmRegionC::IsShmAddress(portAddr)) {
+      coms = std::make_shared<ComsShmC>();
+    } else if(ComsReplayC::IsReplayAddress(portAddr)) {
+      coms = std::make_shared<ComsReplayC>();
+    } else if(ComsSimC::IsSimAddress(portAddr)) {
+      coms = std::make_shared<ComsSimC>();
     } else {
       coms = std::make_shared<ComsSerialC>();
     }
@@ -0,0 +1,234 @@
+
+#include "dogbot/ComsRecord.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+
+namespace DogBotN
+{
+  static const uint32_t g_comsLogMagic = 0x4C504244; // 'DBPL'
+  static const uint32_t g_comsLogVersion = 1;
+
+  static_assert(sizeof(ComsLogHeaderC) == 64,"Packet log header should be 64 bytes. ");
+  static_assert(sizeof(ComsLogRecordC) == 9,"Packet log records should be packed. ");
+
+  //! Record packets received by 'coms'.
+  ComsRecorderC::ComsRecorderC(const std::shared_ptr<ComsC> &coms)
+   : m_coms(coms)
+  {}
+
+  //! Finish recording.
+  ComsRecorderC::~ComsRecorderC()
+  {
+    Close();
+  }
+
+  //! Start recording to 'filename'.
+  bool ComsRecorderC::Open(const std::string &filename)
+  {
+    Close();
+    std::lock_guard<std::mutex> lock(m_access);
+    m_file = fopen(filename.c_str(),"wb");
+    if(m_file == nullptr) {
+      m_log->error("Failed to open '{}' to record packets, {} ",filename,strerror(errno));
+      return false;
+    }
+    m_buffer.resize(1 << 20);
+    setvbuf(m_file,m_buffer.data(),_IOFBF,m_buffer.size());
+
+    ComsLogHeaderC header;
+    memset(&header,0,sizeof(header));
+    header.m_magic = g_comsLogMagic;
+    header.m_version = g_comsLogVersion;
+    header.m_startTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    m_startTime = header.m_startTime;
+    fwrite(&header,sizeof(header),1,m_file);
+    m_start = ClockT::now();
+    m_offset = sizeof(header);
+    m_lastTime = 0;
+    m_packets = 0;
+    m_index.clear();
+
+    m_genericHandlerId = m_coms->SetGenericHandler([this](uint8_t *data,int len) { Record(data,len); });
+    m_log->info("Recording packets to '{}' ",filename);
+    return true;
+  }
+
+  //! Stop recording and write the index.
+  void ComsRecorderC::Close()
+  {
+    if(m_genericHandlerId >= 0) {
+      m_coms->RemoveGenericHandler(m_genericHandlerId);
+      m_genericHandlerId = -1;
+    }
+    std::lock_guard<std::mutex> lock(m_access);
+    if(m_file == nullptr)
+      return ;
+    ComsLogHeaderC header;
+    memset(&header,0,sizeof(header));
+    header.m_magic = g_comsLogMagic;
+    header.m_version = g_comsLogVersion;
+    header.m_startTime = m_startTime;
+    header.m_packets = m_packets;
+    header.m_indexOffset = m_offset;
+    header.m_indexEntries = m_index.size();
+    header.m_duration = m_lastTime;
+    bool ok = m_index.empty() || fwrite(m_index.data(),sizeof(ComsLogIndexC),m_index.size(),m_file) == m_index.size();
+    ok = ok && fseek(m_file,0,SEEK_SET) == 0 && fwrite(&header,sizeof(header),1,m_file) == 1;
+    if(fclose(m_file) != 0 || !ok)
+      m_log->error("Failed to finish packet log, {} ",strerror(errno));
+    m_file = nullptr;
+    m_log->info("Recorded {} packets. ",(uint64_t) m_packets);
+  }
+
+  //! Write a packet to the log.
+  void ComsRecorderC::Record(const uint8_t *data,int len)
+  {
+    if(len <= 0 || len > 255)
+      return ;
+    std::lock_guard<std::mutex> lock(m_access);
+    if(m_file == nullptr)
+      return ;
+    ComsLogRecordC record;
+    record.m_time = std::chrono::duration_cast<std::chrono::nanoseconds>(ClockT::now() - m_start).count();
+    record.m_len = len;
+    if(m_packets % g_comsLogIndexEvery == 0)
+      m_index.push_back(ComsLogIndexC { record.m_time,m_offset });
+    fwrite(&record,sizeof(record),1,m_file);
+    fwrite(data,1,len,m_file);
+    m_offset += sizeof(record) + len;
+    m_lastTime = record.m_time;
+    m_packets++;
+  }
+
+  // ----------------------------------------------------------------
+
+  //! Default constructor.
+  ComsLogReaderC::ComsLogReaderC()
+  {}
+
+  //! Unmap file.
+  ComsLogReaderC::~ComsLogReaderC()
+  {
+    Close();
+  }
+
+  //! Map a log.
+  bool ComsLogReaderC::Open(const std::string &filename)
+  {
+    Close();
+    int fd = open(filename.c_str(),O_RDONLY);
+    if(fd < 0) {
+      m_log->error("Failed to open packet log '{}', {} ",filename,strerror(errno));
+      return false;
+    }
+    struct stat st;
+    if(fstat(fd,&st) != 0 || st.st_size < (off_t) sizeof(ComsLogHeaderC)) {
+      m_log->error("Packet log '{}' is too short. ",filename);
+      close(fd);
+      return false;
+    }
+    void *mem = mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(mem == MAP_FAILED) {
+      m_log->error("Failed to map packet log '{}', {} ",filename,strerror(errno));
+      return false;
+    }
+    m_data = (const uint8_t *) mem;
+    m_size = st.st_size;
+    madvise(mem,m_size,MADV_SEQUENTIAL);
+
+    ComsLogHeaderC header;
+    memcpy(&header,m_data,sizeof(header));
+    if(header.m_magic != g_comsLogMagic || header.m_version != g_comsLogVersion) {
+      m_log->error("'{}' isn't a packet log this version can read. ",filename);
+      Close();
+      return false;
+    }
+    m_startTime = header.m_startTime;
+    if(header.m_indexOffset >= sizeof(header) &&
+       header.m_indexOffset + header.m_indexEntries * sizeof(ComsLogIndexC) <= m_size) {
+      m_end = header.m_indexOffset;
+      m_packets = header.m_packets;
+      m_duration = header.m_duration;
+      m_index.resize(header.m_indexEntries);
+      if(!m_index.empty())
+        memcpy(m_index.data(),m_data + m_end,m_index.size() * sizeof(ComsLogIndexC));
+    } else {
+      m_log->warn("Packet log '{}' wasn't closed, scanning it. ",filename);
+      Scan();
+    }
+    return true;
+  }
+
+  //! Unmap file.
+  void ComsLogReaderC::Close()
+  {
+    if(m_data == nullptr)
+      return ;
+    munmap((void *) m_data,m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_end = 0;
+    m_packets = 0;
+    m_duration = 0;
+    m_index.clear();
+  }
+
+  //! Scan the packets to count them and build the index.
+  void ComsLogReaderC::Scan()
+  {
+    m_end = m_size;
+    m_index.clear();
+    m_packets = 0;
+    uint64_t offset = Begin();
+    uint64_t at = offset;
+    ComsLogPacketC packet;
+    while(Next(offset,packet)) {
+      if(m_packets % g_comsLogIndexEvery == 0)
+        m_index.push_back(ComsLogIndexC { packet.m_time,at });
+      m_duration = packet.m_time;
+      m_packets++;
+      at = offset;
+    }
+    // Ignore a record cut short when recording stopped.
+    m_end = at;
+  }
+
+  //! Position of the first packet at or after 'time'.
+  uint64_t ComsLogReaderC::Seek(uint64_t time) const
+  {
+    auto at = std::upper_bound(m_index.begin(),m_index.end(),time,
+                               [](uint64_t t,const ComsLogIndexC &entry) { return t <= entry.m_time; });
+    uint64_t offset = (at == m_index.begin()) ? Begin() : (at - 1)->m_offset;
+    uint64_t last = offset;
+    ComsLogPacketC packet;
+    while(Next(offset,packet)) {
+      if(packet.m_time >= time)
+        return last;
+      last = offset;
+    }
+    return m_end;
+  }
+
+  //! Read the packet at 'offset' and move 'offset' on to the next one.
+  bool ComsLogReaderC::Next(uint64_t &offset,ComsLogPacketC &packet) const
+  {
+    if(offset + sizeof(ComsLogRecordC) > m_end)
+      return false;
+    ComsLogRecordC record;
+    memcpy(&record,m_data + offset,sizeof(record));
+    uint64_t next = offset + sizeof(record) + record.m_len;
+    if(record.m_len == 0 || next > m_end)
+      return false;
+    packet.m_time = record.m_time;
+    packet.m_data = m_data + offset + sizeof(record);
+    packet.m_len = record.m_len;
+    offset = next;
+    return true;
+  }
+
+}
@@ -0,0 +1,120 @@
+
+#include "dogbot/ComsReplay.hh"
+#include <cstring>
+
+namespace DogBotN
+{
+
+  //! default
+  ComsReplayC::ComsReplayC()
+  {}
+
+  //! Destructor
+  ComsReplayC::~ComsReplayC()
+  {
+    Close();
+  }
+
+  //! Open a log and start playing it.
+  bool ComsReplayC::Open(const std::string &portAddr)
+  {
+    Close();
+    if(!IsReplayAddress(portAddr)) {
+      m_log->error("Not a replay address '{}' ",portAddr);
+      return false;
+    }
+    std::string filename = portAddr.substr(7);
+    size_t at = filename.rfind('@');
+    if(at != std::string::npos) {
+      m_speed = atof(filename.c_str() + at + 1);
+      filename = filename.substr(0,at);
+    }
+    if(!m_reader.Open(filename))
+      return false;
+    m_log->info("Replaying {} packets, {} seconds, from '{}' ",m_reader.Packets(),m_reader.Duration() / 1e9,filename);
+    m_terminate = false;
+    m_played = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_finished = false;
+    }
+    m_threadReplay = std::thread([this]{ RunReplay(); });
+    return true;
+  }
+
+  //! Stop playing.
+  void ComsReplayC::Close()
+  {
+    m_terminate = true;
+    if(m_threadReplay.joinable())
+      m_threadReplay.join();
+    m_reader.Close();
+  }
+
+  //! Is connection ready ?
+  bool ComsReplayC::IsReady() const
+  {
+    return m_reader.IsOpen();
+  }
+
+  //! Packets sent to a replay go nowhere.
+  void ComsReplayC::SendPacket(const uint8_t *data,int len)
+  {}
+
+  //! Wait until playback has finished.
+  bool ComsReplayC::Wait(std::chrono::milliseconds timeout)
+  {
+    std::unique_lock<std::mutex> lock(m_access);
+    return m_finishedCond.wait_for(lock,timeout,[this]{ return m_finished; });
+  }
+
+  //! Note when handlers have been installed.
+  void ComsReplayC::HandlersChanged(const HandlerTableC &table)
+  {
+    bool any = false;
+    for(auto &a : table.m_genericHandler)
+      any = any || (bool) a;
+    for(auto &a : table.m_packetHandler)
+      for(auto &b : a)
+        any = any || (bool) b;
+    if(any)
+      m_hasHandlers = true;
+  }
+
+  //! Play the log.
+  void ComsReplayC::RunReplay()
+  {
+    typedef std::chrono::steady_clock ClockT;
+    while(!m_terminate && !m_hasHandlers)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    for(int i = 0;i < 10 && !m_terminate;i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    // Handlers are given a buffer they can write to, the log is mapped read only.
+    uint8_t data[256];
+    for(int pass = 0;!m_terminate && (m_repeat <= 0 || pass < m_repeat);pass++) {
+      double speed = m_speed;
+      ClockT::time_point start = ClockT::now();
+      uint64_t offset = m_reader.Begin();
+      ComsLogPacketC packet;
+      while(!m_terminate && m_reader.Next(offset,packet)) {
+        if(speed > 0) {
+          ClockT::time_point playAt = start + std::chrono::duration_cast<ClockT::duration>(std::chrono::duration<double,std::nano>(packet.m_time / speed));
+          // Sleep in short steps through gaps in the recording so Close() isn't held up.
+          for(;;) {
+            ClockT::time_point now = ClockT::now();
+            if(now >= playAt || m_terminate)
+              break;
+            std::this_thread::sleep_until(std::min(playAt,now + std::chrono::milliseconds(100)));
+          }
+        }
+        memcpy(data,packet.m_data,packet.m_len);
+        ProcessPacket(data,packet.m_len);
+        m_played++;
+      }
+    }
+    std::lock_guard<std::mutex> lock(m_access);
+    m_finished = true;
+    m_finishedCond.notify_all();
+  }
+
+}
@@ -107,6 +107,10 @@ namespace DogBotN
         return false;
       }
     }
+    m_decoder.Reset();
+    m_decoderCOBS.Reset();
+    m_rxFraming = SF_STXChecksum;
+    m_txFraming = SF_STXChecksum;
     if(!m_terminate) {
       if(!m_mutexExitOk.try_lock()) {
         m_log->error("Exit lock already locked, multiple threads attempting to open coms ?");
@@ -114,6 +118,8 @@ namespace DogBotN
         m_threadRecieve = std::move(std::thread { [this]{ RunRecieve(); } });
       }
     }
+    if(m_preferredFraming != SF_STXChecksum && !NegotiateFraming())
+      m_log->info("No reply to framing request, using STX framing. ");
     // Send some messages to make sure receiver is in sync
     for(int i =0;i < 3;i++)
       SendSync();
@@ -122,76 +128,79 @@ namespace DogBotN
     return true;
   }
 
+  //! Accept a byte
   void ComsSerialC::AcceptByte(uint8_t sendByte)
   {
-    switch(m_state)
-    {
-    case 0: // Wait for STX.
-      if(sendByte == m_charSTX)
-        m_state = 1;
-      // Else remain in state 0.
-      break;
-    case 1: // Packet length.
-      m_packetLen = sendByte;
-      if(m_packetLen > 64) {
-        printf("Packet to long! %d  ",m_packetLen);
-        if(sendByte != m_charSTX)
-          m_state = 0;
-        break;
-      }
+    AcceptBlock(&sendByte,1);
+  }
 
-      m_at = 0;
-      m_checkSum = 0x55 + m_packetLen;
-      m_state = 2;
-      break;
-    case 2: // Data
-      m_checkSum += sendByte;
-      m_data[m_at] = sendByte;
-      m_at++;
-      if(m_at >= m_packetLen)
-        m_state = 3;
-      break;
-    case 3: { // CRC 1
-      uint8_t cs1 = (m_checkSum & 0xff);
-      //m_log->debug("Checksum1 : %d %d ",(int)  cs1 , (int) sendByte);
-      if(cs1 != sendByte) {
-        m_log->warn("Checksum 1 failed. ");
-        if(sendByte == m_charSTX)
-          m_state = 1;
-        else
-          m_state = 0;
-        break;
-      }
+  //! Accept a block of bytes
+  void ComsSerialC::AcceptBlock(uint8_t *data,size_t len)
+  {
+    uint32_t errors = RxErrors();
+    auto handler = [this](uint8_t *packet,int packetLen) { HandleFrame(packet,packetLen); };
+    size_t at = 0;
+    while(at < len) {
+      if(m_rxFraming == SF_COBSCRC16)
+        at += m_decoderCOBS.Decode(data + at,len - at,handler);
+      else
+        at += m_decoder.Decode(data + at,len - at,handler);
+    }
+    if(RxErrors() != errors)
+      m_log->warn("{} corrupted packets received. ",RxErrors() - errors);
+  }
 
-      m_state = 4;
-    } break;
-    case 4: { // CRC 1
-      uint8_t cs2 = ((m_checkSum >> 8) & 0xff);
-      //m_log->debug("Checksum2 : %d %d ",(int) ((m_checkSum >> 8) & 0xff) , (int) sendByte);
-      if(cs2 != sendByte) {
-        m_log->warn("Checksum 2 failed. ");
-        if(sendByte == m_charSTX)
-          m_state = 1;
-        else
-          m_state = 0;
-        break;
+  //! Handle a frame that has been received.
+  void ComsSerialC::HandleFrame(uint8_t *data,int len)
+  {
+    if(data[0] == CPT_SerialFraming && len == sizeof(PacketSerialFramingC)) {
+      // Frames after this one use the framing the device has chosen.
+      const PacketSerialFramingC *pkt = reinterpret_cast<const PacketSerialFramingC *>(data);
+      m_decoder.Pause();
+      m_decoderCOBS.Pause();
+      m_decoder.Reset();
+      m_decoderCOBS.Reset();
+      m_rxFraming = (pkt->m_framing == SF_COBSCRC16) ? SF_COBSCRC16 : SF_STXChecksum;
+      {
+        std::lock_guard<std::mutex> lock(m_accessFraming);
+        m_gotFramingReply = true;
       }
-
-      m_state = 5;
-    } break;
-    case 5: // ETX.
-      if(sendByte == m_charETX) {
-        ProcessPacket(m_data,m_packetLen);
-      } else {
-        m_log->warn("Packet corrupted. Len {} Type {} ",m_packetLen,(int) m_data[0]);
-        if(sendByte == m_charSTX) {
-          m_state = 1;
-          break;
-        }
+      m_framingReply.notify_all();
+      return ;
+    }
+    if(data[0] == CPT_Error && len == sizeof(PacketErrorC) && reinterpret_cast<const PacketErrorC *>(data)->m_causeType == CPT_SerialFraming) {
+      // Device doesn't know about framing, so carry on as we are.
+      m_log->info("Device doesn't support changing framing. ");
+      {
+        std::lock_guard<std::mutex> lock(m_accessFraming);
+        m_gotFramingReply = true;
       }
-      m_state = 0;
-      break;
+      m_framingReply.notify_all();
+      return ;
     }
+    ProcessPacket(data,len);
+  }
+
+  //! Ask the device for m_preferredFraming.
+  bool ComsSerialC::NegotiateFraming()
+  {
+    // Hold the transmit lock so nothing is sent while the framing is changing.
+    std::lock_guard<std::mutex> lockTx(m_accessTx);
+    {
+      std::lock_guard<std::mutex> lock(m_accessFraming);
+      m_gotFramingReply = false;
+    }
+    PacketSerialFramingC pkt;
+    pkt.m_packetType = CPT_SerialFraming;
+    pkt.m_framing = m_preferredFraming;
+    WriteFrame((const uint8_t *) &pkt,sizeof(pkt));
+
+    std::unique_lock<std::mutex> lock(m_accessFraming);
+    if(!m_framingReply.wait_for(lock,std::chrono::milliseconds(250),[this]{ return m_gotFramingReply; }))
+      return false;
+    m_txFraming = m_rxFraming.load();
+    m_log->debug("Using framing {} ",m_txFraming.load());
+    return true;
   }
 
   //! Process received packet.
@@ -199,7 +208,7 @@ namespace DogBotN
   bool ComsSerialC::RunRecieve()
   {
     assert(m_fd >= 0);
-    uint8_t readBuff[1024];
+    uint8_t readBuff[4096];
     fd_set localFds;
     fd_set exceptFds;
     FD_ZERO(&localFds);
@@ -219,7 +228,6 @@ namespace DogBotN
         perror("Failed to select");
         continue;
       }
-      // FIXME:- Read into a larger buffer.
       int n = read(theFd,readBuff,sizeof readBuff);
       if(n == 0)
         continue;
@@ -235,18 +243,7 @@ namespace DogBotN
         m_fd = 0;
         break;
       }
-#if 0
-      m_log->debug("Got %d bytes: ",n);
-      for(int i = 0;i < n;i++) {
-        m_log->debug("%02X ",(int) readBuff[i]);
-        AcceptByte(readBuff[i]);
-      }
-      m_log->debug("\n");
-#else
-      for(int i = 0;i < n;i++) {
-        AcceptByte(readBuff[i]);
-      }
-#endif
+      AcceptBlock(readBuff,n);
     }
     m_mutexExitOk.unlock();
     m_log->debug("Exiting receiver fd {} ",m_fd);
@@ -259,38 +256,40 @@ namespace DogBotN
   {
     assert(m_fd >= 0);
 
-    std::vector<uint8_t> packet;
-    packet.reserve(len + 6);
-
-
-    packet.push_back(m_charSTX);
-    int crc = len + 0x55;
-    packet.push_back(len);
-    for(int i =0;i < len;i++) {
-      uint8_t data = buff[i];
-      packet.push_back(data);
-      crc += data;
+    if(len > m_maxPacketLen) {
+      m_log->error("Packet too long to send. {} Bytes ",len);
+      return ;
     }
-    packet.push_back(crc);
-    packet.push_back(crc >> 8);
-    packet.push_back(m_charETX);
 
     std::lock_guard<std::mutex> lock(m_accessTx);
+    WriteFrame(buff,len);
+  }
+
+  //! Encode and write a packet, m_accessTx must be locked.
+  void ComsSerialC::WriteFrame(const uint8_t *buff,int len)
+  {
+    int frameLen = 0;
+    if(m_txFraming == SF_COBSCRC16)
+      frameLen = SerialFrameEncodeCOBS(m_txFrame,buff,len);
+    else
+      frameLen = SerialFrameEncode(m_txFrame,buff,len);
     int at = 0;
     fd_set localFds;
     FD_ZERO(&localFds);
     FD_SET(m_fd,&localFds);
 
-    while(at < packet.size()) {
+    while(at < frameLen) {
       int x = select(m_fd+1,0,&localFds,0,0);
       if(x < 0) {
         m_log->error("Failed to select write. ");
         break;
       }
-      int n = write(m_fd,&packet[at],packet.size());
+      int n = write(m_fd,&m_txFrame[at],frameLen - at);
       if(n < 0) {
         if(errno == EAGAIN || errno == EINTR)
           continue;
+        m_log->error("Failed to write packet. {} ",strerror(errno));
+        break;
       }
       at += n;
     }
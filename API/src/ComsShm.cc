@@ -0,0 +1,466 @@
+
+#include "dogbot/ComsShm.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <cstring>
+
+namespace DogBotN
+{
+  static const uint32_t g_comsShmMagic = 0x44425348; // 'DBSH'
+  static const uint32_t g_comsShmVersion = 1;
+
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,"Shared memory rings need lock free atomics. ");
+
+  //! Wait while '*addr' is 'value', for up to 'timeoutMs'. Works between processes.
+  static void FutexWait(std::atomic<uint32_t> *addr,uint32_t value,int timeoutMs)
+  {
+    struct timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+    syscall(SYS_futex,(uint32_t *) addr,FUTEX_WAIT,value,&ts,nullptr,0);
+  }
+
+  //! Wake everything waiting on 'addr'.
+  static void FutexWake(std::atomic<uint32_t> *addr)
+  {
+    syscall(SYS_futex,(uint32_t *) addr,FUTEX_WAKE,INT_MAX,nullptr,nullptr,0);
+  }
+
+  //! Round up to a power of two.
+  static size_t RoundUpPow2(size_t n)
+  {
+    size_t ret = 2;
+    while(ret < n)
+      ret <<= 1;
+    return ret;
+  }
+
+  //! Default constructor.
+  ComsShmRegionC::ComsShmRegionC()
+  {}
+
+  //! Unmap the segment.
+  ComsShmRegionC::~ComsShmRegionC()
+  {
+    Detach();
+  }
+
+  //! Name used for shm_open from an address, 'shm://name' or 'shm:name'.
+  std::string ComsShmRegionC::ShmName(const std::string &addr)
+  {
+    std::string name;
+    if(addr.compare(0,6,"shm://") == 0)
+      name = addr.substr(6);
+    else if(addr.compare(0,4,"shm:") == 0)
+      name = addr.substr(4);
+    else
+      return std::string();
+    if(name.empty() || name.find('/') != std::string::npos)
+      return std::string();
+    return "/" + name;
+  }
+
+  //! Map 'size' bytes of an open segment.
+  bool ComsShmRegionC::Map(int fd,size_t size)
+  {
+    void *mem = mmap(nullptr,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if(mem == MAP_FAILED) {
+      m_log->error("Failed to map shared memory, {} ",strerror(errno));
+      return false;
+    }
+    m_header = (ComsShmHeaderC *) mem;
+    m_size = size;
+    return true;
+  }
+
+  //! Check if the segment open on 'fd', 'size' bytes long, has the ring sizes
+  //! wanted. If it doesn't, any clients using it are told the server has gone.
+  static bool CanReuse(int fd,size_t size,size_t wantSize,uint32_t pubSlots,uint32_t cmdSlots)
+  {
+    if(size == 0)
+      return true;
+    if(size < sizeof(ComsShmHeaderC))
+      return false;
+    void *mem = mmap(nullptr,sizeof(ComsShmHeaderC),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if(mem == MAP_FAILED)
+      return false;
+    ComsShmHeaderC *header = (ComsShmHeaderC *) mem;
+    bool ours = header->m_magic == g_comsShmMagic && header->m_version == g_comsShmVersion;
+    bool ret = size == wantSize && (!ours || (header->m_pubSlots == pubSlots && header->m_cmdSlots == cmdSlots));
+    if(!ret && ours) {
+      header->m_running = 0;
+      header->m_generation++;
+      header->m_pubNotify++;
+      FutexWake(&header->m_pubNotify);
+    }
+    munmap(mem,sizeof(ComsShmHeaderC));
+    return ret;
+  }
+
+  //! Create or take over the segment 'name' as the server.
+  bool ComsShmRegionC::Create(const std::string &name,size_t pubSlots,size_t cmdSlots)
+  {
+    Detach();
+    pubSlots = RoundUpPow2(pubSlots);
+    cmdSlots = RoundUpPow2(cmdSlots);
+    size_t size = sizeof(ComsShmHeaderC) + (pubSlots + cmdSlots) * sizeof(ComsShmSlotC);
+    int fd = shm_open(name.c_str(),O_RDWR | O_CREAT,0666);
+    if(fd < 0) {
+      m_log->error("Failed to create shared memory '{}', {} ",name,strerror(errno));
+      return false;
+    }
+    // Clients may still have the segment mapped from a previous server. If
+    // it has the same rings it is reused, and they see the generation change.
+    // Otherwise resizing it would move the slots under them, so it is
+    // replaced, and they see the generation change and map the new one.
+    struct stat st;
+    bool ok = fstat(fd,&st) == 0;
+    if(ok && !CanReuse(fd,st.st_size,size,pubSlots,cmdSlots)) {
+      m_log->info("Replacing shared memory '{}' as its rings have changed. ",name);
+      close(fd);
+      shm_unlink(name.c_str());
+      fd = shm_open(name.c_str(),O_RDWR | O_CREAT | O_EXCL,0666);
+      if(fd < 0) {
+        m_log->error("Failed to create shared memory '{}', {} ",name,strerror(errno));
+        return false;
+      }
+      st.st_size = 0;
+    }
+    ok = ok && (st.st_size == (off_t) size || ftruncate(fd,size) == 0);
+    if(ok)
+      ok = Map(fd,size);
+    else
+      m_log->error("Failed to size shared memory '{}', {} ",name,strerror(errno));
+    close(fd);
+    if(!ok)
+      return false;
+    m_isServer = true;
+    m_pubSlots = (ComsShmSlotC *) (m_header + 1);
+    m_cmdSlots = m_pubSlots + pubSlots;
+
+    uint32_t generation = (m_header->m_magic == g_comsShmMagic) ? m_header->m_generation.load() + 1 : 1;
+    m_header->m_running = 0;
+    m_header->m_magic = 0;
+    m_header->m_version = g_comsShmVersion;
+    m_header->m_pubSlots = pubSlots;
+    m_header->m_cmdSlots = cmdSlots;
+    for(size_t i = 0;i < pubSlots;i++)
+      m_pubSlots[i].m_seq.store(0,std::memory_order_relaxed);
+    for(size_t i = 0;i < cmdSlots;i++)
+      m_cmdSlots[i].m_seq.store(i,std::memory_order_relaxed);
+    m_header->m_pubHead = 0;
+    m_header->m_cmdHead = 0;
+    m_header->m_cmdTail = 0;
+    m_header->m_generation = generation;
+    m_header->m_magic = g_comsShmMagic;
+    m_header->m_running = 1;
+    // Wake any clients left waiting by the last server so they notice.
+    m_header->m_pubNotify++;
+    FutexWake(&m_header->m_pubNotify);
+    return true;
+  }
+
+  //! Map an existing segment 'name' as a client.
+  bool ComsShmRegionC::Attach(const std::string &name)
+  {
+    Detach();
+    int fd = shm_open(name.c_str(),O_RDWR,0);
+    if(fd < 0) {
+      m_log->error("Failed to open shared memory '{}', is the server running ? {} ",name,strerror(errno));
+      return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd,&st) == 0 && st.st_size >= (off_t) sizeof(ComsShmHeaderC) && Map(fd,st.st_size);
+    close(fd);
+    if(!ok)
+      return false;
+    if(m_header->m_magic != g_comsShmMagic || m_header->m_version != g_comsShmVersion ||
+       sizeof(ComsShmHeaderC) + (m_header->m_pubSlots + (size_t) m_header->m_cmdSlots) * sizeof(ComsShmSlotC) > m_size) {
+      m_log->error("Shared memory '{}' isn't set up for this version. ",name);
+      Detach();
+      return false;
+    }
+    m_isServer = false;
+    m_pubSlots = (ComsShmSlotC *) (m_header + 1);
+    m_cmdSlots = m_pubSlots + m_header->m_pubSlots;
+    return true;
+  }
+
+  //! Unmap the segment, if it was created the server is marked as stopped.
+  void ComsShmRegionC::Detach()
+  {
+    if(m_header == nullptr)
+      return ;
+    if(m_isServer) {
+      m_header->m_running = 0;
+      m_header->m_pubNotify++;
+      FutexWake(&m_header->m_pubNotify);
+    }
+    munmap(m_header,m_size);
+    m_header = nullptr;
+    m_pubSlots = nullptr;
+    m_cmdSlots = nullptr;
+    m_size = 0;
+    m_knownHead = 0;
+  }
+
+  //! Write a packet to the publish ring.
+  bool ComsShmRegionC::Publish(const uint8_t *data,int len)
+  {
+    if(len <= 0 || len > g_comsShmMaxPacket)
+      return false;
+    uint64_t pos = m_header->m_pubHead.load(std::memory_order_relaxed);
+    ComsShmSlotC *slot = PubSlot(pos);
+    // Mark the slot as being written so a reader still on it sees the change.
+    slot->m_seq.store(0,std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->m_len = len;
+    memcpy(slot->m_data,data,len);
+    slot->m_seq.store(pos + 1,std::memory_order_release);
+    m_header->m_pubHead.store(pos + 1,std::memory_order_release);
+    m_header->m_pubNotify.fetch_add(1);
+    if(m_header->m_pubWaiters.load() > 0)
+      FutexWake(&m_header->m_pubNotify);
+    return true;
+  }
+
+  //! Read the packet at 'cursor'.
+  int ComsShmRegionC::ReadPublished(uint64_t &cursor,uint8_t *data,uint64_t &lost)
+  {
+    const uint64_t slots = m_header->m_pubSlots;
+    for(;;) {
+      // The head is written for every packet, so only look at it again when
+      // we've caught up with where it was, saving a cache miss per packet.
+      if(cursor >= m_knownHead) {
+        uint64_t head = m_header->m_pubHead.load(std::memory_order_acquire);
+        if(cursor > head) {
+          // The server restarted.
+          cursor = head;
+        }
+        m_knownHead = head;
+        if(cursor == head)
+          return 0;
+        if(head - cursor > slots) {
+          lost += head - cursor - slots;
+          cursor = head - slots;
+        }
+      }
+      ComsShmSlotC *slot = PubSlot(cursor);
+      uint64_t seq = slot->m_seq.load(std::memory_order_acquire);
+      int len = slot->m_len;
+      if(len > g_comsShmMaxPacket)
+        len = g_comsShmMaxPacket;
+      memcpy(data,slot->m_data,len);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(seq != cursor + 1 || slot->m_seq.load(std::memory_order_relaxed) != seq) {
+        // Overwritten while we were reading it, or before.
+        lost++;
+        cursor++;
+        m_knownHead = 0;
+        continue;
+      }
+      cursor++;
+      return len;
+    }
+  }
+
+  //! Wait up to 'timeoutMs' for a packet after 'cursor' to be published.
+  void ComsShmRegionC::WaitPublished(uint64_t cursor,int timeoutMs)
+  {
+    auto spinUntil = std::chrono::steady_clock::now() + m_spin;
+    do {
+      if(m_header->m_pubHead.load(std::memory_order_acquire) != cursor)
+        return ;
+      std::this_thread::yield();
+    } while(std::chrono::steady_clock::now() < spinUntil);
+    // Sleep even if the server has stopped, a restart bumps m_pubNotify and wakes us.
+    m_header->m_pubWaiters.fetch_add(1);
+    uint32_t notify = m_header->m_pubNotify.load();
+    if(m_header->m_pubHead.load() == cursor)
+      FutexWait(&m_header->m_pubNotify,notify,timeoutMs);
+    m_header->m_pubWaiters.fetch_sub(1);
+  }
+
+  //! Queue a packet for the server.
+  bool ComsShmRegionC::PushCommand(const uint8_t *data,int len)
+  {
+    if(len <= 0 || len > g_comsShmMaxPacket)
+      return false;
+    uint64_t pos = m_header->m_cmdHead.load(std::memory_order_relaxed);
+    for(;;) {
+      ComsShmSlotC *slot = CmdSlot(pos);
+      uint64_t seq = slot->m_seq.load(std::memory_order_acquire);
+      int64_t diff = (int64_t) seq - (int64_t) pos;
+      if(diff == 0) {
+        if(m_header->m_cmdHead.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed)) {
+          slot->m_len = len;
+          memcpy(slot->m_data,data,len);
+          slot->m_seq.store(pos + 1,std::memory_order_release);
+          break;
+        }
+      } else if(diff < 0) {
+        return false; // Full
+      } else {
+        pos = m_header->m_cmdHead.load(std::memory_order_relaxed);
+      }
+    }
+    m_header->m_cmdNotify.fetch_add(1);
+    if(m_header->m_cmdWaiters.load() > 0)
+      FutexWake(&m_header->m_cmdNotify);
+    return true;
+  }
+
+  //! Take the next packet sent to the server.
+  int ComsShmRegionC::PopCommand(uint8_t *data)
+  {
+    uint64_t tail = m_header->m_cmdTail;
+    ComsShmSlotC *slot = CmdSlot(tail);
+    if(slot->m_seq.load(std::memory_order_acquire) != tail + 1)
+      return 0;
+    int len = slot->m_len;
+    if(len > g_comsShmMaxPacket)
+      len = g_comsShmMaxPacket;
+    memcpy(data,slot->m_data,len);
+    slot->m_seq.store(tail + m_header->m_cmdSlots,std::memory_order_release);
+    m_header->m_cmdTail = tail + 1;
+    return len;
+  }
+
+  //! Wait up to 'timeoutMs' for a packet to be sent to the server.
+  void ComsShmRegionC::WaitCommand(int timeoutMs)
+  {
+    auto spinUntil = std::chrono::steady_clock::now() + m_spin;
+    do {
+      if(CmdSlot(m_header->m_cmdTail)->m_seq.load(std::memory_order_acquire) == m_header->m_cmdTail + 1)
+        return ;
+      std::this_thread::yield();
+    } while(std::chrono::steady_clock::now() < spinUntil);
+    m_header->m_cmdWaiters.fetch_add(1);
+    uint32_t notify = m_header->m_cmdNotify.load();
+    if(CmdSlot(m_header->m_cmdTail)->m_seq.load() != m_header->m_cmdTail + 1)
+      FutexWait(&m_header->m_cmdNotify,notify,timeoutMs);
+    m_header->m_cmdWaiters.fetch_sub(1);
+  }
+
+  // ---------------------------------------------------------------------
+
+  //! default
+  ComsShmC::ComsShmC()
+  {}
+
+  //! Destructor
+  ComsShmC::~ComsShmC()
+  {
+    Close();
+  }
+
+  //! Open a port.
+  bool ComsShmC::Open(const std::string &portAddr)
+  {
+    Close();
+    std::string name = ComsShmRegionC::ShmName(portAddr);
+    if(name.empty()) {
+      m_log->error("Not a shared memory address '{}' ",portAddr);
+      return false;
+    }
+    auto region = std::make_shared<ComsShmRegionC>();
+    region->SetSpin(m_spin);
+    if(!region->Attach(name))
+      return false;
+    m_name = name;
+    std::atomic_store(&m_region,region);
+    m_terminate = false;
+    m_threadRecieve = std::thread([this]{ RunRecieve(); });
+    return true;
+  }
+
+  //! Close connection
+  void ComsShmC::Close()
+  {
+    ComsC::Close();
+    if(m_threadRecieve.joinable())
+      m_threadRecieve.join();
+    std::atomic_store(&m_region,std::shared_ptr<ComsShmRegionC>());
+  }
+
+  //! Is connection ready ? Not while the server is stopped.
+  bool ComsShmC::IsReady() const
+  {
+    std::shared_ptr<ComsShmRegionC> region = std::atomic_load(&m_region);
+    return !m_terminate && region && region->IsAttached() && region->Header().m_running.load();
+  }
+
+  //! Map the segment again once the server has started.
+  std::shared_ptr<ComsShmRegionC> ComsShmC::Reattach()
+  {
+    while(!m_terminate) {
+      auto region = std::make_shared<ComsShmRegionC>();
+      region->SetSpin(m_spin);
+      if(region->Attach(m_name) && region->Header().m_running.load()) {
+        std::atomic_store(&m_region,region);
+        return region;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return std::shared_ptr<ComsShmRegionC>();
+  }
+
+  //! Read published packets and dispatch them.
+  void ComsShmC::RunRecieve()
+  {
+    m_log->debug("Running shared memory receiver. ");
+    // Senders keep their own reference, so the old mapping stays valid until
+    // they're done with it.
+    std::shared_ptr<ComsShmRegionC> region = std::atomic_load(&m_region);
+    // Start with the packets published from now on.
+    uint32_t generation = region->Header().m_generation.load();
+    uint64_t cursor = region->Header().m_pubHead.load();
+    uint64_t lost = 0;
+    auto lastWarning = std::chrono::steady_clock::now() - std::chrono::seconds(10);
+    uint8_t data[g_comsShmMaxPacket];
+    while(!m_terminate) {
+      if(region->Header().m_generation.load() != generation) {
+        // The new server may have resized or replaced the segment, so don't
+        // trust the old layout.
+        m_log->info("Server restarted. ");
+        region = Reattach();
+        if(!region)
+          break;
+        generation = region->Header().m_generation.load();
+        cursor = region->Header().m_pubHead.load();
+        continue;
+      }
+      int len = region->ReadPublished(cursor,data,lost);
+      if(len == 0) {
+        if(lost != m_lost) {
+          m_lost = lost;
+          auto now = std::chrono::steady_clock::now();
+          if(now - lastWarning > std::chrono::seconds(1)) {
+            m_log->warn("Fell behind the server, {} packets lost in total. ",lost);
+            lastWarning = now;
+          }
+        }
+        region->WaitPublished(cursor,100);
+        continue;
+      }
+      ProcessPacket(data,len);
+    }
+    m_log->debug("Exiting shared memory receiver. ");
+  }
+
+  //! Send packet
+  void ComsShmC::SendPacket(const uint8_t *data,int len)
+  {
+    std::shared_ptr<ComsShmRegionC> region = std::atomic_load(&m_region);
+    if(m_terminate || !region)
+      return ;
+    if(!region->PushCommand(data,len))
+      m_log->warn("Dropped packet to server, queue full. ");
+  }
+
+}
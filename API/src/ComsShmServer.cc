@@ -0,0 +1,61 @@
+
+#include "dogbot/ComsShmServer.hh"
+
+namespace DogBotN {
+
+  ComsShmServerC::ComsShmServerC(const std::shared_ptr<ComsC> &coms,std::shared_ptr<spdlog::logger> &log)
+   : m_log(log),
+     m_coms(coms)
+  {}
+
+  //! Make sure everything is disconnected.
+  ComsShmServerC::~ComsShmServerC()
+  {
+    if(m_coms && m_genericHandlerId >= 0) {
+      m_coms->RemoveGenericHandler(m_genericHandlerId);
+      m_genericHandlerId = -1;
+    }
+  }
+
+  //! Run server
+  bool ComsShmServerC::Run(const std::string &addr,size_t pubSlots,size_t cmdSlots)
+  {
+    std::string name = ComsShmRegionC::ShmName(addr);
+    if(name.empty()) {
+      m_log->error("Not a shared memory address '{}' ",addr);
+      return false;
+    }
+    if(!m_region.Create(name,pubSlots,cmdSlots))
+      return false;
+    m_log->info("Serving clients on shared memory {} ",name);
+
+    m_genericHandlerId = m_coms->SetGenericHandler([this](uint8_t *data,int len)
+                              {
+                                std::lock_guard<std::mutex> lock(m_accessPublish);
+                                if(m_region.Publish(data,len))
+                                  m_published++;
+                              });
+    m_ready = true;
+
+    uint8_t data[g_comsShmMaxPacket];
+    while(!m_terminate) {
+      int len = m_region.PopCommand(data);
+      if(len == 0) {
+        m_region.WaitCommand(100);
+        continue;
+      }
+      m_coms->SendPacket(data,len);
+    }
+
+    m_ready = false;
+    m_coms->RemoveGenericHandler(m_genericHandlerId);
+    m_genericHandlerId = -1;
+    {
+      std::lock_guard<std::mutex> lock(m_accessPublish);
+      m_region.Detach();
+    }
+    m_log->info("Shared memory server finished. ");
+    return true;
+  }
+
+}
@@ -0,0 +1,1196 @@
+
+#include "dogbot/ComsSim.hh"
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+namespace DogBotN
+{
+  // Flash layout of the STM32F405, as in flashops.cpp
+  static const int g_simFlashSectors = 12;
+  static const uint32_t g_simFlashAddr[g_simFlashSectors+1] = {
+    0x08000000,0x08004000,0x08008000,0x0800C000,0x08010000,0x08020000,
+    0x08040000,0x08060000,0x08080000,0x080A0000,0x080C0000,0x080E0000,
+    0x08100000
+  };
+  static const int g_simPageSize = 256;
+  static const int g_simAckInterval = 8;
+
+  // Motor and gearbox model.
+  static const float g_simActuatorRatio = 7.0 * 21.0; // Motor phase radians per joint radian.
+  static const float g_simKt = (60.0 * 21.0) / (2 * M_PI * 260.0); // Joint torque per amp, as ServoC.
+  static const float g_simInertia = 0.05;   // Joint inertia, kg m^2
+  static const float g_simDamping = 0.05;   // Viscous friction, Nm per rad/s
+  static const float g_simBrake = 2.0;      // Damping with the windings shorted.
+  static const float g_simSupplyVoltage = 24.0;
+  static const float g_simAmbient = 25.0;
+
+  //! Number of bytes in each parameter, 0 for unknown parameters. From ReadParam() in parameters.cpp.
+  static int SimParamSize(int index)
+  {
+    if(index >= CPI_ANGLE_CAL_0 && index <= CPI_ANGLE_CAL_17)
+      return 6;
+    switch((enum ComsParameterIndexT) index)
+    {
+    case CPI_DeviceType:
+    case CPI_FirmwareVersion:
+    case CPI_PWMState:
+    case CPI_PWMMode:
+    case CPI_PWMFullReport:
+    case CPI_CANBridgeMode:
+    case CPI_HomedState:
+    case CPI_PositionRef:
+    case CPI_ControlState:
+    case CPI_FaultCode:
+    case CPI_Indicator:
+    case CPI_OtherJoint:
+    case CPI_DebugIndex:
+    case CPI_IndexSensor:
+    case CPI_JointRelative:
+    case CPI_FanMode:
+    case CPI_FanState:
+      return 1;
+    case CPI_DRV8305_01:
+    case CPI_DRV8305_02:
+    case CPI_DRV8305_03:
+    case CPI_DRV8305_04:
+    case CPI_DRV8305_05:
+    case CPI_TIM1_SR:
+    case CPI_VSUPPLY:
+      return 2;
+    case CPI_5VRail:
+    case CPI_CalibrationOffset:
+    case CPI_DriveTemp:
+    case CPI_MotorTemp:
+    case CPI_OtherJointGain:
+    case CPI_OtherJointOffset:
+    case CPI_PhaseVelocity:
+    case CPI_PositionGain:
+    case CPI_MotorResistance:
+    case CPI_MotorInductance:
+    case CPI_MotorIGain:
+    case CPI_MotorPGain:
+    case CPI_VelocityPGain:
+    case CPI_VelocityIGain:
+    case CPI_DemandPhaseVelocity:
+    case CPI_VelocityLimit:
+    case CPI_MaxCurrent:
+    case CPI_homeIndexPosition:
+    case CPI_MinSupplyVoltage:
+    case CPI_USBPacketDrops:
+    case CPI_USBPacketErrors:
+    case CPI_CANPacketDrops:
+    case CPI_CANPacketErrors:
+    case CPI_FaultState:
+    case CPI_MainLoopTimeout:
+    case CPI_FanTemperatureThreshold:
+      return 4;
+    case CPI_HallSensors:
+      return 6;
+    case CPI_BoardUID:
+      return 8;
+    default:
+      break;
+    }
+    return 0;
+  }
+
+  //! Parameters the boot-loader can read, from its parameters.cpp
+  static bool SimBootLoaderParam(int index)
+  {
+    switch((enum ComsParameterIndexT) index)
+    {
+    case CPI_DeviceType:
+    case CPI_FirmwareVersion:
+    case CPI_CANBridgeMode:
+    case CPI_BoardUID:
+    case CPI_VSUPPLY:
+    case CPI_5VRail:
+    case CPI_ControlState:
+    case CPI_FaultCode:
+    case CPI_Indicator:
+    case CPI_DebugIndex:
+    case CPI_MinSupplyVoltage:
+    case CPI_USBPacketDrops:
+    case CPI_USBPacketErrors:
+    case CPI_CANPacketDrops:
+    case CPI_CANPacketErrors:
+    case CPI_FaultState:
+      return true;
+    default:
+      break;
+    }
+    return false;
+  }
+
+  //! Convert a joint angle to the position in servo packets.
+  static int16_t SimAngle2Position(float angle)
+  {
+    long value = lrint(angle * 65535.0 / (4.0 * M_PI));
+    return (int16_t) (uint16_t) (value & 0xffff);
+  }
+
+  //! Checksum of an area of flash, as either a byte sum or a CRC-32. From BootLoaderSumArea() in flashops.cpp.
+  static uint32_t SimFlashSum(const uint8_t *data,int len,bool crc)
+  {
+    uint32_t sum = 0;
+    if(!crc) {
+      for(int i = 0;i < len;i++)
+        sum += data[i];
+      return sum;
+    }
+    sum = 0xFFFFFFFF;
+    for(int i = 0;i < len;i++) {
+      sum ^= data[i];
+      for(int b = 0;b < 8;b++)
+        sum = (sum >> 1) ^ (0xEDB88320 & (0 - (sum & 1)));
+    }
+    return ~sum;
+  }
+
+  //! Context passed to the decompressor.
+  struct SimFlashContextC
+  {
+    ComsSimC *m_sim;
+    void *m_dev;
+  };
+
+  // ----------------------------------------------------------------
+
+  //! default
+  ComsSimC::ComsSimC()
+  {}
+
+  //! Destructor
+  ComsSimC::~ComsSimC()
+  {
+    Close();
+  }
+
+  //! Start simulating.
+  bool ComsSimC::Open(const std::string &portAddr)
+  {
+    Close();
+    if(!IsSimAddress(portAddr)) {
+      m_log->error("Not a simulator address '{}' ",portAddr);
+      return false;
+    }
+    int devices = 12;
+    float rate = 100;
+    if(portAddr.size() > 4) {
+      std::string args = portAddr.substr(4);
+      devices = atoi(args.c_str());
+      size_t comma = args.find(',');
+      if(comma != std::string::npos)
+        rate = atof(args.c_str() + comma + 1);
+    }
+    if(devices < 1 || devices > 254 || rate <= 0 || rate > 10000) {
+      m_log->error("Bad simulator address '{}', expected 'sim[:devices[,rate]]' ",portAddr);
+      return false;
+    }
+    m_rate = rate;
+    m_start = ClockT::now();
+    m_devices.clear();
+    m_devices.resize(devices);
+    for(int i = 0;i < devices;i++) {
+      DeviceC &dev = m_devices[i];
+      memset(dev.m_param,0,sizeof(dev.m_param));
+      // Keep uids the same between runs so configurations can refer to them.
+      dev.m_uid[0] = 0x53494d00 + i;
+      dev.m_uid[1] = 0x44420000 + i;
+      dev.m_stateChanged = m_start;
+      dev.m_nextBackground = m_start;
+      dev.m_position = 0.1f * i;
+      dev.m_param[CPI_OtherJointGain].float32[0] = 1.0;
+      dev.m_param[CPI_MotorPGain].float32[0] = 1.2;
+      dev.m_param[CPI_VelocityPGain].float32[0] = 0.03;
+      dev.m_param[CPI_VelocityIGain].float32[0] = 3.0;
+      dev.m_param[CPI_VelocityLimit].float32[0] = 4000.0;
+      dev.m_param[CPI_PositionGain].float32[0] = 5.0;
+      dev.m_param[CPI_MaxCurrent].float32[0] = 20.0;
+      dev.m_param[CPI_MotorResistance].float32[0] = 0.2;
+      dev.m_param[CPI_MotorInductance].float32[0] = 1e-4;
+      dev.m_param[CPI_MinSupplyVoltage].float32[0] = 6.0;
+      dev.m_param[CPI_FanMode].uint8[0] = FM_Auto;
+      dev.m_param[CPI_FanTemperatureThreshold].float32[0] = 40.0;
+    }
+    m_log->info("Simulating {} devices reporting at {} Hz ",devices,rate);
+    m_terminate = false;
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_incoming.clear();
+      m_running = true;
+    }
+    m_threadSim = std::thread([this]{ RunSim(); });
+    return true;
+  }
+
+  //! Stop simulating.
+  void ComsSimC::Close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_terminate = true;
+      m_running = false;
+    }
+    m_wake.notify_all();
+    if(m_threadSim.joinable())
+      m_threadSim.join();
+  }
+
+  //! Is connection ready ?
+  bool ComsSimC::IsReady() const
+  {
+    return m_threadSim.joinable() && !m_terminate;
+  }
+
+  //! Queue a packet for the simulation thread.
+  void ComsSimC::SendPacket(const uint8_t *data,int len)
+  {
+    if(len <= 0)
+      return ;
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      if(!m_running)
+        return ;
+      m_incoming.push_back(std::vector<uint8_t>(data,data+len));
+    }
+    m_wake.notify_one();
+  }
+
+  //! Send a packet from a device to the host.
+  void ComsSimC::Send(const void *data,int len)
+  {
+    // Handlers are allowed to modify the packet, so give them a copy.
+    uint8_t buff[64];
+    assert(len <= (int) sizeof(buff));
+    memcpy(buff,data,len);
+    m_sent++;
+    ProcessPacket(buff,len);
+  }
+
+  //! Run the simulation.
+  void ComsSimC::RunSim()
+  {
+    ClockT::duration period = std::chrono::duration_cast<ClockT::duration>(std::chrono::duration<double>(1.0 / m_rate));
+    // Step the model at 1KHz or faster.
+    int subSteps = (int) ceil(1000.0 / m_rate);
+    float dt = 1.0 / (m_rate * subSteps);
+    ClockT::time_point next = ClockT::now();
+    std::vector<std::vector<uint8_t> > incoming;
+    while(!m_terminate) {
+      {
+        std::unique_lock<std::mutex> lock(m_access);
+        m_wake.wait_until(lock,next,[this]{ return m_terminate || !m_incoming.empty(); });
+        incoming.swap(m_incoming);
+      }
+      // Replies are sent from this thread, with nothing locked, so handlers can send packets.
+      for(auto &a : incoming)
+        HandlePacket(a.data(),(int) a.size());
+      incoming.clear();
+
+      ClockT::time_point now = ClockT::now();
+      if(now < next)
+        continue;
+      for(auto &dev : m_devices) {
+        for(int i = 0;i < subSteps;i++)
+          Step(dev,dt);
+        Report(dev,now);
+      }
+      next += period;
+      // Don't try and catch up after a stall.
+      if(next < now - period * 10)
+        next = now + period;
+    }
+  }
+
+  //! Act on a packet sent by the host.
+  void ComsSimC::HandlePacket(const uint8_t *data,int len)
+  {
+    enum ComsPacketTypeT cpt = (enum ComsPacketTypeT) data[0];
+    switch(cpt)
+    {
+    case CPT_EmergencyStop:
+      for(auto &dev : m_devices) {
+        if(dev.m_controlState != CS_BootLoader)
+          ChangeControlState(dev,CS_EmergencyStop);
+      }
+      return ;
+    case CPT_QueryDevices:
+      for(auto &dev : m_devices) {
+        PacketDeviceIdC pkt;
+        pkt.m_packetType = CPT_AnnounceId;
+        pkt.m_deviceId = dev.m_deviceId;
+        pkt.m_uid[0] = dev.m_uid[0];
+        pkt.m_uid[1] = dev.m_uid[1];
+        Send(&pkt,sizeof(pkt));
+      }
+      return ;
+    case CPT_SetDeviceId: {
+      if(len != sizeof(PacketDeviceIdC))
+        return ;
+      PacketDeviceIdC pkt;
+      memcpy(&pkt,data,sizeof(pkt));
+      for(auto &dev : m_devices) {
+        if(dev.m_uid[0] != pkt.m_uid[0] || dev.m_uid[1] != pkt.m_uid[1])
+          continue;
+        dev.m_deviceId = pkt.m_deviceId;
+        pkt.m_packetType = CPT_AnnounceId;
+        Send(&pkt,sizeof(pkt));
+      }
+    } return ;
+    case CPT_NoOp:
+    case CPT_SyncTime:
+    case CPT_Sync:
+    case CPT_BridgeMode:
+    case CPT_SerialFraming:
+    case CPT_Error:
+    case CPT_ServoReport:
+    case CPT_ReportParam:
+    case CPT_Pong:
+    case CPT_AnnounceId:
+    case CPT_PWMState:
+    case CPT_FlashCmdResult:
+    case CPT_FlashChecksumResult:
+      return ;
+    default:
+      break;
+    }
+    if(len < 2)
+      return ;
+    int deviceId = data[1];
+    for(auto &dev : m_devices) {
+      if(deviceId != 0 && deviceId != dev.m_deviceId)
+        continue;
+      if(dev.m_controlState == CS_BootLoader)
+        HandleBootLoaderPacket(dev,data,len);
+      else
+        HandleDevicePacket(dev,data,len);
+    }
+  }
+
+  //! Act on a packet addressed to 'dev'.
+  void ComsSimC::HandleDevicePacket(DeviceC &dev,const uint8_t *data,int len)
+  {
+    enum ComsPacketTypeT cpt = (enum ComsPacketTypeT) data[0];
+    switch(cpt)
+    {
+    case CPT_Ping: {
+      if(len != sizeof(PacketPingPongC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        break;
+      }
+      PacketPingPongC pkt;
+      pkt.m_packetType = CPT_Pong;
+      pkt.m_deviceId = dev.m_deviceId;
+      Send(&pkt,sizeof(pkt));
+    } break;
+    case CPT_ReadParam: {
+      if(len != sizeof(PacketReadParamC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        break;
+      }
+      PacketReadParamC pkt;
+      memcpy(&pkt,data,sizeof(pkt));
+      SendParam(dev,pkt.m_index);
+    } break;
+    case CPT_SetParam: {
+      if(len < (int) sizeof(PacketParamHeaderC) || len > (int) sizeof(PacketParam8ByteC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        break;
+      }
+      PacketParam8ByteC pkt;
+      memcpy(&pkt,data,len);
+      int index = pkt.m_header.m_index;
+      if(SetParam(dev,index,pkt.m_data,len - sizeof(PacketParamHeaderC))) {
+        // Entering the boot-loader restarts the device, which then answers.
+        SendParam(dev,index);
+      } else {
+        SendError(dev,CET_ParameterOutOfRange,CPT_SetParam,index);
+      }
+    } break;
+    case CPT_Servo: {
+      if(len != sizeof(PacketServoC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        break;
+      }
+      PacketServoC pkt;
+      memcpy(&pkt,data,sizeof(pkt));
+      // As MotionSetPosition() and UpdateRequestedPosition()
+      float maxCurrent = dev.m_param[CPI_MaxCurrent].float32[0];
+      dev.m_currentLimit = ((float) pkt.m_torqueLimit) * maxCurrent / 65536.0;
+      dev.m_demandMode = pkt.m_mode;
+      switch((enum PWMControlDynamicT) (pkt.m_mode >> 2))
+      {
+      case CM_Velocity:
+        dev.m_demandVelocity = ((float) pkt.m_position) * 4.0 * M_PI / 32767.0;
+        break;
+      case CM_Torque:
+        dev.m_demandCurrent = ((float) pkt.m_position) * 10.0 / 32767.0;
+        break;
+      default: {
+        float position = ComsC::PositionReport2Angle(pkt.m_position);
+        if((pkt.m_mode & 0x1) != 0) { // Calibrated position ?
+          if(dev.m_homedState != MHS_Homed)
+            break;
+          position += dev.m_homeOffset;
+        }
+        dev.m_demandPosition = position;
+      } break;
+      }
+    } break;
+    case CPT_CalZero: {
+      if(len != sizeof(PacketCalZeroC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        break;
+      }
+      // As MotionCalZero(), only while the motor is running.
+      if(dev.m_controlState != CS_Ready && dev.m_controlState != CS_Home &&
+         dev.m_controlState != CS_Teach && dev.m_controlState != CS_Diagnostic) {
+        SendError(dev,CET_MotorNotRunning,CPT_CalZero,0);
+        break;
+      }
+      dev.m_demandMode = 0;
+      dev.m_demandPosition = dev.m_position;
+      dev.m_homeOffset = dev.m_position;
+      dev.m_homedState = MHS_Homed;
+      SendParam(dev,CPI_CalibrationOffset);
+      SendParam(dev,CPI_HomedState);
+    } break;
+    case CPT_SaveSetup:
+    case CPT_LoadSetup:
+      if(len != sizeof(PacketStoredConfigC))
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+      break;
+    case CPT_FlashCmdReset:
+    case CPT_FlashEraseSector:
+    case CPT_FlashChecksum:
+    case CPT_FlashCRC32:
+    case CPT_FlashData:
+    case CPT_FlashWrite:
+    case CPT_FlashRead:
+    case CPT_FlashWriteCompressed:
+      // Only the boot-loader acts on these.
+      break;
+    default:
+      SendError(dev,CET_UnknownPacketType,cpt,0);
+      break;
+    }
+  }
+
+  //! Act on a boot-loader packet addressed to 'dev', following flashops.cpp
+  void ComsSimC::HandleBootLoaderPacket(DeviceC &dev,const uint8_t *data,int len)
+  {
+    enum ComsPacketTypeT cpt = (enum ComsPacketTypeT) data[0];
+    switch(cpt)
+    {
+    case CPT_Ping:
+    case CPT_ReadParam:
+    case CPT_SetParam:
+      HandleDevicePacket(dev,data,len);
+      return ;
+    case CPT_FlashCmdReset: {
+      if(len != sizeof(PacketFlashResetC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        return ;
+      }
+      bool enable = data[2] != 0;
+      dev.m_blTxSeq = 0;
+      dev.m_blState = enable ? BLS_Ready : BLS_Disabled;
+      dev.m_blLastSeq = 0;
+      dev.m_blLastAck = 0;
+      dev.m_blResyncSent = false;
+      dev.m_blLen = 0;
+      dev.m_blAt = 0;
+      dev.m_blAddress = 0;
+      dev.m_blCompressed = false;
+      SendFlashResult(dev,0,dev.m_blState,enable ? FOS_ReadyCompressed : FOS_Ok);
+    } return ;
+    case CPT_FlashEraseSector: {
+      if(len != sizeof(PacketFlashEraseC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        return ;
+      }
+      PacketFlashEraseC pkt;
+      memcpy(&pkt,data,sizeof(pkt));
+      if(dev.m_blState == BLS_Disabled)
+        return ;
+      if(!BootLoaderCheckSequence(dev,pkt.m_sequenceNumber,cpt))
+        return ;
+      if(dev.m_blState != BLS_Ready && dev.m_blState != BLS_Write) {
+        SendError(dev,CET_BootLoaderUnexpectedState,cpt,dev.m_blState);
+        return ;
+      }
+      int sector = -1;
+      for(int i = 0;i < g_simFlashSectors;i++) {
+        if(g_simFlashAddr[i] == pkt.m_addr)
+          sector = i;
+      }
+      if(sector < 0) {
+        SendError(dev,CET_BootLoaderUnalignedAddress,cpt,pkt.m_addr >> 16);
+        return ;
+      }
+      if(sector < 3) {
+        SendError(dev,CET_BootLoaderProtected,cpt,sector);
+        return ;
+      }
+      auto begin = dev.m_flash.begin() + (g_simFlashAddr[sector] - g_simFlashAddr[0]);
+      auto end = dev.m_flash.begin() + (g_simFlashAddr[sector+1] - g_simFlashAddr[0]);
+      if(std::all_of(begin,end,[](uint8_t v) { return v == 0xff; })) {
+        SendFlashResult(dev,pkt.m_sequenceNumber,dev.m_blState,FOS_AlreadyErased);
+        return ;
+      }
+      std::fill(begin,end,0xff);
+      SendFlashResult(dev,pkt.m_sequenceNumber,dev.m_blState,FOS_Ok);
+    } return ;
+    case CPT_FlashWrite:
+    case CPT_FlashWriteCompressed: {
+      if(len != sizeof(PacketFlashWriteC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        return ;
+      }
+      PacketFlashWriteC pkt;
+      memcpy(&pkt,data,sizeof(pkt));
+      if(dev.m_blState == BLS_Disabled)
+        return ;
+      if(!BootLoaderCheckSequence(dev,pkt.m_sequenceNumber,cpt))
+        return ;
+      if(dev.m_blState != BLS_Ready) {
+        SendError(dev,CET_BootLoaderUnexpectedState,cpt,dev.m_blState);
+        return ;
+      }
+      if((pkt.m_addr & 0x3) != 0) {
+        dev.m_blState = BLS_Error;
+        SendError(dev,CET_BootLoaderUnalignedAddress,cpt,dev.m_blState);
+        return ;
+      }
+      if(pkt.m_addr < g_simFlashAddr[4]) {
+        dev.m_blState = BLS_Error;
+        SendError(dev,CET_BootLoaderProtected,cpt,dev.m_blState);
+        return ;
+      }
+      dev.m_blAddress = pkt.m_addr;
+      dev.m_blAt = pkt.m_addr;
+      dev.m_blLastAck = 0;
+      dev.m_blResyncSent = false;
+      dev.m_blLen = pkt.m_len;
+      dev.m_blCompressed = (cpt == CPT_FlashWriteCompressed);
+      FlashLZ_Init(&dev.m_blDecoder,pkt.m_len);
+      dev.m_blPageAddress = pkt.m_addr;
+      dev.m_blPageWritten = false;
+      dev.m_blState = BLS_Write;
+      SendFlashResult(dev,pkt.m_sequenceNumber,BLS_Write,FOS_Ok);
+    } return ;
+    case CPT_FlashData: {
+      if(len < (int) sizeof(PacketFlashDataC) || len > (int) sizeof(PacketFlashDataBufferC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        return ;
+      }
+      uint8_t seqNum = data[2];
+      const uint8_t *payload = data + sizeof(PacketFlashDataC);
+      int payloadLen = len - sizeof(PacketFlashDataC);
+      if(dev.m_blState == BLS_Disabled)
+        return ;
+      // If the final acknowledge was lost the host will resend the end of the block.
+      if(dev.m_blState == BLS_Ready && (uint8_t) (dev.m_blLastSeq - seqNum - 1) < 128) {
+        if(!dev.m_blResyncSent) {
+          SendFlashResult(dev,dev.m_blLastSeq-1,BLS_Write,FOS_WriteComplete);
+          dev.m_blResyncSent = true;
+        }
+        return ;
+      }
+      if(dev.m_blState != BLS_Write) {
+        SendError(dev,CET_BootLoaderUnexpectedState,cpt,dev.m_blState);
+        return ;
+      }
+      if(seqNum != dev.m_blLastSeq) {
+        if(!dev.m_blResyncSent) {
+          uint8_t behind = dev.m_blLastSeq - seqNum;
+          if(behind <= 128)
+            SendFlashResult(dev,dev.m_blLastSeq-1,BLS_Write,FOS_DataAck);
+          else
+            SendError(dev,CET_BootLoaderLostSequence,cpt,dev.m_blLastSeq);
+          dev.m_blResyncSent = true;
+        }
+        return ;
+      }
+      dev.m_blLastSeq++;
+      dev.m_blResyncSent = false;
+
+      enum FlashLZStatusT status = FLZ_Ok;
+      if(dev.m_blCompressed) {
+        SimFlashContextC ctx { this,&dev };
+        status = FlashLZ_Decode(&dev.m_blDecoder,payload,payloadLen,
+            [](void *ctx,uint8_t value) -> int {
+              auto *c = (SimFlashContextC *) ctx;
+              return c->m_sim->BootLoaderPutByte(*((DeviceC *) c->m_dev),value) ? 1 : 0;
+            },
+            [](void *ctx,uint16_t distance) -> uint8_t {
+              auto *c = (SimFlashContextC *) ctx;
+              return c->m_sim->BootLoaderGetByte(*((DeviceC *) c->m_dev),distance);
+            },
+            &ctx);
+      } else {
+        for(int i = 0;i < payloadLen;i++) {
+          if(!BootLoaderPutByte(dev,payload[i])) {
+            status = FLZ_WriteFailed;
+            break;
+          }
+        }
+      }
+      bool complete = dev.m_blAt >= (dev.m_blAddress + dev.m_blLen);
+      if(status == FLZ_Ok && complete && !BootLoaderWritePage(dev))
+        status = FLZ_WriteFailed;
+      if(status != FLZ_Ok) {
+        SendError(dev,status == FLZ_Corrupt ? CET_BootLoaderCorruptData : CET_BootLoaderWriteFailed,cpt,seqNum);
+        dev.m_blState = BLS_Error;
+        return ;
+      }
+      dev.m_blLastAck++;
+      if(complete) {
+        dev.m_blState = BLS_Ready;
+        SendFlashResult(dev,seqNum,BLS_Write,FOS_WriteComplete);
+      } else if((dev.m_blPageWritten && dev.m_blLastAck >= g_simAckInterval) ||
+                dev.m_blLastAck >= BOOTLOADER_ACK_LIMIT) {
+        dev.m_blLastAck = 0;
+        dev.m_blPageWritten = false;
+        SendFlashResult(dev,seqNum,BLS_Write,FOS_DataAck);
+      }
+    } return ;
+    case CPT_FlashChecksum:
+    case CPT_FlashCRC32:
+    case CPT_FlashRead: {
+      if(len != sizeof(PacketFlashChecksumC)) {
+        SendError(dev,CET_UnexpectedPacketSize,cpt,len);
+        return ;
+      }
+      PacketFlashChecksumC pkt;
+      memcpy(&pkt,data,sizeof(pkt));
+      if(dev.m_blState == BLS_Disabled)
+        return ;
+      if(!BootLoaderCheckSequence(dev,pkt.m_sequenceNumber,cpt))
+        return ;
+      if(pkt.m_addr < g_simFlashAddr[0] || pkt.m_addr + pkt.m_len > g_simFlashAddr[g_simFlashSectors]) {
+        SendError(dev,CET_BootLoaderUnalignedAddress,cpt,pkt.m_addr >> 16);
+        return ;
+      }
+      const uint8_t *at = dev.m_flash.data() + (pkt.m_addr - g_simFlashAddr[0]);
+      if(cpt == CPT_FlashChecksum || cpt == CPT_FlashCRC32) {
+        if(dev.m_blState == BLS_Error) {
+          SendError(dev,CET_BootLoaderUnexpectedState,cpt,dev.m_blState);
+          return ;
+        }
+        PacketFlashChecksumResultC result;
+        result.m_packetType = CPT_FlashChecksumResult;
+        result.m_deviceId = dev.m_deviceId;
+        result.m_sequenceNumber = pkt.m_sequenceNumber;
+        result.m_sum = SimFlashSum(at,pkt.m_len,cpt == CPT_FlashCRC32);
+        Send(&result,sizeof(result));
+        return ;
+      }
+      if(dev.m_blState != BLS_Ready) {
+        SendError(dev,CET_BootLoaderUnexpectedState,cpt,dev.m_blState);
+        return ;
+      }
+      SendFlashResult(dev,pkt.m_sequenceNumber,BLS_Read,FOS_Ok);
+      for(int i = 0;i < pkt.m_len;i += 7) {
+        PacketFlashDataBufferC reply;
+        reply.m_header.m_packetType = CPT_FlashData;
+        reply.m_header.m_deviceId = dev.m_deviceId;
+        reply.m_header.m_sequenceNumber = dev.m_blTxSeq++;
+        int n = std::min(7,pkt.m_len - i);
+        memcpy(reply.m_data,at + i,n);
+        Send(&reply,sizeof(reply.m_header) + n);
+      }
+      SendFlashResult(dev,pkt.m_sequenceNumber,BLS_Ready,FOS_Ok);
+    } return ;
+    default:
+      // Everything else is ignored by the boot-loader.
+      return ;
+    }
+  }
+
+  //! Check a boot-loader sequence number.
+  bool ComsSimC::BootLoaderCheckSequence(DeviceC &dev,uint8_t seqNum,int packetType)
+  {
+    if(dev.m_blLastSeq != seqNum) {
+      SendError(dev,CET_BootLoaderLostSequence,packetType,dev.m_blLastSeq);
+      return false;
+    }
+    dev.m_blLastSeq++;
+    return true;
+  }
+
+  //! Add a byte to the page buffer, programming it when full.
+  bool ComsSimC::BootLoaderPutByte(DeviceC &dev,uint8_t value)
+  {
+    if(dev.m_blAt >= (dev.m_blAddress + dev.m_blLen))
+      return false;
+    dev.m_blPage[dev.m_blAt - dev.m_blPageAddress] = value;
+    dev.m_blAt++;
+    if((dev.m_blAt - dev.m_blPageAddress) >= (uint32_t) g_simPageSize)
+      return BootLoaderWritePage(dev);
+    return true;
+  }
+
+  //! Read back a byte we've written, from flash or the page buffer.
+  uint8_t ComsSimC::BootLoaderGetByte(DeviceC &dev,uint16_t distance)
+  {
+    uint32_t addr = dev.m_blAt - distance;
+    if(addr >= dev.m_blPageAddress)
+      return dev.m_blPage[addr - dev.m_blPageAddress];
+    if(addr < g_simFlashAddr[0] || addr >= g_simFlashAddr[g_simFlashSectors])
+      return 0xff;
+    return dev.m_flash[addr - g_simFlashAddr[0]];
+  }
+
+  //! Program the staged page. Programming can only clear bits, so writing
+  //! over anything that hasn't been erased fails, as it does on the device.
+  bool ComsSimC::BootLoaderWritePage(DeviceC &dev)
+  {
+    uint32_t used = dev.m_blAt - dev.m_blPageAddress;
+    if(used == 0)
+      return true;
+    bool ret = dev.m_blPageAddress + used <= g_simFlashAddr[g_simFlashSectors];
+    for(uint32_t i = 0;i < used && ret;i++) {
+      uint8_t &cell = dev.m_flash[dev.m_blPageAddress + i - g_simFlashAddr[0]];
+      cell &= dev.m_blPage[i];
+      ret = cell == dev.m_blPage[i];
+    }
+    dev.m_blPageAddress = dev.m_blAt;
+    dev.m_blPageWritten = true;
+    return ret;
+  }
+
+  //! Follow ChangeControlState() in the firmware.
+  bool ComsSimC::ChangeControlState(DeviceC &dev,enum ControlStateT newState)
+  {
+    if(newState == dev.m_controlState)
+      return true;
+
+    // The boot-loader just restarts the application for anything else.
+    if(dev.m_controlState == CS_BootLoader) {
+      dev.m_controlState = CS_StartUp;
+      dev.m_blState = BLS_Disabled;
+      dev.m_stateChanged = ClockT::now();
+      return true;
+    }
+
+    switch(dev.m_controlState)
+    {
+    case CS_Fault:
+    case CS_EmergencyStop:
+      if(newState != CS_StartUp) {
+        SendParam(dev,CPI_ControlState);
+        return false;
+      }
+      break;
+    default:
+      break;
+    }
+
+    if(newState == CS_BootLoader &&
+       (dev.m_controlState != CS_Standby &&
+        dev.m_controlState != CS_LowPower &&
+        dev.m_controlState != CS_Fault)) {
+      SendParam(dev,CPI_ControlState);
+      return false;
+    }
+
+    dev.m_controlState = newState;
+    dev.m_stateChanged = ClockT::now();
+    dev.m_nextBackground = dev.m_stateChanged;
+
+    switch(newState)
+    {
+    case CS_SelfTest:
+    case CS_FactoryCalibrate:
+    case CS_StartUp:
+    case CS_Standby:
+    case CS_LowPower:
+      dev.m_controlMode = CM_Brake;
+      SendParam(dev,CPI_HomedState);
+      break;
+    case CS_EmergencyStop:
+      dev.m_currentLimit = 0;
+      dev.m_controlMode = CM_Brake;
+      break;
+    case CS_Home:
+    case CS_Ready:
+    case CS_Teach:
+    case CS_Diagnostic:
+      dev.m_velocityISum = 0;
+      break;
+    case CS_Fault:
+      dev.m_currentLimit = 0;
+      dev.m_controlMode = CM_Brake;
+      SendParam(dev,CPI_HomedState);
+      break;
+    case CS_BootLoader:
+      // The device restarts into the boot-loader, which answers the request.
+      dev.m_controlMode = CM_Brake;
+      dev.m_blState = BLS_Disabled;
+      if(dev.m_flash.empty()) {
+        // The boot-loader occupies the first sectors, the application area starts blank.
+        dev.m_flash.assign(g_simFlashAddr[g_simFlashSectors] - g_simFlashAddr[0],0xff);
+        for(uint32_t i = 0;i < g_simFlashAddr[4] - g_simFlashAddr[0];i++)
+          dev.m_flash[i] = (uint8_t) (i * 7 + 3);
+      }
+      return true;
+    default:
+      return false;
+    }
+
+    SendParam(dev,CPI_ControlState);
+    return true;
+  }
+
+  //! Read a parameter.
+  int ComsSimC::ReadParam(DeviceC &dev,int index,BufferTypeT &data)
+  {
+    int len = SimParamSize(index);
+    if(len == 0)
+      return -1;
+    if(dev.m_controlState == CS_BootLoader && !SimBootLoaderParam(index))
+      return -1;
+    memcpy(&data,&dev.m_param[index],sizeof(data));
+    switch((enum ComsParameterIndexT) index)
+    {
+    case CPI_DeviceType:
+      data.uint8[0] = (dev.m_controlState == CS_BootLoader) ? DT_BootLoader : DT_MotorDriver;
+      break;
+    case CPI_FirmwareVersion:
+      data.uint8[0] = (dev.m_controlState == CS_BootLoader) ? 3 : 2;
+      break;
+    case CPI_BoardUID:
+      data.uint32[0] = dev.m_uid[0];
+      data.uint32[1] = dev.m_uid[1];
+      break;
+    case CPI_VSUPPLY:
+      data.uint16[0] = (uint16_t) (g_simSupplyVoltage * 1000.0);
+      break;
+    case CPI_5VRail:
+      data.float32[0] = 5.0;
+      break;
+    case CPI_ControlState:
+      data.uint8[0] = dev.m_controlState;
+      break;
+    case CPI_PWMMode:
+      data.uint8[0] = dev.m_controlMode;
+      break;
+    case CPI_FaultCode:
+      data.uint8[0] = dev.m_faultCode;
+      break;
+    case CPI_HomedState:
+      data.uint8[0] = dev.m_homedState;
+      break;
+    case CPI_PositionRef:
+      data.uint8[0] = dev.m_positionRef;
+      break;
+    case CPI_CalibrationOffset:
+      data.float32[0] = dev.m_homeOffset;
+      break;
+    case CPI_DriveTemp:
+      data.float32[0] = dev.m_driveTemp;
+      break;
+    case CPI_MotorTemp:
+      data.float32[0] = dev.m_motorTemp;
+      break;
+    case CPI_PhaseVelocity:
+      data.float32[0] = dev.m_velocity * g_simActuatorRatio;
+      break;
+    case CPI_FanState:
+      data.uint8[0] = dev.m_driveTemp > dev.m_param[CPI_FanTemperatureThreshold].float32[0];
+      break;
+    default:
+      break;
+    }
+    return len;
+  }
+
+  //! Set a parameter, following SetParam() in parameters.cpp
+  bool ComsSimC::SetParam(DeviceC &dev,int index,const BufferTypeT &data,int len)
+  {
+    int size = SimParamSize(index);
+    if(size == 0)
+      return false;
+    if(dev.m_controlState == CS_BootLoader) {
+      if(index != CPI_ControlState || len != 1)
+        return false;
+      return ChangeControlState(dev,(enum ControlStateT) data.uint8[0]);
+    }
+    switch((enum ComsParameterIndexT) index)
+    {
+    case CPI_FirmwareVersion:
+    case CPI_BoardUID:
+      return false;
+    // Read only, the current value is reported back.
+    case CPI_DRV8305_01:
+    case CPI_DRV8305_02:
+    case CPI_DRV8305_03:
+    case CPI_DRV8305_04:
+    case CPI_DRV8305_05:
+    case CPI_VSUPPLY:
+    case CPI_5VRail:
+    case CPI_DriveTemp:
+    case CPI_MotorTemp:
+    case CPI_MotorResistance:
+    case CPI_MotorInductance:
+    case CPI_PhaseVelocity:
+    case CPI_HallSensors:
+    case CPI_DeviceType:
+    case CPI_TIM1_SR:
+    case CPI_IndexSensor:
+    case CPI_FanState:
+      return true;
+    case CPI_FaultCode:
+      dev.m_faultCode = FC_Ok;
+      return true;
+    case CPI_FaultState:
+    case CPI_USBPacketDrops:
+    case CPI_USBPacketErrors:
+    case CPI_CANPacketDrops:
+    case CPI_CANPacketErrors:
+    case CPI_MainLoopTimeout:
+      dev.m_param[index].uint32[0] = 0;
+      return true;
+    default:
+      break;
+    }
+    if(len != size)
+      return false;
+    switch((enum ComsParameterIndexT) index)
+    {
+    case CPI_ControlState:
+      return ChangeControlState(dev,(enum ControlStateT) data.uint8[0]);
+    case CPI_PWMMode:
+      if(data.uint8[0] >= CM_Final)
+        return false;
+      dev.m_controlMode = (enum PWMControlDynamicT) data.uint8[0];
+      dev.m_velocityISum = 0;
+      return true;
+    case CPI_HomedState:
+      switch((enum MotionHomedStateT) data.uint8[0])
+      {
+      case MHS_Lost:
+      case MHS_Measuring:
+        dev.m_homedState = (enum MotionHomedStateT) data.uint8[0];
+        return true;
+      case MHS_Homed:
+        if(dev.m_homedState != MHS_Homed)
+          SendParam(dev,CPI_HomedState);
+        return false;
+      default:
+        return false;
+      }
+    case CPI_PositionRef:
+      if(data.uint8[0] > PR_Absolute)
+        return false;
+      dev.m_positionRef = (enum PositionReferenceT) data.uint8[0];
+      return true;
+    case CPI_CalibrationOffset:
+      dev.m_homeOffset = data.float32[0];
+      return true;
+    default:
+      break;
+    }
+    memcpy(&dev.m_param[index],&data,len);
+    return true;
+  }
+
+  //! Send the value of a parameter.
+  void ComsSimC::SendParam(DeviceC &dev,int index)
+  {
+    BufferTypeT data;
+    int len = ReadParam(dev,index,data);
+    if(len < 0) {
+      SendError(dev,CET_ParameterOutOfRange,CPT_ReadParam,index);
+      return ;
+    }
+    PacketParam8ByteC pkt;
+    memcpy(&pkt.m_data,&data,len);
+    pkt.m_header.m_packetType = CPT_ReportParam;
+    pkt.m_header.m_deviceId = dev.m_deviceId;
+    pkt.m_header.m_index = index;
+    Send(&pkt,sizeof(pkt.m_header) + len);
+  }
+
+  //! Send an error report from 'dev'.
+  void ComsSimC::SendError(DeviceC &dev,enum ComsErrorTypeT code,int causeType,int data)
+  {
+    PacketErrorC pkt;
+    pkt.m_packetType = CPT_Error;
+    pkt.m_deviceId = dev.m_deviceId;
+    pkt.m_errorCode = code;
+    pkt.m_causeType = causeType;
+    pkt.m_errorData = data;
+    Send(&pkt,sizeof(pkt));
+  }
+
+  //! Send a boot-loader result from 'dev'.
+  void ComsSimC::SendFlashResult(DeviceC &dev,uint8_t seq,enum BootLoaderStateT state,enum FlashOperationStatusT result)
+  {
+    PacketFlashResultC pkt;
+    pkt.m_packetType = CPT_FlashCmdResult;
+    pkt.m_deviceId = dev.m_deviceId;
+    pkt.m_rxSequence = seq;
+    pkt.m_state = state;
+    pkt.m_result = result;
+    Send(&pkt,sizeof(pkt));
+  }
+
+  //! Advance the model of 'dev' by 'dt' seconds.
+  void ComsSimC::Step(DeviceC &dev,float dt)
+  {
+    bool running = false;
+    switch(dev.m_controlState)
+    {
+    case CS_Ready:
+    case CS_Home:
+    case CS_Teach:
+    case CS_Diagnostic:
+      running = true;
+      break;
+    default:
+      break;
+    }
+
+    // The control loops of do_pwm.c, working in phase angles.
+    float torque = 0;
+    float current = 0;
+    if(running) {
+      const float ratio = g_simActuatorRatio;
+      float velocityLimit = dev.m_param[CPI_VelocityLimit].float32[0];
+      float demandVelocity = dev.m_demandVelocity * ratio;
+      bool driven = true;
+      switch(dev.m_controlMode)
+      {
+      case CM_Position:
+        demandVelocity = (dev.m_demandPosition - dev.m_position) * ratio * dev.m_param[CPI_PositionGain].float32[0];
+        demandVelocity = std::max(-velocityLimit,std::min(velocityLimit,demandVelocity));
+        /* no break */
+      case CM_Velocity: {
+        float err = demandVelocity - dev.m_velocity * ratio;
+        const float deadZone = M_PI/8.0f;
+        if(err < 0)
+          err = (err > -deadZone) ? 0 : err + deadZone;
+        else
+          err = (err < deadZone) ? 0 : err - deadZone;
+        dev.m_velocityISum += err * dt * dev.m_param[CPI_VelocityIGain].float32[0];
+        dev.m_velocityISum = std::max(-velocityLimit,std::min(velocityLimit,dev.m_velocityISum));
+        current = err * dev.m_param[CPI_VelocityPGain].float32[0] + dev.m_velocityISum;
+      } break;
+      case CM_Torque:
+        current = dev.m_demandCurrent;
+        break;
+      case CM_Brake:
+        torque = -g_simBrake * dev.m_velocity;
+        /* no break */
+      default:
+        driven = false;
+        break;
+      }
+      if(driven) {
+        float limit = std::min(dev.m_currentLimit,dev.m_param[CPI_MaxCurrent].float32[0]);
+        current = std::max(-limit,std::min(limit,current));
+        torque = current * g_simKt;
+      }
+    } else if(dev.m_controlMode == CM_Brake) {
+      torque = -g_simBrake * dev.m_velocity;
+    }
+    dev.m_current = current;
+
+    // Joint dynamics.
+    float accel = (torque - g_simDamping * dev.m_velocity) / g_simInertia;
+    dev.m_velocity += accel * dt;
+    dev.m_position += dev.m_velocity * dt;
+
+    // Filtered current for torque reports, and heating.
+    dev.m_currentAverage += (current - dev.m_currentAverage) * std::min(1.0f,dt / 0.01f);
+    float heat = current * current * dt;
+    dev.m_driveTemp += heat * 0.001f - (dev.m_driveTemp - g_simAmbient) * dt / 120.0f;
+    dev.m_motorTemp += heat * 0.002f - (dev.m_motorTemp - g_simAmbient) * dt / 300.0f;
+  }
+
+  //! Send the servo and background reports due from 'dev'.
+  void ComsSimC::Report(DeviceC &dev,ClockT::time_point now)
+  {
+    if(dev.m_controlState == CS_BootLoader)
+      return ;
+
+    // DoStartup() once the device has had time to settle.
+    if(dev.m_controlState == CS_StartUp) {
+      if(now - dev.m_stateChanged < std::chrono::milliseconds(50))
+        return ;
+      dev.m_homedState = MHS_Measuring;
+      dev.m_faultCode = FC_Ok;
+      dev.m_param[CPI_FaultState].uint32[0] = 0;
+      SendParam(dev,CPI_FaultCode);
+      SendParam(dev,CPI_FaultState);
+      ChangeControlState(dev,CS_Ready);
+    }
+
+    std::chrono::milliseconds backgroundPeriod(500);
+    switch(dev.m_controlState)
+    {
+    case CS_Ready:
+    case CS_Home:
+    case CS_Teach:
+    case CS_Diagnostic: {
+      // As MotionStep()
+      float position = dev.m_position;
+      enum PositionReferenceT posRef = dev.m_positionRef;
+      if(posRef == PR_Absolute) {
+        if(dev.m_homedState == MHS_Homed)
+          position -= dev.m_homeOffset;
+        else
+          posRef = PR_Relative;
+      }
+      PacketServoReportC pkt;
+      pkt.m_packetType = CPT_ServoReport;
+      pkt.m_deviceId = dev.m_deviceId;
+      pkt.m_mode = posRef & 0x3;
+      pkt.m_timestamp = (uint8_t) ((now - m_start) / std::chrono::milliseconds(10));
+      pkt.m_position = SimAngle2Position(position);
+      float torque = dev.m_currentAverage * 65535.0 / dev.m_param[CPI_MaxCurrent].float32[0];
+      pkt.m_torque = (int16_t) std::max(-32767.0f,std::min(32767.0f,torque));
+      // Only devices with an id report over CAN.
+      if(dev.m_deviceId != 0)
+        Send(&pkt,sizeof(pkt));
+      backgroundPeriod = std::chrono::milliseconds(70);
+    } break;
+    case CS_EmergencyStop:
+      backgroundPeriod = std::chrono::milliseconds(100);
+      break;
+    default:
+      break;
+    }
+
+    // As SendBackgroundStateReport()
+    if(now < dev.m_nextBackground)
+      return ;
+    dev.m_nextBackground = now + backgroundPeriod;
+    switch(dev.m_backgroundCount++)
+    {
+    default:
+      dev.m_backgroundCount = 1;
+      /* no break */
+    case 0:
+      SendParam(dev,CPI_VSUPPLY);
+      break;
+    case 1:
+      SendParam(dev,CPI_DriveTemp);
+      break;
+    case 2:
+      if(dev.m_controlState != CS_LowPower && dev.m_controlState != CS_Standby)
+        SendParam(dev,CPI_MotorTemp);
+      break;
+    case 3:
+      SendParam(dev,CPI_PhaseVelocity);
+      dev.m_backgroundCount = 0;
+      break;
+    }
+  }
+
+}
@@ -6,6 +6,7 @@
 #include <functional>
 #include <assert.h>
 #include <mutex>
+#include <algorithm>
 
 #include <stdio.h>
 #include <string.h>
@@ -15,9 +16,17 @@
 #include <fcntl.h>
 
 #include <unistd.h>
+#include <pthread.h>
 
 #include "dogbot/ComsUSB.hh"
 
+// libusb_interrupt_event_handler() arrived in libusb 1.0.21
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define DOGBOT_USB_HAS_INTERRUPT 1
+#else
+#define DOGBOT_USB_HAS_INTERRUPT 0
+#endif
+
 #define DODEBUG 0
 #if DODEBUG
 #define ONDEBUG(x) x
@@ -27,6 +36,9 @@
 
 namespace DogBotN
 {
+  //! USB ids of the bridge board.
+  static const uint16_t g_usbVendorId = 0x27d8;
+  static const uint16_t g_usbProductId = 0x16c0;
 
   static void usbTransferCB(struct libusb_transfer *transfer)
   {
@@ -64,14 +76,15 @@ namespace DogBotN
   void USBTransferDataC::SetupIso(
       ComsUSBC *coms,
       struct libusb_device_handle *handle,
-      USBTransferDirectionT direction)
+      USBTransferDirectionT direction,
+      int isoPackets)
   {
     m_direction = direction;
     m_comsUSB = coms;
 
-    memset(m_buffer,0,sizeof(m_buffer));
+    m_buffer.assign(isoPackets * IsoPacketSize,0);
     // Initialise an input transfer.
-    m_transfer = libusb_alloc_transfer(1);
+    m_transfer = libusb_alloc_transfer(isoPackets);
 
     unsigned char endPoint;
 
@@ -84,9 +97,9 @@ namespace DogBotN
         m_transfer,
         handle,
         endPoint,
-        m_buffer,
-        sizeof(m_buffer),
-        1,
+        m_buffer.data(),
+        m_buffer.size(),
+        isoPackets,
         &usbTransferCB,
         this,
         0
@@ -102,14 +115,15 @@ namespace DogBotN
     m_transfer->timeout = 0;
     m_transfer->callback = usbTransferCB;
     m_transfer->user_data = this;
-    m_transfer->buffer = m_buffer;
-    m_transfer->length = sizeof(m_buffer);
-    m_transfer->actual_length = sizeof(m_buffer);
+    m_transfer->buffer = m_buffer.data();
+    m_transfer->length = m_buffer.size();
+    m_transfer->actual_length = m_buffer.size();
 #endif
-    m_transfer->num_iso_packets = 1;
-    m_transfer->iso_packet_desc[0].actual_length = sizeof(m_buffer);
-    m_transfer->iso_packet_desc[0].length = sizeof(m_buffer);
-    m_transfer->iso_packet_desc[0].status = LIBUSB_TRANSFER_COMPLETED;
+    for(int i = 0;i < isoPackets;i++) {
+      m_transfer->iso_packet_desc[i].actual_length = IsoPacketSize;
+      m_transfer->iso_packet_desc[i].length = IsoPacketSize;
+      m_transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+    }
   }
 
   //! Test if the object if for a particular device.
@@ -122,6 +136,43 @@ namespace DogBotN
 
   // ====================================================================
 
+  //! Construct from a device name
+  ComsUSBTransferConfigC::ComsUSBTransferConfigC(const std::string &name)
+  {
+    Parse(name);
+  }
+
+  //! Set from a device name of the form 'usb', 'usb@location' or 'usb:in,out,isoPackets,dispatchCPU'
+  bool ComsUSBTransferConfigC::Parse(const std::string &name)
+  {
+    if(name.compare(0,3,"usb") != 0)
+      return false;
+    size_t at = 3;
+    if(at < name.size() && name[at] == '@') {
+      size_t end = name.find(':',at);
+      m_location = name.substr(at+1,end == std::string::npos ? std::string::npos : end - at - 1);
+      at = (end == std::string::npos) ? name.size() : end;
+    }
+    if(at == name.size())
+      return true;
+    if(name[at] != ':')
+      return false;
+    int *values[4] = { &m_inTransfers, &m_outTransfers, &m_isoPacketsPerTransfer, &m_dispatchCPU };
+    const char *str = name.c_str() + at + 1;
+    for(int i = 0;i < 4 && *str != 0;i++) {
+      char *end = 0;
+      long value = strtol(str,&end,10);
+      if(end != str && value >= (i == 3 ? 0 : 1) && value <= 128)
+        *values[i] = value;
+      if(*end != ',')
+        break;
+      str = end + 1;
+    }
+    return true;
+  }
+
+  // ====================================================================
+
   ComsUSBC::ComsUSBC(std::shared_ptr<spdlog::logger> &log)
    : ComsC(log)
   {
@@ -134,6 +185,22 @@ namespace DogBotN
     Init();
   }
 
+  //! Construct with transfer settings
+  ComsUSBC::ComsUSBC(const ComsUSBTransferConfigC &config)
+   : m_config(config)
+  {
+    Init();
+  }
+
+  //! Get a copy of the transfer counters.
+  ComsUSBStatsC ComsUSBC::Stats()
+  {
+    std::lock_guard<std::mutex> lock(m_accessTx);
+    ComsUSBStatsC ret = m_stats;
+    ret.m_txDropped = m_txDropped;
+    return ret;
+  }
+
   //! Close usb handle
   void ComsUSBC::CloseUSB()
   {
@@ -142,9 +209,6 @@ namespace DogBotN
 
     std::lock_guard<std::mutex> lock(m_accessTx);
 
-    // Dump all packets from tx queue.
-    m_txQueue.empty();
-
     // Cancel all active transfers.
     std::vector<USBTransferDataC *> stillActive;
     stillActive.reserve(32);
@@ -180,10 +244,47 @@ namespace DogBotN
     m_device = 0;
   }
 
+  //! Location of a device
+  std::string ComsUSBC::DeviceLocation(libusb_device *device)
+  {
+    uint8_t ports[8];
+    int numPorts = libusb_get_port_numbers(device,ports,sizeof(ports));
+    std::string ret = std::to_string(libusb_get_bus_number(device));
+    for(int i = 0;i < numPorts;i++) {
+      ret += (i == 0) ? '-' : '.';
+      ret += std::to_string(ports[i]);
+    }
+    return ret;
+  }
+
+  //! List the locations of all the bridges currently plugged in.
+  std::vector<std::string> ComsUSBC::ListBridges()
+  {
+    std::vector<std::string> ret;
+    libusb_context *context = 0;
+    if(libusb_init(&context) != 0)
+      return ret;
+    libusb_device **list = 0;
+    ssize_t count = libusb_get_device_list(context,&list);
+    for(ssize_t i = 0;i < count;i++) {
+      struct libusb_device_descriptor desc;
+      if(libusb_get_device_descriptor(list[i],&desc) != LIBUSB_SUCCESS)
+        continue;
+      if(desc.idVendor == g_usbVendorId && desc.idProduct == g_usbProductId)
+        ret.push_back(DeviceLocation(list[i]));
+    }
+    if(count >= 0)
+      libusb_free_device_list(list,1);
+    libusb_exit(context);
+    std::sort(ret.begin(),ret.end());
+    return ret;
+  }
+
   // Disconnects and closes file descriptors
   ComsUSBC::~ComsUSBC()
   {
     m_terminate = true;
+    WakeUSBThread();
 
     if(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
       libusb_hotplug_deregister_callback(m_usbContext,m_hotplugCallbackHandle);
@@ -193,6 +294,7 @@ namespace DogBotN
 
     if(m_threadUSB.joinable())
       m_threadUSB.join();
+    StopDispatch();
 
     libusb_exit(m_usbContext);
     m_usbContext = 0;
@@ -239,6 +341,10 @@ namespace DogBotN
       m_log->info("Drive already open. Ignoring device. ");
       return ;
     }
+    if(!m_config.m_location.empty() && DeviceLocation(device) != m_config.m_location) {
+      m_log->info("Device at {} is not the one at {}, ignoring it. ",DeviceLocation(device),m_config.m_location);
+      return ;
+    }
     if((rc = libusb_open(device,&m_handle)) != LIBUSB_SUCCESS) {
       m_log->error("Error opening device. {} ",libusb_error_name(rc));
       return ;
@@ -285,28 +391,32 @@ namespace DogBotN
       std::lock_guard<std::mutex> lock(m_accessTx);
 
       m_log->info("Active transfers on open: {} ",m_activeTransfers.size());
+      m_log->info("Using {} IN and {} OUT transfers of {} iso packets. ",m_config.m_inTransfers,m_config.m_outTransfers,m_config.m_isoPacketsPerTransfer);
 
       // Setup a series of IN transfers.
-      for(int i = 0;i < 2;i++) {
+      m_inQueued = 0;
+      for(int i = 0;i < m_config.m_inTransfers;i++) {
         USBTransferDataC *a = new USBTransferDataC();
-        a->SetupIso(this,handle,UTD_IN);
+        a->SetupIso(this,handle,UTD_IN,m_config.m_isoPacketsPerTransfer);
         int rc = libusb_submit_transfer(a->Transfer());
         if(rc != LIBUSB_SUCCESS) {
           m_log->error("Got error setting up input iso transfer. {} ",libusb_error_name(rc));
           delete a;
-          assert(0); // We need to deal with this.
         } else {
           m_activeTransfers.push_back(a);
+          m_inQueued++;
           m_log->debug("Input iso transfer setup ok. ");
         }
       }
+      if(m_inQueued == 0)
+        m_log->error("No input transfers could be set up. ");
 
-      m_outDataFree.empty();
-      m_outDataFree.reserve(4);
+      m_outDataFree.clear();
+      m_outDataFree.reserve(m_config.m_outTransfers);
       // Setup some OUT transfers.
-      for(int i = 0;i < 4;i++) {
+      for(int i = 0;i < m_config.m_outTransfers;i++) {
         USBTransferDataC *a = new USBTransferDataC();
-        a->SetupIso(this,handle,UTD_OUT);
+        a->SetupIso(this,handle,UTD_OUT,m_config.m_isoPacketsPerTransfer);
         m_outDataFree.push_back(a);
       }
 
@@ -321,6 +431,7 @@ namespace DogBotN
   //! Remove transfer from active list.
   void ComsUSBC::TransferComplete(USBTransferDataC *data)
   {
+    std::lock_guard<std::mutex> lock(m_accessTx);
     auto at = std::find(m_activeTransfers.begin(),m_activeTransfers.end(),data);
     if(at == m_activeTransfers.end()) {
       m_log->error("Transfer not found, can't be completed.");
@@ -334,6 +445,9 @@ namespace DogBotN
 
   void ComsUSBC::ProcessInTransferIso(USBTransferDataC *data)
   {
+    // Frames can be missed until this is resubmitted if there's nothing else queued.
+    bool underrun = --m_inQueued == 0;
+
     if(!data->IsForUSBDevice(m_handle)) {
       m_log->info("Dropping in transfer from old device. ");
       TransferComplete(data);
@@ -341,58 +455,152 @@ namespace DogBotN
       return ;
     }
 
+    int packets = 0;
+    int packetErrors = 0;
+    int rxOverflows = 0;
     //m_log->info("ProcessTransferIn");
     switch(data->Transfer()->status)
     {
       case LIBUSB_TRANSFER_COMPLETED: {
         //m_log->info("Transfer completed");
-        int at = 0;
         for(int i = 0;i < data->Transfer()->num_iso_packets;i++) {
+          if(data->Transfer()->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) {
+            packetErrors++;
+            continue;
+          }
           int usbLen = data->Transfer()->iso_packet_desc[i].actual_length;
           if(usbLen <= 0)
             continue;
-          unsigned char *pdata = &data->Transfer()->buffer[at];
-          int dat = 0;
-          //ONDEBUG(m_log->info("Packet iso size {} Type:{} Status:{}",usbLen,(int) pdata[dat],(int) data->Transfer()->iso_packet_desc[i].status));
-          while(dat < usbLen) {
-            int packetLen = pdata[dat++];
-            if(packetLen == 0) {
-              m_log->error("Zero packet length at {} ",dat);
-              break;
-            }
-            if(packetLen < 0 || packetLen > 15) {
-              m_log->error("Unexpected packet size at {} of {} ",dat,packetLen);
-              break;
-            }
-            ONDEBUG(m_log->info("Packet iso at {} Len:{} Type:{} ",dat,packetLen,(int) pdata[dat+1]));
-            ProcessPacket(&pdata[dat],packetLen);
-            dat += packetLen;
-          }
-          if(dat != usbLen) {
-            m_log->error("Packet boundary error. at {} of {} ",dat,usbLen);
+          packets++;
+          // Hand it to the dispatch thread, so slow handlers don't hold up resubmitting the transfer.
+          DataPacketT *frame = m_rxQueue->Back();
+          if(frame == nullptr) {
+            rxOverflows++;
+            continue;
           }
-          at += usbLen;
+          // Each packet has its own slot in the buffer however much data it holds.
+          frame->m_len = std::min(usbLen,(int) sizeof(frame->m_data));
+          memcpy(frame->m_data,libusb_get_iso_packet_buffer_simple(data->Transfer(),i),frame->m_len);
+          m_rxQueue->PushBack();
         }
       } break;
       case LIBUSB_TRANSFER_NO_DEVICE:
         m_log->warn("Device removed.");
+        packetErrors = data->Transfer()->num_iso_packets;
         break;
       case LIBUSB_TRANSFER_OVERFLOW:
       default:
         m_log->warn("Transfer status {} ",data->Transfer()->status);
+        packetErrors = data->Transfer()->num_iso_packets;
         break;
     }
 
-    // Clear things out for debug.
-    memset(data->Transfer()->buffer,0,data->Transfer()->length);
+    // Wake the dispatch thread if it is waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(packets > 0 && m_rxSleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(m_accessRxWake);
+      m_rxWake.notify_one();
+    }
+
     for(int i = 0;i < data->Transfer()->num_iso_packets;i++) {
       data->Transfer()->iso_packet_desc[i].actual_length = 0;
-      data->Transfer()->iso_packet_desc[i].length = data->BufferSize();
+      data->Transfer()->iso_packet_desc[i].length = USBTransferDataC::IsoPacketSize;
       data->Transfer()->iso_packet_desc[i].status = LIBUSB_TRANSFER_ERROR;
     }
 
     // Resubmit transfer to get more lovely data.
-    libusb_submit_transfer(data->Transfer());
+    int rc = libusb_submit_transfer(data->Transfer());
+    if(rc == LIBUSB_SUCCESS)
+      m_inQueued++;
+    else
+      m_log->error("Failed to resubmit input iso transfer. {} ",libusb_error_name(rc));
+
+    {
+      std::lock_guard<std::mutex> lock(m_accessTx);
+      m_stats.m_inTransfers++;
+      m_stats.m_inPackets += packets;
+      m_stats.m_inPacketErrors += packetErrors;
+      if(underrun)
+        m_stats.m_inUnderruns++;
+      m_stats.m_rxOverflows += rxOverflows;
+      m_stats.m_rxQueueMax = std::max(m_stats.m_rxQueueMax,m_rxQueue->Size());
+    }
+    if(rxOverflows > 0)
+      m_log->warn("Receive queue full, dropped {} packets. ",rxOverflows);
+    if(rc != LIBUSB_SUCCESS) {
+      TransferComplete(data);
+      delete data;
+    }
+  }
+
+  //! Thread passing received packets to handlers.
+
+  void ComsUSBC::RunDispatch()
+  {
+#ifdef __linux__
+    if(m_config.m_dispatchCPU >= 0) {
+      cpu_set_t cpuSet;
+      CPU_ZERO(&cpuSet);
+      CPU_SET(m_config.m_dispatchCPU,&cpuSet);
+      int rc = pthread_setaffinity_np(pthread_self(),sizeof(cpuSet),&cpuSet);
+      if(rc != 0)
+        m_log->error("Failed to run dispatch thread on CPU {}, error {} ",m_config.m_dispatchCPU,rc);
+    }
+#endif
+    while(!m_rxTerminate) {
+      DataPacketT *frame = m_rxQueue->Front();
+      if(frame != nullptr) {
+        DispatchFrame(*frame);
+        m_rxQueue->PopFront();
+        continue;
+      }
+      // Say we're going to sleep, then check again in case data arrived before we did.
+      std::unique_lock<std::mutex> lock(m_accessRxWake);
+      m_rxSleeping = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(m_rxQueue->IsEmpty() && !m_rxTerminate)
+        m_rxWake.wait_for(lock,std::chrono::milliseconds(100));
+      m_rxSleeping = false;
+    }
+  }
+
+  //! Split an iso packet into its packets and process them.
+
+  void ComsUSBC::DispatchFrame(const DataPacketT &frame)
+  {
+    const uint8_t *pdata = frame.m_data;
+    int usbLen = frame.m_len;
+    int dat = 0;
+    while(dat < usbLen) {
+      int packetLen = pdata[dat++];
+      if(packetLen == 0) {
+        m_log->error("Zero packet length at {} ",dat);
+        break;
+      }
+      if(packetLen < 0 || packetLen > 15 || dat + packetLen > usbLen) {
+        m_log->error("Unexpected packet size at {} of {} ",dat,packetLen);
+        break;
+      }
+      ONDEBUG(m_log->info("Packet iso at {} Len:{} Type:{} ",dat,packetLen,(int) pdata[dat+1]));
+      ProcessPacket(const_cast<uint8_t *>(&pdata[dat]),packetLen);
+      dat += packetLen;
+    }
+    if(dat != usbLen) {
+      m_log->error("Packet boundary error. at {} of {} ",dat,usbLen);
+    }
+  }
+
+  //! Stop the dispatch thread.
+
+  void ComsUSBC::StopDispatch()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_accessRxWake);
+      m_rxTerminate = true;
+    }
+    m_rxWake.notify_all();
+    if(m_threadDispatch.joinable())
+      m_threadDispatch.join();
   }
 
   //! Process outgoing data complete
@@ -400,6 +608,12 @@ namespace DogBotN
   void ComsUSBC::ProcessOutTransferIso(USBTransferDataC *data)
   {
     TransferComplete(data);
+    {
+      std::lock_guard<std::mutex> lock(m_accessTx);
+      m_stats.m_outTransfers++;
+      if(data->Transfer()->status != LIBUSB_TRANSFER_COMPLETED)
+        m_stats.m_outErrors++;
+    }
     // If not open, just drop the packet.
     if(!data->IsForUSBDevice(m_handle)) {
       m_log->info("Dropping in transfer from old device. ");
@@ -413,6 +627,10 @@ namespace DogBotN
 
   void ComsUSBC::Init()
   {
+    m_txQueue.reset(new MPSCRingC<DataPacketT>(m_config.m_txQueueSize));
+    m_rxQueue.reset(new SPSCRingC<DataPacketT>(m_config.m_rxQueueSize));
+    m_threadDispatch = std::thread([this]{ RunDispatch(); });
+
     //putenv("LIBUSB_DEBUG=4");
     int r = libusb_init(&m_usbContext);
     if(r != 0) {
@@ -428,8 +646,8 @@ namespace DogBotN
           m_usbContext,
           (libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
           LIBUSB_HOTPLUG_ENUMERATE,
-          0x27d8,
-          0x16c0,
+          g_usbVendorId,
+          g_usbProductId,
           LIBUSB_HOTPLUG_MATCH_ANY,
           &coms_usb_hotplug_callback,
           this,
@@ -452,10 +670,12 @@ namespace DogBotN
   {
     m_log->debug("Close called.");
     m_terminate = true;
+    WakeUSBThread();
     if(!m_mutexExitOk.try_lock_for(std::chrono::milliseconds(500))) {
       m_log->error("Failed to shutdown receiver thread.");
     }
     m_threadUSB.join();
+    StopDispatch();
   }
 
   //! Is connection ready ?
@@ -479,7 +699,24 @@ namespace DogBotN
     m_log->debug("Running receiver.");
     int rc = 0;
     while(!m_terminate) {
-      if((rc = libusb_handle_events(m_usbContext)) < 0) {
+      // Send anything queued, then ask to be woken when more arrives. Check the queue
+      // again after setting the flag, as a packet may have been added before it was.
+      while(SendTxQueue(0)) ;
+      m_txWake = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(TxPending()) {
+        m_txWake = false;
+        continue;
+      }
+#if DOGBOT_USB_HAS_INTERRUPT
+      rc = libusb_handle_events(m_usbContext);
+#else
+      // Without a way of interrupting the event handler, poll once a frame.
+      struct timeval tv = { 0, 1000 };
+      rc = libusb_handle_events_timeout_completed(m_usbContext,&tv,nullptr);
+#endif
+      m_txWake = false;
+      if(rc < 0) {
         m_log->error("libusb_handle_events() failed: {}",libusb_error_name(rc));
       }
     }
@@ -492,58 +729,92 @@ namespace DogBotN
     return true;
   }
 
-  void ComsUSBC::SendTxQueue(USBTransferDataC *txBuffer)
+  //! Make the USB thread return from handling events.
+  void ComsUSBC::WakeUSBThread()
+  {
+#if DOGBOT_USB_HAS_INTERRUPT
+    if(m_usbContext != 0)
+      libusb_interrupt_event_handler(m_usbContext);
+#endif
+  }
+
+  //! Test if there are packets queued and a free transfer to send them with.
+  bool ComsUSBC::TxPending()
+  {
+    std::lock_guard<std::mutex> lock(m_accessTx);
+    return m_handle != 0 && !m_outDataFree.empty() && !m_txQueue->IsEmpty();
+  }
+
+  bool ComsUSBC::SendTxQueue(USBTransferDataC *txBuffer)
   {
     int at = 0;
 
     // Gather some data to send.
-    {
-      std::lock_guard<std::mutex> lock(m_accessTx);
-      if(m_handle == 0)
-        return ;
-      if(txBuffer == 0) {
-        if(m_txQueue.size() == 0)
-          return ; // Nothing to do.
-        if(m_outDataFree.empty()) {
-          //m_log->error("No free iso transmit buffers.");
-          return ;
-        }
-        txBuffer = m_outDataFree.back();
-        m_outDataFree.pop_back();
-        assert(txBuffer->Transfer() != 0);
-      } else {
-        if(m_txQueue.size() == 0) {
-          // Nothing to send, just return the buffer.
-          m_outDataFree.push_back(txBuffer);
-          return ;
-        }
+    std::lock_guard<std::mutex> lock(m_accessTx);
+    if(m_handle == 0) {
+      // Nowhere to send them, dump all packets from tx queue.
+      while(m_txQueue->Front() != nullptr)
+        m_txQueue->PopFront();
+      return false;
+    }
+    if(txBuffer == 0) {
+      if(m_txQueue->IsEmpty())
+        return false; // Nothing to do.
+      if(m_outDataFree.empty()) {
+        // Sent when a transfer completes.
+        return false;
       }
-
-      uint8_t *txData = txBuffer->Buffer();
-      while(!m_txQueue.empty() && at < 50) {
-        DataPacketT &packet = m_txQueue.front();
-        txData[at++] = packet.m_len;
-        memcpy(&txData[at],packet.m_data,packet.m_len);
-        at += packet.m_len;
-        m_txQueue.pop_front();
+      txBuffer = m_outDataFree.back();
+      m_outDataFree.pop_back();
+      assert(txBuffer->Transfer() != 0);
+    } else {
+      if(m_txQueue->IsEmpty()) {
+        // Nothing to send, just return the buffer.
+        m_outDataFree.push_back(txBuffer);
+        return false;
       }
     }
+    m_stats.m_txQueueMax = std::max(m_stats.m_txQueueMax,m_txQueue->Size());
+
+    // Pack queued packets into as many iso packets as the transfer has.
+    struct libusb_transfer *transfer = txBuffer->Transfer();
+    assert(transfer != 0);
+    uint8_t *txData = txBuffer->Buffer();
+    int isoPackets = 0;
+    int packetStart = 0;
+    DataPacketT *packet;
+    while(isoPackets < txBuffer->IsoPackets() && (packet = m_txQueue->Front()) != nullptr) {
+      if((at - packetStart) + 1 + packet->m_len > USBTransferDataC::IsoPacketSize) {
+        transfer->iso_packet_desc[isoPackets].actual_length = at - packetStart;
+        transfer->iso_packet_desc[isoPackets].length = at - packetStart;
+        isoPackets++;
+        packetStart = at;
+        continue;
+      }
+      txData[at++] = packet->m_len;
+      memcpy(&txData[at],packet->m_data,packet->m_len);
+      at += packet->m_len;
+      m_txQueue->PopFront();
+    }
+    if(at > packetStart) {
+      transfer->iso_packet_desc[isoPackets].actual_length = at - packetStart;
+      transfer->iso_packet_desc[isoPackets].length = at - packetStart;
+      isoPackets++;
+    }
 
     // Put the packet together and transfer it.
-    assert(txBuffer->Transfer() != 0);
-    txBuffer->Transfer()->num_iso_packets = 1;
-    txBuffer->Transfer()->iso_packet_desc[0].actual_length = at;
-    txBuffer->Transfer()->iso_packet_desc[0].length = at;
-    txBuffer->Transfer()->length = at;
-    int rc = libusb_submit_transfer(txBuffer->Transfer());
+    transfer->num_iso_packets = isoPackets;
+    transfer->length = at;
+    int rc = libusb_submit_transfer(transfer);
     if(rc != LIBUSB_SUCCESS) {
       m_log->error("Got error setting up output iso transfer. {} ",libusb_error_name(rc));
-      TransferComplete(txBuffer);
+      m_stats.m_outErrors++;
       m_outDataFree.push_back(txBuffer);
-    } else {
-      m_activeTransfers.push_back(txBuffer);
-      ONDEBUG(m_log->info("Output iso transfer setup ok. "));
+      return false;
     }
+    m_activeTransfers.push_back(txBuffer);
+    ONDEBUG(m_log->info("Output iso transfer setup ok. "));
+    return true;
   }
 
   //! Send packet
@@ -557,25 +828,21 @@ namespace DogBotN
       m_log->error("Dropping small packet.");
       return ;
     }
-    {
-      std::lock_guard<std::mutex> lock(m_accessTx);
-      // If not open, just drop the packet.
-      if(m_handle == 0)
-        return ;
-      // Is the queue too long ?
-      if(m_txQueue.size() > 32) {
-        m_log->error("Transmit queue to long, dropping packet. {} ",m_txQueue.size());
-        return ;
-      }
-      if(m_txQueue.size() > 24) {
-        m_log->warn("Transmit queue getting very long. {} ",m_txQueue.size());
-      }
-      m_txQueue.emplace_back();
-      DataPacketT &packet = m_txQueue.back();
-      packet.m_len = len;
-      memcpy(packet.m_data,buff,len);
+    // If not open, just drop the packet.
+    if(m_handle == 0)
+      return ;
+    DataPacketT packet;
+    packet.m_len = len;
+    memcpy(packet.m_data,buff,len);
+    if(!m_txQueue->Push(packet)) {
+      if(m_txDropped++ == 0)
+        m_log->error("Transmit queue full, dropping packets.");
+      return ;
     }
-    SendTxQueue(0);
+    // The USB thread packs and sends it, wake it if it is waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_txWake.load(std::memory_order_relaxed) && m_txWake.exchange(false))
+      WakeUSBThread();
   }
 
 }
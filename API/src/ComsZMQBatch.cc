@@ -0,0 +1,140 @@
+
+#include "dogbot/ComsZMQBatch.hh"
+#include <algorithm>
+
+namespace DogBotN {
+
+  const uint8_t ComsZMQBatcherC::ZMQBatchMarker;
+  const uint8_t ComsZMQBatcherC::ZMQTopicAnyDevice;
+  const int ComsZMQBatcherC::ZMQTopicSize;
+
+  //! Construct with function to send messages.
+  ComsZMQBatcherC::ComsZMQBatcherC(const std::function<void (zmq::message_t &msg)> &send,int flushUs,size_t maxBytes,bool topics)
+   : m_send(send),
+     m_flushWindow(flushUs),
+     m_maxBytes(std::max(maxBytes,(size_t) 66)),
+     m_topics(topics)
+  {
+    if(flushUs > 0)
+      m_threadFlush = std::thread([this]{ RunFlush(); });
+  }
+
+  //! Send anything waiting and stop.
+  ComsZMQBatcherC::~ComsZMQBatcherC()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_terminate = true;
+    }
+    m_wake.notify_all();
+    if(m_threadFlush.joinable())
+      m_threadFlush.join();
+    try {
+      Flush();
+    } catch(zmq::error_t &err) {
+      m_log->error("Caught exception sending last batch {} '{}' ",err.num(),err.what());
+    }
+  }
+
+  //! Queue a packet to send.
+  void ComsZMQBatcherC::Add(const uint8_t *data,int len)
+  {
+    if(len < 1)
+      return ;
+    std::lock_guard<std::mutex> lock(m_access);
+    int deviceId = ComsC::PacketDeviceId(data,len);
+    uint8_t topicDevice = (deviceId >= 0) ? (uint8_t) deviceId : ZMQTopicAnyDevice;
+    if(m_flushWindow.count() <= 0) {
+      int topicSize = m_topics ? ZMQTopicSize : 0;
+      zmq::message_t msg(topicSize + len);
+      uint8_t *at = (uint8_t *) msg.data();
+      if(m_topics) {
+        at[0] = data[0];
+        at[1] = topicDevice;
+      }
+      memcpy(at + topicSize,data,len);
+      m_send(msg);
+      m_stats.m_messages++;
+      m_stats.m_packets++;
+      return ;
+    }
+    BatchC &batch = m_batch;
+    // The topic gives the type of every packet in a batch, so a packet of
+    // another type has to wait for the next one. Send this one first to
+    // keep the packets in order.
+    if(!batch.m_data.empty() &&
+       ((m_topics && batch.m_data[0] != data[0]) || batch.m_data.size() + len + 1 > m_maxBytes))
+      SendBatch();
+    if(batch.m_data.empty()) {
+      if(m_topics) {
+        batch.m_data.push_back(data[0]);
+        batch.m_data.push_back(topicDevice);
+      }
+      batch.m_data.push_back(ZMQBatchMarker);
+      m_wake.notify_all();
+    } else if(m_topics && batch.m_data[1] != topicDevice) {
+      batch.m_data[1] = ZMQTopicAnyDevice;
+    }
+    batch.m_data.push_back((uint8_t) len);
+    batch.m_data.insert(batch.m_data.end(),data,data + len);
+    batch.m_arrived.push_back(ClockT::now());
+  }
+
+  //! Send anything waiting now.
+  void ComsZMQBatcherC::Flush()
+  {
+    std::lock_guard<std::mutex> lock(m_access);
+    SendBatch();
+  }
+
+  //! Get a copy of the counters.
+  ComsZMQBatchStatsC ComsZMQBatcherC::Stats()
+  {
+    std::lock_guard<std::mutex> lock(m_access);
+    return m_stats;
+  }
+
+  //! Send the waiting batch, m_access must be locked.
+  void ComsZMQBatcherC::SendBatch()
+  {
+    BatchC &batch = m_batch;
+    if(batch.m_data.empty())
+      return ;
+    zmq::message_t msg(batch.m_data.size());
+    memcpy(msg.data(),batch.m_data.data(),batch.m_data.size());
+    ClockT::time_point now = ClockT::now();
+    for(auto &a : batch.m_arrived) {
+      double delay = std::chrono::duration<double,std::micro>(now - a).count();
+      m_stats.m_totalDelayUs += delay;
+      m_stats.m_maxDelayUs = std::max(m_stats.m_maxDelayUs,delay);
+    }
+    m_stats.m_messages++;
+    m_stats.m_packets += batch.m_arrived.size();
+    batch.m_data.clear();
+    batch.m_arrived.clear();
+    m_send(msg);
+  }
+
+  //! Thread sending batches when their flush window ends.
+  void ComsZMQBatcherC::RunFlush()
+  {
+    std::unique_lock<std::mutex> lock(m_access);
+    while(!m_terminate) {
+      if(m_batch.m_data.empty()) {
+        m_wake.wait(lock);
+        continue;
+      }
+      ClockT::time_point flushAt = m_batch.m_arrived.front() + m_flushWindow;
+      if(ClockT::now() < flushAt) {
+        m_wake.wait_until(lock,flushAt);
+        continue;
+      }
+      try {
+        SendBatch();
+      } catch(zmq::error_t &err) {
+        m_log->error("Caught exception sending batch {} '{}' ",err.num(),err.what());
+      }
+    }
+  }
+
+}
@@ -27,6 +27,11 @@ namespace DogBotN
 
     ComsC::Close();
 
+    {
+      std::lock_guard<std::mutex> lock(m_accessTx);
+      m_batcher.reset();
+    }
+
     if(!m_mutexExitOk.try_lock_for(std::chrono::milliseconds(1000))) {
       m_log->error("Failed to shutdown receiver thread.");
     }
@@ -50,17 +55,30 @@ namespace DogBotN
     }
     if(m_terminate)
       return false;
+    m_subscriptionsChanged = true;
+    std::string commands,state;
+    if(!ZMQEndpoints(portAddr,false,commands,state)) {
+      m_log->error("Don't know how to connect to '{}' ",portAddr);
+      m_mutexExitOk.unlock();
+      return false;
+    }
     try {
       {
         std::lock_guard<std::mutex> lock(m_accessTx);
         m_client = std::make_shared<zmq::socket_t>(g_zmqContext,ZMQ_PUSH);
-        m_client->connect ("tcp://127.0.0.1:7200");
+        m_client->connect (commands);
         m_client->setsockopt(ZMQ_SNDTIMEO,500);
+        std::shared_ptr<zmq::socket_t> client = m_client;
+        m_batcher = std::make_shared<ComsZMQBatcherC>([this,client](zmq::message_t &msg) {
+            if(!client->send(msg))
+              m_log->warn("Timeout sending message. ");
+          },m_batchFlushUs,m_batchMaxBytes);
       }
 
-      m_threadRecieve = std::move(std::thread { [this]{ RunRecieve(); } });
+      m_threadRecieve = std::move(std::thread { [this,state]{ RunRecieve(state); } });
     } catch(zmq::error_t &err) {
-      m_log->error("Caught exception in opening port '%s'  Error: %d '%s' ",portAddr.c_str(),err.num(),err.what());
+      m_log->error("Caught exception in opening port '{}'  Error: {} '{}' ",portAddr,err.num(),err.what());
+      m_mutexExitOk.unlock();
       return false;
     }
     return true;
@@ -69,22 +87,26 @@ namespace DogBotN
 
   //! Process received packet.
 
-  bool ComsZMQClientC::RunRecieve()
+  bool ComsZMQClientC::RunRecieve(const std::string &stateEndpoint)
   {
     m_log->debug("Running receiver. ");
 
     std::shared_ptr<zmq::socket_t> sub = std::make_shared<zmq::socket_t>(g_zmqContext,ZMQ_SUB);
-    sub->connect ("tcp://127.0.0.1:7201");
-    sub->setsockopt(ZMQ_SUBSCRIBE,0,0);
-    sub->setsockopt(ZMQ_RCVTIMEO,500);
+    sub->connect (stateEndpoint);
+    // Short enough that new subscriptions take effect promptly.
+    sub->setsockopt(ZMQ_RCVTIMEO,50);
+    std::set<std::string> subscribed;
     try {
       while(!m_terminate) {
+        if(m_subscriptionsChanged.exchange(false))
+          UpdateSubscriptions(*sub,subscribed);
         //bool socket_t::recv(message_t *msg, int flags = 0);
         zmq::message_t msg;
         if(!sub->recv(&msg,0))
           continue;
         //m_log->info("Client got msg.");
-        ProcessPacket((uint8_t*)msg.data(),msg.size());
+        if(!ComsZMQBatcherC::Unpack(msg,[this](uint8_t *data,int len) { ProcessPacket(data,len); },true))
+          m_log->error("Corrupt batch received. ");
       }
     } catch(zmq::error_t &err) {
       m_log->error("Caught exception in receive thread %d '%s' ",err.num(),err.what());
@@ -96,6 +118,107 @@ namespace DogBotN
     return true;
   }
 
+  //! Receive packets of type 'packetType' from device 'deviceId', or from every device if it's negative.
+  void ComsZMQClientC::Subscribe(ComsPacketTypeT packetType,int deviceId)
+  {
+    std::lock_guard<std::mutex> lock(m_accessSubscriptions);
+    std::string topic(1,(char) packetType);
+    if(deviceId >= 0)
+      topic += (char) deviceId;
+    m_explicitTopics.insert(topic);
+    m_subscriptionsChanged = true;
+  }
+
+  //! Remove a subscription made with Subscribe().
+  void ComsZMQClientC::Unsubscribe(ComsPacketTypeT packetType,int deviceId)
+  {
+    std::lock_guard<std::mutex> lock(m_accessSubscriptions);
+    std::string topic(1,(char) packetType);
+    if(deviceId >= 0)
+      topic += (char) deviceId;
+    m_explicitTopics.erase(topic);
+    m_subscriptionsChanged = true;
+  }
+
+  //! Subscribe to each packet type when a handler is first registered for it.
+  void ComsZMQClientC::SetAutoSubscribe(bool enable)
+  {
+    std::lock_guard<std::mutex> lock(m_accessSubscriptions);
+    m_autoSubscribe = enable;
+    m_subscriptionsChanged = true;
+  }
+
+  //! Called when handlers are added or removed.
+  void ComsZMQClientC::HandlersChanged(const HandlerTableC &table)
+  {
+    std::lock_guard<std::mutex> lock(m_accessSubscriptions);
+    // Types stay subscribed once they've had a handler, handlers are often
+    // registered just for the length of a request and the subscription takes
+    // a moment to reach the server.
+    for(size_t i = 0;i < table.m_packetHandler.size();i++) {
+      if(m_handlerTypes[i])
+        continue;
+      for(auto &a : table.m_packetHandler[i]) {
+        if(a) {
+          m_handlerTypes[i] = true;
+          m_subscriptionsChanged = true;
+          break;
+        }
+      }
+    }
+    bool generic = false;
+    for(auto &a : table.m_genericHandler)
+      if(a) generic = true;
+    if(generic != m_genericHandler) {
+      m_genericHandler = generic;
+      m_subscriptionsChanged = true;
+    }
+  }
+
+  //! Topics the receiver should be subscribed to, m_accessSubscriptions must be locked.
+  std::set<std::string> ComsZMQClientC::WantedTopics() const
+  {
+    std::set<std::string> topics;
+    if(m_autoSubscribe && m_genericHandler && m_explicitTopics.empty()) {
+      topics.insert(std::string());
+      return topics;
+    }
+    // Replies to requests we might make.
+    const ComsPacketTypeT replies[] = { CPT_ReportParam, CPT_Error, CPT_Pong, CPT_FlashCmdResult, CPT_FlashChecksumResult };
+    for(auto a : replies)
+      topics.insert(std::string(1,(char) a));
+    for(auto &a : m_explicitTopics) {
+      topics.insert(a);
+      // Batches from several devices are published with a topic for any device.
+      if(a.size() > 1)
+        topics.insert(std::string(1,a[0]) + (char) ComsZMQBatcherC::ZMQTopicAnyDevice);
+    }
+    if(m_autoSubscribe) {
+      for(size_t i = 0;i < m_handlerTypes.size();i++)
+        if(m_handlerTypes[i])
+          topics.insert(std::string(1,(char) i));
+    }
+    return topics;
+  }
+
+  //! Bring the subscriptions on 'sub' up to date, called from the receive thread.
+  void ComsZMQClientC::UpdateSubscriptions(zmq::socket_t &sub,std::set<std::string> &subscribed)
+  {
+    std::set<std::string> wanted;
+    {
+      std::lock_guard<std::mutex> lock(m_accessSubscriptions);
+      wanted = WantedTopics();
+    }
+    for(auto &a : subscribed)
+      if(wanted.find(a) == wanted.end())
+        sub.setsockopt(ZMQ_UNSUBSCRIBE,a.data(),a.size());
+    for(auto &a : wanted)
+      if(subscribed.find(a) == subscribed.end())
+        sub.setsockopt(ZMQ_SUBSCRIBE,a.data(),a.size());
+    m_log->debug("Subscribed to {} topics. ",wanted.size());
+    subscribed = wanted;
+  }
+
   //! Send packet
   void ComsZMQClientC::SendPacket(const uint8_t *buff,int len)
   {
@@ -103,14 +226,21 @@ namespace DogBotN
       return ; // Drop packets if we're terminating.
     try {
       std::lock_guard<std::mutex> lock(m_accessTx);
-      zmq::message_t msg (len);
-      memcpy (msg.data (), buff, len);
-      if(!m_client->send (msg)) {
-        m_log->warn("Timeout sending message. ");
-      }
+      if(!m_batcher)
+        return ;
+      m_batcher->Add(buff,len);
     } catch(zmq::error_t &err) {
       m_log->error("Caught exception in transmit thread %d '%s' ",err.num(),err.what());
     }
   }
 
+  //! Get counters for messages sent.
+  ComsZMQBatchStatsC ComsZMQClientC::BatchStats()
+  {
+    std::lock_guard<std::mutex> lock(m_accessTx);
+    if(!m_batcher)
+      return ComsZMQBatchStatsC();
+    return m_batcher->Stats();
+  }
+
 }
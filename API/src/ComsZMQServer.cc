@@ -23,20 +23,71 @@ namespace DogBotN {
 
   }
 
+  //! Get counters for published messages.
+  ComsZMQBatchStatsC ComsZMQServerC::BatchStats()
+  {
+    std::lock_guard<std::mutex> lock(m_accessBatcher);
+    if(!m_batcher)
+      return ComsZMQBatchStatsC();
+    return m_batcher->Stats();
+  }
+
+  //! Log the rate messages are published at and the delay batching adds.
+  void ComsZMQServerC::LogBatchStats()
+  {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - m_lastStatsTime).count();
+    if(elapsed < 10.0)
+      return ;
+    ComsZMQBatchStatsC stats = BatchStats();
+    uint64_t packets = stats.m_packets - m_lastStats.m_packets;
+    uint64_t messages = stats.m_messages - m_lastStats.m_messages;
+    double meanDelay = packets > 0 ? (stats.m_totalDelayUs - m_lastStats.m_totalDelayUs) / packets : 0;
+    m_log->info("Published {:.1f} packets/s in {:.1f} messages/s, mean batching delay {:.1f} us, max {:.1f} us ",
+                packets / elapsed,messages / elapsed,meanDelay,stats.m_maxDelayUs);
+    m_lastStats = stats;
+    m_lastStatsTime = now;
+  }
+
   //! Run server
   void ComsZMQServerC::Run(const std::string &addr)
   {
 
     std::shared_ptr<zmq::socket_t>  zserver = std::make_shared<zmq::socket_t>(g_zmqContext,ZMQ_PULL);
-    zserver->bind ("tcp://*:7200");
     zserver->setsockopt(ZMQ_RCVTIMEO,500);
 
     // Publish state messages
     std::shared_ptr<zmq::socket_t> zpub = std::make_shared<zmq::socket_t>(g_zmqContext,ZMQ_PUB);
-    zpub->bind ("tcp://*:7201");
     zpub->setsockopt(ZMQ_SNDTIMEO,500);
 
-    m_genericHandlerId = m_coms->SetGenericHandler([this,zpub](uint8_t *data,int len) mutable
+    // The same sockets can serve clients over several transports at once.
+    for(auto &a : ZMQSplitAddresses(addr)) {
+      std::string commands,state;
+      if(!ZMQEndpoints(a,true,commands,state)) {
+        m_log->error("Don't know how to serve on '{}' ",a);
+        continue;
+      }
+      try {
+        zserver->bind(commands);
+        zpub->bind(state);
+      } catch(zmq::error_t &err) {
+        m_log->error("Failed to bind to '{}', {} '{}' ",a,err.num(),err.what());
+        continue;
+      }
+      m_log->info("Serving clients on {} and {} ",commands,state);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_accessBatcher);
+      m_batcher = std::make_shared<ComsZMQBatcherC>([zpub](zmq::message_t &msg) { zpub->send(msg); },m_batchFlushUs,m_batchMaxBytes,true);
+    }
+    std::shared_ptr<ComsZMQBatcherC> batcher = m_batcher;
+    m_lastStats = ComsZMQBatchStatsC();
+    m_lastStatsTime = std::chrono::steady_clock::now();
+    if(m_batchFlushUs > 0)
+      m_log->info("Batching published packets for up to {} us, {} bytes ",m_batchFlushUs,m_batchMaxBytes);
+
+    m_genericHandlerId = m_coms->SetGenericHandler([this,batcher](uint8_t *data,int len) mutable
                               {
                                 ComsPacketTypeT cpt = (ComsPacketTypeT)data[0];
                                 switch(cpt)
@@ -61,9 +112,7 @@ namespace DogBotN {
                                   break;
                                 }
                                 try {
-                                  zmq::message_t msg (len);
-                                  memcpy (msg.data (), data, len);
-                                  zpub->send(msg);
+                                  batcher->Add(data,len);
                                 } catch(zmq::error_t &err) {
                                   m_log->error("Caught exception forwarding message %d '%s' ",err.num(),err.what());
                                 }
@@ -73,6 +122,8 @@ namespace DogBotN {
     m_log->info("Server run loop started.");
     try {
       while(!m_terminate) {
+        if(m_batchFlushUs > 0)
+          LogBatchStats();
         zmq::message_t msg;
         if(!zserver->recv(&msg,0)) {
           if(m_verbose) {
@@ -83,7 +134,8 @@ namespace DogBotN {
         if(m_verbose) {
           m_log->info("Server got msg.");
         }
-        m_coms->SendPacket((uint8_t *) msg.data(),msg.size());
+        if(!ComsZMQBatcherC::Unpack(msg,[this](uint8_t *data,int len) { m_coms->SendPacket(data,len); }))
+          m_log->error("Corrupt batch received. ");
       }
     } catch(zmq::error_t &err) {
       m_log->error("Caught exception run thread %d '%s' ",err.num(),err.what());
@@ -93,6 +145,11 @@ namespace DogBotN {
     // Remove handler with reference to this instance.
     m_coms->RemoveGenericHandler(m_genericHandlerId);
     m_genericHandlerId = -1;
+    batcher.reset();
+    {
+      std::lock_guard<std::mutex> lock(m_accessBatcher);
+      m_batcher.reset();
+    }
 
     m_log->info("Server finished.");
   }
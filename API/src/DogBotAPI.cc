@@ -3,7 +3,12 @@
 #include "dogbot/protocol.h"
 #include "dogbot/ComsSerial.hh"
 #include "dogbot/ComsZMQClient.hh"
+#include "dogbot/ZMQContext.hh"
 #include "dogbot/ComsUSB.hh"
+#include "dogbot/ComsMultiUSB.hh"
+#include "dogbot/ComsShm.hh"
+#include "dogbot/ComsReplay.hh"
+#include "dogbot/ComsSim.hh"
 #include "dogbot/Joint4BarLinkage.hh"
 #include "dogbot/JointRelative.hh"
 #include <fstream>
@@ -114,6 +119,7 @@ namespace DogBotN {
       case CET_BootLoaderBusy: return "BootLoader busy";
       case CET_BootLoaderWriteFailed: return "BootLoader write failed";
       case CET_BootLoaderUnalignedAddress: return "BootLoader unaligned address";
+      case CET_BootLoaderCorruptData: return "BootLoader corrupt data";
     }
     printf("Unexpected error code %d",(int)errorCode);
     return "Invalid";
@@ -151,6 +157,9 @@ namespace DogBotN {
       case CPT_FlashData: return "FlashData";
       case CPT_FlashWrite: return "FlashWrite";
       case CPT_FlashRead: return "FlashRead";
+      case CPT_FlashWriteCompressed: return "FlashWriteCompressed";
+      case CPT_SerialFraming: return "SerialFraming";
+      case CPT_FlashCRC32: return "FlashCRC32";
     }
     printf("Unexpected packet type %d",(int)packetType);
     return "Invalid";
@@ -227,12 +236,28 @@ namespace DogBotN {
   bool DogBotAPIC::Connect(const std::string &name)
   {
     m_deviceName = name;
-    if(name == "local") {
-      m_coms = std::make_shared<ComsZMQClientC>("tcp://127.0.0.1");
+    if(IsZMQAddress(name)) {
+      m_coms = std::make_shared<ComsZMQClientC>();
       if(m_deviceManagerMode == DMM_Auto)
         m_deviceManagerMode = DMM_ClientOnly;
-    } else if(name == "usb") {
-      m_coms = std::make_shared<ComsUSBC>();
+    } else if(ComsShmRegionC::IsShmAddress(name)) {
+      m_coms = std::make_shared<ComsShmC>();
+      if(m_deviceManagerMode == DMM_Auto)
+        m_deviceManagerMode = DMM_ClientOnly;
+    } else if(ComsReplayC::IsReplayAddress(name)) {
+      m_coms = std::make_shared<ComsReplayC>();
+      if(m_deviceManagerMode == DMM_Auto)
+        m_deviceManagerMode = DMM_ClientOnly;
+    } else if(ComsSimC::IsSimAddress(name)) {
+      m_coms = std::make_shared<ComsSimC>();
+      if(m_deviceManagerMode == DMM_Auto)
+        m_deviceManagerMode = DMM_DeviceManager;
+    } else if(ComsUSBTransferConfigC().Parse(name)) {
+      m_coms = std::make_shared<ComsUSBC>(ComsUSBTransferConfigC(name));
+      if(m_deviceManagerMode == DMM_Auto)
+        m_deviceManagerMode = DMM_DeviceManager;
+    } else if(ComsMultiUSBC::IsMultiUSBName(name)) {
+      m_coms = std::make_shared<ComsMultiUSBC>();
       if(m_deviceManagerMode == DMM_Auto)
         m_deviceManagerMode = DMM_DeviceManager;
     } else {
@@ -383,7 +408,7 @@ namespace DogBotN {
     if(m_deviceName.empty())
       m_deviceName = m_configRoot.get("device","usb").asString();
     if(m_deviceManagerMode == DMM_Auto && !m_deviceName.empty()) {
-      if(m_deviceName == "local") {
+      if(IsZMQAddress(m_deviceName) || ComsShmRegionC::IsShmAddress(m_deviceName) || ComsReplayC::IsReplayAddress(m_deviceName)) {
         m_deviceManagerMode = DMM_ClientOnly;
       } else {
         m_deviceManagerMode = DMM_DeviceManager;
@@ -1,11 +1,14 @@
 
 #include "dogbot/FirmwareUpdate.hh"
+#include "dogbot/ComsParamEngine.hh"
 #include "dogbot/protocol.h"
+#include "dogbot/flashlz.h"
 #include <cassert>
 #include <string.h>
 #include <fstream>
 #include <algorithm>
 #include <condition_variable>
+#include <thread>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -53,60 +56,382 @@ namespace DogBotN {
    : m_coms(coms)
   {}
 
-  //! Wait for result.
-  bool FirmwareUpdateC::WaitForResult(uint8_t seqNo,const std::string &op)
+  //! Find state for a device, returns null if it isn't part of the update.
+  FirmwareUpdateC::DeviceStateC *FirmwareUpdateC::FindDevice(int deviceId)
+  {
+    auto it = m_devices.find(deviceId);
+    if(it != m_devices.end())
+      return &it->second;
+    // A single target of 0 takes replies from whichever device answers.
+    if(m_devices.size() == 1 && m_devices.begin()->first == 0)
+      return &m_devices.begin()->second;
+    return nullptr;
+  }
+
+  //! Clear results from all devices, ready for a new command.
+  void FirmwareUpdateC::ClearResults()
+  {
+    std::lock_guard<std::mutex> lk(m_mutexResult);
+    for(auto &a : m_devices) {
+      a.second.m_gotResult = false;
+      a.second.m_gotCheckSum = false;
+      a.second.m_lostSequence = false;
+    }
+  }
+
+  //! Wait for a result with the given sequence number from all devices.
+  bool FirmwareUpdateC::WaitForResult(uint8_t seqNo,const std::string &op,int timeoutMs)
   {
     //m_log->info("Waiting for seq {} for op '{}' ",(int) seqNo,op);
     using Ms = std::chrono::milliseconds;
     std::unique_lock<std::mutex> lk(m_mutexResult);
-    if(!m_condVar.wait_for(lk,Ms(2000),[&]{
-      //m_log->info("Got Notify Result:{} ",m_gotResult);
-      return m_gotResult;
+    if(!m_condVar.wait_for(lk,Ms(timeoutMs),[&]{
+      for(auto &a : m_devices) {
+        if(!a.second.m_gotResult && !a.second.m_error)
+          return false;
+      }
+      return true;
     })) {
-      m_log->error("Timeout waiting for op '{}'.",op);
+      for(auto &a : m_devices) {
+        if(!a.second.m_gotResult)
+          m_log->error("Timeout waiting for device {} for op '{}'.",a.first,op);
+      }
       return false;
     }
-    m_gotResult = false;
-    if(m_pktResult.m_rxSequence != seqNo) {
-      m_log->warn("Got seq {} (expected {}) , and result {} for op '{}' ",(int) m_pktResult.m_rxSequence,(int) seqNo,(int) m_pktResult.m_result,op);
+    bool ret = true;
+    for(auto &a : m_devices) {
+      DeviceStateC &dev = a.second;
+      if(dev.m_error) {
+        m_log->error("Device {} reported an error for op '{}'.",a.first,op);
+        ret = false;
+        continue;
+      }
+      dev.m_gotResult = false;
+      if(dev.m_result.m_rxSequence != seqNo) {
+        m_log->warn("Got seq {} (expected {}) , and result {} for op '{}' from device {} ",(int) dev.m_result.m_rxSequence,(int) seqNo,(int) dev.m_result.m_result,op,a.first);
+        ret = false;
+      }
     }
-    return m_pktResult.m_rxSequence == seqNo;
+    return ret;
+  }
+
+  //! Set the number of data packets allowed in flight before waiting for an acknowledge.
+  void FirmwareUpdateC::SetWindowSize(int packets)
+  {
+    if(packets < BOOTLOADER_ACK_LIMIT)
+      packets = BOOTLOADER_ACK_LIMIT;
+    if(packets > 127)
+      packets = 127;
+    m_windowSize = packets;
   }
 
   //! Write data to flash
-  bool FirmwareUpdateC::WriteFlash(uint8_t targetDevice,uint32_t targetAddress,uint8_t *data,uint32_t size)
+  //! Data packets are sent with a sliding window, the boot-loaders acknowledge
+  //! them cumulatively and report the sequence number they are waiting for if
+  //! they see a gap.  When updating several devices at once the data is broadcast,
+  //! and a device that misses some has them resent to it alone until it catches up.
+
+  bool FirmwareUpdateC::WriteFlash(uint32_t targetAddress,uint8_t *data,uint32_t size)
   {
+    using Ms = std::chrono::milliseconds;
+
     uint16_t blockSize = size;
     uint8_t *blockBuffer = data;
-    SendBootLoaderBeginWrite(targetDevice,++m_seqNo,targetAddress,blockSize);
-
-    WaitForResult(m_seqNo,"write");
-
-    // Send data.
-    int at = 0;
-    while(at < blockSize) {
-      for(int i = 0;i < 8 && at < blockSize;i++) {
-        int len = 7;
-        int nextAt = at+len;
-        if(nextAt > blockSize) {
-          len = blockSize - at;
-          nextAt = blockSize;
+    std::vector<uint8_t> compressed;
+    if(m_useCompression) {
+      compressed = Compress(data,size);
+      if(compressed.size() < size) {
+        blockSize = compressed.size();
+        blockBuffer = compressed.data();
+      } else {
+        compressed.clear();
+      }
+    }
+    m_bytesSent += blockSize;
+
+    ClearResults();
+    SendBootLoaderBeginWrite(m_sendAddress,++m_seqNo,targetAddress,size,!compressed.empty());
+
+    if(!WaitForResult(m_seqNo,"write"))
+      return false;
+
+    const int packetCount = (blockSize + 6) / 7;
+    const uint8_t firstSeq = m_seqNo + 1;
+    int sent = 0;   // Packets sent to all devices.
+
+    std::unique_lock<std::mutex> lk(m_mutexResult);
+    for(auto &a : m_devices) {
+      DeviceStateC &dev = a.second;
+      dev.m_acked = 0;
+      dev.m_next = 0;
+      dev.m_resendFrom = -1;
+      dev.m_retries = 0;
+      dev.m_gotResult = false;
+      dev.m_lostSequence = false;
+    }
+
+    std::vector<std::pair<uint8_t,int> > toSend;
+    while(true) {
+      int minAcked = packetCount;
+      for(auto &a : m_devices)
+        minAcked = std::min(minAcked,a.second.m_acked);
+      if(minAcked >= packetCount)
+        break;
+
+      // Bring any device that has fallen behind back up to the rest.
+      toSend.clear();
+      for(auto &a : m_devices) {
+        DeviceStateC &dev = a.second;
+        for(;dev.m_next < sent && (dev.m_next - dev.m_acked) < m_windowSize;dev.m_next++) {
+          toSend.push_back(std::pair<uint8_t,int>(a.first,dev.m_next));
+          m_retransmitCount++;
         }
-        SendBootLoaderData(targetDevice,++m_seqNo,&blockBuffer[at],len);
-        //m_log->info("Seq {}, Sent {} data bytes.",(int) m_seqNo,len);
-        at = nextAt;
       }
-      // Wait for ack.
-      //m_log->info("Waiting for data ack. seq {} ",m_seqNo);
-      if(!WaitForResult(m_seqNo,"data")) {
-        m_log->error("Failed to get data ack..");
+
+      // Move the window along for everyone.
+      int oldSent = sent;
+      for(;sent < packetCount && (sent - minAcked) < m_windowSize;sent++)
+        toSend.push_back(std::pair<uint8_t,int>(m_sendAddress,sent));
+      for(auto &a : m_devices) {
+        if(a.second.m_next == oldSent)
+          a.second.m_next = sent;
+      }
+
+      lk.unlock();
+      for(auto &a : toSend) {
+        int at = a.second * 7;
+        int len = std::min(7,blockSize - at);
+        SendBootLoaderData(a.first,(uint8_t) (firstSeq + a.second),&blockBuffer[at],len);
+      }
+      lk.lock();
+
+      if(!m_condVar.wait_for(lk,Ms(m_dataTimeout),[&]{
+        for(auto &a : m_devices) {
+          const DeviceStateC &dev = a.second;
+          if(dev.m_gotResult || dev.m_lostSequence || dev.m_error)
+            return true;
+        }
+        return m_flagError;
+      })) {
+        // Resend everything that hasn't been acknowledged.
+        for(auto &a : m_devices) {
+          DeviceStateC &dev = a.second;
+          if(dev.m_acked >= sent)
+            continue;
+          if(++dev.m_retries > m_maxRetries) {
+            m_log->error("Timeout waiting for data ack from device {} at packet {} of {}. ",a.first,dev.m_acked,packetCount);
+            return false;
+          }
+          dev.m_next = dev.m_acked;
+          dev.m_resendFrom = dev.m_acked;
+        }
+        continue;
+      }
+      if(m_flagError) {
+        m_log->error("Error while writing data.");
         return false;
       }
+
+      for(auto &a : m_devices) {
+        DeviceStateC &dev = a.second;
+        if(dev.m_error) {
+          m_log->error("Device {} reported an error while writing data.",a.first);
+          return false;
+        }
+        const uint8_t ackedSeq = firstSeq + dev.m_acked;
+        if(dev.m_gotResult) {
+          dev.m_gotResult = false;
+          if(dev.m_result.m_result == FOS_DataAck || dev.m_result.m_result == FOS_WriteComplete) {
+            int offset = (uint8_t) (dev.m_result.m_rxSequence - ackedSeq);
+            if(offset < dev.m_next - dev.m_acked) {
+              dev.m_acked += offset + 1;
+              dev.m_retries = 0;
+            }
+          }
+        }
+        if(dev.m_lostSequence) {
+          dev.m_lostSequence = false;
+          int offset = (uint8_t) (dev.m_lostSequenceExpected - ackedSeq);
+          int from = dev.m_acked + offset;
+          // Ignore repeated reports for a point we've already gone back to.
+          if(offset < dev.m_next - dev.m_acked && from != dev.m_resendFrom) {
+            if(++dev.m_retries > m_maxRetries) {
+              m_log->error("Too many lost packets writing data to device {}. ",a.first);
+              return false;
+            }
+            dev.m_acked = from;
+            dev.m_next = from;
+            dev.m_resendFrom = from;
+          }
+        }
+      }
     }
 
+    m_seqNo = firstSeq + packetCount - 1;
     return true;
   }
 
+  //! Checksum of what the loaded image puts in an area of flash, taking
+  //! anything outside the image as erased. Either the byte sum or, if 'crc'
+  //! is set, the CRC-32 computed by the boot-loader.
+  uint32_t FirmwareUpdateC::ImageCheckSum(uint32_t address,uint32_t len,bool crc) const
+  {
+    const uint32_t end = address + len;
+    std::vector<uint8_t> area(len,0xff);
+    for(auto &block : m_dataMap) {
+      uint32_t blockStart = std::max(block.first,address);
+      uint32_t blockEnd = std::min(block.first + (uint32_t) block.second.size(),end);
+      for(uint32_t at = blockStart;at < blockEnd;at++)
+        area[at - address] = block.second[at - block.first];
+    }
+    uint32_t sum = 0;
+    if(!crc) {
+      for(auto a : area)
+        sum += a;
+      return sum;
+    }
+    // Standard CRC-32 (reflected, polynomial 0xEDB88320), as BootLoaderSumArea() in flashops.cpp
+    sum = 0xFFFFFFFF;
+    for(auto a : area) {
+      sum ^= a;
+      for(int b = 0;b < 8;b++)
+        sum = (sum >> 1) ^ (0xEDB88320 & (0 - (sum & 1)));
+    }
+    return ~sum;
+  }
+
+  //! Ask every device for the checksum of an area of flash and compare it with the image.
+  bool FirmwareUpdateC::CheckFlash(uint32_t address,uint16_t len,bool quiet)
+  {
+    using Ms = std::chrono::milliseconds;
+
+    uint32_t sum = ImageCheckSum(address,len,m_useCRC);
+    ClearResults();
+    uint8_t seqNo = ++m_seqNo;
+    SendBootLoaderCheckSum(m_sendAddress,seqNo,address,len,m_useCRC);
+
+    std::unique_lock<std::mutex> lk(m_mutexResult);
+    m_condVar.wait_for(lk,Ms(2000),[&]{
+      for(auto &a : m_devices) {
+        if(!a.second.m_gotCheckSum && !a.second.m_error)
+          return false;
+      }
+      return true;
+    });
+    bool ret = true;
+    for(auto &a : m_devices) {
+      DeviceStateC &dev = a.second;
+      if(!dev.m_gotCheckSum || dev.m_checkSum.m_sequenceNumber != seqNo) {
+        m_log->error("No checksum from device {} for {:08X} ",a.first,address);
+        ret = false;
+      } else if(dev.m_checkSum.m_sum != sum) {
+        if(!quiet)
+          m_log->error("Checksum mismatch on device {} for {:08X} Len:{:04X} ",a.first,address,len);
+        ret = false;
+      }
+    }
+    return ret;
+  }
+
+  //! Check the flash contents of every device against the loaded image.
+  bool FirmwareUpdateC::VerifyFlash()
+  {
+    bool ret = true;
+    for(auto &block : m_dataMap) {
+      const std::vector<uint8_t> &data = block.second;
+      for(uint32_t at = 0;at < data.size();) {
+        uint32_t len = std::min((uint32_t) data.size() - at,(uint32_t) 0x8000);
+        if(!CheckFlash(block.first + at,len))
+          ret = false;
+        at += len;
+      }
+    }
+    return ret;
+  }
+
+
+  //! Compress a block of data into the format described in flashlz.h
+  //! This is a greedy LZ77 match finder with hash chains, checking one byte
+  //! ahead for a longer match before committing.
+
+  std::vector<uint8_t> FirmwareUpdateC::Compress(const uint8_t *data,size_t len)
+  {
+    const int hashBits = 12;
+    const int maxChain = 256;
+    std::vector<uint8_t> out;
+    std::vector<int> head(1 << hashBits,-1);
+    std::vector<int> prev(len,-1);
+
+    auto hash = [&](size_t at) -> int {
+      uint32_t value = data[at] | (data[at+1] << 8) | (data[at+2] << 16) | ((uint32_t) data[at+3] << 24);
+      return (value * 2654435761u) >> (32 - hashBits);
+    };
+    auto insert = [&](size_t at) {
+      if(at + FLASHLZ_MIN_MATCH > len)
+        return;
+      int h = hash(at);
+      prev[at] = head[h];
+      head[h] = at;
+    };
+    auto findMatch = [&](size_t at,size_t &bestDistance) -> size_t {
+      if(at + FLASHLZ_MIN_MATCH > len)
+        return 0;
+      size_t maxLen = std::min((size_t) FLASHLZ_MAX_MATCH,len - at);
+      size_t best = 0;
+      int chain = maxChain;
+      for(int cand = head[hash(at)];cand >= 0 && chain-- > 0;cand = prev[cand]) {
+        size_t distance = at - cand;
+        if(distance > FLASHLZ_MAX_DISTANCE)
+          break;
+        size_t matchLen = 0;
+        while(matchLen < maxLen && data[cand + matchLen] == data[at + matchLen])
+          matchLen++;
+        if(matchLen > best) {
+          best = matchLen;
+          bestDistance = distance;
+          if(matchLen == maxLen)
+            break;
+        }
+      }
+      return best >= FLASHLZ_MIN_MATCH ? best : 0;
+    };
+
+    size_t literalStart = 0;
+    auto flushLiterals = [&](size_t end) {
+      while(literalStart < end) {
+        size_t n = std::min(end - literalStart,(size_t) FLASHLZ_MAX_LITERAL);
+        out.push_back(n - 1);
+        out.insert(out.end(),data + literalStart,data + literalStart + n);
+        literalStart += n;
+      }
+    };
+
+    size_t at = 0;
+    while(at < len) {
+      size_t distance = 0;
+      size_t matchLen = findMatch(at,distance);
+      insert(at);
+      if(matchLen == 0) {
+        at++;
+        continue;
+      }
+      size_t nextDistance = 0;
+      if(findMatch(at+1,nextDistance) > matchLen) {
+        at++;
+        continue;
+      }
+      flushLiterals(at);
+      out.push_back(0x80 | (matchLen - FLASHLZ_MIN_MATCH));
+      out.push_back(distance & 0xff);
+      out.push_back(distance >> 8);
+      for(size_t i = 1;i < matchLen;i++)
+        insert(at + i);
+      at += matchLen;
+      literalStart = at;
+    }
+    flushLiterals(len);
+    return out;
+  }
 
   bool FirmwareUpdateC::Hex2Number(const char *start,const char *end,uint32_t &value) {
     const char *at = start;
@@ -253,9 +578,30 @@ namespace DogBotN {
   //! Start update
 
   bool FirmwareUpdateC::DoUpdate(int targetDevice,const std::string &filename)
+  {
+    return DoUpdate(std::vector<int>({ targetDevice }),filename);
+  }
+
+  //! Update a set of devices at once.
+
+  bool FirmwareUpdateC::DoUpdate(const std::vector<int> &devices,const std::string &filename)
   {
     using Ms = std::chrono::milliseconds;
 
+    if(devices.empty()) {
+      m_log->error("No devices to update.");
+      return false;
+    }
+    m_devices.clear();
+    for(auto id : devices)
+      m_devices[id] = DeviceStateC();
+    if(m_devices.size() > 1 && m_devices.count(0) > 0) {
+      m_log->error("Device 0 can't be updated along with other devices.");
+      return false;
+    }
+    m_sendAddress = (m_devices.size() == 1) ? m_devices.begin()->first : 0;
+    m_flagError = false;
+
     if(!LoadHexFile(filename))
       return false;
 
@@ -264,47 +610,120 @@ namespace DogBotN {
     if(!m_dryRun) {
       callbacks.SetHandler(CPT_FlashCmdResult,[&](uint8_t *data,int len)
        {
-         auto *pkt = (struct PacketFlashResultC *) data;
-         //m_log->info("Got flash result from device {}, waiting for {}  rxSequence:{} State:{} Result:{} ",(int) pkt->m_deviceId,(int) targetDevice,(int) pkt->m_rxSequence,(int) pkt->m_state,(int) pkt->m_result);
-         // Is packet of interest ?
-         if(pkt->m_deviceId != targetDevice && targetDevice != 0)
-           return ;
          std::unique_lock<std::mutex> lk(m_mutexResult);
          if(sizeof(PacketFlashResultC) != len) {
            m_log->error("Unexpected FlashCmdResult packet length. {} ",len);
            m_flagError = true;
+           lk.unlock();
+           m_condVar.notify_all();
            return ;
          }
-         memcpy(&m_pktResult,data,sizeof(PacketFlashResultC));
-         m_gotResult = true;
+         auto *pkt = (struct PacketFlashResultC *) data;
+         //m_log->info("Got flash result from device {}, rxSequence:{} State:{} Result:{} ",(int) pkt->m_deviceId,(int) pkt->m_rxSequence,(int) pkt->m_state,(int) pkt->m_result);
+         // Is packet of interest ?
+         DeviceStateC *dev = FindDevice(pkt->m_deviceId);
+         if(dev == nullptr)
+           return ;
+         memcpy(&dev->m_result,data,sizeof(PacketFlashResultC));
+         dev->m_gotResult = true;
          lk.unlock();
          m_condVar.notify_all();
        }
       );
 
-      // Change device into boot-loader mode.
-      if(!m_coms->SetParam(targetDevice,CPI_ControlState,(uint8_t) CS_BootLoader)) {
-        m_log->error("Failed to change into boot-loader.");
-        return false;
+      callbacks.SetHandler(CPT_FlashChecksumResult,[&](uint8_t *data,int len)
+       {
+         if(sizeof(PacketFlashChecksumResultC) != len) {
+           m_log->error("Unexpected FlashChecksumResult packet length. {} ",len);
+           return ;
+         }
+         auto *pkt = (struct PacketFlashChecksumResultC *) data;
+         std::unique_lock<std::mutex> lk(m_mutexResult);
+         DeviceStateC *dev = FindDevice(pkt->m_deviceId);
+         if(dev == nullptr)
+           return ;
+         memcpy(&dev->m_checkSum,data,sizeof(PacketFlashChecksumResultC));
+         dev->m_gotCheckSum = true;
+         lk.unlock();
+         m_condVar.notify_all();
+       }
+      );
+
+      callbacks.SetHandler(CPT_Error,[&](uint8_t *data,int len)
+       {
+         if(sizeof(PacketErrorC) != len) {
+           m_log->error("Unexpected Error packet length. {} ",len);
+           return ;
+         }
+         auto *pkt = (struct PacketErrorC *) data;
+         std::unique_lock<std::mutex> lk(m_mutexResult);
+         DeviceStateC *dev = FindDevice(pkt->m_deviceId);
+         if(dev == nullptr)
+           return ;
+         if(pkt->m_errorCode == CET_BootLoaderLostSequence && pkt->m_causeType == CPT_FlashData) {
+           dev->m_lostSequence = true;
+           dev->m_lostSequenceExpected = pkt->m_errorData;
+         } else {
+           m_log->error("Error from device {} : Code {} Packet {} Arg {} ",(int) pkt->m_deviceId,(int) pkt->m_errorCode,(int) pkt->m_causeType,(int) pkt->m_errorData);
+           if(pkt->m_errorCode >= CET_BootLoaderUnexpectedState)
+             dev->m_error = true;
+         }
+         lk.unlock();
+         m_condVar.notify_all();
+       }
+      );
+
+      // Change devices into boot-loader mode.
+      {
+        ComsParamEngineC params(m_coms);
+        std::vector<std::future<bool> > done;
+        for(auto &a : m_devices)
+          done.push_back(params.SetParam(a.first,CPI_ControlState,(uint8_t) CS_BootLoader));
+        bool ok = true;
+        int i = 0;
+        for(auto &a : m_devices) {
+          if(!done[i++].get()) {
+            m_log->error("Failed to change device {} into boot-loader.",a.first);
+            ok = false;
+          }
+        }
+        if(!ok)
+          return false;
       }
 
-      // Wait for change to happen.
+      // Make sure only the devices we're updating act on broadcast commands.
+      if(m_sendAddress == 0 && m_devices.size() > 1) {
+        SendBootLoaderReset(0,false);
+        std::this_thread::sleep_for(Ms(100));
+      }
 
-      m_log->info("Setting up connection for device {} ",targetDevice);
-      SendBootLoaderReset(targetDevice,true);
+      ClearResults();
+      for(auto &a : m_devices) {
+        m_log->info("Setting up connection for device {} ",a.first);
+        SendBootLoaderReset(a.first,true);
+      }
 
       // Wait for ack.
       if(!WaitForResult(0,"reset")) {
         return false;
       }
+
+      // Only compress, or compare flash with a CRC-32, if every device can do it.
+      bool newBootLoader = true;
+      for(auto &a : m_devices) {
+        if(a.second.m_result.m_result != FOS_ReadyCompressed)
+          newBootLoader = false;
+      }
+      m_useCompression = m_compress && newBootLoader;
+      m_useCRC = newBootLoader;
+      if(m_compress && !m_useCompression)
+        m_log->info("Boot-loader doesn't support compression, sending raw data.");
     }
 
     m_seqNo = -1;
 
-    m_log->info("Starting erase. ");
-
-    // Decide what blocks to erase.
-    std::vector<uint32_t> eraseBlocks;
+    // Decide what sectors need erasing.
+    std::vector<int> eraseSectors;
     for(auto block = m_dataMap.begin(); block != m_dataMap.end();block++) {
       uint32_t targetAddress = block->first;
       uint32_t endAddress = targetAddress + block->second.size();
@@ -315,52 +734,132 @@ namespace DogBotN {
       for(int i = 4;i < FLASH_SECTORS;i++) {
         if(targetAddress >= g_flash_addr[i+1])
           continue;
-        if(find(eraseBlocks.begin(),eraseBlocks.end(),g_flash_addr[i]) == eraseBlocks.end()) {
-          eraseBlocks.push_back(g_flash_addr[i]);
+        if(find(eraseSectors.begin(),eraseSectors.end(),i) == eraseSectors.end()) {
+          eraseSectors.push_back(i);
         }
-        if(endAddress < g_flash_addr[i+1])
+        if(endAddress <= g_flash_addr[i+1])
           break;
       }
     }
-    for(auto a : eraseBlocks) {
+
+    // Skip sectors the devices already have, if asked to. The sector is
+    // compared as it would be after a full update, with anything not in the
+    // image erased. A byte sum doesn't change when bytes are moved around,
+    // so this needs boot-loaders that can compute a CRC-32.
+    std::vector<bool> skipSector(FLASH_SECTORS,false);
+    size_t bytesSkipped = 0;
+    if(!m_dryRun && !m_fullUpdate && !m_useCRC)
+      m_log->info("Boot-loader can't compute a CRC-32, writing every sector.");
+    if(!m_dryRun && !m_fullUpdate && m_useCRC) {
+      m_log->info("Comparing flash with image. ");
+      for(auto i : eraseSectors) {
+        bool matches = true;
+        for(uint32_t at = g_flash_addr[i];at < g_flash_addr[i+1] && matches;at += 0x8000) {
+          if(!CheckFlash(at,0x8000,true))
+            matches = false;
+        }
+        if(!matches)
+          continue;
+        m_log->info("Sector at {:08X} is up to date ",g_flash_addr[i]);
+        skipSector[i] = true;
+        bytesSkipped += g_flash_addr[i+1] - g_flash_addr[i];
+      }
+    }
+
+    m_log->info("Starting erase. ");
+    int erasesSkipped = 0;
+
+    for(auto i : eraseSectors) {
+      if(skipSector[i])
+        continue;
+      uint32_t a = g_flash_addr[i];
       m_log->info("Erasing block at {:08X} ",a);
       if(!m_dryRun) {
-        SendBootLoaderErase(targetDevice,++m_seqNo,a);
-        if(!WaitForResult(m_seqNo,"erase"))
+        ClearResults();
+        SendBootLoaderErase(m_sendAddress,++m_seqNo,a);
+        // Erasing a 128K sector can take up to 4 seconds.
+        if(!WaitForResult(m_seqNo,"erase",5000))
           return false;
+        std::lock_guard<std::mutex> lk(m_mutexResult);
+        for(auto &dev : m_devices) {
+          if(dev.second.m_result.m_result == FOS_AlreadyErased) {
+            m_log->info("Device {} block at {:08X} was already blank ",dev.first,a);
+            erasesSkipped++;
+          }
+        }
       }
     }
 
-    m_log->info("Erase completed ok");
+    if(erasesSkipped > 0)
+      m_log->info("Erase completed ok, {} erases skipped ",erasesSkipped);
+    else
+      m_log->info("Erase completed ok");
 
 
     m_log->info("Writing data...");
 
+    auto writeStart = std::chrono::steady_clock::now();
+    size_t bytesWritten = 0;
+    m_retransmitCount = 0;
+    m_bytesSent = 0;
+
     for(auto block = m_dataMap.begin(); block != m_dataMap.end();block++) {
       uint32_t targetAddress = block->first;
       std::vector<uint8_t> &data = block->second;
       uint32_t at = 0;
       while(at < data.size()) {
-        uint32_t blockSize = data.size();
+        uint32_t blockSize = data.size() - at;
+        // Keep blocks word aligned, the boot-loader only accepts aligned writes.
         if(blockSize >= (1<<16))
-          blockSize = (1<<16)-1;
+          blockSize = (1<<16)-4;
+        // Don't let writes cross a sector boundary so unchanged sectors can be skipped.
+        int sector = 4;
+        while(targetAddress + at >= g_flash_addr[sector+1])
+          sector++;
+        if(targetAddress + at + blockSize > g_flash_addr[sector+1])
+          blockSize = g_flash_addr[sector+1] - (targetAddress + at);
+        if(skipSector[sector]) {
+          at += blockSize;
+          continue;
+        }
         m_log->info("Writing block at {:08X} of length {:04X} ",targetAddress+at,blockSize);
         if(!m_dryRun) {
-          if(!WriteFlash(targetDevice,targetAddress+at,&data[at],blockSize)) {
+          if(!WriteFlash(targetAddress+at,&data[at],blockSize)) {
             m_log->info("Write failed.");
             return false;
           }
         }
         at += blockSize;
+        bytesWritten += blockSize;
       }
     }
 
-    m_log->info("Done.");
+    double writeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - writeStart).count();
+    m_log->info("Done. Wrote {} bytes to {} devices in {} seconds, {} packets resent. ",bytesWritten,m_devices.size(),writeTime,m_retransmitCount);
+    if(m_useCompression && bytesWritten > 0)
+      m_log->info("Sent {} bytes of compressed data, {}% of the image. ",m_bytesSent,(m_bytesSent * 100) / bytesWritten);
+    if(bytesSkipped > 0)
+      m_log->info("Skipped {} bytes of flash that were already up to date. ",bytesSkipped);
+
+    if(!m_dryRun) {
+      if(!VerifyFlash()) {
+        m_log->error("Verify failed.");
+        return false;
+      }
+      m_log->info("Verified ok.");
+    }
 
     if(m_exitBootloaderOnComplete) {
       // Restart into normal mode
-      if(!m_coms->SetParam(targetDevice,CPI_ControlState,(uint8_t) CS_StartUp)) {
-        m_log->error("Failed to restart the controller.");
+      ComsParamEngineC params(m_coms);
+      std::vector<std::future<bool> > done;
+      for(auto &a : m_devices)
+        done.push_back(params.SetParam(a.first,CPI_ControlState,(uint8_t) CS_StartUp));
+      int i = 0;
+      for(auto &a : m_devices) {
+        if(!done[i++].get()) {
+          m_log->error("Failed to restart controller {}.",a.first);
+        }
       }
     }
 
@@ -389,10 +888,10 @@ namespace DogBotN {
   }
 
   //! Send a boot-loader begin write
-  void FirmwareUpdateC::SendBootLoaderBeginWrite(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len)
+  void FirmwareUpdateC::SendBootLoaderBeginWrite(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len,bool compressed)
   {
     struct PacketFlashWriteC pkt;
-    pkt.m_packetType = CPT_FlashWrite;
+    pkt.m_packetType = compressed ? CPT_FlashWriteCompressed : CPT_FlashWrite;
     pkt.m_deviceId = deviceId;
     pkt.m_sequenceNumber = seqNum;
     pkt.m_addr = address;
@@ -411,11 +910,11 @@ namespace DogBotN {
     m_coms->SendPacket((const uint8_t *)&pkt,sizeof(pkt));
   }
 
-  //! Send a boot-loader checksum request
-  void FirmwareUpdateC::SendBootLoaderCheckSum(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len)
+  //! Send a boot-loader checksum request, for a CRC-32 if 'crc' is set.
+  void FirmwareUpdateC::SendBootLoaderCheckSum(uint8_t deviceId,uint8_t seqNum,uint32_t address,uint16_t len,bool crc)
   {
     struct PacketFlashChecksumC pkt;
-    pkt.m_packetType = CPT_FlashChecksum;
+    pkt.m_packetType = crc ? CPT_FlashCRC32 : CPT_FlashChecksum;
     pkt.m_deviceId = deviceId;
     pkt.m_sequenceNumber = seqNum;
     pkt.m_addr = address;
@@ -0,0 +1,308 @@
+
+#include "dogbot/JointStateShm.hh"
+#include "dogbot/ComsShm.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+namespace DogBotN
+{
+  static const uint32_t g_jointStateMagic = 0x44424A53; // 'DBJS'
+  static const uint32_t g_jointStateVersion = 1;
+
+  static_assert(sizeof(JointStateRecordC) == 64,"Joint state records should fill exactly one cache line. ");
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,"Joint state tables need lock free atomics. ");
+
+  //! Size of a segment.
+  static const size_t g_jointStateSize = sizeof(JointStateShmHeaderC) + g_jointStateRecords * sizeof(JointStateRecordC);
+
+  //! Default constructor.
+  JointStateTableC::JointStateTableC()
+  {}
+
+  //! Unmap the segment.
+  JointStateTableC::~JointStateTableC()
+  {
+    Detach();
+  }
+
+  //! Map 'size' bytes of an open segment.
+  bool JointStateTableC::Map(int fd,size_t size)
+  {
+    void *mem = mmap(nullptr,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if(mem == MAP_FAILED) {
+      m_log->error("Failed to map joint state table, {} ",strerror(errno));
+      return false;
+    }
+    m_header = (JointStateShmHeaderC *) mem;
+    m_records = (JointStateRecordC *) (m_header + 1);
+    m_size = size;
+    return true;
+  }
+
+  //! Create or take over the segment 'addr' as the writer.
+  bool JointStateTableC::Create(const std::string &addr)
+  {
+    Detach();
+    std::string name = ComsShmRegionC::ShmName(addr);
+    if(name.empty()) {
+      m_log->error("Joint state table address '{}' should be shm://name ",addr);
+      return false;
+    }
+    int fd = shm_open(name.c_str(),O_RDWR | O_CREAT,0666);
+    if(fd < 0) {
+      m_log->error("Failed to create joint state table '{}', {} ",name,strerror(errno));
+      return false;
+    }
+    // Readers may still have the segment mapped from a previous writer, so
+    // it is reused rather than replaced.
+    struct stat st;
+    bool ok = fstat(fd,&st) == 0 && (st.st_size == (off_t) g_jointStateSize || ftruncate(fd,g_jointStateSize) == 0);
+    if(ok)
+      ok = Map(fd,g_jointStateSize);
+    else
+      m_log->error("Failed to size joint state table '{}', {} ",name,strerror(errno));
+    close(fd);
+    if(!ok)
+      return false;
+    m_isWriter = true;
+
+    uint32_t generation = (m_header->m_magic == g_jointStateMagic) ? m_header->m_generation.load() + 1 : 1;
+    m_header->m_running = 0;
+    m_header->m_magic = 0;
+    m_header->m_version = g_jointStateVersion;
+    m_header->m_records = g_jointStateRecords;
+    // Start every record even and invalid, a writer may have died part way through one.
+    for(int i = 0;i < g_jointStateRecords;i++) {
+      JointStateRecordC &record = m_records[i];
+      uint32_t seq = record.m_seq.load(std::memory_order_relaxed);
+      record.m_seq.store((seq | 1) + 1,std::memory_order_relaxed);
+      memset(&record.m_state,0,sizeof(record.m_state));
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    m_header->m_updates = 0;
+    m_header->m_generation = generation;
+    m_header->m_magic = g_jointStateMagic;
+    m_header->m_running = 1;
+    return true;
+  }
+
+  //! Map an existing segment 'addr' for reading.
+  bool JointStateTableC::Attach(const std::string &addr)
+  {
+    Detach();
+    std::string name = ComsShmRegionC::ShmName(addr);
+    if(name.empty()) {
+      m_log->error("Joint state table address '{}' should be shm://name ",addr);
+      return false;
+    }
+    int fd = shm_open(name.c_str(),O_RDWR,0);
+    if(fd < 0) {
+      m_log->error("Failed to open joint state table '{}', is the server running ? {} ",name,strerror(errno));
+      return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd,&st) == 0 && st.st_size >= (off_t) g_jointStateSize && Map(fd,g_jointStateSize);
+    close(fd);
+    if(!ok)
+      return false;
+    if(m_header->m_magic != g_jointStateMagic || m_header->m_version != g_jointStateVersion ||
+       m_header->m_records != (uint32_t) g_jointStateRecords) {
+      m_log->error("Joint state table '{}' isn't set up for this version. ",name);
+      Detach();
+      return false;
+    }
+    m_isWriter = false;
+    return true;
+  }
+
+  //! Unmap the segment, if it was created the writer is marked as stopped.
+  void JointStateTableC::Detach()
+  {
+    if(m_header == nullptr)
+      return ;
+    if(m_isWriter)
+      m_header->m_running = 0;
+    munmap(m_header,m_size);
+    m_header = nullptr;
+    m_records = nullptr;
+    m_size = 0;
+  }
+
+  //! Write the record for a device.
+  bool JointStateTableC::Write(int deviceId,const JointStateC &state)
+  {
+    if(m_header == nullptr || deviceId < 0 || deviceId >= g_jointStateRecords)
+      return false;
+    JointStateRecordC &record = m_records[deviceId];
+    uint32_t seq = record.m_seq.load(std::memory_order_relaxed);
+    record.m_seq.store(seq + 1,std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    uint32_t updates = record.m_state.m_updates;
+    record.m_state = state;
+    record.m_state.m_updates = updates + 1;
+    record.m_state.m_deviceId = deviceId;
+    record.m_seq.store(seq + 2,std::memory_order_release);
+    m_header->m_updates.fetch_add(1,std::memory_order_release);
+    return true;
+  }
+
+  //! Mark the record for a device as no longer valid.
+  void JointStateTableC::Clear(int deviceId)
+  {
+    if(m_header == nullptr || deviceId < 0 || deviceId >= g_jointStateRecords)
+      return ;
+    JointStateRecordC &record = m_records[deviceId];
+    uint32_t seq = record.m_seq.load(std::memory_order_relaxed);
+    record.m_seq.store(seq + 1,std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.m_state.m_valid = 0;
+    record.m_seq.store(seq + 2,std::memory_order_release);
+    m_header->m_updates.fetch_add(1,std::memory_order_release);
+  }
+
+  //! Read the record for a device.
+  bool JointStateTableC::Read(int deviceId,JointStateC &state) const
+  {
+    if(m_header == nullptr || deviceId < 0 || deviceId >= g_jointStateRecords)
+      return false;
+    const JointStateRecordC &record = m_records[deviceId];
+    // A write takes a few nanoseconds, so only give up if the writer
+    // looks to have stopped part way through one.
+    for(int i = 0;i < 10000;i++) {
+      uint32_t seq = record.m_seq.load(std::memory_order_acquire);
+      if(seq & 1)
+        continue;
+      state = record.m_state;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(record.m_seq.load(std::memory_order_relaxed) == seq)
+        return state.m_valid != 0;
+    }
+    return false;
+  }
+
+  //! Read every valid record.
+  size_t JointStateTableC::Snapshot(std::vector<JointStateC> &states) const
+  {
+    states.clear();
+    JointStateC state;
+    for(int i = 0;i < g_jointStateRecords;i++) {
+      if(Read(i,state))
+        states.push_back(state);
+    }
+    return states.size();
+  }
+
+  // ----------------------------------------------------------------
+
+  //! Publish the servos known to 'api'.
+  JointStatePublisherC::JointStatePublisherC(DogBotAPIC &api,std::shared_ptr<spdlog::logger> &log)
+   : m_api(api),
+     m_log(log)
+  {}
+
+  //! Remove callbacks and mark the table as stopped.
+  JointStatePublisherC::~JointStatePublisherC()
+  {
+    Close();
+  }
+
+  //! Create the segment and start publishing.
+  bool JointStatePublisherC::Open(const std::string &addr)
+  {
+    Close();
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      if(!m_table.Create(addr))
+        return false;
+    }
+    m_statusCallback = m_api.AddServoStatusHandler([this](JointC *joint,DogBotAPIC::ServoUpdateTypeT op) {
+      ServoC *servo = dynamic_cast<ServoC *>(joint);
+      if(servo == nullptr)
+        return ;
+      if(op != DogBotAPIC::SUT_Remove) {
+        UpdateServo(servo);
+        return ;
+      }
+      std::lock_guard<std::mutex> lock(m_access);
+      auto at = m_servos.find(servo);
+      if(at == m_servos.end())
+        return ;
+      at->second.m_positionCallback.Remove();
+      m_table.Clear(at->second.m_deviceId);
+      m_servos.erase(at);
+    });
+    // The device list is locked while status callbacks are made, so it
+    // mustn't be listed with m_access held.
+    for(auto &a : m_api.ListServos()) {
+      if(a)
+        UpdateServo(a.get());
+    }
+    m_log->info("Publishing joint state in '{}' ",addr);
+    return true;
+  }
+
+  //! Stop publishing.
+  void JointStatePublisherC::Close()
+  {
+    m_statusCallback.Remove();
+    std::lock_guard<std::mutex> lock(m_access);
+    for(auto &a : m_servos)
+      a.second.m_positionCallback.Remove();
+    m_servos.clear();
+    m_table.Detach();
+  }
+
+  //! Add a servo, or update its record after a status change.
+  void JointStatePublisherC::UpdateServo(ServoC *servo)
+  {
+    std::lock_guard<std::mutex> lock(m_access);
+    if(!m_table.IsAttached())
+      return ;
+    ServoEntryC &entry = m_servos[servo];
+    if(!entry.m_positionCallback.IsActive()) {
+      entry.m_positionCallback = servo->AddPositionUpdateCallback([this,servo](JointC::TimePointT theTime,double position,double velocity,double torque) {
+        std::lock_guard<std::mutex> lock(m_access);
+        WriteServo(servo,theTime,position,velocity,torque);
+      });
+    }
+    JointC::TimePointT tick;
+    double position = 0,velocity = 0,torque = 0;
+    servo->GetState(tick,position,velocity,torque);
+    WriteServo(servo,tick,position,velocity,torque);
+  }
+
+  //! Write the record for a servo, m_access must be locked.
+  void JointStatePublisherC::WriteServo(ServoC *servo,JointC::TimePointT theTime,double position,double velocity,double torque)
+  {
+    if(!m_table.IsAttached())
+      return ;
+    auto at = m_servos.find(servo);
+    if(at == m_servos.end())
+      return ;
+    int deviceId = servo->Id();
+    // Device ids can be reassigned, don't leave a record under the old one.
+    if(at->second.m_deviceId != deviceId) {
+      m_table.Clear(at->second.m_deviceId);
+      at->second.m_deviceId = deviceId;
+    }
+    JointStateC state;
+    memset(&state,0,sizeof(state));
+    state.m_timestamp = JointStateTableC::Timestamp(theTime);
+    state.m_position = position;
+    state.m_velocity = velocity;
+    state.m_torque = torque;
+    state.m_temperature = servo->Temperature();
+    state.m_supplyVoltage = servo->SupplyVoltage();
+    state.m_valid = 1;
+    state.m_faultCode = servo->FaultCode();
+    state.m_controlState = servo->ControlState();
+    state.m_homedState = servo->HomedState();
+    state.m_controlDynamic = servo->ControlDynamic();
+    state.m_enabled = servo->IsEnabled();
+    m_table.Write(deviceId,state);
+  }
+
+}
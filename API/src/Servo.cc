@@ -291,6 +291,7 @@ namespace DogBotN {
       m_position = newPosition;
       m_torque =  ComsC::TorqueReport2Current(report.m_torque) * m_servoKt;
       m_reportedMode = report.m_mode;
+      PublishState();
 
       // End block, and unlock m_mutexState.
     }
@@ -502,34 +503,65 @@ namespace DogBotN {
   }
 
 
+  //! Publish the current state for GetState() and GetStateAt().
+  void ServoC::PublishState()
+  {
+    ServoStateC state { m_tick,m_position,m_velocity,m_torque };
+    uint32_t seq = m_stateSeq.load(std::memory_order_relaxed);
+    // Point readers at the second copy while updating the first, then back to
+    // the first while updating the second. Readers only ever see the second
+    // after the next call has moved them on, so it's done by then.
+    for(int i = 0;i < 2;i++) {
+      m_stateSeq.store(++seq,std::memory_order_release);
+      std::atomic_thread_fence(std::memory_order_release);
+      m_state[i] = state;
+    }
+  }
+
+  //! Get a consistent copy of the published state.
+  void ServoC::ReadState(ServoStateC &state) const
+  {
+    // The copy we're pointed at is never being written, so we only retry if
+    // the writer has moved on while we read it, never to wait for it to finish.
+    for(;;) {
+      uint32_t seq = m_stateSeq.load(std::memory_order_acquire);
+      state = m_state[seq & 1];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(m_stateSeq.load(std::memory_order_relaxed) == seq)
+        return ;
+    }
+  }
+
   //! Get last reported state of the servo.
   bool ServoC::GetState(TimePointT &tick,double &position,double &velocity,double &torque) const
   {
-    std::lock_guard<std::mutex> lock(m_mutexState);
-    tick = m_timeEpoch + m_tick * m_tickDuration;
-    position = m_position;
-    torque = m_torque;
-    velocity = m_velocity;
+    ServoStateC state;
+    ReadState(state);
+    tick = m_timeEpoch + state.m_tick * m_tickDuration;
+    position = state.m_position;
+    torque = state.m_torque;
+    velocity = state.m_velocity;
     return true;
   }
 
   //! Estimate state at the given time.
   bool ServoC::GetStateAt(TimePointT theTime,double &position,double &velocity,double &torque) const
   {
-    std::lock_guard<std::mutex> lock(m_mutexState);
-    TimePointT lastTick = m_timeEpoch + m_tick * m_tickDuration;
+    ServoStateC state;
+    ReadState(state);
+    TimePointT lastTick = m_timeEpoch + state.m_tick * m_tickDuration;
     auto timeDiff = theTime - lastTick;
     if(fabs(timeDiff.count()) < m_tickDuration.count() * 5) {
       // Correct position for current speed.
-      position = m_position + m_velocity * timeDiff.count();
+      position = state.m_position + state.m_velocity * timeDiff.count();
     } else {
       // Out of date, just use last reported position.
       // This will 'pop' back to the last reported position, not ideal.
-      position = m_position;
+      position = state.m_position;
     }
     // Assume torque and velocity are approximately constant.
-    torque = m_torque;
-    velocity = m_velocity;
+    torque = state.m_torque;
+    velocity = state.m_velocity;
     return true;
   }
 
@@ -565,7 +597,9 @@ namespace DogBotN {
         m_log->warn("Lost contact with servo {}  for {} seconds",m_id,timeSinceLastReport.count());
 
         // Set velocity estimate to zero.
+        std::lock_guard<std::mutex> lock(m_mutexState);
         m_velocity = 0;
+        PublishState();
       }
     } else {
 #if 0
@@ -1,9 +1,67 @@
 #include "dogbot/ZMQContext.hh"
+#include <cstdlib>
 
 namespace DogBotN
 {
 
   zmq::context_t g_zmqContext(1);
 
+  //! Test if 'addr' names a ZMQ server, 'local' or a tcp://, ipc:// or inproc:// address.
+  bool IsZMQAddress(const std::string &addr)
+  {
+    return addr == "local" ||
+        addr.compare(0,6,"tcp://") == 0 ||
+        addr.compare(0,6,"ipc://") == 0 ||
+        addr.compare(0,9,"inproc://") == 0;
+  }
+
+  //! Work out the endpoints used to send commands to a server and receive its state from an address.
+  bool ZMQEndpoints(const std::string &addr,bool bind,std::string &commands,std::string &state)
+  {
+    std::string host;
+    int port = g_zmqDefaultPort;
+    if(addr.empty() || addr == "local") {
+      host = bind ? "*" : "127.0.0.1";
+    } else if(addr == "*" || addr == "*.*.*.*") {
+      host = "*";
+    } else if(addr.compare(0,6,"tcp://") == 0) {
+      host = addr.substr(6);
+      size_t colon = host.rfind(':');
+      if(colon != std::string::npos && host.find(']',colon) == std::string::npos) {
+        port = atoi(host.c_str() + colon + 1);
+        host = host.substr(0,colon);
+      }
+      if(host.empty() || port <= 0 || port >= 65535)
+        return false;
+    } else if(addr.compare(0,6,"ipc://") == 0 || addr.compare(0,9,"inproc://") == 0) {
+      size_t prefix = addr.find("://") + 3;
+      if(addr.size() == prefix)
+        return false;
+      commands = addr + "-commands";
+      state = addr + "-state";
+      return true;
+    } else {
+      return false;
+    }
+    commands = "tcp://" + host + ":" + std::to_string(port);
+    state = "tcp://" + host + ":" + std::to_string(port+1);
+    return true;
+  }
+
+  //! Split a comma separated list of addresses.
+  std::vector<std::string> ZMQSplitAddresses(const std::string &addrs)
+  {
+    std::vector<std::string> ret;
+    size_t at = 0;
+    while(at <= addrs.size()) {
+      size_t comma = addrs.find(',',at);
+      if(comma == std::string::npos)
+        comma = addrs.size();
+      if(comma > at)
+        ret.push_back(addrs.substr(at,comma - at));
+      at = comma + 1;
+    }
+    return ret;
+  }
 
 }
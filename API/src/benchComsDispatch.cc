@@ -0,0 +1,69 @@
+
+// Measure the cost of dispatching received packets to handlers, with and
+// without other threads registering and removing handlers at the same time.
+//
+// Usage: benchComsDispatch [packets]
+
+#include "dogbot/Coms.hh"
+#include <iostream>
+#include <atomic>
+#include <chrono>
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  int packets = 1000000;
+  if(argc > 1)
+    packets = atoi(argv[1]);
+
+  const int handlerCounts[3] = { 0, 1, 10 };
+
+  PacketServoReportC report;
+  memset(&report,0,sizeof(report));
+  report.m_packetType = CPT_ServoReport;
+
+  std::cout << "Handlers  Churn threads  ns/packet  Registrations/s " << std::endl;
+  for(int churnThreads = 0;churnThreads <= 2;churnThreads += 2) {
+    for(int handlers : handlerCounts) {
+      std::shared_ptr<DogBotN::ComsC> coms = std::make_shared<DogBotN::ComsC>();
+      std::atomic<int> calls(0);
+      std::vector<DogBotN::ComsCallbackHandleC> handles;
+      for(int i = 0;i < handlers;i++)
+        handles.push_back(coms->SetHandler(CPT_ServoReport,[&calls](uint8_t *,int) { calls++; }));
+
+      // Other threads adding and removing handlers for a different packet type.
+      std::atomic<bool> done(false);
+      std::atomic<long> registrations(0);
+      std::vector<std::thread> churn;
+      for(int i = 0;i < churnThreads;i++) {
+        churn.push_back(std::thread([&]{
+          while(!done) {
+            auto handle = coms->SetHandler(CPT_ReportParam,[](uint8_t *,int) {});
+            coms->DeleteHandler(handle);
+            registrations++;
+          }
+        }));
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      for(int i = 0;i < packets;i++)
+        coms->ProcessPacket((uint8_t *) &report,sizeof(report));
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      done = true;
+      for(auto &t : churn)
+        t.join();
+      for(auto &h : handles)
+        coms->DeleteHandler(h);
+
+      if(calls != (long) handlers * packets) {
+        std::cerr << "Expected " << (long) handlers * packets << " calls, got " << calls << std::endl;
+        return 1;
+      }
+      std::cout << handlers << "  " << churnThreads << "  " << (elapsed * 1e9) / packets << "  " << registrations / elapsed << std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,225 @@
+
+// Compare clients talking to a server through shared memory with the
+// ZMQ tcp path. Times ReadParam round trips to a simulated device, then
+// how fast a burst of servo reports reaches a client and how many are lost.
+// The server and client are in the same process, the numbers show only
+// what each transport costs.
+//
+// Usage: benchComsShm [round trips] [burst packets]
+
+#include "dogbot/ComsShmServer.hh"
+#include "dogbot/ComsZMQServer.hh"
+#include "dogbot/ComsZMQClient.hh"
+#include "BenchLatency.hh"
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! A device which answers every ReadParam straight away, and can send a burst of servo reports.
+
+class ComsSimDeviceC
+  : public ComsC
+{
+public:
+  void SendPacket(const uint8_t *data,int len) override
+  {
+    if(len < (int) sizeof(PacketReadParamC) || data[0] != CPT_ReadParam)
+      return ;
+    const PacketReadParamC *pkt = (const PacketReadParamC *) data;
+    PacketParam8ByteC reply;
+    reply.m_header.m_packetType = CPT_ReportParam;
+    reply.m_header.m_deviceId = pkt->m_deviceId;
+    reply.m_header.m_index = pkt->m_index;
+    reply.m_data.uint32[0] = 0x12345678;
+    ProcessPacket((uint8_t *) &reply,sizeof(reply.m_header) + sizeof(uint32_t));
+  }
+
+  //! Send 'count' servo reports as fast as possible.
+  void Burst(int count)
+  {
+    PacketServoReportC pkt;
+    memset(&pkt,0,sizeof(pkt));
+    pkt.m_packetType = CPT_ServoReport;
+    for(int i = 0;i < count;i++) {
+      pkt.m_deviceId = 1 + (i % 12);
+      ProcessPacket((uint8_t *) &pkt,sizeof(pkt));
+    }
+  }
+};
+
+//! A server and a client connected to it.
+
+class TransportC
+{
+public:
+  virtual ~TransportC()
+  {}
+
+  virtual std::shared_ptr<ComsC> Client() = 0;
+};
+
+class TransportShmC
+  : public TransportC
+{
+public:
+  TransportShmC(const std::shared_ptr<ComsC> &device,std::shared_ptr<spdlog::logger> &logger)
+   : m_server(device,logger)
+  {
+    std::string addr = "shm://dogbot-bench-" + std::to_string(getpid());
+    m_thread = std::thread([this,addr]{ m_server.Run(addr); });
+    // Wait for the segment to be created.
+    for(int i = 0;i < 100 && !m_server.IsReady();i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    m_client->Open(addr);
+    m_name = ComsShmRegionC::ShmName(addr);
+  }
+
+  ~TransportShmC()
+  {
+    m_client->Close();
+    m_server.Stop();
+    m_thread.join();
+    shm_unlink(m_name.c_str());
+  }
+
+  std::shared_ptr<ComsC> Client() override
+  { return m_client; }
+
+protected:
+  ComsShmServerC m_server;
+  std::shared_ptr<ComsShmC> m_client = std::make_shared<ComsShmC>();
+  std::thread m_thread;
+  std::string m_name;
+};
+
+class TransportTCPC
+  : public TransportC
+{
+public:
+  TransportTCPC(const std::shared_ptr<ComsC> &device,std::shared_ptr<spdlog::logger> &logger)
+   : m_server(device,logger)
+  {
+    m_thread = std::thread([this]{ m_server.Run("tcp://127.0.0.1:7220"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    m_client->Open("tcp://127.0.0.1:7220");
+  }
+
+  ~TransportTCPC()
+  {
+    m_client->Close();
+    m_server.Stop();
+    m_thread.join();
+  }
+
+  std::shared_ptr<ComsC> Client() override
+  { return m_client; }
+
+protected:
+  ComsZMQServerC m_server;
+  std::shared_ptr<ComsZMQClientC> m_client = std::make_shared<ComsZMQClientC>();
+  std::thread m_thread;
+};
+
+//! Time ReadParam round trips and print the results.
+
+static void RoundTrips(const std::string &name,ComsC &client,int trips)
+{
+  const int warmup = 100;
+  std::mutex access;
+  std::condition_variable replied;
+  int replies = 0;
+  ComsCallbackHandleC handle = client.SetHandler(CPT_ReportParam,[&](uint8_t *,int) {
+    std::lock_guard<std::mutex> lock(access);
+    replies++;
+    replied.notify_all();
+  });
+  // Give any subscription time to reach the server.
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  BenchLatencyC latency(trips);
+  int timeouts = 0;
+  for(int i = 0;i < trips + warmup;i++) {
+    std::unique_lock<std::mutex> lock(access);
+    int expected = replies + 1;
+    ClockT::time_point start = ClockT::now();
+    lock.unlock();
+    client.SendQueryParam(1,CPI_FirmwareVersion);
+    lock.lock();
+    if(!replied.wait_for(lock,std::chrono::milliseconds(100),[&]{ return replies >= expected; })) {
+      timeouts++;
+      replies = expected;
+      continue;
+    }
+    if(i >= warmup)
+      latency.Add(std::chrono::duration<double,std::micro>(ClockT::now() - start).count());
+  }
+  client.DeleteHandler(handle);
+
+  std::cout << name << "  ";
+  latency.Print(std::cout);
+  std::cout << "  " << timeouts << std::endl;
+}
+
+//! Send a burst of servo reports and see how many reach the client, and how quickly.
+
+static void Burst(const std::string &name,ComsSimDeviceC &device,ComsC &client,int packets)
+{
+  std::atomic<int> received(0);
+  std::atomic<int64_t> lastAt(0);
+  ComsCallbackHandleC handle = client.SetHandler(CPT_ServoReport,[&](uint8_t *,int) {
+    received++;
+    lastAt = ClockT::now().time_since_epoch().count();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  ClockT::time_point start = ClockT::now();
+  device.Burst(packets);
+  double sendSeconds = std::chrono::duration<double>(ClockT::now() - start).count();
+  // Wait for the client to stop receiving.
+  int last = -1;
+  while(received != last) {
+    last = received;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+  client.DeleteHandler(handle);
+  double recvSeconds = std::chrono::duration<double>(ClockT::time_point(ClockT::duration(lastAt.load())) - start).count();
+
+  std::cout << name << "  " << packets / sendSeconds / 1e6 << "  " << (recvSeconds > 0 ? received / recvSeconds / 1e6 : 0.0)
+            << "  " << packets - received << std::endl;
+}
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  int trips = (argc > 1) ? atoi(argv[1]) : 10000;
+  int burst = (argc > 2) ? atoi(argv[2]) : 1000000;
+
+  auto device = std::make_shared<ComsSimDeviceC>();
+  std::vector<std::pair<std::string,std::function<std::shared_ptr<TransportC> ()> > > transports = {
+    { "shm", [&]{ return std::make_shared<TransportShmC>(device,logger); } },
+    { "tcp", [&]{ return std::make_shared<TransportTCPC>(device,logger); } }
+  };
+
+  std::cout << trips << " ReadParam round trips. " << std::endl;
+  std::cout << "Transport  " << BenchLatencyC::Titles("us") << "  Timeouts " << std::endl;
+  for(auto &a : transports) {
+    std::shared_ptr<TransportC> transport = a.second();
+    RoundTrips(a.first,*transport->Client(),trips);
+  }
+
+  std::cout << burst << " servo reports sent as fast as possible. " << std::endl;
+  std::cout << "Transport  Sent Mpkt/s  Received Mpkt/s  Lost " << std::endl;
+  for(auto &a : transports) {
+    std::shared_ptr<TransportC> transport = a.second();
+    Burst(a.first,*device,*transport->Client(),burst);
+  }
+  return 0;
+}
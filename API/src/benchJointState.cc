@@ -0,0 +1,96 @@
+
+// Measure how long it takes to read servo state from a shared memory
+// joint state table while a writer updates it as fast as it can, and
+// check that no reader ever sees a record half written.
+//
+// Usage: benchJointState [reads] [servos]
+
+#include "dogbot/JointStateShm.hh"
+#include "dogbot/ComsShm.hh"
+#include "BenchLatency.hh"
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  int reads = (argc > 1) ? atoi(argv[1]) : 1000000;
+  int servos = (argc > 2) ? atoi(argv[2]) : 12;
+
+  std::string addr = "shm://dogbot-joints-bench-" + std::to_string(getpid());
+  JointStateTableC writer;
+  if(!writer.Create(addr))
+    return 1;
+  JointStateTableC reader;
+  if(!reader.Attach(addr))
+    return 1;
+
+  // Every field the writer sets holds the same count, so a torn read shows up as a mismatch.
+  std::atomic<bool> terminate(false);
+  std::atomic<uint64_t> writes(0);
+  std::thread writerThread([&]{
+    JointStateC state;
+    memset(&state,0,sizeof(state));
+    state.m_valid = 1;
+    uint32_t count = 0;
+    while(!terminate) {
+      count++;
+      state.m_timestamp = count;
+      state.m_position = state.m_velocity = state.m_torque = count;
+      for(int i = 1;i <= servos;i++)
+        writer.Write(i,state);
+      writes += servos;
+    }
+  });
+
+  BenchLatencyC readTimes(reads);
+  uint64_t torn = 0;
+  JointStateC state;
+  for(int i = 0;i < reads;i++) {
+    int deviceId = 1 + (i % servos);
+    ClockT::time_point start = ClockT::now();
+    bool ok = reader.Read(deviceId,state);
+    readTimes.Add(std::chrono::duration<double,std::nano>(ClockT::now() - start).count());
+    if(ok && (state.m_position != (float) state.m_timestamp || state.m_velocity != state.m_position || state.m_torque != state.m_position))
+      torn++;
+  }
+
+  int snapshots = std::max(reads / servos,1);
+  BenchLatencyC snapshotTimes(snapshots);
+  std::vector<JointStateC> states;
+  states.reserve(g_jointStateRecords);
+  for(int i = 0;i < snapshots;i++) {
+    ClockT::time_point start = ClockT::now();
+    reader.Snapshot(states);
+    snapshotTimes.Add(std::chrono::duration<double,std::nano>(ClockT::now() - start).count());
+    for(auto &a : states) {
+      if(a.m_position != (float) a.m_timestamp || a.m_velocity != a.m_position || a.m_torque != a.m_position)
+        torn++;
+    }
+  }
+
+  terminate = true;
+  writerThread.join();
+
+  std::cout << servos << " servos, " << writes << " records written during the run. " << std::endl;
+  std::cout << "Read       " << BenchLatencyC::Titles("ns") << std::endl;
+  std::cout << "one servo  ";
+  readTimes.Print(std::cout);
+  std::cout << std::endl << "snapshot   ";
+  snapshotTimes.Print(std::cout);
+  std::cout << std::endl;
+  std::cout << "Torn reads: " << torn << std::endl;
+
+  reader.Detach();
+  writer.Detach();
+  shm_unlink(ComsShmRegionC::ShmName(addr).c_str());
+  return torn == 0 ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+
+// Compare pushing a configuration to a set of servos one parameter at a time
+// with ComsC::SetParam against issuing it all at once with ComsParamEngineC.
+// Devices are simulated, each frame occupies the bus for a fixed time and
+// devices take a while to answer.
+//
+// Usage: benchParamEngine [devices] [params per device, up to 18] [latency us] [drop percent]
+
+#include "dogbot/ComsParamEngine.hh"
+#include <iostream>
+#include <map>
+#include <condition_variable>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! Simulated set of devices which echo parameters back.
+
+class ComsSimParamC
+  : public ComsC
+{
+public:
+  ComsSimParamC(int latencyUs,int dropPercent)
+   : m_latency(latencyUs),
+     m_dropPercent(dropPercent)
+  {
+    m_thread = std::thread([this]{ Run(); });
+  }
+
+  ~ComsSimParamC()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_access);
+      m_done = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+  }
+
+  void SendPacket(const uint8_t *data,int len) override
+  {
+    const PacketParam8ByteC *pkt = reinterpret_cast<const PacketParam8ByteC *>(data);
+    std::lock_guard<std::mutex> lock(m_access);
+    m_sent++;
+    // Each frame, there and back, takes its turn on the bus.
+    ClockT::time_point now = ClockT::now();
+    m_busFree = std::max(m_busFree,now) + 2 * m_frameTime;
+    if((rand() % 100) < m_dropPercent)
+      return ;
+    PacketParam8ByteC reply;
+    reply.m_header = pkt->m_header;
+    reply.m_header.m_packetType = CPT_ReportParam;
+    int dataLen = len - sizeof(PacketParamHeaderC);
+    KeyT key(pkt->m_header.m_deviceId,pkt->m_header.m_index);
+    if(pkt->m_header.m_packetType == CPT_SetParam)
+      m_params[key] = std::vector<uint8_t>(pkt->m_data.uint8,pkt->m_data.uint8 + dataLen);
+    std::vector<uint8_t> &value = m_params[key];
+    memcpy(reply.m_data.uint8,value.data(),value.size());
+    const uint8_t *at = (const uint8_t *) &reply;
+    m_replies.insert(std::make_pair(m_busFree + m_latency,std::vector<uint8_t>(at,at + sizeof(reply.m_header) + value.size())));
+    m_wake.notify_all();
+  }
+
+  int Sent()
+  {
+    std::lock_guard<std::mutex> lock(m_access);
+    return m_sent;
+  }
+
+protected:
+  typedef std::pair<int,int> KeyT;
+
+  void Run()
+  {
+    std::unique_lock<std::mutex> lock(m_access);
+    while(!m_done) {
+      if(m_replies.empty()) {
+        m_wake.wait(lock);
+        continue;
+      }
+      auto it = m_replies.begin();
+      if(it->first > ClockT::now()) {
+        m_wake.wait_until(lock,it->first);
+        continue;
+      }
+      std::vector<uint8_t> pkt = it->second;
+      m_replies.erase(it);
+      lock.unlock();
+      ProcessPacket(pkt.data(),pkt.size());
+      lock.lock();
+    }
+  }
+
+  std::chrono::microseconds m_latency;
+  std::chrono::microseconds m_frameTime = std::chrono::microseconds(130); // 8 byte frame at 1 Mbit
+  int m_dropPercent = 0;
+  int m_sent = 0;
+
+  std::mutex m_access;
+  std::condition_variable m_wake;
+  bool m_done = false;
+  ClockT::time_point m_busFree;
+  std::multimap<ClockT::time_point,std::vector<uint8_t> > m_replies;
+  std::map<KeyT,std::vector<uint8_t> > m_params;
+  std::thread m_thread;
+};
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::err);
+
+  int devices = (argc > 1) ? atoi(argv[1]) : 12;
+  int params = (argc > 2) ? atoi(argv[2]) : 18;
+  int latencyUs = (argc > 3) ? atoi(argv[3]) : 2000;
+  int dropPercent = (argc > 4) ? atoi(argv[4]) : 0;
+
+  // Use the calibration table, it has plenty of entries and takes any value.
+  if(params > 18)
+    params = 18;
+  auto Param = [](int i) { return static_cast<enum ComsParameterIndexT>(CPI_ANGLE_CAL + i); };
+
+  std::cout << devices << " devices, " << params << " parameters each, " << latencyUs << " us latency, " << dropPercent << "% dropped. " << std::endl;
+
+  bool allOk = true;
+  {
+    auto sim = std::make_shared<ComsSimParamC>(latencyUs,dropPercent);
+    auto start = ClockT::now();
+    int failed = 0;
+    for(int d = 1;d <= devices;d++)
+      for(int i = 0;i < params;i++)
+        if(!sim->SetParam(d,Param(i),(uint16_t) (d * 100 + i)))
+          failed++;
+    double elapsed = std::chrono::duration<double>(ClockT::now() - start).count();
+    std::cout << "SetParam:  " << elapsed * 1000.0 << " ms, " << sim->Sent() << " packets sent, " << failed << " failed. " << std::endl;
+    if(dropPercent == 0 && failed != 0)
+      allOk = false;
+  }
+
+  {
+    auto sim = std::make_shared<ComsSimParamC>(latencyUs,dropPercent);
+    ComsParamEngineC engine(sim);
+    auto start = ClockT::now();
+    std::vector<std::future<bool> > results;
+    for(int d = 1;d <= devices;d++)
+      for(int i = 0;i < params;i++)
+        results.push_back(engine.SetParam(d,Param(i),(uint16_t) (d * 100 + i)));
+    int failed = 0;
+    for(auto &r : results)
+      if(!r.get())
+        failed++;
+    double elapsed = std::chrono::duration<double>(ClockT::now() - start).count();
+    std::cout << "Engine:    " << elapsed * 1000.0 << " ms, " << sim->Sent() << " packets sent, " << failed << " failed. " << std::endl;
+    if(dropPercent == 0 && failed != 0)
+      allOk = false;
+
+    // Read back what was set.
+    std::vector<std::future<ComsParamResultC> > reads;
+    for(int d = 1;d <= devices;d++)
+      for(int i = 0;i < params;i++)
+        reads.push_back(engine.ReadParam(d,Param(i)));
+    int wrong = 0;
+    for(int d = 1,n = 0;d <= devices;d++) {
+      for(int i = 0;i < params;i++,n++) {
+        ComsParamResultC r = reads[n].get();
+        if(r.m_ok && (r.m_len != 2 || r.m_data.uint16[0] != d * 100 + i))
+          wrong++;
+      }
+    }
+    if(wrong != 0) {
+      std::cout << "Read back " << wrong << " wrong values. " << std::endl;
+      allOk = false;
+    }
+  }
+  return allOk ? 0 : 1;
+}
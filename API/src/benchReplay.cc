@@ -0,0 +1,102 @@
+
+// Replay a packet log as fast as possible, first to a single handler to
+// show what the replay itself costs, then through DogBotAPIC to load the
+// whole stack. Without a log one is made with 12 servos reporting.
+//
+// Usage: benchReplay [log file] [passes]
+
+#include "dogbot/ComsReplay.hh"
+#include "dogbot/DogBotAPI.hh"
+#include <iostream>
+#include <unistd.h>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! Record announcements from 12 servos followed by 'reports' servo reports.
+
+static bool MakeLog(const std::string &filename,int reports)
+{
+  auto device = std::make_shared<ComsC>();
+  ComsRecorderC recorder(device);
+  if(!recorder.Open(filename))
+    return false;
+  for(int i = 1;i <= 12;i++) {
+    PacketDeviceIdC announce;
+    memset(&announce,0,sizeof(announce));
+    announce.m_packetType = CPT_AnnounceId;
+    announce.m_deviceId = i;
+    announce.m_uid[0] = 0x1000 + i;
+    announce.m_uid[1] = 0x2000 + i;
+    device->ProcessPacket((uint8_t *) &announce,sizeof(announce));
+  }
+  PacketServoReportC report;
+  memset(&report,0,sizeof(report));
+  report.m_packetType = CPT_ServoReport;
+  for(int i = 0;i < reports;i++) {
+    report.m_deviceId = 1 + (i % 12);
+    report.m_timestamp = i / 12;
+    report.m_position = i;
+    device->ProcessPacket((uint8_t *) &report,sizeof(report));
+  }
+  recorder.Close();
+  return true;
+}
+
+//! Replay 'filename' 'passes' times into 'replay' and print the rate.
+
+static void Play(const std::string &name,ComsReplayC &replay,const std::string &filename,int passes,std::atomic<uint64_t> &handled)
+{
+  replay.SetSpeed(0);
+  replay.SetRepeat(passes);
+  if(!replay.Open("replay:" + filename))
+    return ;
+  // Playing starts a short time after the handlers are in place, time from the first packet.
+  while(replay.Played() == 0 && !replay.Wait(std::chrono::milliseconds(0)))
+    std::this_thread::yield();
+  ClockT::time_point start = ClockT::now();
+  uint64_t startPlayed = replay.Played();
+  replay.Wait(std::chrono::minutes(10));
+  double seconds = std::chrono::duration<double>(ClockT::now() - start).count();
+  uint64_t played = replay.Played() - startPlayed;
+  std::cout << name << "  " << played << "  " << seconds << "  " << played / seconds / 1e6 << "  " << handled << std::endl;
+  replay.Close();
+}
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  std::string filename;
+  bool madeLog = false;
+  if(argc > 1) {
+    filename = argv[1];
+  } else {
+    filename = "/tmp/dogbot-replay-" + std::to_string(getpid()) + ".log";
+    if(!MakeLog(filename,1200000))
+      return 1;
+    madeLog = true;
+  }
+  int passes = (argc > 2) ? atoi(argv[2]) : 1;
+
+  std::cout << "Stack      Packets  Seconds  Mpkt/s  Handled " << std::endl;
+  {
+    auto replay = std::make_shared<ComsReplayC>();
+    std::atomic<uint64_t> handled(0);
+    replay->SetGenericHandler([&handled](uint8_t *,int) { handled++; });
+    Play("handler  ",*replay,filename,passes,handled);
+  }
+  {
+    auto replay = std::make_shared<ComsReplayC>();
+    std::atomic<uint64_t> handled(0);
+    DogBotAPIC api(replay,logger,false,DogBotAPIC::DMM_ClientOnly);
+    api.AddServoStatusHandler([&handled](JointC *,DogBotAPIC::ServoUpdateTypeT) { handled++; });
+    Play("DogBotAPI",*replay,filename,passes,handled);
+  }
+
+  if(madeLog)
+    unlink(filename.c_str());
+  return 0;
+}
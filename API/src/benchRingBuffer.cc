@@ -0,0 +1,152 @@
+
+// Measure the cost of queuing a packet for transmission from one or more
+// threads, using the lock free ring ComsUSBC queues packets in, against a
+// mutex protected deque as it used to be. A consumer thread drains the queue
+// the way the USB thread does. Then check and time the single producer ring
+// received data is passed to the dispatch thread through.
+//
+// Usage: benchRingBuffer [packets per thread]
+
+#include "dogbot/ComsUSB.hh"
+#include <iostream>
+#include <deque>
+#include <chrono>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! Queue a packet and account for the time it took.
+
+template<typename PushT>
+static double RunProducers(int threads,int packets,const PushT &push)
+{
+  std::vector<std::thread> producers;
+  std::vector<double> elapsed(threads);
+  for(int t = 0;t < threads;t++) {
+    producers.push_back(std::thread([&,t]{
+      DataPacketT packet;
+      packet.m_len = sizeof(PacketServoC);
+      memset(packet.m_data,t,packet.m_len);
+      auto start = ClockT::now();
+      for(int i = 0;i < packets;i++) {
+        // Retry until there is space, as a control loop would drop instead.
+        while(!push(packet))
+          std::this_thread::yield();
+      }
+      elapsed[t] = std::chrono::duration<double,std::nano>(ClockT::now() - start).count();
+    }));
+  }
+  double total = 0;
+  for(int t = 0;t < threads;t++) {
+    producers[t].join();
+    total += elapsed[t];
+  }
+  return total / ((double) threads * packets);
+}
+
+int main(int argc,char **argv)
+{
+  int packets = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+  std::cout << "Producers  Ring ns/packet  Mutex ns/packet " << std::endl;
+  for(int threads = 1;threads <= 4;threads *= 2) {
+    double ringTime = 0;
+    {
+      MPSCRingC<DataPacketT> ring(64);
+      std::atomic<bool> done(false);
+      std::atomic<long> received(0);
+      std::thread consumer([&]{
+        while(!done || !ring.IsEmpty()) {
+          DataPacketT *packet = ring.Front();
+          if(packet == nullptr) {
+            std::this_thread::yield();
+            continue;
+          }
+          ring.PopFront();
+          received++;
+        }
+      });
+      ringTime = RunProducers(threads,packets,[&ring](const DataPacketT &packet) { return ring.Push(packet); });
+      done = true;
+      consumer.join();
+      if(received != (long) threads * packets) {
+        std::cerr << "Lost packets, expected " << (long) threads * packets << " got " << received << std::endl;
+        return 1;
+      }
+    }
+
+    double mutexTime = 0;
+    {
+      std::mutex access;
+      std::deque<DataPacketT> queue;
+      std::atomic<bool> done(false);
+      std::thread consumer([&]{
+        for(;;) {
+          std::unique_lock<std::mutex> lock(access);
+          if(queue.empty()) {
+            if(done)
+              break;
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+          }
+          queue.pop_front();
+        }
+      });
+      mutexTime = RunProducers(threads,packets,[&](const DataPacketT &packet) {
+        std::lock_guard<std::mutex> lock(access);
+        if(queue.size() > 64)
+          return false;
+        queue.push_back(packet);
+        return true;
+      });
+      done = true;
+      consumer.join();
+    }
+    std::cout << threads << "  " << ringTime << "  " << mutexTime << std::endl;
+  }
+
+  {
+    SPSCRingC<DataPacketT> ring(256);
+    std::atomic<bool> done(false);
+    long errors = 0;
+    std::thread consumer([&]{
+      uint8_t expect = 0;
+      while(!done || !ring.IsEmpty()) {
+        DataPacketT *frame = ring.Front();
+        if(frame == nullptr) {
+          std::this_thread::yield();
+          continue;
+        }
+        if(frame->m_data[0] != expect++)
+          errors++;
+        ring.PopFront();
+      }
+    });
+    long overflows = 0;
+    uint8_t count = 0;
+    auto start = ClockT::now();
+    for(int i = 0;i < packets;i++) {
+      DataPacketT *frame = ring.Back();
+      if(frame == nullptr) {
+        overflows++;
+        std::this_thread::yield();
+        i--;
+        continue;
+      }
+      frame->m_len = 64;
+      memset(frame->m_data,count++,64);
+      ring.PushBack();
+    }
+    double elapsed = std::chrono::duration<double,std::nano>(ClockT::now() - start).count();
+    done = true;
+    consumer.join();
+    std::cout << "Receive ring: " << elapsed / packets << " ns/frame, " << overflows << " times full. " << std::endl;
+    if(errors != 0) {
+      std::cerr << "Receive ring delivered " << errors << " frames out of order. " << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
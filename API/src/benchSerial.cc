@@ -0,0 +1,512 @@
+
+// Measure the cost of decoding the serial link framing, comparing the block
+// decoder in SerialFrame.hh with the one byte at a time state machine it
+// replaced. A stream of servo sized packets, with some bytes corrupted, is
+// decoded from memory and then sent through a pty pair. The two decoders
+// must find the same packets.
+//
+// Then compare STX and COBS framing on a stream with bursts of line noise,
+// counting packets lost beyond those the noise hit, and corrupted packets
+// that got through. Finally ComsSerialC negotiates each framing with a
+// simulated device on a pty pair and receives a stream with it.
+//
+// Usage: benchSerial [packets] [corrupt bytes per million] [noise bursts per million bytes]
+
+#include "dogbot/ComsSerial.hh"
+#include <iostream>
+#include <algorithm>
+#include <pty.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! The original state machine, one byte at a time. Frames with no data are
+//! read correctly so the results can be compared with SerialFrameDecoderC.
+
+class ByteDecoderC
+{
+public:
+  template<typename HandlerT>
+  void AcceptByte(uint8_t sendByte,const HandlerT &handler)
+  {
+    switch(m_state)
+    {
+    case 0: // Wait for STX.
+      if(sendByte == g_serialFrameSTX)
+        m_state = 1;
+      break;
+    case 1: // Packet length.
+      m_packetLen = sendByte;
+      if(m_packetLen > 64) {
+        m_state = 0;
+        break;
+      }
+      m_at = 0;
+      m_checkSum = 0x55 + m_packetLen;
+      m_state = (m_packetLen == 0) ? 3 : 2;
+      break;
+    case 2: // Data
+      m_checkSum += sendByte;
+      m_data[m_at++] = sendByte;
+      if(m_at >= m_packetLen)
+        m_state = 3;
+      break;
+    case 3: // CRC 1
+      if((m_checkSum & 0xff) != sendByte) {
+        m_state = (sendByte == g_serialFrameSTX) ? 1 : 0;
+        break;
+      }
+      m_state = 4;
+      break;
+    case 4: // CRC 2
+      if(((m_checkSum >> 8) & 0xff) != sendByte) {
+        m_state = (sendByte == g_serialFrameSTX) ? 1 : 0;
+        break;
+      }
+      m_state = 5;
+      break;
+    case 5: // ETX.
+      if(sendByte == g_serialFrameETX) {
+        handler(m_data,m_packetLen);
+      } else if(sendByte == g_serialFrameSTX) {
+        m_state = 1;
+        break;
+      }
+      m_state = 0;
+      break;
+    }
+  }
+
+protected:
+  int m_state = 0;
+  int m_checkSum = 0;
+  int m_packetLen = 0;
+  uint8_t m_data[64];
+  int m_at = 0;
+};
+
+//! Summary of the packets found.
+
+class ResultC
+{
+public:
+  void Add(const uint8_t *data,int len)
+  {
+    m_packets++;
+    for(int i = 0;i < len;i++)
+      m_sum = m_sum * 31 + data[i];
+  }
+
+  long m_packets = 0;
+  uint64_t m_sum = 0;
+};
+
+//! Build a stream of servo reports and parameter replies.
+
+static std::vector<uint8_t> MakeStream(int packets,int corruptPerMillion)
+{
+  std::vector<uint8_t> stream;
+  uint8_t frame[64 + g_serialFrameOverhead];
+  uint8_t data[64];
+  for(int i = 0;i < packets;i++) {
+    int len = (i % 4 == 0) ? 11 : sizeof(PacketServoReportC);
+    for(int j = 0;j < len;j++)
+      data[j] = rand();
+    data[0] = (i % 4 == 0) ? CPT_ReportParam : CPT_ServoReport;
+    int frameLen = SerialFrameEncode(frame,data,len);
+    stream.insert(stream.end(),frame,frame + frameLen);
+  }
+  if(corruptPerMillion > 0) {
+    for(size_t i = 0;i < stream.size();i++)
+      if((rand() % 1000000) < corruptPerMillion)
+        stream[i] = rand();
+  }
+  return stream;
+}
+
+//! Open a pty pair, returns the master and slave fds.
+
+static bool OpenPty(int &master,int &slave,std::string &slaveName)
+{
+  char name[256];
+  if(openpty(&master,&slave,name,0,0) < 0) {
+    std::cerr << "Failed to open pty. " << strerror(errno) << std::endl;
+    return false;
+  }
+  termios termios_p;
+  tcgetattr(slave,&termios_p);
+  cfmakeraw(&termios_p);
+  tcsetattr(slave,TCSANOW,&termios_p);
+  slaveName = name;
+  return true;
+}
+
+//! Write a stream to a fd from another thread.
+
+static std::thread WriteStream(int fd,const std::vector<uint8_t> &stream)
+{
+  return std::thread([fd,&stream]{
+    size_t at = 0;
+    while(at < stream.size()) {
+      ssize_t n = write(fd,stream.data() + at,std::min((size_t) 4096,stream.size() - at));
+      if(n < 0) {
+        if(errno == EAGAIN || errno == EINTR)
+          continue;
+        break;
+      }
+      at += n;
+    }
+  });
+}
+
+//! Read the stream through a pty, passing each block read to 'decode'.
+
+template<typename DecodeT>
+static double RunPty(const std::vector<uint8_t> &stream,const DecodeT &decode)
+{
+  int master = -1,slave = -1;
+  std::string slaveName;
+  if(!OpenPty(master,slave,slaveName))
+    return -1;
+  auto start = ClockT::now();
+  std::thread writer = WriteStream(master,stream);
+  uint8_t readBuff[4096];
+  size_t total = 0;
+  while(total < stream.size()) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(slave,&fds);
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    if(select(slave+1,&fds,0,0,&timeout) <= 0)
+      break;
+    ssize_t n = read(slave,readBuff,sizeof(readBuff));
+    if(n <= 0)
+      break;
+    decode(readBuff,n);
+    total += n;
+  }
+  double elapsed = std::chrono::duration<double>(ClockT::now() - start).count();
+  writer.join();
+  close(master);
+  close(slave);
+  if(total != stream.size()) {
+    std::cerr << "Only received " << total << " of " << stream.size() << " bytes. " << std::endl;
+    return -1;
+  }
+  return elapsed;
+}
+
+//! Contents of the packet with sequence number 'seq'.
+
+static int MakePacket(uint8_t *data,uint32_t seq)
+{
+  const int len = sizeof(PacketServoReportC);
+  data[0] = CPT_ServoReport;
+  memcpy(data + 1,&seq,sizeof(seq));
+  uint32_t hash = seq * 2654435761u;
+  for(int i = 1 + sizeof(seq);i < len;i++) {
+    hash = hash * 1103515245u + 12345u;
+    data[i] = hash >> 24;
+  }
+  return len;
+}
+
+//! Encode 'packets' numbered packets with 'framing', noting where each frame starts.
+
+static std::vector<uint8_t> MakeFramedStream(SerialFramingT framing,int packets,std::vector<size_t> *starts = 0)
+{
+  std::vector<uint8_t> stream;
+  uint8_t frame[64 + g_serialFrameOverhead];
+  uint8_t data[64];
+  for(int i = 0;i < packets;i++) {
+    int len = MakePacket(data,i);
+    int frameLen = (framing == SF_COBSCRC16) ? SerialFrameEncodeCOBS(frame,data,len) : SerialFrameEncode(frame,data,len);
+    if(starts != 0)
+      starts->push_back(stream.size());
+    stream.insert(stream.end(),frame,frame + frameLen);
+  }
+  return stream;
+}
+
+//! Count of packets received.
+
+class SequenceCheckC
+{
+public:
+  SequenceCheckC(int packets)
+   : m_seen(packets,false)
+  {}
+
+  void Add(const uint8_t *data,int len)
+  {
+    uint8_t expect[64];
+    uint32_t seq = 0;
+    if(len >= 5)
+      memcpy(&seq,data + 1,sizeof(seq));
+    if(seq >= m_seen.size() || len != MakePacket(expect,seq) || memcmp(expect,data,len) != 0) {
+      m_corrupt++;
+      return ;
+    }
+    if(!m_seen[seq])
+      m_good++;
+    m_seen[seq] = true;
+  }
+
+  std::vector<bool> m_seen;
+  long m_good = 0;
+  long m_corrupt = 0;
+};
+
+//! Decode a stream with bursts of noise in it with 'framing'.
+
+static bool RunNoise(SerialFramingT framing,int packets,int burstsPerMillion)
+{
+  std::vector<size_t> starts;
+  std::vector<uint8_t> stream = MakeFramedStream(framing,packets,&starts);
+
+  // Time decoding the clean stream.
+  double cleanTime = 0;
+  {
+    std::vector<uint8_t> buff(stream);
+    SequenceCheckC check(packets);
+    auto handler = [&check](const uint8_t *data,int len) { check.Add(data,len); };
+    SerialFrameDecoderC<64> decoder;
+    SerialFrameCOBSDecoderC<64> decoderCOBS;
+    auto start = ClockT::now();
+    for(size_t at = 0;at < buff.size();at += 4096) {
+      size_t n = std::min((size_t) 4096,buff.size() - at);
+      if(framing == SF_COBSCRC16)
+        decoderCOBS.Decode(&buff[at],n,handler);
+      else
+        decoder.Decode(&buff[at],n,handler);
+    }
+    cleanTime = std::chrono::duration<double>(ClockT::now() - start).count();
+    if(check.m_good != packets) {
+      std::cerr << "Lost packets from a clean stream. " << std::endl;
+      return false;
+    }
+  }
+
+  // Overwrite bursts of 1 to 8 bytes with noise, noting the frames hit.
+  std::vector<bool> hit(packets,false);
+  srand(1234);
+  for(size_t i = 0;i < stream.size();i++) {
+    if((rand() % 1000000) >= burstsPerMillion)
+      continue;
+    int burst = 1 + rand() % 8;
+    for(int j = 0;j < burst && i < stream.size();j++,i++) {
+      stream[i] = rand();
+      size_t frame = std::upper_bound(starts.begin(),starts.end(),i) - starts.begin() - 1;
+      hit[frame] = true;
+    }
+  }
+  long hitCount = std::count(hit.begin(),hit.end(),true);
+
+  SequenceCheckC check(packets);
+  auto handler = [&check](const uint8_t *data,int len) { check.Add(data,len); };
+  SerialFrameDecoderC<64> decoder;
+  SerialFrameCOBSDecoderC<64> decoderCOBS;
+  auto start = ClockT::now();
+  for(size_t at = 0;at < stream.size();at += 4096) {
+    size_t n = std::min((size_t) 4096,stream.size() - at);
+    if(framing == SF_COBSCRC16)
+      decoderCOBS.Decode(&stream[at],n,handler);
+    else
+      decoder.Decode(&stream[at],n,handler);
+  }
+  double noisyTime = std::chrono::duration<double>(ClockT::now() - start).count();
+
+  // Packets lost that the noise didn't touch.
+  long collateral = 0;
+  for(int i = 0;i < packets;i++)
+    if(!check.m_seen[i] && !hit[i])
+      collateral++;
+
+  std::cout << ((framing == SF_COBSCRC16) ? "COBS CRC-16  " : "STX checksum ")
+            << (double) stream.size() / packets << "  "
+            << stream.size() / 1e6 / cleanTime << "  " << stream.size() / 1e6 / noisyTime << "  "
+            << hitCount << "  " << packets - check.m_good << "  " << collateral << "  " << check.m_corrupt << std::endl;
+  return true;
+}
+
+//! Simulated device on the master side of a pty, it answers framing requests
+//! and discards anything else.
+
+class DeviceSimC
+{
+public:
+  DeviceSimC(int fd)
+   : m_fd(fd)
+  {
+    m_thread = std::thread([this]{ Run(); });
+  }
+
+  ~DeviceSimC()
+  {
+    m_done = true;
+    m_thread.join();
+  }
+
+  SerialFramingT Framing() const
+  { return (SerialFramingT) m_framing.load(); }
+
+protected:
+  void Run()
+  {
+    uint8_t buff[256];
+    auto handler = [this](const uint8_t *data,int len) {
+      if(data[0] != CPT_SerialFraming || len != sizeof(PacketSerialFramingC))
+        return ;
+      uint8_t frame[16];
+      int frameLen = SerialFrameEncode(frame,data,len);
+      if(write(m_fd,frame,frameLen) != frameLen)
+        std::cerr << "Failed to write framing reply. " << std::endl;
+      m_framing = data[1];
+      m_decoder.Pause();
+    };
+    while(!m_done) {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(m_fd,&fds);
+      struct timeval timeout;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 10000;
+      if(select(m_fd+1,&fds,0,0,&timeout) <= 0)
+        continue;
+      ssize_t n = read(m_fd,buff,sizeof(buff));
+      if(n <= 0)
+        continue;
+      size_t at = 0;
+      while(at < (size_t) n) {
+        if(m_framing == SF_COBSCRC16)
+          at += m_decoderCOBS.Decode(buff + at,n - at,handler);
+        else
+          at += m_decoder.Decode(buff + at,n - at,handler);
+      }
+    }
+  }
+
+  int m_fd;
+  std::atomic<bool> m_done { false };
+  std::atomic<int> m_framing { SF_STXChecksum };
+  SerialFrameDecoderC<64> m_decoder;
+  SerialFrameCOBSDecoderC<64> m_decoderCOBS;
+  std::thread m_thread;
+};
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::err);
+
+  int packets = (argc > 1) ? atoi(argv[1]) : 1000000;
+  int corruptPerMillion = (argc > 2) ? atoi(argv[2]) : 100;
+  int burstsPerMillion = (argc > 3) ? atoi(argv[3]) : 1000;
+
+  std::vector<uint8_t> stream = MakeStream(packets,corruptPerMillion);
+  double mbytes = stream.size() / 1e6;
+  std::cout << packets << " packets, " << stream.size() << " bytes, " << corruptPerMillion << " bytes per million corrupted. " << std::endl;
+  std::cout << "Test               Byte decoder MB/s  Block decoder MB/s " << std::endl;
+
+  bool ok = true;
+
+  // Decode from memory, in reads of various sizes.
+  for(size_t blockSize : { (size_t) 61, (size_t) 1024, (size_t) 4096 }) {
+    ResultC byteResult;
+    ByteDecoderC byteDecoder;
+    auto start = ClockT::now();
+    for(size_t i = 0;i < stream.size();i++)
+      byteDecoder.AcceptByte(stream[i],[&byteResult](const uint8_t *data,int len) { byteResult.Add(data,len); });
+    double byteTime = std::chrono::duration<double>(ClockT::now() - start).count();
+
+    ResultC blockResult;
+    SerialFrameDecoderC<64> blockDecoder;
+    std::vector<uint8_t> buff(stream);
+    start = ClockT::now();
+    for(size_t at = 0;at < buff.size();at += blockSize)
+      blockDecoder.Decode(&buff[at],std::min(blockSize,buff.size() - at),[&blockResult](const uint8_t *data,int len) { blockResult.Add(data,len); });
+    double blockTime = std::chrono::duration<double>(ClockT::now() - start).count();
+
+    std::cout << "Memory, " << blockSize << " byte reads  " << mbytes / byteTime << "  " << mbytes / blockTime << std::endl;
+    if(byteResult.m_packets != blockResult.m_packets || byteResult.m_sum != blockResult.m_sum) {
+      std::cerr << "Decoders disagree, byte decoder found " << byteResult.m_packets << " packets, block decoder " << blockResult.m_packets << std::endl;
+      ok = false;
+    }
+  }
+
+  // Decode through a pty pair.
+  {
+    ResultC byteResult;
+    ByteDecoderC byteDecoder;
+    double byteTime = RunPty(stream,[&](uint8_t *data,size_t len) {
+      for(size_t i = 0;i < len;i++)
+        byteDecoder.AcceptByte(data[i],[&byteResult](const uint8_t *packet,int packetLen) { byteResult.Add(packet,packetLen); });
+    });
+    ResultC blockResult;
+    SerialFrameDecoderC<64> blockDecoder;
+    double blockTime = RunPty(stream,[&](uint8_t *data,size_t len) {
+      blockDecoder.Decode(data,len,[&blockResult](const uint8_t *packet,int packetLen) { blockResult.Add(packet,packetLen); });
+    });
+    if(byteTime < 0 || blockTime < 0)
+      return 1;
+    std::cout << "Pty pair            " << mbytes / byteTime << "  " << mbytes / blockTime << std::endl;
+    if(byteResult.m_packets != blockResult.m_packets || byteResult.m_sum != blockResult.m_sum) {
+      std::cerr << "Decoders disagree over pty, byte decoder found " << byteResult.m_packets << " packets, block decoder " << blockResult.m_packets << std::endl;
+      ok = false;
+    }
+  }
+
+  // Compare framing on a noisy stream.
+  std::cout << std::endl << burstsPerMillion << " noise bursts per million bytes. " << std::endl;
+  std::cout << "Framing      Bytes/packet  Clean MB/s  Noisy MB/s  Packets hit  Lost  Lost untouched  Corrupt delivered " << std::endl;
+  for(auto framing : { SF_STXChecksum, SF_COBSCRC16 })
+    if(!RunNoise(framing,packets,burstsPerMillion))
+      ok = false;
+
+  // Negotiate framing and receive with ComsSerialC.
+  std::cout << std::endl;
+  for(auto framing : { SF_STXChecksum, SF_COBSCRC16 }) {
+    int master = -1,slave = -1;
+    std::string slaveName;
+    if(!OpenPty(master,slave,slaveName))
+      return 1;
+    std::atomic<long> received(0);
+    {
+      DeviceSimC device(master);
+      ComsSerialC coms;
+      coms.SetFraming(framing);
+      coms.SetGenericHandler([&received](uint8_t *,int) { received++; });
+      if(!coms.Open(slaveName)) {
+        std::cerr << "Failed to open " << slaveName << std::endl;
+        return 1;
+      }
+      if(coms.Framing() != framing || device.Framing() != framing) {
+        std::cerr << "Failed to negotiate framing " << (int) framing << std::endl;
+        ok = false;
+      }
+      // Let the packets sent when the port is opened arrive.
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+      std::vector<uint8_t> clean = MakeFramedStream(framing,packets);
+      auto start = ClockT::now();
+      std::thread writer = WriteStream(master,clean);
+      writer.join();
+      for(int i = 0;i < 200 && received < packets;i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      double elapsed = std::chrono::duration<double>(ClockT::now() - start).count();
+      std::cout << "ComsSerialC " << ((framing == SF_COBSCRC16) ? "COBS: " : "STX:  ") << clean.size() / 1e6 / elapsed << " MB/s, " << received << " of " << packets << " packets. " << std::endl;
+      if(received != packets)
+        ok = false;
+      coms.Close();
+    }
+    close(master);
+    close(slave);
+  }
+  return ok ? 0 : 1;
+}
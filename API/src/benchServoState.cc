@@ -0,0 +1,145 @@
+
+// Measure how long ServoC::GetStateAt() takes while servo reports are
+// handled as fast as possible on another thread, with a growing number of
+// threads reading at the same time, and check that no reader ever sees
+// the state of one report mixed with another.
+//
+// Usage: benchServoState [reads per thread] [servos] [max reader threads]
+
+#include "dogbot/DogBotAPI.hh"
+#include "BenchLatency.hh"
+#include <iostream>
+#include <algorithm>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! Stands in for the servos, ignoring the queries the monitor thread sends them.
+
+class ComsDiscardC
+  : public ComsC
+{
+public:
+  void SendPacket(const uint8_t *,int) override
+  {}
+};
+
+//! Announce device 'deviceId' until 'api', which starts listening from its
+//! monitor thread, has picked it up.
+
+static std::shared_ptr<ServoC> Announce(DogBotAPIC &api,ComsC &coms,int deviceId)
+{
+  PacketDeviceIdC announce;
+  memset(&announce,0,sizeof(announce));
+  announce.m_packetType = CPT_AnnounceId;
+  announce.m_deviceId = deviceId;
+  announce.m_uid[0] = 0x1000 + deviceId;
+  announce.m_uid[1] = 0x2000 + deviceId;
+  std::shared_ptr<ServoC> servo;
+  for(int i = 0;i < 100 && !servo;i++) {
+    coms.ProcessPacket((uint8_t *) &announce,sizeof(announce));
+    servo = api.GetServoById(deviceId);
+    if(!servo)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return servo;
+}
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::err);
+
+  int reads = (argc > 1) ? atoi(argv[1]) : 1000000;
+  int servoCount = (argc > 2) ? atoi(argv[2]) : 12;
+  int maxReaders = (argc > 3) ? atoi(argv[3]) : 4;
+
+  auto coms = std::make_shared<ComsDiscardC>();
+  DogBotAPIC api(coms,logger,false,DogBotAPIC::DMM_ClientOnly);
+  std::vector<std::shared_ptr<ServoC> > servos;
+  for(int i = 1;i <= servoCount;i++) {
+    std::shared_ptr<ServoC> servo = Announce(api,*coms,i);
+    if(!servo) {
+      std::cerr << "Servo " << i << " was not picked up. " << std::endl;
+      return 1;
+    }
+    servos.push_back(servo);
+  }
+
+  // Every report carries the same count as its position and torque, so a
+  // read mixing two reports shows up as torque out of proportion to position.
+  PacketServoReportC report;
+  memset(&report,0,sizeof(report));
+  report.m_packetType = CPT_ServoReport;
+  report.m_position = 1000;
+  report.m_torque = 1000;
+  for(int i = 1;i <= servoCount;i++) {
+    report.m_deviceId = i;
+    coms->ProcessPacket((uint8_t *) &report,sizeof(report));
+  }
+  JointC::TimePointT tick;
+  double position = 0,velocity = 0,torque = 0;
+  servos[0]->GetState(tick,position,velocity,torque);
+  if(position == 0 || torque == 0) {
+    std::cerr << "Servo reports were not handled. " << std::endl;
+    return 1;
+  }
+  double torquePerPosition = torque / position;
+
+  std::cout << "Readers  Reports/s  " << BenchLatencyC::Titles("ns") << "  Torn " << std::endl;
+  for(int readers = 0;readers <= maxReaders;readers = (readers == 0) ? 1 : readers * 2) {
+    std::atomic<bool> terminate(false);
+    std::atomic<uint64_t> reports(0);
+    std::thread writerThread([&]{
+      PacketServoReportC pkt = report;
+      uint32_t count = 0;
+      while(!terminate) {
+        count++;
+        pkt.m_timestamp = count;
+        pkt.m_position = pkt.m_torque = 1 + (count % 30000);
+        for(int i = 1;i <= servoCount;i++) {
+          pkt.m_deviceId = i;
+          coms->ProcessPacket((uint8_t *) &pkt,sizeof(pkt));
+        }
+        reports += servoCount;
+      }
+    });
+
+    std::vector<BenchLatencyC> times(readers);
+    std::atomic<uint64_t> torn(0);
+    std::vector<std::thread> readerThreads;
+    ClockT::time_point start = ClockT::now();
+    for(int r = 0;r < readers;r++) {
+      readerThreads.push_back(std::thread([&,r]{
+        BenchLatencyC &readTimes = times[r];
+        readTimes = BenchLatencyC(reads);
+        double position,velocity,torque;
+        for(int i = 0;i < reads;i++) {
+          ClockT::time_point at = ClockT::now();
+          servos[i % servoCount]->GetStateAt(at,position,velocity,torque);
+          readTimes.Add(std::chrono::duration<double,std::nano>(ClockT::now() - at).count());
+          if(fabs(torque - position * torquePerPosition) > fabs(torque) * 1e-4)
+            torn++;
+        }
+      }));
+    }
+    if(readers == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    for(auto &a : readerThreads)
+      a.join();
+    double elapsed = std::chrono::duration<double>(ClockT::now() - start).count();
+    terminate = true;
+    writerThread.join();
+
+    BenchLatencyC all;
+    for(auto &a : times)
+      all.Add(a);
+    std::cout << readers << "  " << reports / elapsed << "  ";
+    all.Print(std::cout);
+    std::cout << "  " << torn << std::endl;
+    if(torn != 0)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,80 @@
+
+// Run DogBotAPIC against a set of simulated controllers to see how the API
+// copes with many joints. Times how long it takes for every device to be
+// given an id and start running, then has every joint follow a sine wave
+// and counts the servo updates handled, and how far the joints fall behind.
+//
+// Usage: benchSim [devices] [rate] [seconds]
+
+#include "dogbot/DogBotAPI.hh"
+#include "dogbot/ComsSim.hh"
+#include <iostream>
+#include <cmath>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  int devices = (argc > 1) ? atoi(argv[1]) : 48;
+  int rate = (argc > 2) ? atoi(argv[2]) : 100;
+  double seconds = (argc > 3) ? atof(argv[3]) : 5.0;
+
+  std::atomic<uint64_t> updates(0);
+  ClockT::time_point start = ClockT::now();
+  DogBotAPIC api("sim:" + std::to_string(devices) + "," + std::to_string(rate),"",logger);
+  api.AddServoStatusHandler([&updates](JointC *,DogBotAPIC::ServoUpdateTypeT op) { if(op == DogBotAPIC::SUT_Updated) updates++; });
+
+  // Wait for every device to be given an id and report it is ready.
+  std::vector<std::shared_ptr<ServoC> > servos;
+  while(ClockT::now() - start < std::chrono::seconds(30)) {
+    servos.clear();
+    for(auto &a : api.ListServos()) {
+      if(a && a->Id() != 0 && a->ControlState() == CS_Ready)
+        servos.push_back(a);
+    }
+    if((int) servos.size() >= devices)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  double readyTime = std::chrono::duration<double>(ClockT::now() - start).count();
+  if((int) servos.size() < devices) {
+    std::cerr << "Only " << servos.size() << " of " << devices << " devices became ready. " << std::endl;
+    return 1;
+  }
+
+  api.DemandHoldPosition();
+  std::vector<float> origin;
+  for(auto &a : servos)
+    origin.push_back(a->Position());
+
+  // Move every joint at 1Hz, demands sent at the report rate.
+  uint64_t startUpdates = updates;
+  start = ClockT::now();
+  ClockT::time_point next = start;
+  float maxError = 0;
+  for(;;) {
+    ClockT::time_point now = ClockT::now();
+    double t = std::chrono::duration<double>(now - start).count();
+    if(t > seconds)
+      break;
+    for(size_t i = 0;i < servos.size();i++) {
+      // Give the joints a second to get going.
+      if(t > 1.0)
+        maxError = std::max(maxError,(float) fabs(servos[i]->Position() - origin[i] - 0.5 * sin(2 * M_PI * t)));
+      servos[i]->DemandPosition(origin[i] + 0.5 * sin(2 * M_PI * t),5.0);
+    }
+    next += std::chrono::microseconds(1000000 / rate);
+    std::this_thread::sleep_until(next);
+  }
+  double runTime = std::chrono::duration<double>(ClockT::now() - start).count();
+  uint64_t handled = updates - startUpdates;
+
+  std::cout << "Devices  Ready(s)  Updates/s  Expected/s  FollowingError(rad) " << std::endl;
+  std::cout << devices << "  " << readyTime << "  " << handled / runTime << "  " << devices * rate << "  " << maxError << std::endl;
+  return 0;
+}
@@ -0,0 +1,120 @@
+
+// Measure frame loss and round trip latency over USB for different transfer
+// pipeline depths. Bridge mode is turned off so pings are answered by the USB
+// bridge board itself and nothing goes onto the CAN bus, making the board a
+// loopback. Busy threads can be added to load the host.
+//
+// Usage: benchUSB [pings] [busy threads] [in,out,iso,cpu ...]
+
+#include "dogbot/ComsUSB.hh"
+#include "BenchLatency.hh"
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <atomic>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+static bool RunTest(const ComsUSBTransferConfigC &config,int pings)
+{
+  auto coms = std::make_shared<ComsUSBC>(config);
+  for(int i = 0;i < 200 && !coms->IsReady();i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  if(!coms->IsReady()) {
+    std::cerr << "No USB device found. " << std::endl;
+    return false;
+  }
+  coms->SendEnableBridge(false);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::mutex access;
+  std::condition_variable gotPong;
+  bool waiting = false;
+  int late = 0;
+  ClockT::time_point received;
+  auto handle = coms->SetHandler(CPT_Pong,[&](uint8_t *,int) {
+    std::lock_guard<std::mutex> lock(access);
+    if(!waiting) {
+      late++;
+      return ;
+    }
+    received = ClockT::now();
+    waiting = false;
+    gotPong.notify_all();
+  });
+
+  BenchLatencyC latency(pings);
+  int lost = 0;
+  ComsUSBStatsC before = coms->Stats();
+  for(int i = 0;i < pings;i++) {
+    std::unique_lock<std::mutex> lock(access);
+    waiting = true;
+    ClockT::time_point sent = ClockT::now();
+    lock.unlock();
+    coms->SendPing(0);
+    lock.lock();
+    if(!gotPong.wait_for(lock,std::chrono::milliseconds(20),[&]{ return !waiting; })) {
+      waiting = false;
+      lost++;
+      continue;
+    }
+    latency.Add(std::chrono::duration<double,std::micro>(received - sent).count());
+  }
+  ComsUSBStatsC after = coms->Stats();
+  coms->DeleteHandler(handle);
+  coms->SendEnableBridge(true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  std::cout << config.m_inTransfers << "," << config.m_outTransfers << "," << config.m_isoPacketsPerTransfer
+            << "  " << pings << "  " << lost << "  " << late
+            << "  " << latency.Percentile(0) << "  " << latency.Percentile(0.5) << "  " << latency.Percentile(0.99) << "  " << latency.Percentile(1.0)
+            << "  " << after.m_inUnderruns - before.m_inUnderruns
+            << "  " << after.m_inPacketErrors - before.m_inPacketErrors
+            << "  " << after.m_txDropped - before.m_txDropped
+            << "  " << after.m_rxOverflows - before.m_rxOverflows
+            << "  " << after.m_rxQueueMax
+            << std::endl;
+  return true;
+}
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  int pings = (argc > 1) ? atoi(argv[1]) : 2000;
+  int busyThreads = (argc > 2) ? atoi(argv[2]) : 0;
+  std::vector<ComsUSBTransferConfigC> configs;
+  for(int i = 3;i < argc;i++)
+    configs.push_back(ComsUSBTransferConfigC(std::string("usb:") + argv[i]));
+  if(configs.empty()) {
+    for(auto name : { "usb:2,4,1", "usb:4,4,1", "usb:8,8,1", "usb:16,8,1", "usb:8,8,2" })
+      configs.push_back(ComsUSBTransferConfigC(name));
+  }
+
+  std::atomic<bool> done(false);
+  std::vector<std::thread> busy;
+  for(int i = 0;i < busyThreads;i++) {
+    busy.push_back(std::thread([&done]{
+      volatile uint64_t count = 0;
+      while(!done)
+        count++;
+    }));
+  }
+
+  std::cout << "in,out,iso  Pings  Lost  Late  Min us  Median us  99% us  Max us  Underruns  Packet errors  Tx dropped  Rx overflows  Rx queue max " << std::endl;
+  bool ok = true;
+  for(auto &config : configs) {
+    if(!RunTest(config,pings)) {
+      ok = false;
+      break;
+    }
+  }
+
+  done = true;
+  for(auto &t : busy)
+    t.join();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+
+// Measure the message rate and latency of packets published by
+// ComsZMQServerC to a ComsZMQClientC for different batching windows.
+// A simulated set of devices sends servo reports at a fixed rate, each
+// carrying a sequence number so the client can tell how long it took.
+//
+// Usage: benchZMQBatch [devices] [rate Hz] [seconds] [window us ...]
+
+#include "dogbot/ComsZMQServer.hh"
+#include "dogbot/ComsZMQClient.hh"
+#include "BenchLatency.hh"
+#include <iostream>
+#include <algorithm>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! Devices sending servo reports at a fixed rate.
+
+class ComsSimReportsC
+  : public ComsC
+{
+public:
+  ComsSimReportsC(int devices,int rateHz,size_t maxReports)
+   : m_devices(devices),
+     m_period(1000000 / rateHz),
+     m_sentAt(maxReports)
+  {}
+
+  ~ComsSimReportsC()
+  { Stop(); }
+
+  //! Start sending reports.
+  void Start()
+  {
+    m_done = false;
+    m_thread = std::thread([this]{ Run(); });
+  }
+
+  //! Stop sending reports.
+  void Stop()
+  {
+    m_done = true;
+    if(m_thread.joinable())
+      m_thread.join();
+  }
+
+  //! Time report 'seq' was sent.
+  ClockT::time_point SentAt(uint32_t seq) const
+  { return m_sentAt[seq]; }
+
+  //! Number of reports sent.
+  uint32_t Sent() const
+  { return m_seq; }
+
+  void SendPacket(const uint8_t *,int) override
+  {}
+
+protected:
+  void Run()
+  {
+    ClockT::time_point next = ClockT::now();
+    while(!m_done && m_seq < m_sentAt.size()) {
+      std::this_thread::sleep_until(next);
+      next += m_period;
+      // All the devices report at about the same point in each cycle.
+      for(int d = 1;d <= m_devices && m_seq < m_sentAt.size();d++) {
+        PacketServoReportC pkt;
+        memset(&pkt,0,sizeof(pkt));
+        pkt.m_packetType = CPT_ServoReport;
+        pkt.m_deviceId = d;
+        // The sequence number goes in the position and torque fields.
+        uint32_t seq = m_seq;
+        memcpy(&pkt.m_position,&seq,sizeof(seq));
+        m_sentAt[seq] = ClockT::now();
+        m_seq = seq + 1;
+        ProcessPacket((uint8_t *) &pkt,sizeof(pkt));
+      }
+    }
+  }
+
+  int m_devices;
+  std::chrono::microseconds m_period;
+  std::vector<ClockT::time_point> m_sentAt;
+  std::atomic<uint32_t> m_seq { 0 };
+  std::atomic<bool> m_done { true };
+  std::thread m_thread;
+};
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  int devices = (argc > 1) ? atoi(argv[1]) : 12;
+  int rateHz = (argc > 2) ? atoi(argv[2]) : 100;
+  double seconds = (argc > 3) ? atof(argv[3]) : 5.0;
+  std::vector<int> windows;
+  for(int i = 4;i < argc;i++)
+    windows.push_back(atoi(argv[i]));
+  if(windows.empty())
+    windows = { 0, 250, 1000, 2000, 5000 };
+
+  std::cout << devices << " devices reporting at " << rateHz << " Hz for " << seconds << " s. " << std::endl;
+  std::cout << "Window us  Packets/s  Messages/s  Mean delay us  Max delay us  Median latency us  99% latency us  Lost " << std::endl;
+  for(int window : windows) {
+    size_t maxReports = (size_t) (devices * rateHz * (seconds + 1.0));
+    auto sim = std::make_shared<ComsSimReportsC>(devices,rateHz,maxReports);
+    ComsZMQServerC server(sim,logger);
+    server.SetBatching(window);
+    std::thread serverThread([&server]{ server.Run("*"); });
+
+    std::mutex access;
+    BenchLatencyC latency(maxReports);
+    auto client = std::make_shared<ComsZMQClientC>();
+    client->SetHandler(CPT_ServoReport,[&](uint8_t *data,int len) {
+      ClockT::time_point now = ClockT::now();
+      const PacketServoReportC *pkt = (const PacketServoReportC *) data;
+      uint32_t seq;
+      memcpy(&seq,&pkt->m_position,sizeof(seq));
+      std::lock_guard<std::mutex> lock(access);
+      latency.Add(std::chrono::duration<double,std::micro>(now - sim->SentAt(seq)).count());
+    });
+    client->Open("local");
+    // Give the subscription time to reach the server.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    sim->Start();
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    sim->Stop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ComsZMQBatchStatsC stats = server.BatchStats();
+    client->Close();
+    server.Stop();
+    serverThread.join();
+
+    std::cout << window << "  " << stats.m_packets / seconds << "  " << stats.m_messages / seconds
+              << "  " << (stats.m_packets > 0 ? stats.m_totalDelayUs / stats.m_packets : 0.0) << "  " << stats.m_maxDelayUs
+              << "  " << latency.Percentile(0.5) << "  " << latency.Percentile(0.99)
+              << "  " << (long) sim->Sent() - (long) latency.Size() << std::endl;
+    // Let the ports be released before the next run binds them.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+
+// Measure the round trip time of a ReadParam from a ComsZMQClientC through
+// a ComsZMQServerC to a simulated device and back, over tcp, ipc and inproc.
+// The server and client run in the same process, so every transport can be
+// used, and the numbers show only what the transport itself costs.
+//
+// Usage: benchZMQTransport [round trips]
+
+#include "dogbot/ComsZMQServer.hh"
+#include "dogbot/ComsZMQClient.hh"
+#include "BenchLatency.hh"
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <unistd.h>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! A device which answers every ReadParam straight away.
+
+class ComsSimParamReplyC
+  : public ComsC
+{
+public:
+  void SendPacket(const uint8_t *data,int len) override
+  {
+    if(len < (int) sizeof(PacketReadParamC) || data[0] != CPT_ReadParam)
+      return ;
+    const PacketReadParamC *pkt = (const PacketReadParamC *) data;
+    PacketParam8ByteC reply;
+    reply.m_header.m_packetType = CPT_ReportParam;
+    reply.m_header.m_deviceId = pkt->m_deviceId;
+    reply.m_header.m_index = pkt->m_index;
+    reply.m_data.uint32[0] = 0x12345678;
+    ProcessPacket((uint8_t *) &reply,sizeof(reply.m_header) + sizeof(uint32_t));
+  }
+};
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  int trips = (argc > 1) ? atoi(argv[1]) : 10000;
+  const int warmup = 100;
+
+  std::string ipcPath = "ipc:///tmp/dogbot-bench-" + std::to_string(getpid());
+  const std::string transports[3][2] = {
+    { "tcp://127.0.0.1:7210", "tcp://127.0.0.1:7210" },
+    { ipcPath, ipcPath },
+    { "inproc://dogbot-bench", "inproc://dogbot-bench" }
+  };
+
+  std::cout << trips << " ReadParam round trips. " << std::endl;
+  std::cout << "Transport  " << BenchLatencyC::Titles("us") << "  Timeouts " << std::endl;
+  for(auto &transport : transports) {
+    auto sim = std::make_shared<ComsSimParamReplyC>();
+    ComsZMQServerC server(sim,logger);
+    std::thread serverThread([&server,&transport]{ server.Run(transport[0]); });
+    // inproc needs the server bound before a client connects.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::mutex access;
+    std::condition_variable replied;
+    int replies = 0;
+    auto client = std::make_shared<ComsZMQClientC>();
+    client->SetHandler(CPT_ReportParam,[&](uint8_t *,int) {
+      std::lock_guard<std::mutex> lock(access);
+      replies++;
+      replied.notify_all();
+    });
+    if(!client->Open(transport[1])) {
+      std::cerr << "Failed to connect to " << transport[1] << std::endl;
+      server.Stop();
+      serverThread.join();
+      continue;
+    }
+    // Give the subscription time to reach the server.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    BenchLatencyC latency(trips);
+    int timeouts = 0;
+    for(int i = 0;i < trips + warmup;i++) {
+      std::unique_lock<std::mutex> lock(access);
+      int expected = replies + 1;
+      ClockT::time_point start = ClockT::now();
+      lock.unlock();
+      client->SendQueryParam(1,CPI_FirmwareVersion);
+      lock.lock();
+      if(!replied.wait_for(lock,std::chrono::milliseconds(100),[&]{ return replies >= expected; })) {
+        timeouts++;
+        replies = expected;
+        continue;
+      }
+      if(i >= warmup)
+        latency.Add(std::chrono::duration<double,std::micro>(ClockT::now() - start).count());
+    }
+
+    client->Close();
+    server.Stop();
+    serverThread.join();
+
+    std::cout << transport[1].substr(0,transport[1].find(':')) << "  ";
+    latency.Print(std::cout);
+    std::cout << "  " << timeouts << std::endl;
+  }
+  return 0;
+}
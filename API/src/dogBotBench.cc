@@ -0,0 +1,376 @@
+
+// Measure the latency of the main paths through the API, so they can be
+// tracked from one release to the next. Each path is timed one packet at a
+// time and reported as percentiles:
+//
+//  dispatch  - ComsC::ProcessPacket() to a registered handler.
+//  setparam  - ComsC::SetParam() round trip to a simulated controller.
+//  report    - A servo report arriving to DogBotAPIC's status callback.
+//  demand    - ServoC::DemandPosition() to the packet being sent.
+//  fanout    - A packet published by ComsZMQServerC until every client has it.
+//
+// Usage: dogBotBench [-s samples] [-c clients] [-j results.json]
+
+#include "dogbot/DogBotAPI.hh"
+#include "dogbot/ComsSim.hh"
+#include "dogbot/ComsZMQServer.hh"
+#include "dogbot/ComsZMQClient.hh"
+#include "BenchLatency.hh"
+#include "cxxopts.hpp"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <condition_variable>
+
+using namespace DogBotN;
+
+typedef std::chrono::steady_clock ClockT;
+
+//! Latencies measured for one path, in nanoseconds.
+
+class LatencyC
+  : public BenchLatencyC
+{
+public:
+  LatencyC(const std::string &name,size_t samples)
+   : BenchLatencyC(samples),
+     m_name(name)
+  {}
+
+  void Add(ClockT::time_point start,ClockT::time_point end)
+  { BenchLatencyC::Add(std::chrono::duration<double,std::nano>(end - start).count()); }
+
+  Json::Value AsJSON() const
+  {
+    Json::Value ret;
+    ret["name"] = m_name;
+    ret["unit"] = "ns";
+    ret["samples"] = (Json::UInt64) Size();
+    ret["lost"] = m_lost;
+    ret["mean"] = Mean();
+    ret["p50"] = Percentile(0.5);
+    ret["p99"] = Percentile(0.99);
+    ret["p99.9"] = Percentile(0.999);
+    ret["max"] = Percentile(1.0);
+    return ret;
+  }
+
+  std::string m_name;
+  int m_lost = 0;                //!< Packets which never arrived.
+};
+
+//! Stands in for a device, remembering when the last servo command was sent.
+
+class ComsLoopbackC
+  : public ComsC
+{
+public:
+  void SendPacket(const uint8_t *data,int len) override
+  {
+    if(len > 0 && data[0] == CPT_Servo)
+      m_lastServo = ClockT::now();
+  }
+
+  ClockT::time_point m_lastServo;
+};
+
+//! Announce device 'deviceId' on 'coms', as if a controller had been plugged
+//! in, until 'api' has picked it up. The API only starts listening once its
+//! monitor thread is running.
+
+static std::shared_ptr<ServoC> Announce(DogBotAPIC &api,ComsC &coms,int deviceId)
+{
+  PacketDeviceIdC announce;
+  memset(&announce,0,sizeof(announce));
+  announce.m_packetType = CPT_AnnounceId;
+  announce.m_deviceId = deviceId;
+  announce.m_uid[0] = 0x1000 + deviceId;
+  announce.m_uid[1] = 0x2000 + deviceId;
+  std::shared_ptr<ServoC> servo;
+  for(int i = 0;i < 100 && !servo;i++) {
+    coms.ProcessPacket((uint8_t *) &announce,sizeof(announce));
+    servo = api.GetServoById(deviceId);
+    if(!servo)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return servo;
+}
+
+static void BenchDispatch(LatencyC &latency,int samples)
+{
+  auto coms = std::make_shared<ComsC>();
+  volatile int calls = 0;
+  auto handle = coms->SetHandler(CPT_ServoReport,[&calls](uint8_t *,int) { calls++; });
+  PacketServoReportC report;
+  memset(&report,0,sizeof(report));
+  report.m_packetType = CPT_ServoReport;
+  report.m_deviceId = 1;
+  for(int i = 0;i < samples;i++) {
+    ClockT::time_point start = ClockT::now();
+    coms->ProcessPacket((uint8_t *) &report,sizeof(report));
+    latency.Add(start,ClockT::now());
+  }
+  coms->DeleteHandler(handle);
+}
+
+static void BenchSetParam(LatencyC &latency,int samples,std::shared_ptr<spdlog::logger> &logger)
+{
+  auto sim = std::make_shared<ComsSimC>();
+  sim->SetLogger(logger);
+  if(!sim->Open("sim:1"))
+    return ;
+
+  // The simulated controller starts without an id, give it one.
+  std::atomic<bool> assigned(false);
+  auto handle = sim->SetHandler(CPT_AnnounceId,[&sim,&assigned](uint8_t *data,int len) {
+    if(len != sizeof(PacketDeviceIdC))
+      return ;
+    const PacketDeviceIdC *pkt = (const PacketDeviceIdC *) data;
+    if(pkt->m_deviceId == 1)
+      assigned = true;
+    else
+      sim->SendSetDeviceId(1,pkt->m_uid[0],pkt->m_uid[1]);
+  });
+  for(int i = 0;i < 100 && !assigned;i++) {
+    sim->SendQueryDevices();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  sim->DeleteHandler(handle);
+  if(!assigned) {
+    logger->error("Simulated controller was not given an id. ");
+    return ;
+  }
+
+  // ComsSimC has its own SetParam() for the simulated devices.
+  ComsC &coms = *sim;
+  for(int i = 0;i < samples;i++) {
+    ClockT::time_point start = ClockT::now();
+    if(coms.SetParam(1,CPI_PositionRef,(uint8_t) (i % 2 ? PR_Absolute : PR_Relative)))
+      latency.Add(start,ClockT::now());
+    else
+      latency.m_lost++;
+  }
+  sim->Close();
+}
+
+static void BenchReport(LatencyC &latency,int samples,std::shared_ptr<spdlog::logger> &logger)
+{
+  auto coms = std::make_shared<ComsLoopbackC>();
+  DogBotAPIC api(coms,logger,false,DogBotAPIC::DMM_ClientOnly);
+  ClockT::time_point updated;
+  api.AddServoStatusHandler([&updated](JointC *,DogBotAPIC::ServoUpdateTypeT op) {
+    if(op == DogBotAPIC::SUT_Updated)
+      updated = ClockT::now();
+  });
+  if(!Announce(api,*coms,1)) {
+    logger->error("No servo to report on. ");
+    return ;
+  }
+
+  PacketServoReportC report;
+  memset(&report,0,sizeof(report));
+  report.m_packetType = CPT_ServoReport;
+  report.m_deviceId = 1;
+  for(int i = 0;i < samples;i++) {
+    report.m_timestamp = i;
+    report.m_position = i;
+    updated = ClockT::time_point();
+    ClockT::time_point start = ClockT::now();
+    coms->ProcessPacket((uint8_t *) &report,sizeof(report));
+    if(updated == ClockT::time_point())
+      latency.m_lost++;
+    else
+      latency.Add(start,updated);
+  }
+}
+
+static void BenchDemand(LatencyC &latency,int samples,std::shared_ptr<spdlog::logger> &logger)
+{
+  auto coms = std::make_shared<ComsLoopbackC>();
+  DogBotAPIC api(coms,logger,false,DogBotAPIC::DMM_ClientOnly);
+  std::shared_ptr<ServoC> servo = Announce(api,*coms,1);
+  if(!servo) {
+    logger->error("No servo to send demands to. ");
+    return ;
+  }
+  for(int i = 0;i < samples;i++) {
+    coms->m_lastServo = ClockT::time_point();
+    ClockT::time_point start = ClockT::now();
+    servo->DemandPosition((i % 100) * 0.01,1.0);
+    if(coms->m_lastServo == ClockT::time_point())
+      latency.m_lost++;
+    else
+      latency.Add(start,coms->m_lastServo);
+  }
+}
+
+//! Publish numbered packets through a ZMQ server to 'clients' clients at 1kHz,
+//! timing each until the last client has received it.
+
+static void BenchFanOut(LatencyC &latency,int samples,int clients,const std::string &addr,std::shared_ptr<spdlog::logger> &logger)
+{
+  auto device = std::make_shared<ComsC>();
+  ComsZMQServerC server(device,logger);
+  std::thread serverThread([&server,&addr]{ server.Run(addr); });
+
+  std::vector<ClockT::time_point> sent(samples);
+  std::vector<ClockT::time_point> arrived(samples);
+  std::vector<int> copies(samples,0);
+  std::mutex access;
+  std::condition_variable allArrived;
+
+  std::vector<std::shared_ptr<ComsZMQClientC> > zclients;
+  for(int i = 0;i < clients;i++) {
+    auto client = std::make_shared<ComsZMQClientC>();
+    client->SetHandler(CPT_ServoReport,[&,clients](uint8_t *data,int len) {
+      if(len != sizeof(PacketServoReportC))
+        return ;
+      ClockT::time_point now = ClockT::now();
+      const PacketServoReportC *pkt = (const PacketServoReportC *) data;
+      int seq = (uint16_t) pkt->m_position;
+      if(seq >= (int) copies.size())
+        return ;
+      std::lock_guard<std::mutex> lock(access);
+      if(++copies[seq] == clients) {
+        arrived[seq] = now;
+        allArrived.notify_all();
+      }
+    });
+    if(!client->Open(addr)) {
+      logger->error("Failed to connect to {} ",addr);
+      break;
+    }
+    zclients.push_back(client);
+  }
+  // Give the subscriptions time to reach the server.
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  if((int) zclients.size() == clients) {
+    PacketServoReportC report;
+    memset(&report,0,sizeof(report));
+    report.m_packetType = CPT_ServoReport;
+    report.m_deviceId = 1;
+    ClockT::time_point next = ClockT::now();
+    for(int i = 0;i < samples;i++) {
+      report.m_position = i;
+      sent[i] = ClockT::now();
+      device->ProcessPacket((uint8_t *) &report,sizeof(report));
+      next += std::chrono::milliseconds(1);
+      std::this_thread::sleep_until(next);
+    }
+    // Wait for stragglers.
+    std::unique_lock<std::mutex> lock(access);
+    allArrived.wait_for(lock,std::chrono::milliseconds(500),[&copies,clients]{ return copies.back() == clients; });
+    for(int i = 0;i < samples;i++) {
+      if(copies[i] == clients)
+        latency.Add(sent[i],arrived[i]);
+      else
+        latency.m_lost++;
+    }
+  }
+
+  for(auto &a : zclients)
+    a->Close();
+  server.Stop();
+  serverThread.join();
+}
+
+int main(int argc,char **argv)
+{
+  int samples = 100000;
+  int clients = 4;
+  std::string benches = "dispatch,setparam,report,demand,fanout";
+  std::string zmqAddr = "tcp://127.0.0.1:7212";
+  std::string jsonFile;
+  std::string label;
+
+  auto logger = spdlog::stdout_logger_mt("console");
+  logger->set_level(spdlog::level::warn);
+
+  try
+  {
+    cxxopts::Options options(argv[0], "DogBot API latency benchmarks");
+    options
+      .positional_help("[optional args]")
+      .show_positional_help();
+
+    options.add_options()
+      ("s,samples", "Packets to time on each path, setparam takes a tenth and fanout a hundredth of this as they are slower ", cxxopts::value<int>(samples))
+      ("b,bench", "Comma separated list of paths to time, from dispatch, setparam, report, demand and fanout ", cxxopts::value<std::string>(benches))
+      ("c,clients", "Number of ZMQ clients in the fanout test ", cxxopts::value<int>(clients))
+      ("z,zmq", "Address to serve the fanout test on ", cxxopts::value<std::string>(zmqAddr))
+      ("j,json", "Write the results as JSON to this file, '-' for stdout ", cxxopts::value<std::string>(jsonFile))
+      ("l,label", "Label stored with the JSON results, such as the release being measured ", cxxopts::value<std::string>(label))
+      ("h,help", "Print help")
+    ;
+
+    auto result = options.parse(argc, argv);
+
+    if (result.count("help"))
+    {
+      std::cout << options.help({""}) << std::endl;
+      exit(0);
+    }
+
+  } catch (const cxxopts::OptionException& e)
+  {
+    std::cout << "error parsing options: " << e.what() << std::endl;
+    exit(1);
+  }
+
+  auto Wanted = [&benches](const std::string &name) {
+    return ("," + benches + ",").find("," + name + ",") != std::string::npos;
+  };
+
+  std::vector<LatencyC> results;
+  if(Wanted("dispatch")) {
+    results.push_back(LatencyC("dispatch",samples));
+    BenchDispatch(results.back(),samples);
+  }
+  if(Wanted("setparam")) {
+    results.push_back(LatencyC("setparam",samples / 10));
+    BenchSetParam(results.back(),samples / 10,logger);
+  }
+  if(Wanted("report")) {
+    results.push_back(LatencyC("report",samples));
+    BenchReport(results.back(),samples,logger);
+  }
+  if(Wanted("demand")) {
+    results.push_back(LatencyC("demand",samples));
+    BenchDemand(results.back(),samples,logger);
+  }
+  if(Wanted("fanout") && clients > 0) {
+    int packets = std::max(samples / 100,1);
+    results.push_back(LatencyC("fanout-" + std::to_string(clients),packets));
+    BenchFanOut(results.back(),packets,clients,zmqAddr,logger);
+  }
+
+  Json::Value root;
+  if(!label.empty())
+    root["label"] = label;
+  root["timestamp"] = (Json::Int64) std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  Json::Value list(Json::arrayValue);
+  for(auto &a : results)
+    list.append(a.AsJSON());
+  root["benchmarks"] = list;
+
+  if(jsonFile == "-") {
+    std::cout << root;
+    return 0;
+  }
+  std::cout << "Path  Samples  Lost  " << BenchLatencyC::Titles("ns") << std::endl;
+  for(auto &a : results) {
+    std::cout << a.m_name << "  " << a.Size() << "  " << a.m_lost << "  ";
+    a.Print(std::cout);
+    std::cout << std::endl;
+  }
+  if(!jsonFile.empty()) {
+    std::ofstream strm(jsonFile);
+    if(!strm) {
+      std::cerr << "Failed to open '" << jsonFile << "' " << std::endl;
+      return 1;
+    }
+    strm << root;
+  }
+  return 0;
+}
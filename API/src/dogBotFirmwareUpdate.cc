@@ -15,9 +15,12 @@ int main(int argc,char **argv)
   std::string devFilename = "local";
   std::string configFile;
   std::string firmwareFile;
-  int targetDeviceId = 0;
+  std::vector<int> targetDeviceIds;
   bool dryRun = false;
   bool stayInBootloader = false;
+  bool skipUnchanged = false;
+  bool rawData = false;
+  int windowSize = 48;
   auto logger = spdlog::stdout_logger_mt("console");
 
   try
@@ -31,9 +34,12 @@ int main(int argc,char **argv)
       ("c,config", "Configuration file", cxxopts::value<std::string>(configFile))
       ("d,device", "Device to use from communication. Typically 'local' for local server or 'usb' for direct connection ", cxxopts::value<std::string>(devFilename))
       ("f,firmware", "Firmware file ", cxxopts::value<std::string>(firmwareFile))
-      ("t,target","Target device id", cxxopts::value<int>(targetDeviceId))
+      ("t,target","Target device id, repeat to update several devices at once", cxxopts::value<std::vector<int> >(targetDeviceIds))
       ("n,dryrun","Target device id", cxxopts::value<bool>(dryRun))
       ("e,noexit","Stay in boot-loader after update is complete.", cxxopts::value<bool>(stayInBootloader))
+      ("k,skip-unchanged","Skip sectors the devices already have, if their boot-loaders can check this with a CRC-32.", cxxopts::value<bool>(skipUnchanged))
+      ("r,raw","Don't compress data sent to the boot-loader.", cxxopts::value<bool>(rawData))
+      ("w,window","Number of data packets in flight while writing, from 16 to 127.", cxxopts::value<int>(windowSize))
       ("h,help", "Print help")
     ;
 
@@ -66,7 +72,12 @@ int main(int argc,char **argv)
   if(dryRun)
     updater.SetDryRun();
   updater.SetExitBootloaderOnComplete(!stayInBootloader);
-  if(!updater.DoUpdate(targetDeviceId,firmwareFile)) {
+  updater.SetWindowSize(windowSize);
+  updater.SetFullUpdate(!skipUnchanged);
+  updater.SetCompression(!rawData);
+  if(targetDeviceIds.empty())
+    targetDeviceIds.push_back(0);
+  if(!updater.DoUpdate(targetDeviceIds,firmwareFile)) {
     logger->error("Firmware update failed");
     return 1;
   }
@@ -6,6 +6,9 @@
 #include "dogbot/ComsSerial.hh"
 #include "dogbot/DogBotAPI.hh"
 #include "dogbot/ComsZMQServer.hh"
+#include "dogbot/ComsShmServer.hh"
+#include "dogbot/JointStateShm.hh"
+#include "dogbot/ComsRecord.hh"
 #include "cxxopts.hpp"
 
 // This provides a network interface for controlling the servos via ZMQ.
@@ -14,6 +17,11 @@ int main(int argc,char **argv)
 {
   std::string devFilename = "usb";
   std::string configFile;
+  std::string batch;
+  std::string serveAddr = "tcp://*";
+  std::string shmAddr;
+  std::string jointsAddr;
+  std::string recordFile;
 
   bool managerMode = true;
   auto logger = spdlog::stdout_logger_mt("console");
@@ -28,7 +36,12 @@ int main(int argc,char **argv)
     options.add_options()
       ("m,manager", "Manager mode, allowing allocation of device ids", cxxopts::value<bool>(managerMode))
       ("c,config", "Configuration file", cxxopts::value<std::string>(configFile))
-      ("d,device", "Device to use from communication ", cxxopts::value<std::string>(devFilename))
+      ("d,device", "Device to use from communication, usb:in,out,iso,cpu sets the number of USB transfers, iso packets per transfer and the CPU packets are handled on, usb@bus-port only opens the bridge at that location, usb* opens every bridge plugged in ", cxxopts::value<std::string>(devFilename))
+      ("b,batch", "Batch packets published to clients, 'us[,bytes]' sends packets arriving within us microseconds of each other, up to bytes in total, as one message ", cxxopts::value<std::string>(batch))
+      ("s,serve", "Comma separated addresses to serve clients on, tcp://*[:port] for the network, ipc:///path for processes on this machine ", cxxopts::value<std::string>(serveAddr))
+      ("shm", "Also serve clients on this machine through shared memory, shm://name creates /dev/shm/name ", cxxopts::value<std::string>(shmAddr))
+      ("joints", "Keep the latest state of every servo in a table in shared memory, shm://name creates /dev/shm/name ", cxxopts::value<std::string>(jointsAddr))
+      ("r,record", "Record every packet received to a log file, which can be played back by connecting to replay:file ", cxxopts::value<std::string>(recordFile))
       ("h,help", "Print help")
     ;
 
@@ -61,10 +74,40 @@ int main(int argc,char **argv)
 
 
   DogBotN::ComsZMQServerC server(dogbot.Connection(),logger);
+  if(!batch.empty()) {
+    int flushUs = atoi(batch.c_str());
+    size_t maxBytes = 4096;
+    size_t comma = batch.find(',');
+    if(comma != std::string::npos)
+      maxBytes = atoi(batch.c_str() + comma + 1);
+    server.SetBatching(flushUs,maxBytes);
+  }
+
+  DogBotN::JointStatePublisherC jointState(dogbot,logger);
+  if(!jointsAddr.empty() && !jointState.Open(jointsAddr)) {
+    logger->error("Failed to publish joint state in '{}' ",jointsAddr);
+    return 1;
+  }
+
+  DogBotN::ComsRecorderC recorder(dogbot.Connection());
+  if(!recordFile.empty() && !recorder.Open(recordFile))
+    return 1;
 
   logger->info("Setup and ready. ");
 
-  server.Run("*.*.*.*");
+  std::shared_ptr<DogBotN::ComsShmServerC> shmServer;
+  std::thread shmThread;
+  if(!shmAddr.empty()) {
+    shmServer = std::make_shared<DogBotN::ComsShmServerC>(dogbot.Connection(),logger);
+    shmThread = std::thread([shmServer,shmAddr]{ shmServer->Run(shmAddr); });
+  }
+
+  server.Run(serveAddr);
+
+  if(shmServer) {
+    shmServer->Stop();
+    shmThread.join();
+  }
 
   return 0;
 }
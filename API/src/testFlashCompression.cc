@@ -0,0 +1,119 @@
+
+// This program checks firmware images survive compression and decompression
+// with the code used by the boot-loader, and reports how much smaller the
+// transfer is.  Arguments are intel hex or raw binary images, if none are
+// given the program checks itself.
+
+#include "dogbot/FirmwareUpdate.hh"
+#include "dogbot/flashlz.h"
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string.h>
+
+struct OutputC {
+  std::vector<uint8_t> m_data;
+};
+
+static int PutByte(void *ctx,uint8_t value)
+{
+  ((OutputC *) ctx)->m_data.push_back(value);
+  return 1;
+}
+
+static uint8_t GetByte(void *ctx,uint16_t distance)
+{
+  std::vector<uint8_t> &data = ((OutputC *) ctx)->m_data;
+  return data[data.size() - distance];
+}
+
+//! Load an image, returning blocks of data indexed by address.
+
+static bool LoadImage(const std::string &filename,std::map<uint32_t,std::vector<uint8_t> > &image)
+{
+  if(filename.size() > 4 && filename.substr(filename.size()-4) == ".hex") {
+    DogBotN::FirmwareUpdateC updater(std::shared_ptr<DogBotN::ComsC>(nullptr));
+    if(!updater.LoadHexFile(filename))
+      return false;
+    image = updater.Image();
+    return true;
+  }
+  std::ifstream strm(filename,std::ios::binary);
+  if(!strm)
+    return false;
+  image[0x08010000] = std::vector<uint8_t>(std::istreambuf_iterator<char>(strm),std::istreambuf_iterator<char>());
+  return true;
+}
+
+//! Compress the image a block at a time, as the firmware updater does,
+//! and feed it back through the boot-loader decoder in data packet sized pieces.
+
+static bool TestImage(const std::string &filename,size_t &rawBytes,size_t &sentBytes)
+{
+  std::map<uint32_t,std::vector<uint8_t> > image;
+  if(!LoadImage(filename,image)) {
+    std::cerr << "Failed to load " << filename << std::endl;
+    return false;
+  }
+  rawBytes = 0;
+  sentBytes = 0;
+  for(auto &block : image) {
+    const std::vector<uint8_t> &data = block.second;
+    for(size_t at = 0;at < data.size();) {
+      size_t len = std::min(data.size() - at,(size_t) 0xffff);
+      std::vector<uint8_t> compressed = DogBotN::FirmwareUpdateC::Compress(&data[at],len);
+
+      OutputC output;
+      struct FlashLZDecoderC decoder;
+      FlashLZ_Init(&decoder,len);
+      for(size_t i = 0;i < compressed.size();i += 7) {
+        int packetLen = std::min(compressed.size() - i,(size_t) 7);
+        if(FlashLZ_Decode(&decoder,&compressed[i],packetLen,&PutByte,&GetByte,&output) != FLZ_Ok) {
+          std::cerr << filename << ": Decoder failed at " << std::hex << block.first + at << std::dec << std::endl;
+          return false;
+        }
+      }
+      if(!FlashLZ_Done(&decoder) || output.m_data.size() != len ||
+         memcmp(output.m_data.data(),&data[at],len) != 0) {
+        std::cerr << filename << ": Data mismatch at " << std::hex << block.first + at << std::dec << std::endl;
+        return false;
+      }
+
+      rawBytes += len;
+      // The updater sends raw data if compression doesn't help.
+      sentBytes += std::min(compressed.size(),len);
+      at += len;
+    }
+  }
+  return true;
+}
+
+int main(int argc,char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("console");
+
+  std::vector<std::string> files;
+  for(int i = 1;i < argc;i++)
+    files.push_back(argv[i]);
+  if(files.empty())
+    files.push_back("/proc/self/exe");
+
+  size_t totalRaw = 0;
+  size_t totalSent = 0;
+  for(auto &filename : files) {
+    size_t rawBytes = 0;
+    size_t sentBytes = 0;
+    if(!TestImage(filename,rawBytes,sentBytes))
+      return 1;
+    std::cout << filename << ": " << rawBytes << " bytes, " << (rawBytes + 6) / 7 << " packets raw, "
+              << sentBytes << " bytes, " << (sentBytes + 6) / 7 << " packets compressed, "
+              << (rawBytes > 0 ? (100.0 * (rawBytes - sentBytes)) / rawBytes : 0.0) << "% smaller. " << std::endl;
+    totalRaw += rawBytes;
+    totalSent += sentBytes;
+  }
+  if(files.size() > 1)
+    std::cout << "Total: " << totalRaw << " bytes raw, " << totalSent << " bytes compressed, "
+              << (totalRaw > 0 ? (100.0 * (totalRaw - totalSent)) / totalRaw : 0.0) << "% smaller. " << std::endl;
+  std::cout << "All images round tripped ok. " << std::endl;
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include "canbus.h"
 #include "hal.h"
 #include "coms.h"
+#include "dogbot/flashlz.h"
 
 #define FLASH_SECTORS                   12
 
@@ -98,6 +99,27 @@ static uint16_t g_bootLoader_len = 0;
 static uint32_t g_bootLoader_at = 0;
 static uint32_t g_bootLoader_lastAck = 0;
 static uint8_t g_bootLoaderTxSequenceNumber = 0;
+static bool g_bootLoader_resyncSent = false;
+static bool g_bootLoader_compressed = false;
+static bool g_bootLoader_pageWritten = false;
+static struct FlashLZDecoderC g_bootLoader_decoder;
+
+// Incoming data is staged a page at a time and then programmed a word at a time.
+#define BOOTLOADER_PAGE_SIZE 256
+
+union PageBufferT {
+  uint8_t uint8[BOOTLOADER_PAGE_SIZE];
+  uint32_t uint32[BOOTLOADER_PAGE_SIZE/4];
+} ;
+
+static union PageBufferT g_bootLoaderPage;
+static uint32_t g_bootLoader_pageAddress = 0;
+
+// Data packets are acknowledged cumulatively once a page has been programmed,
+// but no more often than every BOOTLOADER_ACK_INTERVAL packets, and at least
+// every BOOTLOADER_ACK_LIMIT packets so a host with a small window doesn't
+// stall. The ack carries the sequence number of the last packet received in order.
+#define BOOTLOADER_ACK_INTERVAL 8
 
 
 bool BootLoaderCheckSequence(uint8_t seqNum,enum ComsPacketTypeT packetType)
@@ -119,20 +141,38 @@ bool BootLoaderReset(bool enable)
     g_bootLoaderState = BLS_Disabled;
   g_bootLoader_lastSeqNum = 0;
   g_bootLoader_lastAck = 0;
+  g_bootLoader_resyncSent = false;
   g_bootLoader_len = 0;
   g_bootLoader_at = 0;
   g_bootLoader_address = 0;
+  g_bootLoader_compressed = false;
 
-  SendBootLoaderResult(0,g_bootLoaderState,FOS_Ok);
+  // Let the host know we can take compressed data.
+  SendBootLoaderResult(0,g_bootLoaderState,enable ? FOS_ReadyCompressed : FOS_Ok);
+  return true;
+}
+
+// Check if a sector is already in the erased state.
+
+static bool BootLoaderSectorBlank(int sectorNumber)
+{
+  uint32_t endAddress = (sectorNumber + 1 < FLASH_SECTORS) ? g_flash_addr[sectorNumber+1] : 0x08100000;
+  const uint32_t *at = (const uint32_t *) g_flash_addr[sectorNumber];
+  const uint32_t *end = (const uint32_t *) endAddress;
+  for(;at < end;at++) {
+    if(*at != 0xffffffff)
+      return false;
+  }
   return true;
 }
 
 bool BootLoaderErase(uint8_t seqNum,uint32_t blockAddress)
 {
-  if(!BootLoaderCheckSequence(seqNum,CPT_FlashEraseSector))
-    return false;
+  // Boot-loaders not taking part in an update ignore broadcast commands.
   if(g_bootLoaderState == BLS_Disabled)
     return true;
+  if(!BootLoaderCheckSequence(seqNum,CPT_FlashEraseSector))
+    return false;
   if(g_bootLoaderState != BLS_Ready && g_bootLoaderState != BLS_Write) {
     SendError(CET_BootLoaderUnexpectedState,CPT_FlashEraseSector,g_bootLoaderState);
     return false;
@@ -157,6 +197,12 @@ bool BootLoaderErase(uint8_t seqNum,uint32_t blockAddress)
     return false;
   }
 
+  // Scanning takes about a millisecond, erasing up to a couple of seconds.
+  if(BootLoaderSectorBlank(sectorNumber)) {
+    SendBootLoaderResult(seqNum,g_bootLoaderState,FOS_AlreadyErased);
+    return true;
+  }
+
   FLASH_Unlock();
   FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR);
 
@@ -172,123 +218,225 @@ bool BootLoaderErase(uint8_t seqNum,uint32_t blockAddress)
 }
 
 
-bool BootLoaderBeginWrite(uint8_t seqNum,uint32_t address,uint16_t len)
+static bool BootLoaderStartWrite(uint8_t seqNum,uint32_t address,uint16_t len,enum ComsPacketTypeT packetType)
 {
-  if(!BootLoaderCheckSequence(seqNum,CPT_FlashWrite))
-    return false;
+  // Boot-loaders not taking part in an update ignore broadcast commands.
   if(g_bootLoaderState == BLS_Disabled)
     return true;
+  if(!BootLoaderCheckSequence(seqNum,packetType))
+    return false;
   if(g_bootLoaderState != BLS_Ready) {
-    SendError(CET_BootLoaderUnexpectedState,CPT_FlashWrite,g_bootLoaderState);
+    SendError(CET_BootLoaderUnexpectedState,packetType,g_bootLoaderState);
     return false;
   }
   // Check alignment of address
   if((address & 0x3) != 0) {
     g_bootLoaderState = BLS_Error;
-    SendError(CET_BootLoaderUnalignedAddress,CPT_FlashWrite,g_bootLoaderState);
+    SendError(CET_BootLoaderUnalignedAddress,packetType,g_bootLoaderState);
     return false;
   }
   if(address < 0x08010000) {
     g_bootLoaderState = BLS_Error;
-    SendError(CET_BootLoaderProtected,CPT_FlashWrite,g_bootLoaderState);
+    SendError(CET_BootLoaderProtected,packetType,g_bootLoaderState);
     return false;
   }
 
   g_bootLoader_address = address;
   g_bootLoader_at = address;
   g_bootLoader_lastAck = 0;
+  g_bootLoader_resyncSent = false;
   g_bootLoader_len = len;
+  g_bootLoader_compressed = (packetType == CPT_FlashWriteCompressed);
+  FlashLZ_Init(&g_bootLoader_decoder,len);
+  g_bootLoader_pageAddress = address;
+  g_bootLoader_pageWritten = false;
   g_bootLoaderState = BLS_Write;
   SendBootLoaderResult(seqNum,BLS_Write,FOS_Ok);
   return true;
 }
 
+bool BootLoaderBeginWrite(uint8_t seqNum,uint32_t address,uint16_t len)
+{
+  return BootLoaderStartWrite(seqNum,address,len,CPT_FlashWrite);
+}
+
+bool BootLoaderBeginWriteCompressed(uint8_t seqNum,uint32_t address,uint16_t len)
+{
+  return BootLoaderStartWrite(seqNum,address,len,CPT_FlashWriteCompressed);
+}
+
+// Program the staged page into flash.
 
-bool BootLoaderData(uint8_t seqNum,uint8_t *data,uint8_t len)
+static bool BootLoaderWritePage()
 {
-  if(!BootLoaderCheckSequence(seqNum,CPT_FlashData)) {
-   // return false;
+  uint32_t used = g_bootLoader_at - g_bootLoader_pageAddress;
+  if(used == 0)
+    return true;
+  // Pad the last word with the erased value so it can be programmed whole.
+  for(uint32_t i = used;(i & 0x3) != 0;i++)
+    g_bootLoaderPage.uint8[i] = 0xff;
+
+  FLASH_Unlock();
+  FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR);
+
+  bool ret = true;
+  for(uint32_t i = 0;i < (used + 3)/4;i++) {
+    uint32_t addr = g_bootLoader_pageAddress + i * 4;
+    if(FLASH_ProgramWord(addr,g_bootLoaderPage.uint32[i]) != FLASH_COMPLETE ||
+       *((uint32_t *) addr) != g_bootLoaderPage.uint32[i]) {
+      ret = false;
+      break;
+    }
   }
+
+  FLASH_Lock();
+  g_bootLoader_pageAddress = g_bootLoader_at;
+  g_bootLoader_pageWritten = true;
+  return ret;
+}
+
+// Add a byte to the page buffer, programming it when full.
+
+static int BootLoaderPutByte(void *ctx,uint8_t value)
+{
+  (void) ctx;
+  if(g_bootLoader_at >= (g_bootLoader_address + g_bootLoader_len))
+    return 0;
+  g_bootLoaderPage.uint8[g_bootLoader_at - g_bootLoader_pageAddress] = value;
+  g_bootLoader_at++;
+  if((g_bootLoader_at - g_bootLoader_pageAddress) >= BOOTLOADER_PAGE_SIZE)
+    return BootLoaderWritePage();
+  return 1;
+}
+
+// Read back a byte we've written, from flash or the page buffer.
+
+static uint8_t BootLoaderGetByte(void *ctx,uint16_t distance)
+{
+  (void) ctx;
+  uint32_t addr = g_bootLoader_at - distance;
+  if(addr >= g_bootLoader_pageAddress)
+    return g_bootLoaderPage.uint8[addr - g_bootLoader_pageAddress];
+  return *((uint8_t *) addr);
+}
+
+bool BootLoaderData(uint8_t seqNum,uint8_t *data,uint8_t len)
+{
   if(g_bootLoaderState == BLS_Disabled)
     return true;
+  // If the final acknowledge was lost the host will resend the end of the block.
+  if(g_bootLoaderState == BLS_Ready && (uint8_t) (g_bootLoader_lastSeqNum - seqNum - 1) < 128) {
+    if(!g_bootLoader_resyncSent) {
+      SendBootLoaderResult(g_bootLoader_lastSeqNum-1,BLS_Write,FOS_WriteComplete);
+      g_bootLoader_resyncSent = true;
+    }
+    return true;
+  }
   if(g_bootLoaderState != BLS_Write) {
     SendError(CET_BootLoaderUnexpectedState,CPT_FlashData,g_bootLoaderState);
     return false;
   }
 
-  FLASH_Unlock();
-  FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR);
-
-  // FIXME:- Do stuff!
-
-  union WriteBufferT {
-    uint8_t uint8[4];
-    uint32_t uint32[1];
-  } ;
-
-  static union WriteBufferT g_bootLoaderBuffer;
-
-  for(int i = 0;i < len;i++,g_bootLoader_at++) {
-    int ringAt = g_bootLoader_at & 0x03;
-    g_bootLoaderBuffer.uint8[ringAt] = data[i];
-    if(ringAt == 3) {
-      uint32_t addr = g_bootLoader_at & 0xfffffffc;
-      if (FLASH_ProgramWord(addr,g_bootLoaderBuffer.uint32[0]) != FLASH_COMPLETE) {
-        SendError(CET_BootLoaderWriteFailed,CPT_FlashData,seqNum);
-        g_bootLoaderState = BLS_Error;
-        FLASH_Lock();
-        return 1;
+  // The host keeps a window of data packets in flight, so only accept them in order.
+  if(seqNum != g_bootLoader_lastSeqNum) {
+    if(!g_bootLoader_resyncSent) {
+      uint8_t behind = g_bootLoader_lastSeqNum - seqNum;
+      if(behind <= 128) {
+        // Host is resending data we already have, tell it how far we've got.
+        SendBootLoaderResult(g_bootLoader_lastSeqNum-1,BLS_Write,FOS_DataAck);
+      } else {
+        // We've missed some packets, ask for them again.
+        SendError(CET_BootLoaderLostSequence,CPT_FlashData,g_bootLoader_lastSeqNum);
       }
-      g_bootLoaderBuffer.uint32[0] = 0;
+      g_bootLoader_resyncSent = true;
     }
+    return false;
   }
-  // Write any remaining bytes in buffer.
-  if(g_bootLoader_at >= (g_bootLoader_address + g_bootLoader_len)) {
-    uint32_t addr = g_bootLoader_at & 0xfffffffc;
-    for(int i = 0;i < (int) (g_bootLoader_at & 0x3);i++) {
-      if (FLASH_ProgramByte(addr+i,g_bootLoaderBuffer.uint8[i]) != FLASH_COMPLETE) {
-        SendError(CET_BootLoaderWriteFailed,CPT_FlashData,seqNum);
-        g_bootLoaderState = BLS_Error;
-        FLASH_Lock();
-        return 1;
+  g_bootLoader_lastSeqNum++;
+  g_bootLoader_resyncSent = false;
+
+  enum FlashLZStatusT status = FLZ_Ok;
+  if(g_bootLoader_compressed) {
+    status = FlashLZ_Decode(&g_bootLoader_decoder,data,len,&BootLoaderPutByte,&BootLoaderGetByte,0);
+  } else {
+    for(int i = 0;i < len;i++) {
+      if(!BootLoaderPutByte(0,data[i])) {
+        status = FLZ_WriteFailed;
+        break;
       }
     }
+  }
+  // Write what's left at the end of the block.
+  if(status == FLZ_Ok && g_bootLoader_at >= (g_bootLoader_address + g_bootLoader_len)) {
+    if(!BootLoaderWritePage())
+      status = FLZ_WriteFailed;
+  }
+  if(status != FLZ_Ok) {
+    SendError(status == FLZ_Corrupt ? CET_BootLoaderCorruptData : CET_BootLoaderWriteFailed,CPT_FlashData,seqNum);
+    g_bootLoaderState = BLS_Error;
+    return false;
+  }
+
+  g_bootLoader_lastAck++;
+  if(g_bootLoader_at >= (g_bootLoader_address + g_bootLoader_len)) {
     g_bootLoaderState = BLS_Ready;
     SendBootLoaderResult(seqNum,BLS_Write,FOS_WriteComplete);
-  } else {
-    // Send an acknowledge every 16 messages so we can throttle sending data appropriately
-    g_bootLoader_lastAck++;
-    if(g_bootLoader_lastAck >= 8) {
-      g_bootLoader_lastAck = 0;
-      SendBootLoaderResult(seqNum,BLS_Write,FOS_DataAck);
-    }
+  } else if((g_bootLoader_pageWritten && g_bootLoader_lastAck >= BOOTLOADER_ACK_INTERVAL) ||
+             g_bootLoader_lastAck >= BOOTLOADER_ACK_LIMIT) {
+    // Let the host move its window along.
+    g_bootLoader_lastAck = 0;
+    g_bootLoader_pageWritten = false;
+    SendBootLoaderResult(seqNum,BLS_Write,FOS_DataAck);
   }
 
-  FLASH_Lock();
   return true;
 }
 
 
 
-bool BootLoaderCheckSum(uint8_t seqNum,uint32_t address,uint16_t len)
+// Reply with either the byte sum or the CRC-32 of an area of flash.
+
+static bool BootLoaderSumArea(uint8_t seqNum,uint32_t address,uint16_t len,enum ComsPacketTypeT packetType)
 {
-  if(!BootLoaderCheckSequence(seqNum,CPT_FlashChecksum))
-    return false;
+  // Boot-loaders not taking part in an update ignore broadcast commands.
   if(g_bootLoaderState == BLS_Disabled)
     return true;
+  if(!BootLoaderCheckSequence(seqNum,packetType))
+    return false;
   if(g_bootLoaderState == BLS_Error) {
-    SendError(CET_BootLoaderUnexpectedState,CPT_FlashChecksum,g_bootLoaderState);
+    SendError(CET_BootLoaderUnexpectedState,packetType,g_bootLoaderState);
     return false;
   }
   uint32_t sum = 0;
   uint8_t *at = (uint8_t *) address;
   uint8_t *end = at + len;
-  for(;at < end;at++)
-    sum += *at;
+  if(packetType == CPT_FlashCRC32) {
+    // Standard CRC-32 (reflected, polynomial 0xEDB88320)
+    sum = 0xFFFFFFFF;
+    for(;at < end;at++) {
+      sum ^= *at;
+      for(int b = 0;b < 8;b++)
+        sum = (sum >> 1) ^ (0xEDB88320 & (0 - (sum & 1)));
+    }
+    sum = ~sum;
+  } else {
+    for(;at < end;at++)
+      sum += *at;
+  }
 
   return SendBootLoaderCheckSumResult(seqNum,sum);
 }
 
+bool BootLoaderCheckSum(uint8_t seqNum,uint32_t address,uint16_t len)
+{
+  return BootLoaderSumArea(seqNum,address,len,CPT_FlashChecksum);
+}
+
+bool BootLoaderCRC32(uint8_t seqNum,uint32_t address,uint16_t len)
+{
+  return BootLoaderSumArea(seqNum,address,len,CPT_FlashCRC32);
+}
+
 /*
  * Send data.
  */
@@ -328,10 +476,11 @@ static thread_t *g_bootLoadThreadThread = 0;
 
 bool BootLoaderBeginRead(uint8_t seqNum,uint32_t address,uint16_t len)
 {
-  if(!BootLoaderCheckSequence(seqNum,CPT_FlashRead))
-    return false;
+  // Boot-loaders not taking part in an update ignore broadcast commands.
   if(g_bootLoaderState == BLS_Disabled)
     return true;
+  if(!BootLoaderCheckSequence(seqNum,CPT_FlashRead))
+    return false;
   // We can only being read from idle.
   if(g_bootLoaderState != BLS_Ready) {
     SendError(CET_BootLoaderUnexpectedState,CPT_FlashRead,g_bootLoaderState);
@@ -298,6 +298,15 @@ bool CANRecieveFrame(CANRxFrame *rxmsgptr)
         BootLoaderCheckSum(rxmsg.data8[6],rxmsg.data32[0],rxmsg.data16[2]);
       }
     } break;
+    case CPT_FlashCRC32: {    // Generate a CRC-32
+      if(rxDeviceId == g_deviceId || rxDeviceId == 0) {
+        if(rxmsg.DLC != 7) {
+          CANSendError(CET_UnexpectedPacketSize,msgType,rxmsg.DLC);
+          break;
+        }
+        BootLoaderCRC32(rxmsg.data8[6],rxmsg.data32[0],rxmsg.data16[2]);
+      }
+    } break;
     case CPT_FlashData: {     // Data packet
       if(g_canBridgeMode) {
         if(rxmsg.DLC < 1) {
@@ -323,6 +332,15 @@ bool CANRecieveFrame(CANRxFrame *rxmsgptr)
         BootLoaderBeginWrite(rxmsg.data8[6],rxmsg.data32[0],rxmsg.data16[2]);
       }
     } break;
+    case CPT_FlashWriteCompressed: {    // Write buffer from compressed data
+      if(rxDeviceId == g_deviceId || rxDeviceId == 0) {
+        if(rxmsg.DLC != 7) {
+          CANSendError(CET_UnexpectedPacketSize,msgType,rxmsg.DLC);
+          break;
+        }
+        BootLoaderBeginWriteCompressed(rxmsg.data8[6],rxmsg.data32[0],rxmsg.data16[2]);
+      }
+    } break;
     case CPT_FlashRead:  {    // Read buffer and send it back
       if(rxDeviceId == g_deviceId || rxDeviceId == 0) {
         if(rxmsg.DLC != 7) {
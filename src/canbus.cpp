@@ -352,6 +352,21 @@ bool CANSendBootLoaderWrite(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16
   return true;
 }
 
+bool CANSendBootLoaderWriteCompressed(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len)
+{
+  CANTxFrame *txmsg = g_txCANQueue.GetEmptyPacketI();
+  if(txmsg == 0)
+    return false;
+  CANSetAddress(txmsg,deviceId,CPT_FlashWriteCompressed);
+  txmsg->RTR = CAN_RTR_DATA;
+  txmsg->DLC = 7;
+  txmsg->data32[0] = addr;
+  txmsg->data16[2] = len;
+  txmsg->data8[6] = seqNum;
+  g_txCANQueue.PostFullPacket(txmsg);
+  return true;
+}
+
 bool CANSendBootLoaderCheckSum(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len)
 {
   CANTxFrame *txmsg = g_txCANQueue.GetEmptyPacketI();
@@ -367,6 +382,21 @@ bool CANSendBootLoaderCheckSum(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uin
   return true;
 }
 
+bool CANSendBootLoaderCRC32(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len)
+{
+  CANTxFrame *txmsg = g_txCANQueue.GetEmptyPacketI();
+  if(txmsg == 0)
+    return false;
+  CANSetAddress(txmsg,deviceId,CPT_FlashCRC32);
+  txmsg->RTR = CAN_RTR_DATA;
+  txmsg->DLC = 7;
+  txmsg->data32[0] = addr;
+  txmsg->data16[2] = len;
+  txmsg->data8[6] = seqNum;
+  g_txCANQueue.PostFullPacket(txmsg);
+  return true;
+}
+
 bool CANSendBootLoaderCheckSumResult(uint8_t deviceId,uint8_t seqNum,uint32_t sum)
 {
   CANTxFrame *txmsg = g_txCANQueue.GetEmptyPacketI();
@@ -374,7 +404,7 @@ bool CANSendBootLoaderCheckSumResult(uint8_t deviceId,uint8_t seqNum,uint32_t su
     return false;
   CANSetAddress(txmsg,deviceId,CPT_FlashChecksumResult);
   txmsg->RTR = CAN_RTR_DATA;
-  txmsg->DLC = 4;
+  txmsg->DLC = 5;
   txmsg->data32[0] = sum;
   txmsg->data8[4] = seqNum;
   g_txCANQueue.PostFullPacket(txmsg);
@@ -86,7 +86,9 @@ bool CANSendBootLoaderErase(uint8_t deviceId,uint8_t seqNum,uint32_t blockAddr);
 bool CANSendBootLoaderData(uint8_t deviceId,uint8_t seqNum,uint8_t *data,uint8_t len);
 bool CANSendBootLoaderRead(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len);
 bool CANSendBootLoaderWrite(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len);
+bool CANSendBootLoaderWriteCompressed(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len);
 bool CANSendBootLoaderCheckSum(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len);
+bool CANSendBootLoaderCRC32(uint8_t deviceId,uint8_t seqNum,uint32_t addr,uint16_t len);
 bool CANSendBootLoaderCheckSumResult(uint8_t deviceId,uint8_t seqNum,uint32_t sum);
 
 
@@ -395,6 +395,21 @@ void ProcessPacket(const uint8_t *m_data,int m_packetLen)
       }
     }
   } break;
+  case CPT_FlashCRC32: { // Generate a CRC-32
+    if(m_packetLen != sizeof(struct PacketFlashChecksumC)) {
+      USBSendError(g_deviceId,CET_UnexpectedPacketSize,cpt,m_packetLen);
+      break;
+    }
+    auto *psp = (struct PacketFlashChecksumC *) m_data;
+    if(psp->m_deviceId == g_deviceId || psp->m_deviceId == 0) {
+      BootLoaderCRC32(psp->m_sequenceNumber,psp->m_addr,psp->m_len);
+    }
+    if(g_canBridgeMode) {
+      if(psp->m_deviceId != g_deviceId || psp->m_deviceId == 0) {
+        CANSendBootLoaderCRC32(psp->m_deviceId,psp->m_sequenceNumber,psp->m_addr,psp->m_len);
+      }
+    }
+  } break;
   case CPT_FlashData: { // Data packet
     if(m_packetLen < (int) sizeof(struct PacketFlashDataC)) {
       USBSendError(g_deviceId,CET_UnexpectedPacketSize,cpt,m_packetLen);
@@ -427,6 +442,21 @@ void ProcessPacket(const uint8_t *m_data,int m_packetLen)
     }
 
   } break;
+  case CPT_FlashWriteCompressed: {// Write buffer from compressed data
+    if(m_packetLen != sizeof(struct PacketFlashWriteC)) {
+      USBSendError(g_deviceId,CET_UnexpectedPacketSize,cpt,m_packetLen);
+      break;
+    }
+    auto *psp = (struct PacketFlashWriteC *) m_data;
+    if(psp->m_deviceId == g_deviceId || psp->m_deviceId == 0) {
+      BootLoaderBeginWriteCompressed(psp->m_sequenceNumber,psp->m_addr,psp->m_len);
+    }
+    if(g_canBridgeMode) {
+      if(psp->m_deviceId != g_deviceId || psp->m_deviceId == 0) {
+        CANSendBootLoaderWriteCompressed(psp->m_deviceId,psp->m_sequenceNumber,psp->m_addr,psp->m_len);
+      }
+    }
+  } break;
   case CPT_FlashRead: { // Read buffer and send it back
     if(m_packetLen != sizeof(struct PacketFlashReadC)) {
       USBSendError(g_deviceId,CET_UnexpectedPacketSize,cpt,m_packetLen);
@@ -16,6 +16,14 @@ bool BootLoaderBeginWrite(uint8_t seqNum,uint32_t address,uint16_t len)
   return false;
 }
 
+bool BootLoaderBeginWriteCompressed(uint8_t seqNum,uint32_t address,uint16_t len)
+{
+  (void) seqNum;
+  (void) address;
+  (void) len;
+  return false;
+}
+
 bool BootLoaderErase(uint8_t seqNum,uint32_t blockAddress)
 {
   (void) seqNum;
@@ -31,6 +39,14 @@ bool BootLoaderCheckSum(uint8_t seqNum,uint32_t address,uint16_t len)
   return false;
 }
 
+bool BootLoaderCRC32(uint8_t seqNum,uint32_t address,uint16_t len)
+{
+  (void) seqNum;
+  (void) address;
+  (void) len;
+  return false;
+}
+
 bool BootLoaderBeginRead(uint8_t seqNum,uint32_t address,uint16_t len)
 {
   (void) seqNum;
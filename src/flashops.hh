@@ -5,8 +5,10 @@
 
 bool BootLoaderReset(bool enable);
 bool BootLoaderBeginWrite(uint8_t seqNum,uint32_t address,uint16_t len);
+bool BootLoaderBeginWriteCompressed(uint8_t seqNum,uint32_t address,uint16_t len);
 bool BootLoaderErase(uint8_t seqNum,uint32_t blockAddress);
 bool BootLoaderCheckSum(uint8_t seqNum,uint32_t address,uint16_t len);
+bool BootLoaderCRC32(uint8_t seqNum,uint32_t address,uint16_t len);
 bool BootLoaderBeginRead(uint8_t seqNum,uint32_t address,uint16_t len);
 bool BootLoaderData(uint8_t seqNum,uint8_t *data,uint8_t len);
 
@@ -0,0 +1,284 @@
+// Drive the boot-loader flash write code against the flash model and check
+// the result is byte exact, for raw and compressed data streams of awkward
+// lengths.  Reports the program operations and acknowledges used.
+//
+// Usage: bootLoaderTest [seed]
+
+#include "flash_model.h"
+#include "flashops.hh"
+#include "canbus.h"
+#include "coms.h"
+#include "dogbot/flashlz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+uint8_t g_deviceId = 1;
+bool g_canBridgeMode = false;
+
+// Replies from the boot-loader.
+static int g_acks = 0;
+static int g_errors = 0;
+static int g_lastResult = -1;
+static uint32_t g_lastSum = 0;
+
+void SendError(enum ComsErrorTypeT code,uint8_t originalPacketType,uint8_t data)
+{
+  printf("  Error %d from packet %d, data %d \n",(int) code,(int) originalPacketType,(int) data);
+  g_errors++;
+}
+
+bool CANSendBootLoaderResult(uint8_t deviceId,uint8_t lastSeqNum,enum BootLoaderStateT state,enum FlashOperationStatusT result)
+{
+  (void) deviceId;
+  (void) lastSeqNum;
+  (void) state;
+  if(result == FOS_DataAck)
+    g_acks++;
+  g_lastResult = result;
+  return true;
+}
+
+bool CANSendBootLoaderCheckSumResult(uint8_t deviceId,uint8_t seqNum,uint32_t sum)
+{
+  (void) deviceId;
+  (void) seqNum;
+  g_lastSum = sum;
+  return true;
+}
+
+bool CANSendBootLoaderData(uint8_t deviceId,uint8_t seqNum,uint8_t *data,uint8_t len)
+{
+  (void) deviceId;
+  (void) seqNum;
+  (void) data;
+  (void) len;
+  return true;
+}
+
+bool USBSendBootLoaderResult(uint8_t deviceId,uint8_t lastSeqNum,enum BootLoaderStateT state,enum FlashOperationStatusT result)
+{
+  return CANSendBootLoaderResult(deviceId,lastSeqNum,state,result);
+}
+
+bool USBSendBootLoaderCheckSumResult(uint8_t deviceId,uint8_t seqNum,uint32_t sum)
+{
+  return CANSendBootLoaderCheckSumResult(deviceId,seqNum,sum);
+}
+
+bool USBSendBootLoaderData(uint8_t deviceId,uint8_t seqNum,uint8_t *data,uint8_t len)
+{
+  return CANSendBootLoaderData(deviceId,seqNum,data,len);
+}
+
+// Simple compressor, trying a fixed set of distances so matches land both
+// in the boot-loader's page buffer and in flash that has already been written.
+
+static std::vector<uint8_t> Compress(const std::vector<uint8_t> &data)
+{
+  static const int distances[] = { 1, 2, 3, 4, 5, 7, 64, 255, 256, 257, 1000, 4096, 0xffff };
+  std::vector<uint8_t> out;
+  size_t literalStart = 0;
+  size_t at = 0;
+  while(at < data.size()) {
+    size_t bestLen = 0;
+    size_t bestDistance = 0;
+    for(auto distance : distances) {
+      if((size_t) distance > at)
+        break;
+      size_t len = 0;
+      while(len < FLASHLZ_MAX_MATCH && at + len < data.size() && data[at + len] == data[at + len - distance])
+        len++;
+      if(len > bestLen) {
+        bestLen = len;
+        bestDistance = distance;
+      }
+    }
+    if(bestLen < FLASHLZ_MIN_MATCH && (at - literalStart) < FLASHLZ_MAX_LITERAL) {
+      at++;
+      continue;
+    }
+    if(at > literalStart) {
+      out.push_back(at - literalStart - 1);
+      out.insert(out.end(),data.begin() + literalStart,data.begin() + at);
+    }
+    if(bestLen >= FLASHLZ_MIN_MATCH) {
+      out.push_back(0x80 | (bestLen - FLASHLZ_MIN_MATCH));
+      out.push_back(bestDistance & 0xff);
+      out.push_back(bestDistance >> 8);
+      at += bestLen;
+    }
+    literalStart = at;
+  }
+  if(at > literalStart) {
+    out.push_back(at - literalStart - 1);
+    out.insert(out.end(),data.begin() + literalStart,data.begin() + at);
+  }
+  return out;
+}
+
+// Make some data that looks a bit like code, with runs and repeats.
+
+static std::vector<uint8_t> MakeImage(size_t len)
+{
+  std::vector<uint8_t> data(len);
+  for(size_t i = 0;i < len;i++) {
+    int r = rand() % 8;
+    if(r == 0 || i < 8)
+      data[i] = rand();
+    else if(r < 3)
+      data[i] = data[i-1];
+    else
+      data[i] = data[i - 1 - (rand() % 8)];
+  }
+  return data;
+}
+
+static uint8_t g_seqNum = 0;
+
+static bool WriteBlock(uint32_t address,const std::vector<uint8_t> &image,bool compressed)
+{
+  std::vector<uint8_t> stream = compressed ? Compress(image) : image;
+  bool ok = compressed ? BootLoaderBeginWriteCompressed(g_seqNum++,address,image.size())
+                       : BootLoaderBeginWrite(g_seqNum++,address,image.size());
+  if(!ok)
+    return false;
+  // A host with the smallest window has to hear back within BOOTLOADER_ACK_LIMIT packets.
+  int acks = g_acks;
+  int sinceAck = 0;
+  for(size_t at = 0;at < stream.size();at += 7) {
+    int len = std::min(stream.size() - at,(size_t) 7);
+    if(!BootLoaderData(g_seqNum++,&stream[at],len))
+      return false;
+    if(g_acks != acks) {
+      acks = g_acks;
+      sinceAck = 0;
+    } else if(++sinceAck >= BOOTLOADER_ACK_LIMIT && g_lastResult != FOS_WriteComplete) {
+      printf("  No acknowledge for %d packets \n",sinceAck);
+      return false;
+    }
+  }
+  return g_lastResult == FOS_WriteComplete;
+}
+
+static bool CheckBlock(uint32_t address,const std::vector<uint8_t> &image)
+{
+  const uint8_t *flash = (const uint8_t *) address;
+  if(memcmp(flash,image.data(),image.size()) != 0) {
+    for(size_t i = 0;i < image.size();i++) {
+      if(flash[i] != image[i]) {
+        printf("  Mismatch at %08x, got %02x expected %02x \n",(unsigned) (address + i),flash[i],image[i]);
+        break;
+      }
+    }
+    return false;
+  }
+  // Nothing after the block should have been touched.
+  for(size_t i = image.size();i < image.size() + 8;i++) {
+    if(flash[i] != 0xff) {
+      printf("  Write past end of block at %08x \n",(unsigned) (address + i));
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc,char **argv)
+{
+  unsigned seed = (argc > 1) ? atoi(argv[1]) : 1;
+  srand(seed);
+
+  if(!FlashModel_Init()) {
+    fprintf(stderr,"Failed to set up flash model. \n");
+    return 1;
+  }
+
+  static const size_t lengths[] = { 1, 3, 4, 7, 255, 256, 257, 1000, 4093, 60001, 0xfffc };
+  const uint32_t address = 0x08020000; // Sector 5
+  bool allOk = true;
+
+  printf("%-10s %8s %8s %8s %10s %8s %6s \n","mode","bytes","stream","packets","programs","time ms","acks");
+  for(int compressed = 0;compressed < 2;compressed++) {
+    for(auto len : lengths) {
+      std::vector<uint8_t> image = MakeImage(len);
+
+      FlashModel_Reset();
+      g_seqNum = 0;
+      g_acks = 0;
+      g_errors = 0;
+      BootLoaderReset(true);
+      bool ok = g_lastResult == FOS_ReadyCompressed;
+      ok = ok && BootLoaderErase(g_seqNum++,address);
+      uint64_t eraseTime = FlashModel_Stats()->m_timeUs;
+      uint32_t erasePrograms = FlashModel_Stats()->m_programCount;
+
+      ok = ok && WriteBlock(address,image,compressed != 0);
+      ok = ok && CheckBlock(address,image);
+      ok = ok && g_errors == 0 && FlashModel_Stats()->m_programErrors == 0;
+
+      size_t streamLen = compressed ? Compress(image).size() : len;
+      const struct FlashModelStatsT *stats = FlashModel_Stats();
+      printf("%-10s %8zu %8zu %8zu %10u %8.2f %6d %s\n",
+             compressed ? "compressed" : "raw",
+             len,
+             streamLen,
+             (streamLen + 6) / 7,
+             stats->m_programCount - erasePrograms,
+             (stats->m_timeUs - eraseTime) / 1000.0,
+             g_acks,
+             ok ? "ok" : "FAILED");
+      if(!ok)
+        allOk = false;
+    }
+  }
+
+  // Erasing a blank sector should be skipped, a written one erased.
+  FlashModel_Reset();
+  g_seqNum = 0;
+  g_errors = 0;
+  BootLoaderReset(true);
+  BootLoaderErase(g_seqNum++,address);
+  bool eraseOk = g_lastResult == FOS_AlreadyErased && FlashModel_Stats()->m_eraseCount[5] == 0;
+  // Write the last word of the sector.
+  eraseOk = eraseOk && WriteBlock(address + 0x1fffc,std::vector<uint8_t>(4,0x00),false);
+  BootLoaderErase(g_seqNum++,address);
+  eraseOk = eraseOk && g_lastResult == FOS_Ok && FlashModel_Stats()->m_eraseCount[5] == 1;
+  eraseOk = eraseOk && *((const uint32_t *) (address + 0x1fffc)) == 0xffffffff;
+  printf("Blank check: %s \n",eraseOk ? "ok" : "FAILED");
+  if(!eraseOk)
+    allOk = false;
+
+  // The byte sum can't tell reordered data apart, the CRC-32 can.
+  FlashModel_Reset();
+  g_seqNum = 0;
+  g_errors = 0;
+  BootLoaderReset(true);
+  BootLoaderErase(g_seqNum++,address);
+  const char *digits = "123456789";
+  bool sumOk = WriteBlock(address,std::vector<uint8_t>(digits,digits + 9),false);
+  BootLoaderCheckSum(g_seqNum++,address,9);
+  sumOk = sumOk && g_lastSum == 477;
+  BootLoaderCRC32(g_seqNum++,address,9);
+  sumOk = sumOk && g_lastSum == 0xCBF43926 && g_errors == 0;
+  printf("Checksums: %s \n",sumOk ? "ok" : "FAILED");
+  if(!sumOk)
+    allOk = false;
+
+  // A stream that refers back before the start of the block must be rejected.
+  FlashModel_Reset();
+  g_seqNum = 0;
+  g_errors = 0;
+  BootLoaderReset(true);
+  BootLoaderErase(g_seqNum++,address);
+  uint8_t bad[] = { 0x80, 0x10, 0x00 };
+  BootLoaderBeginWriteCompressed(g_seqNum++,address,16);
+  if(BootLoaderData(g_seqNum++,bad,sizeof(bad)) || g_errors != 1) {
+    printf("Corrupt stream not detected. \n");
+    allOk = false;
+  }
+
+  printf("%s \n",allOk ? "All tests passed." : "Tests FAILED.");
+  return allOk ? 0 : 1;
+}
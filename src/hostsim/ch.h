@@ -0,0 +1,32 @@
+#ifndef HOSTSIM_CH_HEADER
+#define HOSTSIM_CH_HEADER 1
+
+// Minimal stand in for the ChibiOS kernel header, just enough for the
+// firmware headers to compile on the host.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+  int m_dummy;
+} binary_semaphore_t;
+
+typedef uint32_t systime_t;
+
+// Threads are never started on the host.
+typedef struct {
+  int m_dummy;
+} thread_t;
+
+#define NORMALPRIO 128
+#define THD_WORKING_AREA(name,size) char name[size]
+#define THD_FUNCTION(name,arg) void name(void *arg)
+
+static inline bool chThdShouldTerminateX(void) { return true; }
+static inline bool chThdTerminatedX(thread_t *tp) { (void) tp; return true; }
+static inline void chThdSleepMicroseconds(uint32_t us) { (void) us; }
+static inline thread_t *chThdCreateStatic(void *wsp,size_t size,int prio,void (*func)(void *),void *arg)
+{ (void) wsp; (void) size; (void) prio; (void) func; (void) arg; return NULL; }
+
+#endif
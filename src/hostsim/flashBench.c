@@ -0,0 +1,264 @@
+// Simulate years of SaveSetup() calls against the flash model and report
+// the wear and latency for each of the configuration save policies.
+//
+// Usage: flashBench [savesPerDay] [years]
+
+#include "flash_model.h"
+#include "storedconf.h"
+#include "eeprom.h"
+#include "stm32f4xx_flash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Matches the base used in storedconf.c
+#define EEPROM_BASE_GENERALCONF  1000
+#define EEPROM_CONF_WORDS        (sizeof(struct StoredConfigT) / 2)
+
+#define FLASH_ENDURANCE_CYCLES   10000
+
+enum SavePolicyT {
+  SP_EEPROM,       // Original behaviour, every word written on every save.
+  SP_EEPROMDelta,  // EEPROM emulation, only words that have changed are written.
+  SP_Record,       // CRC checked record log, as used by StoredConf_Save()
+  SP_Count
+};
+
+static const char *g_policyNames[SP_Count] = {
+  "eeprom",
+  "eeprom-delta",
+  "record"
+};
+
+static uint16_t ConfWord(const struct StoredConfigT *conf,unsigned int i)
+{
+  const uint8_t *conf_addr = (const uint8_t *) conf;
+  return (uint16_t) (((conf_addr[2 * i] << 8) & 0xFF00) | (conf_addr[2 * i + 1] & 0xFF));
+}
+
+static bool SaveEEPROM(const struct StoredConfigT *conf,bool onlyChanged)
+{
+  for(unsigned int i = 0;i < EEPROM_CONF_WORDS;i++) {
+    uint16_t var = ConfWord(conf,i);
+    if(onlyChanged) {
+      uint16_t current;
+      if(EE_ReadVariable(EEPROM_BASE_GENERALCONF + i,&current) == 0 && current == var)
+        continue;
+    }
+    if(EE_WriteVariable(EEPROM_BASE_GENERALCONF + i,var) != FLASH_COMPLETE)
+      return false;
+  }
+  return true;
+}
+
+static bool LoadEEPROM(struct StoredConfigT *conf)
+{
+  uint8_t *conf_addr = (uint8_t *) conf;
+  uint16_t var;
+  for(unsigned int i = 0;i < EEPROM_CONF_WORDS;i++) {
+    if(EE_ReadVariable(EEPROM_BASE_GENERALCONF + i,&var) != 0)
+      return false;
+    conf_addr[2 * i] = (var >> 8) & 0xFF;
+    conf_addr[2 * i + 1] = var & 0xFF;
+  }
+  return true;
+}
+
+// Change the configuration the way a user typically does, mostly small
+// tweaks to the home position with the occasional recalibration.
+
+static void MutateConfig(struct StoredConfigT *conf,unsigned long saveNumber)
+{
+  conf->configState = 1;
+  conf->m_homeIndexPosition = (float) (saveNumber % 1000) * 0.001f;
+  if((saveNumber % 10) == 0) {
+    for(int i = 0;i < g_calibrationPointCount;i++)
+      conf->phaseAngles[i][saveNumber % 3] = (uint16_t) (2000 + ((saveNumber + i) % 1000));
+  }
+  if((saveNumber % 100) == 0)
+    conf->deviceId = (uint16_t) (1 + (saveNumber / 100) % 12);
+}
+
+static double ElapsedUs(const struct timespec *start,const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static bool RunPolicy(enum SavePolicyT policy,unsigned long saves)
+{
+  FlashModel_Reset();
+  StoredConf_Init();
+  if(policy != SP_Record)
+    EE_Init();
+
+  struct StoredConfigT conf;
+  StoredConf_Load(&conf);
+
+  uint64_t worstUs = 0;
+  uint64_t startUs = FlashModel_Stats()->m_timeUs;
+  for(unsigned long i = 1;i <= saves;i++) {
+    MutateConfig(&conf,i);
+    uint64_t before = FlashModel_Stats()->m_timeUs;
+    bool ok = false;
+    switch(policy) {
+      case SP_EEPROM:      ok = SaveEEPROM(&conf,false); break;
+      case SP_EEPROMDelta: ok = SaveEEPROM(&conf,true); break;
+      case SP_Record:      ok = StoredConf_Save(&conf); break;
+      case SP_Count: break;
+    }
+    if(!ok) {
+      fprintf(stderr,"%s: Save %lu failed. \n",g_policyNames[policy],i);
+      return false;
+    }
+    uint64_t took = FlashModel_Stats()->m_timeUs - before;
+    if(took > worstUs)
+      worstUs = took;
+  }
+  uint64_t totalUs = FlashModel_Stats()->m_timeUs - startUs;
+
+  // Check what comes back after a power cycle, and how long it takes to get it.
+  struct StoredConfigT loaded;
+  memset(&loaded,0,sizeof(loaded));
+  struct timespec loadStart,loadEnd;
+  clock_gettime(CLOCK_MONOTONIC,&loadStart);
+  bool loadOk;
+  if(policy == SP_Record) {
+    StoredConf_Init();
+    loadOk = StoredConf_Load(&loaded);
+  } else {
+    EE_Init();
+    loadOk = LoadEEPROM(&loaded);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&loadEnd);
+  bool matches = loadOk && memcmp(&loaded,&conf,sizeof(conf)) == 0;
+
+  const struct FlashModelStatsT *stats = FlashModel_Stats();
+  // Each page transfer erases the page that has just been copied from.
+  uint32_t pageTransfers = stats->m_eraseCount[2] + stats->m_eraseCount[3];
+  uint32_t maxErase = 0;
+  for(int i = 0;i < FLASHMODEL_SECTORS;i++) {
+    if(stats->m_eraseCount[i] > maxErase)
+      maxErase = stats->m_eraseCount[i];
+  }
+
+  printf("%-13s %8lu %9u %6u %6u %6u %10.1f %10.3f %12.1f %9.1f %s\n",
+         g_policyNames[policy],
+         saves,
+         (unsigned) stats->m_programCount,
+         (unsigned) pageTransfers,
+         (unsigned) (stats->m_eraseCount[2] + stats->m_eraseCount[3]),
+         (unsigned) (stats->m_eraseCount[10] + stats->m_eraseCount[11]),
+         worstUs / 1000.0,
+         (totalUs / 1000.0) / saves,
+         ElapsedUs(&loadStart,&loadEnd),
+         maxErase == 0 ? 0.0 : (double) FLASH_ENDURANCE_CYCLES / maxErase,
+         matches ? "ok" : "MISMATCH");
+  if(stats->m_programErrors != 0)
+    printf("  %u program operations tried to set cleared bits. \n",(unsigned) stats->m_programErrors);
+  return matches;
+}
+
+// Save 'conf' with the power cut after every possible number of flash
+// operations, starting each time from 'flashImage', and check that a power
+// cycle always brings back either the configuration from before the save or
+// 'conf'.  Returns the number of cuts tried, or -1 if one lost the
+// configuration.
+
+static int PowerCutSave(const struct StoredConfigT *before,const struct StoredConfigT *conf,const uint8_t *flashImage)
+{
+  int cuts = 0;
+  for(int after = 0;;after++) {
+    FlashModel_Restore(flashImage);
+    FlashModel_PowerFailAfter(after);
+    bool saved = StoredConf_Save((struct StoredConfigT *) conf);
+    FlashModel_PowerFailAfter(-1);
+
+    // Before the first save there is nothing stored and the defaults come back.
+    struct StoredConfigT loaded;
+    StoredConf_Init();
+    StoredConf_Load(&loaded);
+    bool isBefore = memcmp(&loaded,before,sizeof(loaded)) == 0;
+    bool isNew = memcmp(&loaded,conf,sizeof(loaded)) == 0;
+    if(!isBefore && !isNew) {
+      fprintf(stderr,"Configuration lost with the power cut after %d flash operations. \n",after);
+      return -1;
+    }
+    if(saved) {
+      // The save got all the way through, so leave the flash with it in.
+      if(!isNew) {
+        fprintf(stderr,"Save reported success but the old configuration was loaded. \n");
+        return -1;
+      }
+      return cuts;
+    }
+    cuts++;
+  }
+}
+
+// Fill both record sectors twice over, cutting the power at every step of
+// the first save, an ordinary append and each change of sector.
+
+static bool CheckPowerCuts(void)
+{
+  static uint8_t flashImage[FLASHMODEL_SIZE];
+  FlashModel_Reset();
+  StoredConf_Init();
+
+  struct StoredConfigT before,conf;
+  StoredConf_Load(&before);
+  conf = before;
+  int cuts = 0,checkedSaves = 0;
+  for(unsigned long i = 1;i <= 4000;i++) {
+    MutateConfig(&conf,i);
+    const struct FlashModelStatsT *stats = FlashModel_Stats();
+    uint32_t erases = stats->m_eraseCount[10] + stats->m_eraseCount[11];
+    FlashModel_Save(flashImage);
+    if(!StoredConf_Save(&conf)) {
+      fprintf(stderr,"Save %lu failed. \n",i);
+      return false;
+    }
+    // Go back over saves which erased a sector.
+    if(i <= 2 || erases != stats->m_eraseCount[10] + stats->m_eraseCount[11] || (i % 1000) == 0) {
+      int n = PowerCutSave(&before,&conf,flashImage);
+      if(n < 0)
+        return false;
+      cuts += n;
+      checkedSaves++;
+    }
+    before = conf;
+  }
+  printf("\nPower cut at every step of %d saves, %d cuts, the configuration was never lost. \n",checkedSaves,cuts);
+  return true;
+}
+
+int main(int argc,char **argv)
+{
+  unsigned long savesPerDay = 10;
+  double years = 5;
+  if(argc > 1)
+    savesPerDay = strtoul(argv[1],0,10);
+  if(argc > 2)
+    years = atof(argv[2]);
+
+  if(!FlashModel_Init())
+    return 1;
+
+  unsigned long saves = (unsigned long) (savesPerDay * 365 * years);
+  printf("Config size %u bytes, %lu saves per day for %g years. \n",
+         (unsigned) sizeof(struct StoredConfigT),savesPerDay,years);
+  printf("Wear ratio is the number of times the simulated period could be repeated before the most used sector reaches %u cycles. \n\n",
+         FLASH_ENDURANCE_CYCLES);
+  printf("%-13s %8s %9s %6s %6s %6s %10s %10s %12s %9s %s\n",
+         "policy","saves","programs","xfers","eeErs","recErs","worst(ms)","mean(ms)","load(us)","wear","check");
+
+  bool ok = true;
+  for(int i = 0;i < SP_Count;i++) {
+    if(!RunPolicy((enum SavePolicyT) i,saves))
+      ok = false;
+  }
+  if(!CheckPowerCuts())
+    ok = false;
+  return ok ? 0 : 1;
+}
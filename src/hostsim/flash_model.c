@@ -0,0 +1,213 @@
+#define _GNU_SOURCE 1
+
+#include "flash_model.h"
+#include "stm32f4xx_flash.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+// Typical timings from the STM32F405 datasheet, x32 parallelism.
+#define FLASHMODEL_PROGRAM_TIME_US     16
+#define FLASHMODEL_ERASE16K_TIME_US    400000
+#define FLASHMODEL_ERASE64K_TIME_US    1100000
+#define FLASHMODEL_ERASE128K_TIME_US   2000000
+
+static const uint32_t g_sectorBase[FLASHMODEL_SECTORS] = {
+  0x08000000, 0x08004000, 0x08008000, 0x0800C000,
+  0x08010000, 0x08020000, 0x08040000, 0x08060000,
+  0x08080000, 0x080A0000, 0x080C0000, 0x080E0000
+};
+
+static uint8_t *g_flashRead = 0;   // Read only view at the real address.
+static uint8_t *g_flashWrite = 0;  // Writable alias used by the model.
+static bool g_flashLocked = true;
+static struct FlashModelStatsT g_flashStats;
+static int g_powerFailAfter = -1; // Operations left before the power is cut, -1 for never.
+
+bool FlashModel_Init(void)
+{
+  if(g_flashRead != 0)
+    return true;
+
+  int fd = memfd_create("flashmodel",0);
+  if(fd < 0 || ftruncate(fd,FLASHMODEL_SIZE) != 0) {
+    perror("FlashModel_Init");
+    return false;
+  }
+
+  void *readAddr = mmap((void *) (uintptr_t) FLASHMODEL_BASE,FLASHMODEL_SIZE,PROT_READ,MAP_SHARED | MAP_FIXED_NOREPLACE,fd,0);
+  if(readAddr == MAP_FAILED || readAddr != (void *) (uintptr_t) FLASHMODEL_BASE) {
+    fprintf(stderr,"FlashModel_Init: Failed to map flash at 0x%08x \n",(unsigned) FLASHMODEL_BASE);
+    return false;
+  }
+  void *writeAddr = mmap(0,FLASHMODEL_SIZE,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  if(writeAddr == MAP_FAILED) {
+    perror("FlashModel_Init");
+    return false;
+  }
+  close(fd);
+
+  g_flashRead = (uint8_t *) readAddr;
+  g_flashWrite = (uint8_t *) writeAddr;
+  FlashModel_Reset();
+  return true;
+}
+
+void FlashModel_Reset(void)
+{
+  memset(g_flashWrite,0xff,FLASHMODEL_SIZE);
+  memset(&g_flashStats,0,sizeof(g_flashStats));
+  g_flashLocked = true;
+  g_powerFailAfter = -1;
+}
+
+void FlashModel_PowerFailAfter(int operations)
+{
+  g_powerFailAfter = operations < 0 ? -1 : operations;
+}
+
+void FlashModel_Save(uint8_t *buffer)
+{
+  memcpy(buffer,g_flashRead,FLASHMODEL_SIZE);
+}
+
+void FlashModel_Restore(const uint8_t *buffer)
+{
+  memcpy(g_flashWrite,buffer,FLASHMODEL_SIZE);
+}
+
+// Count down to a power cut.  Returns 1 if this operation is the one cut
+// short, 2 if the power is already off, 0 otherwise.
+
+static int FlashModel_PowerCut(void)
+{
+  if(g_powerFailAfter < 0)
+    return 0;
+  if(g_powerFailAfter == 0) {
+    g_powerFailAfter = -2;
+    return 1;
+  }
+  if(g_powerFailAfter == -2)
+    return 2;
+  g_powerFailAfter--;
+  return 0;
+}
+
+const struct FlashModelStatsT *FlashModel_Stats(void)
+{
+  return &g_flashStats;
+}
+
+int FlashModel_SectorOf(uint32_t address)
+{
+  if(address < FLASHMODEL_BASE || address >= FLASHMODEL_BASE + FLASHMODEL_SIZE)
+    return -1;
+  for(int i = FLASHMODEL_SECTORS-1;i >= 0;i--) {
+    if(address >= g_sectorBase[i])
+      return i;
+  }
+  return -1;
+}
+
+uint32_t FlashModel_SectorBase(int sectorNumber)
+{
+  return g_sectorBase[sectorNumber];
+}
+
+uint32_t FlashModel_SectorSize(int sectorNumber)
+{
+  if(sectorNumber == FLASHMODEL_SECTORS-1)
+    return FLASHMODEL_BASE + FLASHMODEL_SIZE - g_sectorBase[sectorNumber];
+  return g_sectorBase[sectorNumber+1] - g_sectorBase[sectorNumber];
+}
+
+// Program 'len' bytes, flash can only clear bits so the result is old & new.
+
+static FLASH_Status FlashModel_Program(uint32_t address,const uint8_t *data,int len)
+{
+  if(g_flashLocked)
+    return FLASH_ERROR_WRP;
+  if((address & (len-1)) != 0)
+    return FLASH_ERROR_PGA;
+  if(FlashModel_SectorOf(address) < 0 || FlashModel_SectorOf(address + len - 1) < 0)
+    return FLASH_ERROR_PROGRAM;
+
+  int cut = FlashModel_PowerCut();
+  if(cut == 2)
+    return FLASH_ERROR_OPERATION;
+  if(cut == 1)
+    len /= 2;
+
+  uint8_t *at = g_flashWrite + (address - FLASHMODEL_BASE);
+  for(int i = 0;i < len;i++) {
+    if((data[i] & ~at[i]) != 0)
+      g_flashStats.m_programErrors++;
+    at[i] &= data[i];
+  }
+  g_flashStats.m_programCount++;
+  g_flashStats.m_bytesProgrammed += len;
+  g_flashStats.m_timeUs += FLASHMODEL_PROGRAM_TIME_US;
+  return cut ? FLASH_ERROR_OPERATION : FLASH_COMPLETE;
+}
+
+void FLASH_Unlock(void)
+{
+  g_flashLocked = false;
+}
+
+void FLASH_Lock(void)
+{
+  g_flashLocked = true;
+}
+
+void FLASH_ClearFlag(uint32_t FLASH_FLAG)
+{
+  (void) FLASH_FLAG;
+}
+
+FLASH_Status FLASH_EraseSector(uint32_t FLASH_Sector, uint8_t VoltageRange)
+{
+  (void) VoltageRange;
+  if(g_flashLocked)
+    return FLASH_ERROR_WRP;
+  int sectorNumber = (int) (FLASH_Sector >> 3);
+  if((FLASH_Sector & 0x7) != 0 || sectorNumber >= FLASHMODEL_SECTORS)
+    return FLASH_ERROR_OPERATION;
+
+  int cut = FlashModel_PowerCut();
+  if(cut == 2)
+    return FLASH_ERROR_OPERATION;
+
+  uint32_t size = FlashModel_SectorSize(sectorNumber);
+  // An erase cut short leaves the sector part erased.
+  memset(g_flashWrite + (g_sectorBase[sectorNumber] - FLASHMODEL_BASE),0xff,cut ? size / 2 : size);
+  g_flashStats.m_eraseCount[sectorNumber]++;
+  if(size <= 0x4000)
+    g_flashStats.m_timeUs += FLASHMODEL_ERASE16K_TIME_US;
+  else if(size <= 0x10000)
+    g_flashStats.m_timeUs += FLASHMODEL_ERASE64K_TIME_US;
+  else
+    g_flashStats.m_timeUs += FLASHMODEL_ERASE128K_TIME_US;
+  return cut ? FLASH_ERROR_OPERATION : FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_ProgramWord(uint32_t Address, uint32_t Data)
+{
+  return FlashModel_Program(Address,(const uint8_t *) &Data,4);
+}
+
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data)
+{
+  return FlashModel_Program(Address,(const uint8_t *) &Data,2);
+}
+
+FLASH_Status FLASH_ProgramByte(uint32_t Address, uint8_t Data)
+{
+  return FlashModel_Program(Address,&Data,1);
+}
@@ -0,0 +1,61 @@
+#ifndef HOSTSIM_FLASH_MODEL_HEADER
+#define HOSTSIM_FLASH_MODEL_HEADER 1
+
+// RAM backed model of the STM32F405 flash, implementing the FLASH_xxx calls
+// from the standard peripheral library.  The flash array is mapped read only
+// at its real address (0x08000000) so firmware that reads flash through raw
+// pointers works unchanged; writes are only possible through the model.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLASHMODEL_BASE          ((uint32_t)0x08000000)
+#define FLASHMODEL_SIZE          ((uint32_t)0x100000)  /* 1 MByte */
+#define FLASHMODEL_SECTORS       12
+
+struct FlashModelStatsT {
+  uint32_t m_eraseCount[FLASHMODEL_SECTORS];
+  uint32_t m_programCount;   // Number of program operations of any width
+  uint32_t m_bytesProgrammed;
+  uint32_t m_programErrors;  // Attempts to set bits that are already cleared
+  uint64_t m_timeUs;         // Simulated time spent in program and erase operations
+};
+
+//! Map the flash array and set it to the erased state.
+bool FlashModel_Init(void);
+
+//! Erase the whole array and clear the statistics.
+void FlashModel_Reset(void);
+
+//! Access the statistics gathered since the last reset.
+const struct FlashModelStatsT *FlashModel_Stats(void);
+
+//! Cut the power after 'operations' more program or erase operations.  The
+//! next one is left half done and every one after that fails without
+//! touching the array.  A negative count restores the power.
+void FlashModel_PowerFailAfter(int operations);
+
+//! Copy the whole array to 'buffer', FLASHMODEL_SIZE bytes.
+void FlashModel_Save(uint8_t *buffer);
+
+//! Restore the whole array from 'buffer', statistics are left alone.
+void FlashModel_Restore(const uint8_t *buffer);
+
+//! Sector number, 0 to 11, containing the address. -1 if outside flash.
+int FlashModel_SectorOf(uint32_t address);
+
+//! Start address of a sector.
+uint32_t FlashModel_SectorBase(int sectorNumber);
+
+//! Size of a sector in bytes.
+uint32_t FlashModel_SectorSize(int sectorNumber);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
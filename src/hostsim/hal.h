@@ -0,0 +1,23 @@
+#ifndef HOSTSIM_HAL_HEADER
+#define HOSTSIM_HAL_HEADER 1
+
+// Minimal stand in for the ChibiOS HAL header, just enough for the
+// boot-loader flash code to compile on the host.
+
+#include "ch.h"
+
+typedef struct {
+  uint32_t SID;
+  uint8_t IDE;
+  uint8_t RTR;
+  uint8_t DLC;
+  union {
+    uint8_t data8[8];
+    uint16_t data16[4];
+    uint32_t data32[2];
+  };
+} CANTxFrame;
+
+typedef CANTxFrame CANRxFrame;
+
+#endif
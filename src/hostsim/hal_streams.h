@@ -0,0 +1,8 @@
+#ifndef HOSTSIM_HAL_STREAMS_HEADER
+#define HOSTSIM_HAL_STREAMS_HEADER 1
+
+// Minimal stand in for the ChibiOS stream header.
+
+typedef struct BaseSequentialStream BaseSequentialStream;
+
+#endif
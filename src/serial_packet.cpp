@@ -1,91 +1,60 @@
 
 #include "serial_packet.hh"
 
+//! Accept a block of bytes
 
-void SerialDecodeC::AcceptByte(uint8_t sendByte)
+void SerialDecodeC::AcceptBlock(uint8_t *data,int len)
 {
-  switch(m_state)
-  {
-  default: // This can only be caused by a bug.
-    g_usbErrorCount++;
-    m_state = 0;
-    /* no break */
-  case 0: // Wait for STX.
-    if(sendByte == g_charSTX)
-      m_state = 1;
-    // Else remain in state 0.
-    break;
-  case 1: // Packet length.
-    m_packetLen = sendByte;
-    if(m_packetLen >= m_maxPacketSize) {
-      if(sendByte != g_charSTX) // This will always be false, but for good form.
-        m_state = 0;
-      break;
-    }
-
-    m_at = 0;
-    m_checkSum = 0x55 + m_packetLen;
-    m_state = 2;
-    break;
-  case 2: // Data
-    m_checkSum += sendByte;
-    m_data[m_at] = sendByte;
-    m_at++;
-    if(m_at >= m_packetLen)
-      m_state = 3;
-    break;
-  case 3: { // CRC 1
-    uint8_t cs1 = (m_checkSum & 0xff);
-    //RavlDebug("Checksum1 : %d %d ",(int)  cs1 , (int) sendByte);
-    if(cs1 != sendByte) {
-      //RavlDebug("Checksum failed. ");
-      if(sendByte == g_charSTX)
-        m_state = 1;
-      else
-        m_state = 0;
-      break;
-    }
+  auto handler = [this](uint8_t *packet,int packetLen) { HandleFrame(packet,packetLen); };
+  int at = 0;
+  while(at < len) {
+    if(m_rxFraming == SF_COBSCRC16)
+      at += m_decoderCOBS.Decode(data + at,len - at,handler);
+    else
+      at += m_decoder.Decode(data + at,len - at,handler);
+  }
+}
 
-    m_state = 4;
-  } break;
-  case 4: { // CRC 2
-    uint8_t cs2 = ((m_checkSum >> 8) & 0xff);
-    //RavlDebug("Checksum2 : %d %d ",(int) ((m_checkSum >> 8) & 0xff) , (int) sendByte);
-    if(cs2 != sendByte) {
-      //RavlDebug("Checksum failed. ");
-      if(sendByte == g_charSTX)
-        m_state = 1;
-      else
-        m_state = 0;
-      break;
-    }
+//! Handle a frame that has been received.
 
-    m_state = 5;
-  } break;
-  case 5: // ETX.
-    if(sendByte == g_charETX) {
-      //RavlDebug("Got packet!");
-      ProcessPacket();
-    } else {
-      // FIXME Count corrupted packets ?
-      //RavlDebug("Packet corrupted.");
-      if(sendByte == g_charSTX) {
-        m_state = 1;
-        break;
-      }
-    }
-    m_state = 0;
-    break;
+void SerialDecodeC::HandleFrame(uint8_t *data,int len)
+{
+  if(data[0] != CPT_SerialFraming) {
+    ::ProcessPacket(data,len);
+    return ;
+  }
+  if(len != sizeof(struct PacketSerialFramingC)) {
+    USBSendError(g_deviceId,CET_UnexpectedPacketSize,CPT_SerialFraming,len);
+    return ;
   }
+  // Reply with the framing we'll use, the transmit thread changes
+  // to it once the reply is sent. The host sends nothing until it has the reply.
+  struct PacketSerialFramingC *psp = (struct PacketSerialFramingC *) data;
+  struct PacketSerialFramingC reply;
+  reply.m_packetType = CPT_SerialFraming;
+  reply.m_framing = (psp->m_framing == SF_COBSCRC16) ? SF_COBSCRC16 : SF_STXChecksum;
+  if(!USBSendPacket((uint8_t *) &reply,sizeof(reply)))
+    return ;
+  m_decoder.Pause();
+  m_decoderCOBS.Pause();
+  m_decoder.Reset();
+  m_decoderCOBS.Reset();
+  m_rxFraming = reply.m_framing;
 }
 
-//! Process received packet.
+//! Encode a packet with the current framing.
 
-void SerialDecodeC::ProcessPacket()
+int SerialDecodeC::EncodeFrame(uint8_t *frame,const uint8_t *data,int len)
 {
-  ::ProcessPacket(m_data,m_packetLen);
+  int size;
+  if(m_txFraming == SF_COBSCRC16)
+    size = SerialFrameEncodeCOBS(frame,data,len);
+  else
+    size = SerialFrameEncode(frame,data,len);
+  if(data[0] == CPT_SerialFraming && len == sizeof(struct PacketSerialFramingC))
+    m_txFraming = ((struct PacketSerialFramingC *) data)->m_framing;
+  return size;
 }
 
 SerialDecodeC g_comsDecode;
 
-
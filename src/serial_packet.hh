@@ -15,36 +15,45 @@
 
 #include <string.h>
 
-static const uint8_t g_charSTX = 0x02;
-static const uint8_t g_charETX = 0x03;
+#include "dogbot/SerialFrame.hh"
 
 class SerialDecodeC
 {
 public:
 
-  //! Reset state machine
+  //! Reset state machine, going back to SF_STXChecksum framing.
   void ResetStateMachine()
   {
-    m_state = 0;
-    m_at = 0;
+    m_decoder.Reset();
+    m_decoderCOBS.Reset();
+    m_rxFraming = SF_STXChecksum;
+    m_txFraming = SF_STXChecksum;
   }
 
   //! Accept a byte
-  void AcceptByte(uint8_t sendByte);
+  void AcceptByte(uint8_t sendByte)
+  { AcceptBlock(&sendByte,1); }
 
-  //! Process received packet.
-  void ProcessPacket();
+  //! Accept a block of bytes, packets are processed from where they are in 'data'.
+  void AcceptBlock(uint8_t *data,int len);
+
+  //! Handle a frame that has been received.
+  void HandleFrame(uint8_t *data,int len);
+
+  //! Encode a packet with the current framing, 'frame' must have space for
+  //! len + g_serialFrameOverhead bytes. Returns the size of the frame.
+  //! Only called from the transmit thread.
+  int EncodeFrame(uint8_t *frame,const uint8_t *data,int len);
 
-  int m_state = 0;
-  int m_checkSum = 0;
-  int m_packetLen = 0;
   static const int m_maxPacketSize = BMC_MAXPACKETSIZE;
-  uint8_t m_data[m_maxPacketSize];
-  int m_at = 0;
+  SerialFrameDecoderC<m_maxPacketSize-1> m_decoder;
+  SerialFrameCOBSDecoderC<m_maxPacketSize-1> m_decoderCOBS;
+  volatile uint8_t m_rxFraming = SF_STXChecksum;
+  volatile uint8_t m_txFraming = SF_STXChecksum;
 
   BaseAsynchronousChannel *m_SDU = 0;
 
-  // Packet structure.
+  // Packet structure with SF_STXChecksum framing, see dogbot/SerialFrame.hh
   // x    STX
   // x    Len - Of data excluding STX,ETX and Checksum.
   // 0    Address
@@ -55,9 +55,7 @@ static THD_FUNCTION(ThreadRxComs, arg) {
           int ret = chnReadTimeout(g_comsDecode.m_SDU,buff,buffSize,TIME_IMMEDIATE);
           if(ret <= 0)
             break;
-          for(int i = 0;i < ret;i++) {
-            g_comsDecode.AcceptByte(buff[i]);
-          }
+          g_comsDecode.AcceptBlock(buff,ret);
         }
       }
     }
@@ -71,7 +69,7 @@ static THD_FUNCTION(ThreadTxComs, arg) {
   (void)arg;
   chRegSetThreadName("txcoms");
 
-  static uint8_t txbuff[70];
+  static uint8_t txbuff[BMC_MAXPACKETSIZE + g_serialFrameOverhead];
   while(true) {
 
     msg_t txMsg;
@@ -79,24 +77,7 @@ static THD_FUNCTION(ThreadTxComs, arg) {
 
     if(SDU1.config->usbp->state == USB_ACTIVE) {
 
-      uint8_t len = packet->m_len;
-
-      uint8_t *buff = packet->m_data;
-
-      uint8_t *at = txbuff;
-      *(at++) = g_charSTX;
-      *(at++) = len;
-      int crc = len + 0x55;
-      for(int i = 0;i < len;i++) {
-        uint8_t data = buff[i];
-        *(at++) = data;
-        crc += data;
-      }
-      *(at++) = crc;
-      *(at++) = crc>>8;
-      *(at++) = g_charETX;
-      int size = at - txbuff;
-
+      int size = g_comsDecode.EncodeFrame(txbuff,packet->m_data,packet->m_len);
       chnWrite(g_packetStream, txbuff, size);
     } else {
       // If we've lost our connection turn bridge mode off.
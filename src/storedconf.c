@@ -7,10 +7,54 @@
 // EEPROM settings
 #define EEPROM_BASE_GENERALCONF              1000
 
+// Config record settings.  Records are appended to one of two dedicated flash
+// sectors.  When the active sector is full the next record starts the other
+// one, so the newest record is never erased before its replacement has been
+// written and checked.
+#define STOREDCONF_AREA_COUNT                2
+#define STOREDCONF_AREA_SIZE                 ((uint32_t)0x20000)  /* 128 KByte */
+#define STOREDCONF_AREA_MAGIC                ((uint32_t)0x41544D42)
+#define STOREDCONF_RECORD_MAGIC              ((uint32_t)0x43544D42)
+#define STOREDCONF_RECORD_VERSION            1
+
+// Records written before two sectors were used start at the beginning of sector 11.
+#define STOREDCONF_LEGACY_BASE               ((uint32_t)0x080E0000)
+
+static const uint16_t g_storedConfAreaSector[STOREDCONF_AREA_COUNT] = { FLASH_Sector_10, FLASH_Sector_11 };
+static const uint32_t g_storedConfAreaBase[STOREDCONF_AREA_COUNT] = { 0x080C0000, 0x080E0000 };
+
+// Start of each area, the area with the highest generation is the active one.
+struct StoredConfAreaHeaderT {
+  uint32_t magic;
+  uint32_t generation;
+  uint32_t check;      // ~generation
+  uint32_t reserved;
+};
+
+#define STOREDCONF_PAYLOAD_WORDS             ((sizeof(struct StoredConfigT) + 3) / 4)
+
+// Layout of a record in flash, the magic is programmed first and the crc last.
+struct StoredConfRecordT {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t length;
+  union {
+    struct StoredConfigT conf;
+    uint32_t words[STOREDCONF_PAYLOAD_WORDS];
+  } payload;
+  uint32_t crc;
+};
+
+#define STOREDCONF_RECORD_WORDS              (sizeof(struct StoredConfRecordT) / 4)
+#define STOREDCONF_RECORD_SLOTS              ((STOREDCONF_AREA_SIZE - sizeof(struct StoredConfAreaHeaderT)) / sizeof(struct StoredConfRecordT))
+#define STOREDCONF_LEGACY_SLOTS              (STOREDCONF_AREA_SIZE / sizeof(struct StoredConfRecordT))
+
 
 bool g_eeInitDone = false;
 struct StoredConfigT g_storedConfig;
 
+static bool g_eeEmulationInitDone = false;
+
 
 // Global variables
 uint16_t VirtAddVarTab[NB_OF_VAR];
@@ -46,24 +90,227 @@ void StoredConf_Init(void)
   FLASH_Unlock();
   FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
                   FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
-  EE_Init();
+
+  // The EEPROM emulation is only brought up if we need to fall back to it,
+  // see StoredConf_LoadEEPROM()
+  g_eeEmulationInitDone = false;
 }
 
-bool StoredConf_Load(struct StoredConfigT *conf)
+// Standard CRC-32 (reflected, polynomial 0xEDB88320)
+
+static uint32_t StoredConf_CRC32(const uint8_t *data,uint32_t len)
 {
-  bool is_ok = true;
-  uint8_t *conf_addr = (uint8_t*)conf;
-  uint16_t var;
-  memset(conf,0,sizeof(struct StoredConfigT));
-  for (unsigned int i = 0;i < (sizeof(struct StoredConfigT) / 2);i++) {
-    if (EE_ReadVariable(EEPROM_BASE_GENERALCONF + i, &var) == 0) {
-      conf_addr[2 * i] = (var >> 8) & 0xFF;
-      conf_addr[2 * i + 1] = var & 0xFF;
+  uint32_t crc = 0xFFFFFFFF;
+  for(uint32_t i = 0;i < len;i++) {
+    crc ^= data[i];
+    for(int b = 0;b < 8;b++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+// Records in an area start at 'first', the address of slot 0.
+
+static const struct StoredConfRecordT *StoredConf_RecordAt(uint32_t first,uint32_t slot)
+{
+  return (const struct StoredConfRecordT *) (first + slot * sizeof(struct StoredConfRecordT));
+}
+
+static uint32_t StoredConf_AreaFirstRecord(int area)
+{
+  return g_storedConfAreaBase[area] + sizeof(struct StoredConfAreaHeaderT);
+}
+
+// Get the generation of an area, returns false if it has not been started.
+
+static bool StoredConf_AreaGeneration(int area,uint32_t *generation)
+{
+  const struct StoredConfAreaHeaderT *header = (const struct StoredConfAreaHeaderT *) g_storedConfAreaBase[area];
+  if(header->magic != STOREDCONF_AREA_MAGIC || header->check != ~header->generation)
+    return false;
+  *generation = header->generation;
+  return true;
+}
+
+// Find the area with the highest generation, -1 if none have been started.
+
+static int StoredConf_ActiveArea(uint32_t *generation)
+{
+  int active = -1;
+  for(int i = 0;i < STOREDCONF_AREA_COUNT;i++) {
+    uint32_t areaGeneration;
+    if(!StoredConf_AreaGeneration(i,&areaGeneration))
+      continue;
+    if(active < 0 || areaGeneration > *generation) {
+      active = i;
+      *generation = areaGeneration;
+    }
+  }
+  return active;
+}
+
+// CRC covers everything except the magic and the crc itself.
+
+static uint32_t StoredConf_RecordCRC(const struct StoredConfRecordT *record)
+{
+  return StoredConf_CRC32((const uint8_t *) &record->version,
+                          (uint32_t) (sizeof(struct StoredConfRecordT) - 2 * sizeof(uint32_t)));
+}
+
+static bool StoredConf_RecordValid(const struct StoredConfRecordT *record)
+{
+  return record->magic == STOREDCONF_RECORD_MAGIC &&
+         record->version == STOREDCONF_RECORD_VERSION &&
+         record->length == sizeof(struct StoredConfigT) &&
+         record->crc == StoredConf_RecordCRC(record);
+}
+
+// Find the first unused slot in an area.  As records are only ever
+// appended, used slots are all before the unused ones so we can do a binary
+// search on the magic word.
+
+static uint32_t StoredConf_FindFreeSlot(uint32_t first,uint32_t slots)
+{
+  uint32_t low = 0;
+  uint32_t high = slots;
+  while(low < high) {
+    uint32_t mid = (low + high) / 2;
+    if(StoredConf_RecordAt(first,mid)->magic == 0xFFFFFFFF) {
+      high = mid;
     } else {
-      is_ok = false;
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+static bool StoredConf_LoadArea(uint32_t first,uint32_t slots,struct StoredConfigT *conf)
+{
+  // Walk back from the newest record, skipping any left half written by a power failure.
+  for(uint32_t slot = StoredConf_FindFreeSlot(first,slots);slot > 0;slot--) {
+    const struct StoredConfRecordT *record = StoredConf_RecordAt(first,slot-1);
+    if(StoredConf_RecordValid(record)) {
+      memcpy(conf,&record->payload.conf,sizeof(struct StoredConfigT));
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool StoredConf_LoadRecord(struct StoredConfigT *conf)
+{
+  // Try the newest area first, power may have failed just after it was started.
+  uint32_t generation = 0;
+  int active = StoredConf_ActiveArea(&generation);
+  if(active >= 0) {
+    if(StoredConf_LoadArea(StoredConf_AreaFirstRecord(active),STOREDCONF_RECORD_SLOTS,conf))
+      return true;
+    int other = 1 - active;
+    uint32_t otherGeneration;
+    if(StoredConf_AreaGeneration(other,&otherGeneration) &&
+       StoredConf_LoadArea(StoredConf_AreaFirstRecord(other),STOREDCONF_RECORD_SLOTS,conf))
+      return true;
+  }
+  if(StoredConf_RecordAt(STOREDCONF_LEGACY_BASE,0)->magic == STOREDCONF_RECORD_MAGIC)
+    return StoredConf_LoadArea(STOREDCONF_LEGACY_BASE,STOREDCONF_LEGACY_SLOTS,conf);
+  return false;
+}
+
+static bool StoredConf_ProgramWords(uint32_t addr,const uint32_t *words,uint32_t count)
+{
+  for(unsigned int i = 0;i < count;i++) {
+    if(FLASH_ProgramWord(addr + i * 4,words[i]) != FLASH_COMPLETE)
+      return false;
+  }
+  return true;
+}
+
+// Erase an area and write its header.  The other area is left alone.
+
+static bool StoredConf_StartArea(int area,uint32_t generation)
+{
+  const uint32_t *at = (const uint32_t *) g_storedConfAreaBase[area];
+  for(uint32_t i = 0;i < STOREDCONF_AREA_SIZE / 4;i++) {
+    if(at[i] != 0xFFFFFFFF) {
+      if(FLASH_EraseSector(g_storedConfAreaSector[area],VoltageRange_3) != FLASH_COMPLETE)
+        return false;
       break;
     }
   }
+  struct StoredConfAreaHeaderT header;
+  header.magic = STOREDCONF_AREA_MAGIC;
+  header.generation = generation;
+  header.check = ~generation;
+  header.reserved = 0xFFFFFFFF;
+  return StoredConf_ProgramWords(g_storedConfAreaBase[area],(const uint32_t *) &header,sizeof(header) / 4);
+}
+
+static bool StoredConf_SaveRecord(const struct StoredConfigT *conf)
+{
+  struct StoredConfRecordT record;
+  memset(&record,0,sizeof(record));
+  record.magic = STOREDCONF_RECORD_MAGIC;
+  record.version = STOREDCONF_RECORD_VERSION;
+  record.length = sizeof(struct StoredConfigT);
+  memcpy(&record.payload.conf,conf,sizeof(struct StoredConfigT));
+  record.crc = StoredConf_RecordCRC(&record);
+
+  FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+                  FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+  uint32_t generation = 0;
+  int area = StoredConf_ActiveArea(&generation);
+  uint32_t slot = STOREDCONF_RECORD_SLOTS;
+  if(area >= 0)
+    slot = StoredConf_FindFreeSlot(StoredConf_AreaFirstRecord(area),STOREDCONF_RECORD_SLOTS);
+  if(slot >= STOREDCONF_RECORD_SLOTS) {
+    // Move on to the other area.  Until the record below is written the
+    // current one, or a legacy record in sector 11, is still found by
+    // StoredConf_LoadRecord() as the new area holds no valid records.
+    area = (area < 0) ? 0 : 1 - area;
+    if(!StoredConf_StartArea(area,generation + 1))
+      return false;
+    slot = 0;
+  }
+
+  uint32_t first = StoredConf_AreaFirstRecord(area);
+  if(!StoredConf_ProgramWords(first + slot * sizeof(struct StoredConfRecordT),(const uint32_t *) &record,STOREDCONF_RECORD_WORDS))
+    return false;
+
+  return StoredConf_RecordValid(StoredConf_RecordAt(first,slot));
+}
+
+static bool StoredConf_LoadEEPROM(struct StoredConfigT *conf)
+{
+  uint8_t *conf_addr = (uint8_t*)conf;
+  uint16_t var;
+
+  if(!g_eeEmulationInitDone) {
+    EE_Init();
+    g_eeEmulationInitDone = true;
+  }
+
+  for (unsigned int i = 0;i < (sizeof(struct StoredConfigT) / 2);i++) {
+    if (EE_ReadVariable(EEPROM_BASE_GENERALCONF + i, &var) != 0)
+      return false;
+    conf_addr[2 * i] = (var >> 8) & 0xFF;
+    conf_addr[2 * i + 1] = var & 0xFF;
+  }
+  return true;
+}
+
+bool StoredConf_Load(struct StoredConfigT *conf)
+{
+  bool is_ok = true;
+  memset(conf,0,sizeof(struct StoredConfigT));
+
+  if(!StoredConf_LoadRecord(conf)) {
+    // Fall back to configuration saved by older firmware, and migrate it to the record area.
+    memset(conf,0,sizeof(struct StoredConfigT));
+    is_ok = StoredConf_LoadEEPROM(conf);
+    if(is_ok)
+      StoredConf_SaveRecord(conf);
+  }
 
   // Set the default configuration
   if (!is_ok) {
@@ -92,22 +339,5 @@ bool StoredConf_Load(struct StoredConfigT *conf)
 
 bool StoredConf_Save(struct StoredConfigT *conf)
 {
-  bool is_ok = true;
-  uint8_t *conf_addr = (uint8_t*)conf;
-  uint16_t var;
-
-  FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
-                  FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
-
-  for (unsigned int i = 0;i < (sizeof(struct StoredConfigT) / 2);i++) {
-    var = (conf_addr[2 * i] << 8) & 0xFF00;
-    var |= conf_addr[2 * i + 1] & 0xFF;
-
-    if (EE_WriteVariable(EEPROM_BASE_GENERALCONF + i, var) != FLASH_COMPLETE) {
-      is_ok = false;
-      break;
-    }
-  }
-
-  return is_ok;
+  return StoredConf_SaveRecord(conf);
 }